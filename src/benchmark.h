@@ -1,5 +1,7 @@
 #include <dlib/dnn.h>
 
+#include "conv_autotune.h"
+
 class visitor_con_disable_bias
 {
     public:
@@ -34,7 +36,8 @@ template <typename net_type> auto benchmark(
     net_type& net,
     const size_t batch_size = 1,
     const size_t image_size = 224,
-    const int iterations = 100)
+    const int iterations = 100,
+    conv_autotune::autotuner* tuner = nullptr)
 {
     using fms = std::chrono::duration<float, std::milli>;
     dlib::resizable_tensor x;
@@ -43,6 +46,11 @@ template <typename net_type> auto benchmark(
     std::vector<dlib::matrix<dlib::rgb_pixel>> batch(batch_size, image);
     dlib::running_stats<double> rs;
     net.to_tensor(batch.begin(), batch.end(), x);
+    if (tuner)
+    {
+        tuner->tune(net, x);
+        tuner->print_summary(std::cout);
+    }
     // warmup for 10 iterations
     for (int i = 0; i < 10; ++i)
     {
@@ -68,5 +76,30 @@ template <typename net_type> auto benchmark(
     dlib::visit_layers(net, visitor_count_convolutions(num_convolutions));
     std::cout << " #num convolutions: " << num_convolutions << ' ';
     std::cout << " #num layers: " << net_type::num_computational_layers << '\n';
+    if (tuner)
+    {
+        // the convolutions of the last forward pass again, with dlib's algorithm and with the
+        // tuned ones: the network with the tuned ones takes the difference less
+        conv_autotune::planned_convolutions dlib_convolutions(net, tuner->get_thread_pool(), conv_autotune::conv_algorithm::im2col_gemm);
+        conv_autotune::planned_convolutions tuned_convolutions(net, *tuner);
+        dlib::running_stats<double> rs_dlib, rs_tuned;
+        for (int i = 0; i < iterations; ++i)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            dlib_convolutions.run();
+            auto t1 = std::chrono::steady_clock::now();
+            rs_dlib.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            t0 = std::chrono::steady_clock::now();
+            tuned_convolutions.run();
+            t1 = std::chrono::steady_clock::now();
+            rs_tuned.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        }
+        const double tuned_ms = rs.mean() - rs_dlib.mean() + rs_tuned.mean();
+        std::cout << name << " tuned:     " << tuned_ms << " ms";
+        std::cout << " (" << 1.0 / tuned_ms * 1000.0 * batch_size << " fps)";
+        std::cout << " convolutions: " << rs_dlib.mean() << " ms -> " << rs_tuned.mean() << " ms,";
+        std::cout << " " << tuned_convolutions.size() - tuned_convolutions.count(conv_autotune::conv_algorithm::im2col_gemm)
+                  << '/' << tuned_convolutions.size() << " not im2col_gemm\n";
+    }
     std::cin.get();
 }
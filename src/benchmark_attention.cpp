@@ -0,0 +1,326 @@
+#include "lm/causal_attention.h"
+#include "lm/slm_dels.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Stands in for the token_fc_no_bias<d_model * 3> layer below the attention.
+struct qkv_subnet
+{
+    dlib::resizable_tensor output, gradient;
+    const dlib::tensor& get_output() const { return output; }
+    dlib::tensor& get_gradient_input() { return gradient; }
+};
+
+/*
+    What the unfused chain computes for one head: Q, K and V are extracted into their own
+    tensors, the full seq_len x seq_len scores are computed, scaled, masked and normalized,
+    and multiplied by V.
+*/
+void attention_reference(
+    const dlib::tensor& qkv,
+    const long num_heads,
+    const long d_model,
+    dlib::resizable_tensor& output)
+{
+    const long n_samples = qkv.num_samples();
+    const long seq_len = qkv.nr();
+    const long d_k = d_model / num_heads;
+    const float scale = 1.0f / std::sqrt(static_cast<float>(d_k));
+    output.set_size(n_samples, 1, seq_len, d_model);
+    dlib::resizable_tensor q(seq_len, d_k), k(seq_len, d_k), v(seq_len, d_k), scores(seq_len, seq_len), o(seq_len, d_k);
+    for (long n = 0; n < n_samples; ++n)
+    {
+        for (long h = 0; h < num_heads; ++h)
+        {
+            const float* in = qkv.host() + n * seq_len * 3 * d_model;
+            for (long i = 0; i < seq_len; ++i)
+            {
+                std::copy(in + i * 3 * d_model + h * d_k, in + i * 3 * d_model + (h + 1) * d_k, q.host() + i * d_k);
+                std::copy(in + i * 3 * d_model + d_model + h * d_k, in + i * 3 * d_model + d_model + (h + 1) * d_k, k.host() + i * d_k);
+                std::copy(in + i * 3 * d_model + 2 * d_model + h * d_k, in + i * 3 * d_model + 2 * d_model + (h + 1) * d_k, v.host() + i * d_k);
+            }
+            dlib::tt::gemm(0, scores, scale, q, false, k, true);
+            float* s = scores.host();
+            for (long i = 0; i < seq_len; ++i, s += seq_len)
+            {
+                for (long j = i + 1; j < seq_len; ++j)
+                    s[j] = -std::numeric_limits<float>::infinity();
+                const float m = *std::max_element(s, s + i + 1);
+                float sum = 0;
+                for (long j = 0; j < seq_len; ++j)
+                    sum += (s[j] = std::exp(s[j] - m));
+                for (long j = 0; j < seq_len; ++j)
+                    s[j] /= sum;
+            }
+            dlib::tt::gemm(0, o, 1, scores, false, v, false);
+            for (long i = 0; i < seq_len; ++i)
+                std::copy(o.host() + i * d_k, o.host() + (i + 1) * d_k, output.host() + (n * seq_len + i) * d_model + h * d_k);
+        }
+    }
+}
+
+template <long num_heads, long d_model>
+void benchmark_attention(const long batch_size, const long seq_len, const int iterations)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    qkv_subnet sub;
+    sub.output.set_size(batch_size, 1, seq_len, 3 * d_model);
+    dlib::tt::tensor_rand(0).fill_gaussian(sub.output);
+    sub.gradient.copy_size(sub.output);
+
+    transformer::causal_attention_<num_heads, d_model> layer;
+    layer.setup(sub);
+    dlib::resizable_tensor fused, reference, params_grad;
+    dlib::running_stats<double> rs_fused, rs_backward, rs_reference;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        layer.forward(sub, fused);
+        const auto t1 = std::chrono::steady_clock::now();
+        sub.gradient = 0;
+        layer.backward(fused, fused, sub, params_grad);
+        const auto t2 = std::chrono::steady_clock::now();
+        attention_reference(sub.output, num_heads, d_model, reference);
+        const auto t3 = std::chrono::steady_clock::now();
+        rs_fused.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        rs_backward.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+        rs_reference.add(std::chrono::duration_cast<fms>(t3 - t2).count());
+    }
+    float max_diff = 0;
+    for (size_t i = 0; i < fused.size(); ++i)
+        max_diff = std::max(max_diff, std::abs(fused.host()[i] - reference.host()[i]));
+
+    const double score_mib = batch_size * num_heads * seq_len * seq_len * sizeof(float) / 1024.0 / 1024.0;
+    std::cout << "heads: " << num_heads << " d_model: " << d_model << " seq_len: " << seq_len;
+    std::cout << " unfused: " << rs_reference.mean() << " ms (" << score_mib << " MiB of scores)";
+    std::cout << " fused: " << rs_fused.mean() << " ms (speedup: " << rs_reference.mean() / rs_fused.mean() << ")";
+    std::cout << " fused backward: " << rs_backward.mean() << " ms, max error: " << max_diff << '\n';
+}
+
+// Collects the parameters of the computational layers and their gradients.
+class visitor_parameters
+{
+    public:
+    visitor_parameters(std::vector<dlib::tensor*>& params, std::vector<dlib::tensor*>& grads) : params(params), grads(grads) {}
+
+    template <typename T> void operator()(size_t, T&) {}
+
+    template <typename LAYER, typename SUBNET>
+    void operator()(size_t, dlib::add_layer<LAYER, SUBNET>& l)
+    {
+        if (l.layer_details().get_layer_params().size() == 0)
+            return;
+        params.push_back(&l.layer_details().get_layer_params());
+        grads.push_back(&l.get_parameter_gradient());
+    }
+
+    // dlib::embeddings updates its table in its backward pass, which would move the loss
+    // between the finite differences; the table is collected without a gradient
+    template <unsigned long num_embeddings, unsigned long embedding_length, typename SUBNET>
+    void operator()(size_t, dlib::add_layer<dlib::embeddings_<num_embeddings, embedding_length>, SUBNET>& l)
+    {
+        l.layer_details().set_learning_rate_multiplier(0);
+        params.push_back(&l.layer_details().get_embeddings());
+        grads.push_back(nullptr);
+    }
+
+    private:
+    std::vector<dlib::tensor*>& params;
+    std::vector<dlib::tensor*>& grads;
+};
+
+// A batch of random windows of a transformer_config and their next tokens.
+template <typename config>
+void random_windows(
+    const long batch_size,
+    std::vector<dlib::matrix<int, 0, 1>>& windows,
+    std::vector<unsigned long>& labels)
+{
+    dlib::rand rnd(0);
+    windows.resize(batch_size);
+    labels.resize(batch_size);
+    for (long i = 0; i < batch_size; ++i)
+    {
+        windows[i].set_size(config::MAX_SEQ_LEN);
+        for (long t = 0; t < config::MAX_SEQ_LEN; ++t)
+            windows[i](t) = rnd.get_random_32bit_number() % config::VOCAB_SIZE;
+        labels[i] = rnd.get_random_32bit_number() % config::VOCAB_SIZE;
+    }
+}
+
+/*
+    Largest relative error between the parameter gradients of back-propagation and central
+    differences of the loss, over a few parameters of every layer.  The network must be
+    deterministic: network_type<false>, where multiply replaces dropout.
+*/
+template <typename net_type>
+double gradient_check(net_type& net, const dlib::tensor& x, const std::vector<unsigned long>& labels)
+{
+    std::vector<dlib::tensor*> params, grads;
+    net.compute_loss(x, labels.begin());
+    dlib::visit_layers(net, visitor_parameters(params, grads));
+    net.compute_parameter_gradients(x, labels.begin());
+    dlib::rand rnd(1);
+    double max_error = 0;
+    for (size_t l = 0; l < params.size(); ++l)
+    {
+        for (int t = 0; t < 4 && grads[l]; ++t)
+        {
+            const size_t i = rnd.get_random_64bit_number() % params[l]->size();
+            float* p = params[l]->host() + i;
+            const float value = *p;
+            const float eps = 1e-2f;
+            *p = value + eps;
+            const double loss_plus = net.compute_loss(x, labels.begin());
+            *p = value - eps;
+            const double loss_minus = net.compute_loss(x, labels.begin());
+            *p = value;
+            const double numeric = (loss_plus - loss_minus) / (2 * eps);
+            const double analytic = grads[l]->host()[i];
+            max_error = std::max(max_error, std::abs(numeric - analytic) / std::max(1e-2, std::abs(numeric) + std::abs(analytic)));
+        }
+    }
+    return max_error;
+}
+
+/*
+    Runs a training and an inference network of a small transformer_config forward and
+    backward, and checks the gradients of the inference network.
+*/
+template <typename config>
+bool check_network(const std::string& name)
+{
+    std::vector<dlib::matrix<int, 0, 1>> windows;
+    std::vector<unsigned long> labels;
+    random_windows<config>(4, windows, labels);
+
+    typename config::template network_type<true> train_net;
+    dlib::resizable_tensor x;
+    train_net.to_tensor(windows.begin(), windows.end(), x);
+    const double train_loss = train_net.compute_parameter_gradients(x, labels.begin());
+
+    typename config::template network_type<false> net;
+    const double max_error = gradient_check(net, x, labels);
+    const bool ok = std::isfinite(train_loss) && max_error < 0.05;
+    std::cout << name << ": training loss " << train_loss << ", gradient check max relative error " << max_error
+              << (ok ? "" : " FAILED") << '\n';
+    return ok;
+}
+
+template <typename SUBNET> using no_dropout = SUBNET;
+
+// Two blocks of a transformer with the fused or the unfused attention, and without dropout so
+// that both compute the same function.
+template <long num_heads, long num_kv_heads, bool fused>
+struct attention_model
+{
+    static constexpr long VOCAB_SIZE = 50;
+    static constexpr long EMBEDDING_DIM = 32;
+    static constexpr long MAX_SEQ_LEN = 20;
+
+    template <typename SUBNET>
+    using attention = std::conditional_t<fused,
+        transformer::def::multihead_attention<transformer::fast_gelu, no_dropout, EMBEDDING_DIM, num_heads, num_kv_heads, SUBNET>,
+        transformer::def::multihead_attention_unfused<transformer::fast_gelu, no_dropout, EMBEDDING_DIM, num_heads, num_kv_heads, SUBNET>>;
+    template <typename SUBNET>
+    using block = transformer::def::feed_forward<transformer::fast_gelu, no_dropout, EMBEDDING_DIM, attention<SUBNET>>;
+
+    using net_type = transformer::classification_head<false, transformer::softmax_head::full, transformer::fast_gelu, VOCAB_SIZE, EMBEDDING_DIM, MAX_SEQ_LEN,
+        block<block<transformer::positional_embeddings<VOCAB_SIZE, EMBEDDING_DIM, dlib::input<dlib::matrix<int, 0, 1>>>>>>;
+};
+
+/*
+    Compares the loss and the parameter gradients of the fused attention with the ones of the
+    unfused chain on the same weights, and checks the gradients of the unfused network too.
+*/
+template <long num_heads, long num_kv_heads>
+bool check_fused_against_unfused(const std::string& name)
+{
+    using fused_model = attention_model<num_heads, num_kv_heads, true>;
+    std::vector<dlib::matrix<int, 0, 1>> windows;
+    std::vector<unsigned long> labels;
+    random_windows<fused_model>(4, windows, labels);
+
+    typename fused_model::net_type fused;
+    typename attention_model<num_heads, num_kv_heads, false>::net_type unfused;
+    dlib::resizable_tensor x;
+    fused.to_tensor(windows.begin(), windows.end(), x);
+    fused.compute_loss(x, labels.begin());
+    unfused.compute_loss(x, labels.begin());
+
+    // the parameters are the same layers in the same order in both networks
+    std::vector<dlib::tensor*> fused_params, fused_grads, unfused_params, unfused_grads;
+    dlib::visit_layers(fused, visitor_parameters(fused_params, fused_grads));
+    dlib::visit_layers(unfused, visitor_parameters(unfused_params, unfused_grads));
+    DLIB_CASSERT(fused_params.size() == unfused_params.size());
+    for (size_t l = 0; l < fused_params.size(); ++l)
+    {
+        DLIB_CASSERT(fused_params[l]->size() == unfused_params[l]->size());
+        std::copy(fused_params[l]->host(), fused_params[l]->host() + fused_params[l]->size(), unfused_params[l]->host());
+    }
+
+    const double fused_loss = fused.compute_parameter_gradients(x, labels.begin());
+    const double unfused_loss = unfused.compute_parameter_gradients(x, labels.begin());
+    double max_diff = 0, max_grad = 0;
+    for (size_t l = 0; l < fused_grads.size(); ++l)
+    {
+        if (!fused_grads[l])
+            continue;
+        for (size_t i = 0; i < fused_grads[l]->size(); ++i)
+        {
+            max_diff = std::max(max_diff, static_cast<double>(std::abs(fused_grads[l]->host()[i] - unfused_grads[l]->host()[i])));
+            max_grad = std::max(max_grad, static_cast<double>(std::abs(unfused_grads[l]->host()[i])));
+        }
+    }
+    const double loss_diff = std::abs(fused_loss - unfused_loss) / std::abs(unfused_loss);
+    const double max_error = gradient_check(unfused, x, labels);
+    const bool ok = loss_diff < 1e-4 && max_diff < 1e-3 * max_grad && max_error < 0.05;
+    std::cout << name << ": fused/unfused loss relative difference " << loss_diff << ", gradient difference "
+              << max_diff / max_grad << " of the largest gradient, unfused gradient check max relative error " << max_error
+              << (ok ? "" : " FAILED") << '\n';
+    return ok;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the batch size (default: 8)", 1);
+    parser.add_option("num-iters", "set the number of iterations (default: 10)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long batch_size = dlib::get_option(parser, "batch-size", 8);
+    const int num_iters = dlib::get_option(parser, "num-iters", 10);
+
+    using transformer::transformer_config;
+    bool ok = check_network<transformer_config<50, 2, 4, 32, 20>>("transformer_config, 4 heads");
+    ok = check_network<transformer_config<50, 2, 4, 32, 20, false, transformer::fast_gelu, dlib::dropout_10, 2>>(
+        "transformer_config, 4 heads, 2 key/value heads") && ok;
+    ok = check_fused_against_unfused<4, 4>("attention, 4 heads") && ok;
+    ok = check_fused_against_unfused<4, 2>("attention, 4 heads, 2 key/value heads") && ok;
+    ok = check_fused_against_unfused<4, 1>("attention, 4 heads, 1 key/value head") && ok;
+    if (!ok)
+        return EXIT_FAILURE;
+
+    std::cout << std::fixed << std::setprecision(3);
+    for (const long seq_len : {100, 256, 512, 1024})
+        benchmark_attention<8, 128>(batch_size, seq_len, num_iters);
+    for (const long seq_len : {256, 1024})
+        benchmark_attention<8, 512>(batch_size, seq_len, num_iters);
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
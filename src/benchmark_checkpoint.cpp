@@ -0,0 +1,295 @@
+#include "classification/resnet.h"
+#include "lm/slm_dels.h"
+
+#include <dlib/cmd_line_parser.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Every allocation goes through these, to measure the host memory of a training step.
+namespace
+{
+    std::atomic<size_t> allocated_bytes{0};
+    std::atomic<size_t> peak_bytes{0};
+    constexpr size_t header_size = alignof(std::max_align_t);
+}
+
+void* operator new(const size_t size)
+{
+    void* p = std::malloc(size + header_size);
+    if (!p)
+        throw std::bad_alloc();
+    *static_cast<size_t*>(p) = size;
+    const size_t now = allocated_bytes += size;
+    size_t peak = peak_bytes;
+    while (now > peak && !peak_bytes.compare_exchange_weak(peak, now))
+        ;
+    return static_cast<char*>(p) + header_size;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (!p)
+        return;
+    void* block = static_cast<char*>(p) - header_size;
+    allocated_bytes -= *static_cast<size_t*>(block);
+    std::free(block);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+// Time and peak memory of the forward and backward passes of a network, after a first step
+// that allocates the parameters and their gradients.
+template <typename net_type, typename sample_type>
+void benchmark_training_step(
+    const std::string& name,
+    net_type& net,
+    const std::vector<sample_type>& samples,
+    const std::vector<unsigned long>& labels,
+    const int iterations)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    dlib::resizable_tensor x;
+    net.to_tensor(samples.begin(), samples.end(), x);
+    net.compute_parameter_gradients(x, labels.begin());
+    net.clean();
+
+    const size_t baseline = allocated_bytes;
+    peak_bytes = baseline;
+    dlib::running_stats<double> rs;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        net.compute_parameter_gradients(x, labels.begin());
+        rs.add(std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count());
+        net.clean();
+    }
+    std::cout << name << ": " << std::setw(10) << rs.mean() << " ms/step, peak step memory "
+              << std::setw(8) << (peak_bytes - baseline) / 1024.0 / 1024.0 << " MiB\n";
+}
+
+template <bool use_checkpointing>
+using lm_config = transformer::transformer_config<5000, 12, 8, 256, 128, false, transformer::fast_gelu, dlib::dropout_10, 8, 0, 2, use_checkpointing>;
+
+// a small transformer, checkpointed with dlib's dropout_10 or not with the replayable one, so
+// that the second can be given the dropout masks of the first
+template <bool use_checkpointing, template <typename> class DO>
+using check_config = transformer::transformer_config<200, 2, 4, 32, 16, false, transformer::fast_gelu, DO, 4, 0, 2, use_checkpointing>;
+using replayable_dropout_10_ = checkpointing::replayable_dropout_<10>;
+
+// The parameters and the dropout layers of a checkpointed network in the order of visit_layers,
+// the ones of the checkpointed blocks in place of the blocks.
+class visitor_checkpointed_layers
+{
+    public:
+    visitor_checkpointed_layers(std::vector<const dlib::tensor*>& params, std::vector<const replayable_dropout_10_*>& dropouts)
+        : params(params), dropouts(dropouts) {}
+
+    template <typename T> void operator()(size_t, const T&) {}
+
+    template <template <typename> class BLOCK, typename SUBNET>
+    void operator()(size_t, const dlib::add_layer<checkpointing::checkpoint_<BLOCK>, SUBNET>& l)
+    {
+        dlib::visit_layers(l.layer_details().get_block(), *this);
+    }
+
+    template <typename LAYER, typename SUBNET>
+    void operator()(size_t, const dlib::add_layer<LAYER, SUBNET>& l) { params.push_back(&l.layer_details().get_layer_params()); }
+
+    template <typename SUBNET>
+    void operator()(size_t, const dlib::add_layer<replayable_dropout_10_, SUBNET>& l) { dropouts.push_back(&l.layer_details()); }
+
+    private:
+    std::vector<const dlib::tensor*>& params;
+    std::vector<const replayable_dropout_10_*>& dropouts;
+};
+
+// The same for a network without checkpointed blocks, to overwrite them.
+class visitor_plain_layers
+{
+    public:
+    visitor_plain_layers(std::vector<dlib::tensor*>& params, std::vector<replayable_dropout_10_*>& dropouts)
+        : params(params), dropouts(dropouts) {}
+
+    template <typename T> void operator()(size_t, T&) {}
+
+    template <typename LAYER, typename SUBNET>
+    void operator()(size_t, dlib::add_layer<LAYER, SUBNET>& l) { params.push_back(&l.layer_details().get_layer_params()); }
+
+    template <typename SUBNET>
+    void operator()(size_t, dlib::add_layer<replayable_dropout_10_, SUBNET>& l) { dropouts.push_back(&l.layer_details()); }
+
+    private:
+    std::vector<dlib::tensor*>& params;
+    std::vector<replayable_dropout_10_*>& dropouts;
+};
+
+// All the parameter gradients of a network in the order of visit_layers, a checkpointed block
+// giving the ones of its layers in the same order.
+class visitor_gradients
+{
+    public:
+    visitor_gradients(std::vector<float>& values) : values(values) {}
+
+    template <typename T> void operator()(size_t, T&) {}
+
+    template <typename LAYER, typename SUBNET>
+    void operator()(size_t, dlib::add_layer<LAYER, SUBNET>& l)
+    {
+        const dlib::tensor& grad = l.get_parameter_gradient();
+        const size_t size = l.layer_details().get_layer_params().size();
+        if (grad.size() == size)
+            values.insert(values.end(), grad.begin(), grad.end());
+        else
+            values.insert(values.end(), size, 0.f);
+    }
+
+    private:
+    std::vector<float>& values;
+};
+
+/*
+    The backward pass of a checkpointed block recomputes its forward pass, which must apply the
+    dropout masks of the first one.  A checkpointed transformer and the same transformer without
+    checkpointing, given the weights and the dropout masks of the first step of the other, must
+    then compute the same loss and parameter gradients.
+*/
+bool check_checkpointed_gradients()
+{
+    using checkpointed_type = check_config<true, dlib::dropout_10>::network_type<true>;
+    using plain_type = check_config<false, checkpointing::replayable_dropout_10>::network_type<true>;
+    constexpr long seq_len = check_config<true, dlib::dropout_10>::MAX_SEQ_LEN;
+    constexpr long vocab_size = check_config<true, dlib::dropout_10>::VOCAB_SIZE;
+
+    dlib::rand rnd(1);
+    std::vector<dlib::matrix<int, 0, 1>> samples(4);
+    std::vector<unsigned long> labels(samples.size());
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        samples[i].set_size(seq_len);
+        for (long t = 0; t < seq_len; ++t)
+            samples[i](t) = rnd.get_random_32bit_number() % vocab_size;
+        labels[i] = rnd.get_random_32bit_number() % vocab_size;
+    }
+
+    checkpointed_type checkpointed_net;
+    dlib::resizable_tensor x;
+    checkpointed_net.to_tensor(samples.begin(), samples.end(), x);
+    const double checkpointed_loss = checkpointed_net.compute_parameter_gradients(x, labels.begin());
+
+    // the first forward pass sets the layers up, their parameters and masks are replaced after
+    plain_type plain_net;
+    plain_net.forward(x);
+    std::vector<const dlib::tensor*> checkpointed_params;
+    std::vector<const replayable_dropout_10_*> checkpointed_dropouts;
+    dlib::visit_layers(static_cast<const checkpointed_type&>(checkpointed_net), visitor_checkpointed_layers(checkpointed_params, checkpointed_dropouts));
+    std::vector<dlib::tensor*> plain_params;
+    std::vector<replayable_dropout_10_*> plain_dropouts;
+    dlib::visit_layers(plain_net, visitor_plain_layers(plain_params, plain_dropouts));
+    DLIB_CASSERT(checkpointed_params.size() == plain_params.size() && checkpointed_dropouts.size() == plain_dropouts.size());
+    for (size_t i = 0; i < plain_params.size(); ++i)
+    {
+        DLIB_CASSERT(checkpointed_params[i]->size() == plain_params[i]->size());
+        dlib::memcpy(*plain_params[i], *checkpointed_params[i]);
+    }
+    for (size_t i = 0; i < plain_dropouts.size(); ++i)
+    {
+        *plain_dropouts[i] = *checkpointed_dropouts[i];
+        plain_dropouts[i]->set_replay(true);
+    }
+    const double plain_loss = plain_net.compute_parameter_gradients(x, labels.begin());
+
+    std::vector<float> checkpointed_grads, plain_grads;
+    dlib::visit_layers(checkpointed_net, visitor_gradients(checkpointed_grads));
+    dlib::visit_layers(plain_net, visitor_gradients(plain_grads));
+    DLIB_CASSERT(checkpointed_grads.size() == plain_grads.size());
+    float max_diff = 0, max_grad = 0;
+    for (size_t i = 0; i < plain_grads.size(); ++i)
+    {
+        max_diff = std::max(max_diff, std::abs(checkpointed_grads[i] - plain_grads[i]));
+        max_grad = std::max(max_grad, std::abs(plain_grads[i]));
+    }
+    const bool ok = plain_dropouts.size() > 0 && std::abs(checkpointed_loss - plain_loss) <= 1e-5 * std::max(1.0, std::abs(plain_loss))
+        && max_diff <= 1e-4f * std::max(1e-3f, max_grad);
+    std::cout << "checkpointed and plain transformers with " << plain_dropouts.size() << " dropout layers: losses "
+              << checkpointed_loss << " and " << plain_loss << ", gradients differ by " << max_diff
+              << " at most (largest gradient " << max_grad << ")" << (ok ? "" : " FAILED") << '\n';
+    return ok;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the number of sequences per step (default: 16)", 1);
+    parser.add_option("image-batch-size", "set the number of images per step of ResNet-50 (default: 8)", 1);
+    parser.add_option("iterations", "set the number of steps (default: 5)", 1);
+    parser.add_option("skip-resnet", "only run the transformer");
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long batch_size = dlib::get_option(parser, "batch-size", 16);
+    const int iterations = dlib::get_option(parser, "iterations", 5);
+    if (!check_checkpointed_gradients())
+        return EXIT_FAILURE;
+    std::cout << std::fixed << std::setprecision(3);
+
+    // a 12-block transformer over sequences of 128 tokens
+    {
+        dlib::rand rnd(0);
+        std::vector<dlib::matrix<int, 0, 1>> samples(batch_size);
+        std::vector<unsigned long> labels(batch_size);
+        for (long i = 0; i < batch_size; ++i)
+        {
+            samples[i].set_size(lm_config<false>::MAX_SEQ_LEN);
+            for (long t = 0; t < samples[i].size(); ++t)
+                samples[i](t) = rnd.get_random_32bit_number() % lm_config<false>::VOCAB_SIZE;
+            labels[i] = rnd.get_random_32bit_number() % lm_config<false>::VOCAB_SIZE;
+        }
+        lm_config<false>::network_type<true> net;
+        benchmark_training_step("transformer             ", net, samples, labels, iterations);
+        lm_config<true>::network_type<true> checkpointed_net;
+        benchmark_training_step("transformer checkpointed", checkpointed_net, samples, labels, iterations);
+    }
+
+    if (!parser.option("skip-resnet"))
+    {
+        const long image_batch_size = dlib::get_option(parser, "image-batch-size", 8);
+        dlib::rand rnd(0);
+        std::vector<dlib::matrix<dlib::rgb_pixel>> images(image_batch_size);
+        std::vector<unsigned long> labels(image_batch_size);
+        for (long i = 0; i < image_batch_size; ++i)
+        {
+            images[i].set_size(224, 224);
+            for (auto& p : images[i])
+                p = dlib::rgb_pixel(rnd.get_random_8bit_number(), rnd.get_random_8bit_number(), rnd.get_random_8bit_number());
+            labels[i] = rnd.get_random_32bit_number() % 1000;
+        }
+        resnet::train_50 net;
+        benchmark_training_step("resnet50                ", net, images, labels, iterations);
+        resnet::train_50_checkpointed checkpointed_net;
+        benchmark_training_step("resnet50 checkpointed   ", checkpointed_net, images, labels, iterations);
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -31,6 +31,8 @@ try
     parser.add_option("num-outputs", "set the number of fc outputs (default: 1000)", 1);
     parser.add_option("num-iters", "set the number of iterations (default: 100)", 1);
     parser.add_option("cuda-blocking", "disable cuda synchronization");
+    parser.add_option("autotune", "time the CPU convolution algorithms and cache the choices in <arg>", 1);
+    parser.add_option("autotune-threads", "number of threads used by the autotuner (default: all)", 1);
     parser.set_group_name("Help Options");
     parser.add_option("h", "alias for --help");
     parser.add_option("help", "display this message and exit");
@@ -48,6 +50,12 @@ try
     const size_t num_outputs = dlib::get_option(parser, "num-outputs", 1000);
     const int num_iters = dlib::get_option(parser, "num-iters", 100);
     setenv("CUDA_LAUNCH_BLOCKING", cuda_blocking.c_str(), 1);
+    std::unique_ptr<conv_autotune::autotuner> tuner;
+    if (parser.option("autotune"))
+    {
+        const size_t num_threads = dlib::get_option(parser, "autotune-threads", std::thread::hardware_concurrency());
+        tuner = std::make_unique<conv_autotune::autotuner>(parser.option("autotune").argument(), num_threads);
+    }
     std::cout << std::fixed << std::setprecision(3);
 
 #if DNN_BENCH_ALEXNET
@@ -56,7 +64,7 @@ try
         dlib::disable_duplicative_biases(tnet);
         alexnet::infer net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("alexnet  ", net, batch_size, image_size, num_iters);
+        benchmark("alexnet  ", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -66,14 +74,14 @@ try
         dlib::disable_duplicative_biases(tnet);
         squeezenet::infer_v1_0 net(tnet);
         net.subnet().subnet().subnet().layer_details().set_num_filters(num_outputs);
-        benchmark("sqznet1.0", net, batch_size, image_size, num_iters);
+        benchmark("sqznet1.0", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         squeezenet::train_v1_1 tnet;
         dlib::disable_duplicative_biases(tnet);
         squeezenet::infer_v1_1 net(tnet);
         net.subnet().subnet().subnet().layer_details().set_num_filters(num_outputs);
-        benchmark("sqznet1.1", net, batch_size, image_size, num_iters);
+        benchmark("sqznet1.1", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -83,28 +91,28 @@ try
         dlib::disable_duplicative_biases(tnet);
         vggnet::infer_11 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vggnet11 ", net, batch_size, image_size, num_iters);
+        benchmark("vggnet11 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vggnet::train_13 tnet;
         dlib::disable_duplicative_biases(tnet);
         vggnet::infer_13 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vggnet13 ", net, batch_size, image_size, num_iters);
+        benchmark("vggnet13 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vggnet::train_16 tnet;
         dlib::disable_duplicative_biases(tnet);
         vggnet::infer_16 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vggnet16 ", net, batch_size, image_size, num_iters);
+        benchmark("vggnet16 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vggnet::train_19 tnet;
         dlib::disable_duplicative_biases(tnet);
         vggnet::infer_19 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vggnet19 ", net, batch_size, image_size, num_iters);
+        benchmark("vggnet19 ", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -114,7 +122,7 @@ try
         dlib::disable_duplicative_biases(tnet);
         googlenet::infer net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("googlenet", net, batch_size, image_size, num_iters);
+        benchmark("googlenet", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -124,35 +132,35 @@ try
         dlib::disable_duplicative_biases(tnet);
         resnet::infer_18 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("resnet18 ", net, batch_size, image_size, num_iters);
+        benchmark("resnet18 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         resnet::train_34 tnet;
         dlib::disable_duplicative_biases(tnet);
         resnet::infer_34 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("resnet34 ", net, batch_size, image_size, num_iters);
+        benchmark("resnet34 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         resnet::train_50 tnet;
         dlib::disable_duplicative_biases(tnet);
         resnet::infer_50 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("resnet50 ", net, batch_size, image_size, num_iters);
+        benchmark("resnet50 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         resnet::train_101 tnet;
         dlib::disable_duplicative_biases(tnet);
         resnet::infer_101 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("resnet101", net, batch_size, image_size, num_iters);
+        benchmark("resnet101", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         resnet::train_152 tnet;
         dlib::disable_duplicative_biases(tnet);
         resnet::infer_152 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("resnet152", net, batch_size, image_size, num_iters);
+        benchmark("resnet152", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -162,21 +170,21 @@ try
         dlib::disable_duplicative_biases(tnet);
         darknet::infer_19 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("darknet19", net, batch_size, image_size, num_iters);
+        benchmark("darknet19", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         darknet::train_53 tnet;
         dlib::disable_duplicative_biases(tnet);
         darknet::infer_53 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("darknet53", net, batch_size, image_size, num_iters);
+        benchmark("darknet53", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         darknet::train_53csp tnet;
         dlib::disable_duplicative_biases(tnet);
         darknet::infer_53csp net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("darknet53csp", net, batch_size, image_size, num_iters);
+        benchmark("darknet53csp", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -186,35 +194,35 @@ try
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         densenet::infer_121 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("densenet121", net, batch_size, image_size, num_iters);
+        benchmark("densenet121", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         densenet::train_169 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         densenet::infer_169 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("densenet169", net, batch_size, image_size, num_iters);
+        benchmark("densenet169", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         densenet::train_201 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         densenet::infer_201 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("densenet201", net, batch_size, image_size, num_iters);
+        benchmark("densenet201", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         densenet::train_265 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         densenet::infer_265 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("densenet265", net, batch_size, image_size, num_iters);
+        benchmark("densenet265", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         densenet::train_161 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         densenet::infer_161 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("densenet161", net, batch_size, image_size, num_iters);
+        benchmark("densenet161", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -224,49 +232,49 @@ try
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_19_slim net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet19s", net, batch_size, image_size, num_iters);
+        benchmark("vovnet19s", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vovnet::train_19 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_19 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet19 ", net, batch_size, image_size, num_iters);
+        benchmark("vovnet19 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vovnet::train_27_slim tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_27_slim net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet27s", net, batch_size, image_size, num_iters);
+        benchmark("vovnet27s", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vovnet::train_27 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_27 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet27 ", net, batch_size, image_size, num_iters);
+        benchmark("vovnet27 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vovnet::train_39 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_39 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet39 ", net, batch_size, image_size, num_iters);
+        benchmark("vovnet39 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vovnet::train_57 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_57 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet57 ", net, batch_size, image_size, num_iters);
+        benchmark("vovnet57 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         vovnet::train_99 tnet;
         dlib::visit_layers(tnet, visitor_con_disable_bias());
         vovnet::infer_99 net(tnet);
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("vovnet99 ", net, batch_size, image_size, num_iters);
+        benchmark("vovnet99 ", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
@@ -274,37 +282,37 @@ try
     {
         repvgg::infer_a0 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_a0 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_a0 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         repvgg::infer_a1 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_a1 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_a1 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         repvgg::infer_a2 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_a2 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_a2 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         repvgg::infer_b0 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_b0 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_b0 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         repvgg::infer_b1 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_b1 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_b1 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         repvgg::infer_b2 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_b2 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_b2 ", net, batch_size, image_size, num_iters, tuner.get());
     }
     {
         repvgg::infer_b3 net;
         net.subnet().layer_details().set_num_outputs(num_outputs);
-        benchmark("repvgg_b3 ", net, batch_size, image_size, num_iters);
+        benchmark("repvgg_b3 ", net, batch_size, image_size, num_iters, tuner.get());
     }
 #endif
 
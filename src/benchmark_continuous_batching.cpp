@@ -0,0 +1,154 @@
+#include "lm/continuous_batching.h"
+
+#include <dlib/cmd_line_parser.h>
+
+struct workload
+{
+    std::vector<std::vector<int>> prompts;
+    std::vector<long> output_lengths;
+};
+
+workload make_workload(const transformer::decoder_weights& weights, const long num_requests, const long max_prompt, const long max_output)
+{
+    dlib::rand rnd(0);
+    workload load;
+    for (long i = 0; i < num_requests; ++i)
+    {
+        std::vector<int> prompt(1 + rnd.get_random_32bit_number() % max_prompt);
+        for (auto& token : prompt)
+            token = rnd.get_random_32bit_number() % weights.vocab_size;
+        load.prompts.push_back(std::move(prompt));
+        load.output_lengths.push_back(1 + rnd.get_random_32bit_number() % max_output);
+    }
+    return load;
+}
+
+// Batches of batch_size requests in arrival order, with the prompts padded to the longest one
+// and every sequence decoded until the longest output of its batch is done, which is what
+// running network_type<false> on padded batches amounts to.
+double run_static(const transformer::decoder_weights& weights, const workload& load, const size_t batch_size, dlib::running_stats<double>& latency)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    std::vector<transformer::kv_cache> caches(batch_size, transformer::kv_cache(weights));
+    std::vector<std::vector<float>> logits(batch_size);
+    std::vector<std::vector<int>> padded(batch_size);
+    std::vector<int> next(batch_size);
+    std::vector<transformer::decode_chunk> chunks;
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t first = 0; first < load.prompts.size(); first += batch_size)
+    {
+        const size_t n = std::min(batch_size, load.prompts.size() - first);
+        size_t prompt_len = 0;
+        long output_len = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            prompt_len = std::max(prompt_len, load.prompts[first + i].size());
+            output_len = std::max(output_len, load.output_lengths[first + i]);
+        }
+        output_len = std::min<long>(output_len, weights.max_seq_len - prompt_len + 1);
+        chunks.clear();
+        for (size_t i = 0; i < n; ++i)
+        {
+            padded[i] = load.prompts[first + i];
+            padded[i].resize(prompt_len, 0);
+            caches[i].clear();
+            chunks.push_back(transformer::decode_chunk{&caches[i], padded[i].data(), static_cast<long>(prompt_len), &logits[i]});
+        }
+        transformer::forward_batch(weights, chunks);
+        for (long t = 1; t < output_len; ++t)
+        {
+            for (size_t i = 0; i < n; ++i)
+            {
+                next[i] = std::max_element(logits[i].begin(), logits[i].end()) - logits[i].begin();
+                chunks[i] = transformer::decode_chunk{&caches[i], &next[i], 1, &logits[i]};
+            }
+            transformer::forward_batch(weights, chunks);
+        }
+        const double elapsed = std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - start).count();
+        for (size_t i = 0; i < n; ++i)
+            latency.add(elapsed);
+    }
+    return std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - start).count();
+}
+
+double run_continuous(
+    const transformer::decoder_weights& weights,
+    const workload& load,
+    const transformer::continuous_batching_options& options,
+    transformer::continuous_batching_stats& stats)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    const auto start = std::chrono::steady_clock::now();
+    {
+        transformer::continuous_batcher batcher(weights, options);
+        std::vector<std::future<transformer::generation_result>> results;
+        for (size_t i = 0; i < load.prompts.size(); ++i)
+            results.push_back(batcher.submit(load.prompts[i], load.output_lengths[i]));
+        for (auto& result : results)
+            result.get();
+        stats = batcher.get_stats();
+    }
+    return std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("num-requests", "set the number of requests (default: 64)", 1);
+    parser.add_option("max-prompt", "prompts have 1 to this many tokens (default: 40)", 1);
+    parser.add_option("max-output", "requests generate 1 to this many tokens (default: 60)", 1);
+    parser.add_option("max-sequences", "set the number of sequences decoded together (default: 16)", 1);
+    parser.add_option("max-step-tokens", "set the number of tokens per decoding step (default: 256)", 1);
+    parser.set_group_name("Model Options");
+    parser.add_option("num-layers", "set the number of layers (default: 6)", 1);
+    parser.add_option("embedding-dim", "set the embedding dimension (default: 128)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const auto weights = transformer::decoder_weights::random(
+        5000,
+        dlib::get_option(parser, "num-layers", 6),
+        8,
+        dlib::get_option(parser, "embedding-dim", 128),
+        100);
+    const auto load = make_workload(
+        weights,
+        dlib::get_option(parser, "num-requests", 64),
+        dlib::get_option(parser, "max-prompt", 40),
+        dlib::get_option(parser, "max-output", 60));
+    transformer::continuous_batching_options options;
+    options.max_sequences = dlib::get_option(parser, "max-sequences", 16);
+    options.max_step_tokens = dlib::get_option(parser, "max-step-tokens", 256);
+
+    long useful = 0;
+    for (size_t i = 0; i < load.prompts.size(); ++i)
+        useful += std::min<long>(load.output_lengths[i], weights.max_seq_len - load.prompts[i].size() + 1);
+
+    std::cout << std::fixed << std::setprecision(3);
+    dlib::running_stats<double> static_latency;
+    const double static_ms = run_static(weights, load, options.max_sequences, static_latency);
+    std::cout << "static batching:     " << static_ms << " ms, " << useful / static_ms * 1000 << " tokens/s, mean latency: "
+              << static_latency.mean() << " ms\n";
+
+    transformer::continuous_batching_stats stats;
+    const double continuous_ms = run_continuous(weights, load, options, stats);
+    std::cout << "continuous batching: " << continuous_ms << " ms, " << useful / continuous_ms * 1000 << " tokens/s, mean latency: "
+              << stats.latency.mean() << " ms (speedup: " << static_ms / continuous_ms << ")\n";
+    std::cout << stats;
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,94 @@
+#include "classification/darknet.h"
+#include "data_parallel.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Mean time of a training step, after a first step that allocates the gradients and the
+// solver states.
+template <typename F>
+double time_steps(const int iterations, F&& step)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    step();
+    const auto t0 = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+        step();
+    return std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count() / iterations;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the number of images per step (default: 32)", 1);
+    parser.add_option("image-size", "set the size of the images (default: 128)", 1);
+    parser.add_option("iterations", "set the number of steps (default: 5)", 1);
+    parser.add_option("max-replicas", "set the largest number of replicas (default: number of cores)", 1);
+    parser.add_option("no-pinning", "do not bind the replicas to their cores");
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long batch_size = dlib::get_option(parser, "batch-size", 32);
+    const long image_size = dlib::get_option(parser, "image-size", 128);
+    const int iterations = dlib::get_option(parser, "iterations", 5);
+    const long num_cores = std::max(1u, std::thread::hardware_concurrency());
+    const long max_replicas = std::min(batch_size, dlib::get_option(parser, "max-replicas", num_cores));
+    std::cout << std::fixed << std::setprecision(3);
+
+    dlib::rand rnd(0);
+    std::vector<dlib::matrix<dlib::rgb_pixel>> images(batch_size);
+    std::vector<unsigned long> labels(batch_size);
+    for (long i = 0; i < batch_size; ++i)
+    {
+        images[i].set_size(image_size, image_size);
+        for (auto& p : images[i])
+            p = dlib::rgb_pixel(rnd.get_random_8bit_number(), rnd.get_random_8bit_number(), rnd.get_random_8bit_number());
+        labels[i] = rnd.get_random_32bit_number() % 1000;
+    }
+
+    // the reference: dnn_trainer, one thread on the whole batch
+    darknet::train_53 net;
+    double reference_ms = 0;
+    {
+        dlib::dnn_trainer<darknet::train_53> trainer(net);
+        reference_ms = time_steps(iterations, [&]
+        {
+            trainer.train_one_step(images, labels);
+            trainer.get_net(dlib::force_flush_to_disk::no);
+        });
+    }
+    std::cout << "dnn_trainer:            " << std::setw(9) << reference_ms << " ms/step, "
+              << std::setw(7) << batch_size * 1000 / reference_ms << " images/s\n";
+
+    // one replica per group of cores, each replica on batch_size / num_replicas images
+    double one_replica_ms = 0;
+    for (long num_replicas = 1; num_replicas <= max_replicas; num_replicas *= 2)
+    {
+        data_parallel::trainer_options options;
+        options.num_replicas = num_replicas;
+        options.cores_per_replica = std::max(1L, num_cores / num_replicas);
+        options.pin_threads = !parser.option("no-pinning");
+        data_parallel::trainer<darknet::train_53> trainer(net, dlib::sgd(), options);
+        const double ms = time_steps(iterations, [&] { trainer.train_one_step(images, labels); });
+        if (num_replicas == 1)
+            one_replica_ms = ms;
+        std::cout << "data parallel, " << std::setw(2) << num_replicas << " replicas: " << std::setw(9) << ms << " ms/step, "
+                  << std::setw(7) << batch_size * 1000 / ms << " images/s, speedup " << reference_ms / ms
+                  << "x, scaling efficiency " << 100 * one_replica_ms / (ms * num_replicas) << "%\n";
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
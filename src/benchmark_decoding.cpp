@@ -0,0 +1,152 @@
+#include "lm/incremental_decoder.h"
+#include "lm/slm_dels.h"
+
+#include <dlib/cmd_line_parser.h>
+
+int argmax(const std::vector<float>& logits)
+{
+    return std::max_element(logits.begin(), logits.end()) - logits.begin();
+}
+
+// Generates max_seq_len tokens greedily, with the key/value cache and by running the whole
+// prefix again for every token, and reports the latency per token along the sequence.
+void benchmark_decoding(const transformer::decoder_weights& weights)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    const long length = weights.max_seq_len;
+    const long report = std::max(1l, length / 8);
+    transformer::incremental_decoder decoder(weights);
+
+    std::vector<int> tokens{1};
+    std::vector<double> cached(length), full(length);
+    auto logits = decoder.prefill(tokens);
+    for (long i = 1; i < length; ++i)
+    {
+        tokens.push_back(argmax(logits));
+        const auto t0 = std::chrono::steady_clock::now();
+        logits = decoder.step(tokens.back());
+        const auto t1 = std::chrono::steady_clock::now();
+        cached[i] = std::chrono::duration_cast<fms>(t1 - t0).count();
+    }
+
+    float max_diff = 0;
+    std::vector<int> prefix{tokens[0]};
+    for (long i = 1; i < length; ++i)
+    {
+        prefix.push_back(tokens[i]);
+        const auto t0 = std::chrono::steady_clock::now();
+        const auto& reference = decoder.prefill(prefix);
+        const auto t1 = std::chrono::steady_clock::now();
+        full[i] = std::chrono::duration_cast<fms>(t1 - t0).count();
+        if (i + 1 < length)
+            max_diff = std::max(max_diff, std::abs(reference[tokens[i + 1]] - reference[argmax(reference)]));
+    }
+
+    std::cout << "position   cached (ms)   recomputed (ms)\n";
+    double total_cached = 0, total_full = 0;
+    for (long i = 1; i < length; ++i)
+    {
+        total_cached += cached[i];
+        total_full += full[i];
+        if (i % report == 0 || i == length - 1)
+            std::cout << std::setw(8) << i << std::setw(14) << cached[i] << std::setw(18) << full[i] << '\n';
+    }
+    std::cout << "total: " << total_cached << " ms cached, " << total_full << " ms recomputed (speedup: "
+              << total_full / total_cached << "), greedy tokens agree: " << (max_diff < 1e-4 ? "yes" : "no") << '\n';
+}
+
+/*
+    Runs network_type<false> of a small transformer_config on windows of max_seq_len tokens,
+    and the decoder on the weights extracted from it: the first half of each window as the
+    prompt, then one token at a time.  Their logits for the token after the window must agree.
+*/
+template <typename config>
+bool check_against_network(const std::string& name)
+{
+    std::vector<dlib::matrix<int, 0, 1>> windows(3);
+    dlib::rand rnd(0);
+    for (auto& window : windows)
+    {
+        window.set_size(config::MAX_SEQ_LEN);
+        for (long t = 0; t < config::MAX_SEQ_LEN; ++t)
+            window(t) = rnd.get_random_32bit_number() % config::VOCAB_SIZE;
+    }
+
+    typename config::template network_type<false> net;
+    dlib::resizable_tensor x;
+    net.to_tensor(windows.begin(), windows.end(), x);
+    // the logits, below the loss layer
+    const dlib::tensor& reference = net.subnet().forward(x);
+
+    const auto weights = transformer::extract_decoder_weights<config>(net);
+    transformer::incremental_decoder decoder(weights);
+    float max_diff = 0, max_logit = 0;
+    for (size_t n = 0; n < windows.size(); ++n)
+    {
+        const std::vector<int> tokens(windows[n].begin(), windows[n].end());
+        const long prompt = tokens.size() / 2;
+        auto logits = decoder.prefill(std::vector<int>(tokens.begin(), tokens.begin() + prompt));
+        for (size_t t = prompt; t < tokens.size(); ++t)
+            logits = decoder.step(tokens[t]);
+        const float* expected = reference.host() + n * config::VOCAB_SIZE;
+        for (long i = 0; i < config::VOCAB_SIZE; ++i)
+        {
+            max_diff = std::max(max_diff, std::abs(logits[i] - expected[i]));
+            max_logit = std::max(max_logit, std::abs(expected[i]));
+        }
+    }
+    const bool ok = max_diff <= 1e-3f * std::max(1.0f, max_logit);
+    std::cout << name << ": decoder and network_type<false> logits differ by " << max_diff << " at most (largest logit "
+              << max_logit << ")" << (ok ? "" : " FAILED") << '\n';
+    return ok;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("vocab-size", "set the vocabulary size (default: 5000)", 1);
+    parser.add_option("num-layers", "set the number of layers (default: 6)", 1);
+    parser.add_option("num-heads", "set the number of attention heads (default: 8)", 1);
+    parser.add_option("num-kv-heads", "set the number of key/value heads (default: num-heads)", 1);
+    parser.add_option("embedding-dim", "set the embedding dimension (default: 128)", 1);
+    parser.add_option("max-seq-len", "set the number of generated tokens (default: 100)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using transformer::transformer_config;
+    using transformer::fast_gelu;
+    bool ok = check_against_network<transformer_config<50, 2, 4, 32, 16>>("4 heads");
+    ok = check_against_network<transformer_config<50, 2, 4, 32, 16, false, fast_gelu, dlib::dropout_10, 2>>("4 heads, 2 key/value heads") && ok;
+    ok = check_against_network<transformer_config<50, 2, 4, 32, 16, true, fast_gelu, dlib::dropout_10, 4, 4>>("squeezing head, 4 experts") && ok;
+    if (!ok)
+        return EXIT_FAILURE;
+
+    // the defaults are the ones of transformer::vslm
+    const auto weights = transformer::decoder_weights::random(
+        dlib::get_option(parser, "vocab-size", 5000),
+        dlib::get_option(parser, "num-layers", 6),
+        dlib::get_option(parser, "num-heads", 8),
+        dlib::get_option(parser, "embedding-dim", 128),
+        dlib::get_option(parser, "max-seq-len", 100),
+        dlib::get_option(parser, "num-kv-heads", 0));
+    std::cout << "key/value cache: " << weights.num_layers() * weights.max_seq_len * weights.kv_dim() * 2 * sizeof(float) / 1024.0
+              << " KiB per sequence\n";
+    std::cout << std::fixed << std::setprecision(3);
+    benchmark_decoding(weights);
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+#include "classification/darknet.h"
+#include "classification/vggnet.h"
+#include "depth_first.h"
+#include "detection/yolov5.h"
+
+#include <dlib/cmd_line_parser.h>
+
+template <typename net_type> void benchmark_depth_first(
+    const std::string& name,
+    net_type& net,
+    const size_t batch_size,
+    const size_t image_size,
+    const long min_size,
+    const size_t cache_budget,
+    const int iterations)
+{
+    using fms = std::chrono::duration<float, std::milli>;
+    dlib::resizable_tensor x, y;
+    dlib::matrix<dlib::rgb_pixel> image(image_size, image_size);
+    assign_all_pixels(image, dlib::rgb_pixel(127, 127, 127));
+    std::vector<dlib::matrix<dlib::rgb_pixel>> batch(batch_size, image);
+    net.to_tensor(batch.begin(), batch.end(), x);
+    dlib::tt::tensor_rand(0).fill_uniform(x);
+
+    depth_first::fused_chain chain(net, x, std::numeric_limits<size_t>::max(), min_size);
+    std::cout << name << " fused " << chain.num_ops() << " layers, max error: " << depth_first::verify(chain, net, x);
+
+    const auto time_chain = [&]()
+    {
+        dlib::running_stats<double> rs;
+        chain(x, y);
+        for (int i = 0; i < iterations; ++i)
+        {
+            const auto t0 = std::chrono::steady_clock::now();
+            chain(x, y);
+            const auto t1 = std::chrono::steady_clock::now();
+            rs.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        }
+        return rs.mean();
+    };
+
+    // a single tile covering the whole output is the usual layer by layer execution
+    chain.set_tile_size(std::numeric_limits<long>::max(), std::numeric_limits<long>::max());
+    const double full = time_chain();
+    chain.set_cache_budget(cache_budget);
+    const double tiled = time_chain();
+    std::cout << " layer-by-layer: " << full << " ms";
+    std::cout << " tiled " << chain.tile_rows() << "x" << chain.tile_cols() << ": " << tiled << " ms";
+    std::cout << " (speedup: " << full / tiled << ")\n";
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the batch size (default: 1)", 1);
+    parser.add_option("image-size", "set the image size for classification nets (default: 224)", 1);
+    parser.add_option("detection-size", "set the image size for detection nets (default: 640)", 1);
+    parser.add_option("min-size", "stop fusing when feature maps get smaller than this (default: 56)", 1);
+    parser.add_option("cache-budget", "bytes of cache per tile in KiB (default: 1024)", 1);
+    parser.add_option("num-iters", "set the number of iterations (default: 20)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const size_t batch_size = dlib::get_option(parser, "batch-size", 1);
+    const size_t image_size = dlib::get_option(parser, "image-size", 224);
+    const size_t detection_size = dlib::get_option(parser, "detection-size", 640);
+    const long min_size = dlib::get_option(parser, "min-size", 56);
+    const size_t cache_budget = dlib::get_option(parser, "cache-budget", 1024) * 1024;
+    const int num_iters = dlib::get_option(parser, "num-iters", 20);
+    std::cout << std::fixed << std::setprecision(3);
+
+    {
+        vggnet::train_16 tnet;
+        dlib::disable_duplicative_biases(tnet);
+        vggnet::infer_16 net(tnet);
+        benchmark_depth_first("vggnet16 ", net, batch_size, image_size, min_size, cache_budget, num_iters);
+    }
+    {
+        darknet::train_19 tnet;
+        dlib::disable_duplicative_biases(tnet);
+        darknet::infer_19 net(tnet);
+        benchmark_depth_first("darknet19", net, batch_size, image_size, min_size, cache_budget, num_iters);
+    }
+    {
+        yolov5::train_type_s tnet;
+        dlib::disable_duplicative_biases(tnet);
+        yolov5::infer_type_s net(tnet);
+        benchmark_depth_first("yolov5s  ", net, batch_size, detection_size, min_size, cache_budget, num_iters);
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,294 @@
+#include "detection/tiled_inference.h"
+#include "detection/yolo_postprocess.h"
+#include "detection/yolov5.h"
+#include "detection/yolov5p6.h"
+#include "detection/yolov7.h"
+#include "preprocess.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Replaces the outputs of the yolo heads with scores that look like the ones of a trained
+// detector: almost every objectness is close to zero and a few cells light up.
+template <template <typename> class... TAGS, typename SUBNET>
+void fill_synthetic_outputs(const dlib::loss_yolo_<TAGS...>& loss, SUBNET& sub, const double density)
+{
+    dlib::rand rnd(0);
+    const long num_feats = loss.get_options().labels.size() + 5;
+    const auto fill = [&](const dlib::tensor& output)
+    {
+        auto& out = const_cast<dlib::tensor&>(output);
+        float* p = out.host();
+        const long plane = out.nr() * out.nc();
+        for (long n = 0; n < out.num_samples(); ++n)
+        {
+            for (long k = 0; k < out.k(); ++k, p += plane)
+            {
+                for (long i = 0; i < plane; ++i)
+                {
+                    if (k % num_feats == 4)
+                        p[i] = rnd.get_random_double() < density ? 0.3 + 0.7 * rnd.get_random_double() : 0.01 * rnd.get_random_double();
+                    else
+                        p[i] = rnd.get_random_double();
+                }
+            }
+        }
+    };
+    (fill(dlib::layer<TAGS>(sub).get_output()), ...);
+}
+
+// Compares letterboxing into a matrix + to_tensor() against writing straight into the tensor.
+template <typename net_type> void benchmark_preprocess(
+    const std::string& name,
+    net_type& net,
+    const size_t batch_size,
+    const size_t image_size,
+    const int iterations)
+{
+    using fms = std::chrono::duration<float, std::milli>;
+    dlib::matrix<dlib::rgb_pixel> image(1080, 1920);
+    dlib::rand rnd(0);
+    for (auto& p : image)
+        p = dlib::rgb_pixel(rnd.get_random_8bit_number(), rnd.get_random_8bit_number(), rnd.get_random_8bit_number());
+    const std::vector<dlib::matrix<dlib::rgb_pixel>> images(batch_size, image);
+
+    dlib::resizable_tensor x;
+    dlib::running_stats<double> rs;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        std::vector<dlib::matrix<dlib::rgb_pixel>> batch(batch_size);
+        for (size_t n = 0; n < batch_size; ++n)
+            dlib::letterbox_image(images[n], batch[n], image_size);
+        net.to_tensor(batch.begin(), batch.end(), x);
+        const auto t1 = std::chrono::steady_clock::now();
+        rs.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+    }
+
+    preprocess::letterbox_loader loader(image_size, image_size, dlib::input_layer(net));
+    for (int i = 0; i < iterations; ++i)
+        loader.load_images(images, x);
+    std::cout << name << " letterbox+to_tensor: " << rs.mean() << " ms";
+    std::cout << " letterbox_loader: " << loader.get_timings().total.mean() << " ms";
+    std::cout << " speedup: " << rs.mean() / loader.get_timings().total.mean() << '\n';
+}
+
+// Whether two sets of detections hold the same boxes, labels and scores, in any order.
+bool same_detections(std::vector<dlib::yolo_rect> a, std::vector<dlib::yolo_rect> b, std::string& error)
+{
+    if (a.size() != b.size())
+    {
+        error = std::to_string(a.size()) + " against " + std::to_string(b.size()) + " detections";
+        return false;
+    }
+    const auto by_score = [](const dlib::yolo_rect& x, const dlib::yolo_rect& y)
+    {
+        if (x.detection_confidence != y.detection_confidence)
+            return x.detection_confidence > y.detection_confidence;
+        if (x.rect.left() != y.rect.left())
+            return x.rect.left() < y.rect.left();
+        return x.rect.top() < y.rect.top();
+    };
+    std::sort(a.begin(), a.end(), by_score);
+    std::sort(b.begin(), b.end(), by_score);
+    for (size_t i = 0; i < a.size(); ++i)
+    {
+        const auto& x = a[i];
+        const auto& y = b[i];
+        const double box_error = std::max({std::abs(x.rect.left() - y.rect.left()), std::abs(x.rect.top() - y.rect.top()),
+                                           std::abs(x.rect.right() - y.rect.right()), std::abs(x.rect.bottom() - y.rect.bottom())});
+        bool same_labels = x.label == y.label && x.labels.size() == y.labels.size();
+        for (size_t j = 0; same_labels && j < x.labels.size(); ++j)
+            same_labels = x.labels[j].second == y.labels[j].second && std::abs(x.labels[j].first - y.labels[j].first) < 1e-5;
+        if (box_error > 1e-3 * std::max(1.0, x.rect.width() + x.rect.height()) ||
+            std::abs(x.detection_confidence - y.detection_confidence) > 1e-5 || !same_labels)
+        {
+            std::ostringstream sout;
+            sout << "detection " << i << ": " << x.label << ' ' << x.detection_confidence << ' ' << x.rect << " against "
+                 << y.label << ' ' << y.detection_confidence << ' ' << y.rect;
+            error = sout.str();
+            return false;
+        }
+    }
+    return true;
+}
+
+// Times yolo::postprocess against loss_yolo_::to_label and checks that they find the same
+// detections.
+template <typename net_type> bool benchmark_postprocess(
+    const std::string& name,
+    net_type& net,
+    const size_t batch_size,
+    const size_t image_size,
+    const double density,
+    const double threshold,
+    const int iterations)
+{
+    using fms = std::chrono::duration<float, std::milli>;
+    dlib::resizable_tensor x;
+    dlib::matrix<dlib::rgb_pixel> image(image_size, image_size);
+    assign_all_pixels(image, dlib::rgb_pixel(127, 127, 127));
+    std::vector<dlib::matrix<dlib::rgb_pixel>> batch(batch_size, image);
+    net.to_tensor(batch.begin(), batch.end(), x);
+    net.forward(x);
+    fill_synthetic_outputs(net.loss_details(), net.subnet(), density);
+
+    std::vector<std::vector<dlib::yolo_rect>> reference(batch_size), fast;
+    dlib::running_stats<double> rs_ref, rs_fast;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        net.loss_details().to_label(x, net.subnet(), reference.begin(), threshold);
+        const auto t1 = std::chrono::steady_clock::now();
+        fast = yolo::postprocess(net, x, threshold);
+        const auto t2 = std::chrono::steady_clock::now();
+        rs_ref.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        rs_fast.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+    }
+    size_t num_ref = 0, num_fast = 0;
+    for (size_t n = 0; n < batch_size; ++n)
+    {
+        num_ref += reference[n].size();
+        num_fast += fast[n].size();
+    }
+    std::cout << name << " loss_yolo: " << rs_ref.mean() << " ms (" << num_ref << " dets)";
+    std::cout << " fast: " << rs_fast.mean() << " ms (" << num_fast << " dets)";
+    std::cout << " speedup: " << rs_ref.mean() / rs_fast.mean() << '\n';
+    for (size_t n = 0; n < batch_size; ++n)
+    {
+        std::string error;
+        if (!same_detections(reference[n], fast[n], error))
+        {
+            std::cout << name << " the detections of sample " << n << " differ from loss_yolo: " << error << '\n';
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs the tiled detector over a synthetic image of the given width and 16:9 aspect ratio.
+template <typename net_type> void benchmark_tiled(
+    const std::string& name,
+    net_type& net,
+    const long width,
+    const tiled::tiling_options& options,
+    const int iterations)
+{
+    dlib::matrix<dlib::rgb_pixel> image(width * 9 / 16, width);
+    dlib::rand rnd(0);
+    for (auto& p : image)
+        p = dlib::rgb_pixel(rnd.get_random_8bit_number(), rnd.get_random_8bit_number(), rnd.get_random_8bit_number());
+
+    tiled::tiled_detector<net_type> detector(net, options);
+    const auto tiles = tiled::make_tiles(image.nr(), image.nc(), options.tile_size, options.overlap);
+    // the first call tunes the batch size when it is not set
+    size_t num_dets = detector(image).size();
+    for (int i = 0; i < iterations; ++i)
+        num_dets = detector(image).size();
+    const auto& t = detector.get_timings();
+    std::cout << name << " tiled " << image.nc() << "x" << image.nr() << ": " << tiles.size() << " tiles";
+    std::cout << " in batches of " << detector.get_batch_size() << ", " << t.total.mean() << " ms (" << num_dets << " dets)\n";
+    std::cout << "  crop: " << t.preprocess.mean() << " ms, forward: " << t.forward.mean()
+              << " ms, decode: " << t.postprocess.mean() << " ms per batch, merge: " << t.merge.mean() << " ms\n";
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the batch size (default: 1)", 1);
+    parser.add_option("image-size", "set the image size (default: 640)", 1);
+    parser.add_option("density", "fraction of cells with an object (default: 0.005)", 1);
+    parser.add_option("threshold", "detection threshold (default: 0.25)", 1);
+    parser.add_option("num-iters", "set the number of iterations (default: 100)", 1);
+    parser.add_option("tiled", "run yolov5s6 tiled over an image of this width (16:9)", 1);
+    parser.add_option("tile-overlap", "overlap between tiles in pixels (default: 256)", 1);
+    parser.add_option("tile-batch", "tiles per batch, 0 to tune it (default: 0)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const size_t batch_size = dlib::get_option(parser, "batch-size", 1);
+    const size_t image_size = dlib::get_option(parser, "image-size", 640);
+    const double density = dlib::get_option(parser, "density", 0.005);
+    const double threshold = dlib::get_option(parser, "threshold", 0.25);
+    const int num_iters = dlib::get_option(parser, "num-iters", 100);
+    std::cout << std::fixed << std::setprecision(3);
+
+    if (parser.option("tiled"))
+    {
+        dlib::yolo_options options;
+        options.labels = yolo::coco_labels();
+        options.add_anchors<yolov5p6::ytag3>({{19, 27}, {44, 40}, {38, 94}});
+        options.add_anchors<yolov5p6::ytag4>({{96, 68}, {86, 152}, {180, 137}});
+        options.add_anchors<yolov5p6::ytag5>({{140, 301}, {303, 264}, {238, 542}});
+        options.add_anchors<yolov5p6::ytag6>({{436, 615}, {739, 380}, {925, 792}});
+        yolov5p6::infer_type_s net(options);
+        const long num_filters = 3 * (options.labels.size() + 5);
+        dlib::layer<yolov5p6::ytag3, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5p6::ytag4, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5p6::ytag5, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5p6::ytag6, 2>(net).layer_details().set_num_filters(num_filters);
+        tiled::tiling_options tiling;
+        tiling.tile_size = 2 * image_size;
+        tiling.overlap = dlib::get_option(parser, "tile-overlap", 256);
+        tiling.batch_size = dlib::get_option(parser, "tile-batch", 0);
+        tiling.threshold = threshold;
+        benchmark_tiled("yolov5s6 ", net, dlib::get_option(parser, "tiled", 3840), tiling, std::min(num_iters, 5));
+        return EXIT_SUCCESS;
+    }
+
+    bool ok = true;
+    {
+        dlib::yolo_options options;
+        options.labels = yolo::coco_labels();
+        options.add_anchors<yolov5::ytag3>({{10, 13}, {16, 30}, {33, 23}});
+        options.add_anchors<yolov5::ytag4>({{30, 61}, {62, 45}, {59, 119}});
+        options.add_anchors<yolov5::ytag5>({{116, 90}, {156, 198}, {373, 326}});
+        yolov5::infer_type_s net(options);
+        const long num_filters = 3 * (options.labels.size() + 5);
+        dlib::layer<yolov5::ytag3, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5::ytag4, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5::ytag5, 2>(net).layer_details().set_num_filters(num_filters);
+        benchmark_preprocess("yolov5s  ", net, batch_size, image_size, num_iters);
+        ok = benchmark_postprocess("yolov5s  ", net, batch_size, image_size, density, threshold, num_iters) && ok;
+    }
+    {
+        dlib::yolo_options options;
+        options.labels = yolo::coco_labels();
+        options.add_anchors<yolov5p6::ytag3>({{19, 27}, {44, 40}, {38, 94}});
+        options.add_anchors<yolov5p6::ytag4>({{96, 68}, {86, 152}, {180, 137}});
+        options.add_anchors<yolov5p6::ytag5>({{140, 301}, {303, 264}, {238, 542}});
+        options.add_anchors<yolov5p6::ytag6>({{436, 615}, {739, 380}, {925, 792}});
+        yolov5p6::infer_type_s net(options);
+        const long num_filters = 3 * (options.labels.size() + 5);
+        dlib::layer<yolov5p6::ytag3, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5p6::ytag4, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5p6::ytag5, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5p6::ytag6, 2>(net).layer_details().set_num_filters(num_filters);
+        benchmark_preprocess("yolov5s6 ", net, batch_size, 2 * image_size, num_iters);
+        ok = benchmark_postprocess("yolov5s6 ", net, batch_size, 2 * image_size, density, threshold, num_iters) && ok;
+    }
+    {
+        dlib::yolo_options options;
+        options.labels = yolo::coco_labels();
+        options.add_anchors<yolov7::ytag3>({{12, 16}, {19, 36}, {40, 28}});
+        options.add_anchors<yolov7::ytag4>({{36, 75}, {76, 55}, {72, 146}});
+        options.add_anchors<yolov7::ytag5>({{142, 110}, {192, 243}, {459, 401}});
+        yolov7::infer_type net(options);
+        ok = benchmark_postprocess("yolov7   ", net, batch_size, image_size, density, threshold, num_iters) && ok;
+    }
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,122 @@
+#include "lm/kernels.h"
+
+#include <dlib/cmd_line_parser.h>
+
+namespace kernels = transformer::kernels;
+
+// Microseconds per call of f, the best of several runs.
+template <typename F>
+double time_us(F&& f, const int iterations)
+{
+    using fus = std::chrono::duration<double, std::micro>;
+    double best = std::numeric_limits<double>::max();
+    for (int run = 0; run < 5; ++run)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i)
+            f();
+        best = std::min(best, std::chrono::duration_cast<fus>(std::chrono::steady_clock::now() - t0).count() / iterations);
+    }
+    return best;
+}
+
+float max_difference(const std::vector<float>& a, const std::vector<float>& b)
+{
+    float diff = 0;
+    for (size_t i = 0; i < a.size(); ++i)
+        diff = std::max(diff, std::abs(a[i] - b[i]));
+    return diff;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("rows", "set the number of rows, tokens or rows of scores (default: 256)", 1);
+    parser.add_option("dim", "set the number of values per row (default: 512)", 1);
+    parser.add_option("iterations", "set the number of calls per measure (default: 100)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long rows = dlib::get_option(parser, "rows", 256);
+    const long d = dlib::get_option(parser, "dim", 512);
+    const int iterations = dlib::get_option(parser, "iterations", 100);
+    const long n = rows * d;
+
+    std::mt19937 rng(0);
+    std::normal_distribution<float> gaussian(0, 2);
+    std::vector<float> x(n), grad_out(n), gamma(d);
+    for (auto& v : x)
+        v = gaussian(rng);
+    for (auto& v : grad_out)
+        v = gaussian(rng);
+    for (auto& v : gamma)
+        v = 1 + 0.1f * gaussian(rng);
+
+    // forward and backward pass of each kernel, the output compared with the scalar version
+    struct kernel_case
+    {
+        std::string name;
+        std::function<void(const kernels::kernel_table&, std::vector<float>&)> run;
+    };
+    const auto& scalar = kernels::get_kernel_table(kernels::instruction_set::scalar);
+    std::vector<float> softmax_y(n), rms_y(n), saved_inv_rms(rows), inv_rms(rows), grad_gamma(d);
+    scalar.softmax_forward(x.data(), rows, d, softmax_y.data());
+    scalar.rms_norm_forward(x.data(), gamma.data(), rows, d, 1e-5f, rms_y.data(), saved_inv_rms.data());
+    std::vector<kernel_case> cases{
+        {"rms_norm forward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.rms_norm_forward(x.data(), gamma.data(), rows, d, 1e-5f, out.data(), inv_rms.data()); }},
+        {"rms_norm backward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.rms_norm_backward(x.data(), gamma.data(), saved_inv_rms.data(), grad_out.data(), rows, d, out.data(), grad_gamma.data(), false); }},
+        {"softmax forward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.softmax_forward(x.data(), rows, d, out.data()); }},
+        {"softmax backward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.softmax_backward(softmax_y.data(), grad_out.data(), rows, d, out.data(), false); }},
+        {"gelu forward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.gelu_forward(x.data(), n, out.data(), kernels::gelu_approximation::exact); }},
+        {"gelu backward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.gelu_backward(x.data(), grad_out.data(), n, out.data(), kernels::gelu_approximation::exact, false); }},
+        {"gelu_tanh forward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.gelu_forward(x.data(), n, out.data(), kernels::gelu_approximation::tanh); }},
+        {"gelu_tanh backward", [&](const kernels::kernel_table& k, std::vector<float>& out)
+            { k.gelu_backward(x.data(), grad_out.data(), n, out.data(), kernels::gelu_approximation::tanh, false); }},
+    };
+
+    std::cout << rows << " rows of " << d << " values, best instruction set: "
+              << kernels::to_string(kernels::best_instruction_set()) << "\n\n";
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << std::setw(20) << "kernel" << std::setw(8) << "isa" << std::setw(12) << "us/call"
+              << std::setw(10) << "speedup" << std::setw(12) << "max diff" << '\n';
+    for (const auto& c : cases)
+    {
+        std::vector<float> reference(n), out(n);
+        c.run(scalar, reference);
+        const double scalar_us = time_us([&] { c.run(scalar, out); }, iterations);
+        for (const auto isa : {kernels::instruction_set::scalar, kernels::instruction_set::avx2, kernels::instruction_set::avx512})
+        {
+            if (!kernels::is_supported(isa))
+                continue;
+            const auto& table = kernels::get_kernel_table(isa);
+            const double us = isa == kernels::instruction_set::scalar ? scalar_us : time_us([&] { c.run(table, out); }, iterations);
+            c.run(table, out);
+            std::cout << std::setw(20) << c.name << std::setw(8) << kernels::to_string(isa) << std::setw(12) << us
+                      << std::setw(10) << scalar_us / us << std::setw(12) << std::scientific << max_difference(reference, out)
+                      << std::fixed << '\n';
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,119 @@
+#include "lm/incremental_decoder.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Stands in for the rms_norm layer below the feed-forward network.
+struct token_subnet
+{
+    dlib::resizable_tensor output, gradient;
+    const dlib::tensor& get_output() const { return output; }
+    dlib::tensor& get_gradient_input() { return gradient; }
+};
+
+// Training step of a moe_feed_forward layer over batch_size sequences of seq_len tokens.
+template <long num_experts, long top_k, long d_model>
+void benchmark_layer(const long batch_size, const long seq_len, const int iterations)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    token_subnet sub;
+    sub.output.set_size(batch_size, 1, seq_len, d_model);
+    dlib::tt::tensor_rand(0).fill_gaussian(sub.output);
+    sub.gradient.copy_size(sub.output);
+
+    transformer::moe_feed_forward_<num_experts, top_k, d_model> layer;
+    layer.setup(sub);
+    dlib::resizable_tensor output, gradient_input, params_grad;
+    params_grad.copy_size(layer.get_layer_params());
+    dlib::running_stats<double> rs_forward, rs_backward;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        layer.forward(sub, output);
+        const auto t1 = std::chrono::steady_clock::now();
+        gradient_input.copy_size(output);
+        gradient_input = 1;
+        sub.gradient = 0;
+        layer.backward(gradient_input, sub, params_grad);
+        const auto t2 = std::chrono::steady_clock::now();
+        rs_forward.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        rs_backward.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+    }
+    const auto& load = layer.get_expert_load();
+    std::cout << "layer " << std::setw(2) << num_experts << " experts, top " << top_k << ": "
+              << std::setw(8) << layer.get_layer_params().size() / 1e6 << "M params, forward " << rs_forward.mean()
+              << " ms, backward " << rs_backward.mean() << " ms, max expert load " << *std::max_element(load.begin(), load.end())
+              << ", balance loss " << layer.get_balance_loss() << '\n';
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("vocab-size", "set the vocabulary size (default: 5000)", 1);
+    parser.add_option("num-layers", "set the number of layers (default: 6)", 1);
+    parser.add_option("num-heads", "set the number of attention heads (default: 8)", 1);
+    parser.add_option("embedding-dim", "set the embedding dimension of the decoder (default: 256)", 1);
+    parser.add_option("num-tokens", "set the number of generated tokens (default: 100)", 1);
+    parser.add_option("batch-size", "set the number of sequences of the training step (default: 8)", 1);
+    parser.add_option("seq-len", "set the sequence length of the training step (default: 64)", 1);
+    parser.add_option("iterations", "set the number of training steps (default: 10)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using fms = std::chrono::duration<double, std::milli>;
+    std::cout << std::fixed << std::setprecision(3);
+
+    // training step of the feed-forward layer, d_model = 256: a single expert is the dense
+    // network, more experts add parameters for the same work per token at equal top_k
+    const long batch_size = dlib::get_option(parser, "batch-size", 8);
+    const long seq_len = dlib::get_option(parser, "seq-len", 64);
+    const int iterations = dlib::get_option(parser, "iterations", 10);
+    benchmark_layer<1, 1, 256>(batch_size, seq_len, iterations);
+    benchmark_layer<8, 1, 256>(batch_size, seq_len, iterations);
+    benchmark_layer<8, 2, 256>(batch_size, seq_len, iterations);
+    benchmark_layer<16, 2, 256>(batch_size, seq_len, iterations);
+
+    // decoding with the incremental decoder, dense blocks against mixtures of experts
+    const long num_tokens = dlib::get_option(parser, "num-tokens", 100);
+    for (const auto& experts : std::vector<std::pair<long, long>>{{0, 0}, {8, 1}, {8, 2}, {16, 2}})
+    {
+        const auto weights = transformer::decoder_weights::random(
+            dlib::get_option(parser, "vocab-size", 5000),
+            dlib::get_option(parser, "num-layers", 6),
+            dlib::get_option(parser, "num-heads", 8),
+            dlib::get_option(parser, "embedding-dim", 256),
+            num_tokens + 1, 0, 0, experts.first, experts.second);
+        std::ostringstream file;
+        serialize(weights, file);
+
+        transformer::incremental_decoder decoder(weights);
+        auto logits = decoder.prefill({1});
+        const auto t0 = std::chrono::steady_clock::now();
+        for (long i = 0; i < num_tokens; ++i)
+        {
+            const int next = std::max_element(logits.begin(), logits.end()) - logits.begin();
+            logits = decoder.step(next);
+        }
+        const double ms = std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count() / num_tokens;
+        if (experts.first == 0)
+            std::cout << "decoder, dense:             ";
+        else
+            std::cout << "decoder, " << std::setw(2) << experts.first << " experts, top " << experts.second << ": ";
+        std::cout << ms << " ms/token, weights: " << file.str().size() / 1024.0 / 1024.0 << " MiB\n";
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
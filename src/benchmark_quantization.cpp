@@ -0,0 +1,89 @@
+#include "lm/incremental_decoder.h"
+
+#include <dlib/cmd_line_parser.h>
+
+int argmax(const std::vector<float>& logits)
+{
+    return std::max_element(logits.begin(), logits.end()) - logits.begin();
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("vocab-size", "set the vocabulary size (default: 32000)", 1);
+    parser.add_option("num-layers", "set the number of layers (default: 6)", 1);
+    parser.add_option("num-heads", "set the number of attention heads (default: 8)", 1);
+    parser.add_option("embedding-dim", "set the embedding dimension (default: 512)", 1);
+    parser.add_option("group-size", "set the number of weights sharing a scale (default: 64)", 1);
+    parser.add_option("num-tokens", "set the number of generated tokens (default: 100)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using fms = std::chrono::duration<double, std::milli>;
+    const long num_tokens = dlib::get_option(parser, "num-tokens", 100);
+    const long group_size = dlib::get_option(parser, "group-size", 64);
+    const auto reference = transformer::decoder_weights::random(
+        dlib::get_option(parser, "vocab-size", 32000),
+        dlib::get_option(parser, "num-layers", 6),
+        dlib::get_option(parser, "num-heads", 8),
+        dlib::get_option(parser, "embedding-dim", 512),
+        num_tokens + 1);
+
+    // the tokens generated by the float model, fed to every model so their logits compare
+    std::vector<int> tokens{1};
+    std::vector<std::vector<float>> reference_logits;
+    {
+        transformer::incremental_decoder decoder(reference);
+        reference_logits.push_back(decoder.prefill(tokens));
+        for (long i = 0; i < num_tokens; ++i)
+        {
+            tokens.push_back(argmax(reference_logits.back()));
+            reference_logits.push_back(decoder.step(tokens.back()));
+        }
+    }
+
+    std::cout << std::fixed << std::setprecision(3);
+    double baseline_ms = 0;
+    for (const auto format : {transformer::weight_format::f32, transformer::weight_format::int8, transformer::weight_format::int4})
+    {
+        auto weights = reference;
+        weights.quantize(format, group_size);
+        std::ostringstream file;
+        serialize(weights, file);
+
+        transformer::incremental_decoder decoder(weights);
+        float max_diff = 0;
+        long agree = 0;
+        auto logits = decoder.prefill({tokens[0]});
+        const auto t0 = std::chrono::steady_clock::now();
+        for (long i = 0; i < num_tokens; ++i)
+        {
+            for (size_t v = 0; v < logits.size(); ++v)
+                max_diff = std::max(max_diff, std::abs(logits[v] - reference_logits[i][v]));
+            agree += argmax(logits) == tokens[i + 1];
+            logits = decoder.step(tokens[i + 1]);
+        }
+        const double ms = std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count() / num_tokens;
+        if (format == transformer::weight_format::f32)
+            baseline_ms = ms;
+        std::cout << std::setw(4) << transformer::to_string(format) << ": " << ms << " ms/token (speedup: " << baseline_ms / ms
+                  << "), file: " << file.str().size() / 1024.0 / 1024.0 << " MiB, max logit error: " << max_diff
+                  << ", same greedy token: " << agree << "/" << num_tokens << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,140 @@
+#include "lm/sampling.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// What picking a token from the output of fc<VOCAB_SIZE> costs without the fused sampler:
+// all the logits, a softmax over them and a sort of the vocabulary.
+int sample_full(const transformer::dense_weights& fc, const dlib::resizable_tensor& x, const transformer::sampling_options& options, std::mt19937& rng)
+{
+    thread_local dlib::resizable_tensor logits;
+    thread_local std::vector<float> probs;
+    thread_local std::vector<int> order;
+    const long vocab = fc.num_outputs();
+    logits.set_size(1, vocab);
+    dlib::tt::gemm(0, logits, 1, x, false, fc.weights, false);
+    const float* l = logits.host();
+    const float* b = fc.biases.host();
+    probs.resize(vocab);
+    for (long v = 0; v < vocab; ++v)
+        probs[v] = l[v] + b[v];
+    if (options.temperature == 0)
+        return std::max_element(probs.begin(), probs.end()) - probs.begin();
+
+    const float max_logit = *std::max_element(probs.begin(), probs.end());
+    float sum = 0;
+    for (auto& p : probs)
+        sum += (p = std::exp((p - max_logit) / options.temperature));
+    for (auto& p : probs)
+        p /= sum;
+    order.resize(vocab);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](const int a, const int b) { return probs[a] > probs[b]; });
+    long n = options.top_k > 0 ? options.top_k : vocab;
+    float mass = 0;
+    for (long i = 0; i < n; ++i)
+        mass += probs[order[i]];
+    if (options.top_p < 1)
+    {
+        float cumulative = 0;
+        for (long i = 0; i < n; ++i)
+        {
+            cumulative += probs[order[i]] / mass;
+            if (cumulative >= options.top_p)
+            {
+                n = i + 1;
+                break;
+            }
+        }
+        mass = 0;
+        for (long i = 0; i < n; ++i)
+            mass += probs[order[i]];
+    }
+    float u = std::uniform_real_distribution<float>(0, mass)(rng);
+    for (long i = 0; i < n; ++i)
+    {
+        u -= probs[order[i]];
+        if (u < 0)
+            return order[i];
+    }
+    return order[n - 1];
+}
+
+void benchmark_sampling(const long vocab_size, const long d_model, const int iterations)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    transformer::dense_weights fc;
+    fc.weights.set_size(d_model, vocab_size);
+    fc.biases.set_size(1, vocab_size);
+    dlib::tt::tensor_rand rnd(0);
+    rnd.fill_gaussian(fc.weights, 0, 1 / std::sqrt(static_cast<float>(d_model)));
+    rnd.fill_gaussian(fc.biases, 0, 0.1f);
+    dlib::resizable_tensor x(1, d_model);
+    rnd.fill_gaussian(x);
+    const std::vector<float> features(x.host(), x.host() + x.size());
+
+    const auto make = [](const float temperature, const long top_k, const float top_p)
+    {
+        transformer::sampling_options options;
+        options.temperature = temperature;
+        options.top_k = top_k;
+        options.top_p = top_p;
+        return options;
+    };
+    const std::vector<std::pair<std::string, transformer::sampling_options>> modes{
+        {"greedy", make(0, 0, 1)},
+        {"temperature 0.8", make(0.8f, 0, 1)},
+        {"top-k 50", make(1, 50, 1)},
+        {"top-p 0.9", make(1, 0, 0.9f)},
+        {"top-k 50, top-p 0.9", make(0.7f, 50, 0.9f)}};
+
+    std::cout << "vocab size: " << vocab_size << ", d_model: " << d_model << '\n';
+    for (const auto& mode : modes)
+    {
+        std::mt19937 rng(0);
+        transformer::token_sampler sampler(mode.second);
+        dlib::running_stats<double> full, fused;
+        for (int i = 0; i < iterations; ++i)
+        {
+            const auto t0 = std::chrono::steady_clock::now();
+            sample_full(fc, x, mode.second, rng);
+            const auto t1 = std::chrono::steady_clock::now();
+            sampler(fc, features);
+            const auto t2 = std::chrono::steady_clock::now();
+            full.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            fused.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+        }
+        std::cout << std::setw(22) << mode.first << ": full softmax " << full.mean() << " ms, fused " << fused.mean()
+                  << " ms (speedup: " << full.mean() / fused.mean() << ")\n";
+    }
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("embedding-dim", "set the input dimension of the last fc layer (default: 512)", 1);
+    parser.add_option("num-iters", "set the number of sampled tokens per mode (default: 100)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long d_model = dlib::get_option(parser, "embedding-dim", 512);
+    const int num_iters = dlib::get_option(parser, "num-iters", 100);
+    std::cout << std::fixed << std::setprecision(3);
+    for (const long vocab_size : {5000, 32000, 50257})
+        benchmark_sampling(vocab_size, d_model, num_iters);
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
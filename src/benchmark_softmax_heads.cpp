@@ -0,0 +1,122 @@
+#include "lm/softmax_heads.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Stands in for the layer below the output head.
+struct token_subnet
+{
+    dlib::resizable_tensor output, gradient;
+    const dlib::tensor& get_output() const { return output; }
+    dlib::tensor& get_gradient_input() { return gradient; }
+};
+
+constexpr long vocab_size = 32000;
+
+// Loss and gradients of a full fc layer followed by the softmax over the whole vocabulary.
+double full_softmax_step(const token_subnet& sub, const dlib::tensor& weights, const std::vector<long>& labels, dlib::resizable_tensor& logits, dlib::tensor& weights_grad, dlib::tensor& input_grad)
+{
+    const long n = sub.output.num_samples();
+    logits.set_size(n, vocab_size);
+    dlib::tt::gemm(0, logits, 1, sub.output, false, weights, false);
+    const double loss = transformer::impl::softmax_cross_entropy(logits.host(), n, vocab_size, labels.data(), 1.0f / n);
+    dlib::tt::gemm(0, weights_grad, 1, sub.output, true, logits, false);
+    dlib::tt::gemm(0, input_grad, 1, logits, false, weights, true);
+    return loss;
+}
+
+// Loss and gradients of one of the heads of softmax_heads.h.
+template <typename head_type>
+double head_step(head_type& head, const token_subnet& sub, const std::vector<unsigned long>& labels, dlib::tensor& params_grad, dlib::tensor& input_grad)
+{
+    const double loss = head.compute_loss(sub.output, labels.begin(), input_grad);
+    head.backward_inplace(sub.output, input_grad, input_grad, params_grad);
+    return loss;
+}
+
+// Returns the mean time of a step, in milliseconds.
+template <typename F>
+double benchmark(const std::string& name, const int iterations, const double reference_ms, F&& step)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    step();
+    dlib::running_stats<double> rs;
+    double loss = 0;
+    for (int i = 0; i < iterations; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        loss = step();
+        rs.add(std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count());
+    }
+    std::cout << name << ": " << std::setw(9) << rs.mean() << " ms/step, loss " << loss;
+    if (reference_ms > 0)
+        std::cout << ", speedup " << reference_ms / rs.mean() << 'x';
+    std::cout << '\n';
+    return rs.mean();
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the number of tokens per step (default: 256)", 1);
+    parser.add_option("embedding-dim", "set the number of features of the tokens (default: 512)", 1);
+    parser.add_option("iterations", "set the number of steps (default: 10)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long batch_size = dlib::get_option(parser, "batch-size", 256);
+    const long embedding_dim = dlib::get_option(parser, "embedding-dim", 512);
+    const int iterations = dlib::get_option(parser, "iterations", 10);
+    std::cout << std::fixed << std::setprecision(3);
+
+    // Zipf distributed tokens, token i being the i-th most frequent one
+    std::vector<uint64_t> counts(vocab_size);
+    for (long i = 0; i < vocab_size; ++i)
+        counts[i] = 1000000 / (i + 1);
+    dlib::rand rnd(0);
+    std::vector<unsigned long> labels(batch_size);
+    std::vector<long> targets(batch_size);
+    for (long i = 0; i < batch_size; ++i)
+    {
+        const long r = static_cast<long>(std::exp(rnd.get_random_double() * std::log(vocab_size + 1.0))) - 1;
+        labels[i] = targets[i] = std::min(std::max(r, 0L), vocab_size - 1);
+    }
+
+    token_subnet sub;
+    sub.output.set_size(batch_size, embedding_dim);
+    dlib::tt::tensor_rand(0).fill_gaussian(sub.output);
+    sub.gradient.copy_size(sub.output);
+
+    dlib::resizable_tensor weights(embedding_dim, vocab_size), weights_grad(embedding_dim, vocab_size), logits;
+    dlib::tt::tensor_rand(1).fill_gaussian(weights, 0, 1 / std::sqrt(static_cast<float>(embedding_dim)));
+    const double full_ms = benchmark("full softmax          ", iterations, 0, [&] { return full_softmax_step(sub, weights, targets, logits, weights_grad, sub.gradient); });
+
+    transformer::adaptive_softmax_<vocab_size, 2048> adaptive;
+    adaptive.set_token_counts(counts);
+    adaptive.setup(sub);
+    dlib::resizable_tensor adaptive_grad;
+    adaptive_grad.copy_size(adaptive.get_layer_params());
+    benchmark("adaptive softmax      ", iterations, full_ms, [&] { return head_step(adaptive, sub, labels, adaptive_grad, sub.gradient); });
+
+    transformer::sampled_softmax_<vocab_size, 1024> sampled;
+    sampled.set_token_counts(counts);
+    sampled.setup(sub);
+    dlib::resizable_tensor sampled_grad;
+    sampled_grad.copy_size(sampled.get_layer_params());
+    benchmark("sampled softmax (1024)", iterations, full_ms, [&] { return head_step(sampled, sub, labels, sampled_grad, sub.gradient); });
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,150 @@
+#include "lm/sparse_embeddings.h"
+
+#include <dlib/cmd_line_parser.h>
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+// Stands in for the input layer.
+struct token_subnet
+{
+    dlib::resizable_tensor output, gradient;
+    const dlib::tensor& get_output() const { return output; }
+    dlib::tensor& get_gradient_input() { return gradient; }
+};
+
+// What a solver does with a dense gradient over the table: the gradient of the whole table,
+// then Adam over all its rows.
+void dense_adam_step(const dlib::tensor& ids, const dlib::tensor& gradient_input, dlib::tensor& table, dlib::tensor& grad, dlib::tensor& m, dlib::tensor& v, const long t)
+{
+    const long dim = table.k();
+    grad = 0;
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        float* g = grad.host() + static_cast<long>(ids.host()[i]) * dim;
+        for (long d = 0; d < dim; ++d)
+            g[d] += gradient_input.host()[i * dim + d];
+    }
+    const float step_size = 1e-3f * std::sqrt(1 - std::pow(0.999f, t)) / (1 - std::pow(0.9f, t));
+    float* w = table.host();
+    float* pm = m.host();
+    float* pv = v.host();
+    const float* g = grad.host();
+    for (size_t i = 0; i < table.size(); ++i)
+    {
+        pm[i] = 0.9f * pm[i] + 0.1f * g[i];
+        pv[i] = 0.999f * pv[i] + 0.001f * g[i] * g[i];
+        w[i] -= step_size * pm[i] / (std::sqrt(pv[i]) + 1e-8f);
+    }
+}
+
+// Largest difference between the rows of the tokens of ids in two tables, and the largest
+// value of these rows in the first one.
+std::pair<float, float> max_row_difference(const dlib::tensor& ids, const dlib::tensor& a, const dlib::tensor& b)
+{
+    const long dim = a.k();
+    float max_diff = 0, max_value = 0;
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        const long offset = static_cast<long>(ids.host()[i]) * dim;
+        for (long d = 0; d < dim; ++d)
+        {
+            max_diff = std::max(max_diff, std::abs(a.host()[offset + d] - b.host()[offset + d]));
+            max_value = std::max(max_value, std::abs(a.host()[offset + d]));
+        }
+    }
+    return {max_diff, max_value};
+}
+
+// Times the dense and the sparse updates, after checking that the first sparse update gives
+// the rows of the batch the values of the dense one.
+template <long vocab_size, long embedding_dim>
+bool benchmark(const long batch_size, const long seq_len, const int iterations)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    dlib::rand rnd(0);
+    token_subnet sub;
+    sub.output.set_size(batch_size, 1, seq_len, 1);
+    for (auto& id : sub.output)
+        id = static_cast<long>(std::exp(rnd.get_random_double() * std::log(vocab_size + 1.0))) - 1;
+
+    transformer::sparse_embeddings_<vocab_size, embedding_dim> layer;
+    layer.setup(sub);
+    dlib::resizable_tensor output, gradient_input, params_grad;
+    layer.forward(sub, output);
+    gradient_input.copy_size(output);
+    dlib::tt::tensor_rand(1).fill_gaussian(gradient_input);
+
+    dlib::resizable_tensor table, grad, m, v;
+    table.copy_size(layer.get_embeddings());
+    dlib::memcpy(table, layer.get_embeddings());
+    grad.copy_size(table);
+    m.copy_size(table);
+    v.copy_size(table);
+    m = 0;
+    v = 0;
+
+    // first step, from the same table and zero moments on both sides
+    dense_adam_step(sub.output, gradient_input, table, grad, m, v, 1);
+    layer.backward(gradient_input, sub, params_grad);
+    const auto [max_diff, max_value] = max_row_difference(sub.output, table, layer.get_embeddings());
+    const bool ok = max_diff <= 1e-5f * std::max(1.0f, max_value);
+    if (!ok)
+    {
+        std::cout << "vocabulary " << vocab_size << ": the sparse update differs from the dense one by " << max_diff
+                  << " on the rows of the batch (largest value " << max_value << ") FAILED\n";
+    }
+
+    dlib::running_stats<double> rs_dense, rs_sparse;
+    for (int i = 2; i <= iterations + 1; ++i)
+    {
+        const auto t0 = std::chrono::steady_clock::now();
+        dense_adam_step(sub.output, gradient_input, table, grad, m, v, i);
+        const auto t1 = std::chrono::steady_clock::now();
+        layer.backward(gradient_input, sub, params_grad);
+        const auto t2 = std::chrono::steady_clock::now();
+        rs_dense.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        rs_sparse.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+    }
+    std::cout << "vocabulary " << std::setw(6) << vocab_size << ", " << batch_size * seq_len << " tokens: dense "
+              << std::setw(8) << rs_dense.mean() << " ms/step, sparse " << std::setw(6) << rs_sparse.mean()
+              << " ms/step, speedup " << rs_dense.mean() / rs_sparse.mean() << "x\n";
+    return ok;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("batch-size", "set the number of sequences per step (default: 8)", 1);
+    parser.add_option("seq-len", "set the number of tokens per sequence (default: 128)", 1);
+    parser.add_option("iterations", "set the number of steps (default: 10)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long batch_size = dlib::get_option(parser, "batch-size", 8);
+    const long seq_len = dlib::get_option(parser, "seq-len", 128);
+    const int iterations = dlib::get_option(parser, "iterations", 10);
+    std::cout << std::fixed << std::setprecision(3);
+
+    // embedding update of a training step, Adam on the whole table against the rows of the batch
+    bool ok = benchmark<8000, 256>(batch_size, seq_len, iterations);
+    ok = benchmark<32000, 256>(batch_size, seq_len, iterations) && ok;
+    ok = benchmark<128000, 256>(batch_size, seq_len, iterations) && ok;
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,84 @@
+#include "lm/speculative_decoding.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Plain decoding with the target model alone, greedy like speculative decoding at temperature 0.
+std::vector<int> generate_greedy(const transformer::decoder_weights& weights, const std::vector<int>& prompt, const long max_new_tokens)
+{
+    transformer::incremental_decoder decoder(weights);
+    std::vector<int> tokens;
+    auto logits = decoder.prefill(prompt);
+    while (true)
+    {
+        tokens.push_back(std::max_element(logits.begin(), logits.end()) - logits.begin());
+        if (static_cast<long>(tokens.size()) == max_new_tokens || decoder.size() == decoder.max_length())
+            break;
+        logits = decoder.step(tokens.back());
+    }
+    return tokens;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("num-layers", "set the number of layers of the target model (default: 12)", 1);
+    parser.add_option("draft-layers", "set the number of layers of the draft model (default: 2)", 1);
+    parser.add_option("embedding-dim", "set the embedding dimension (default: 256)", 1);
+    parser.add_option("num-draft-tokens", "set the number of tokens proposed per target pass (default: 4)", 1);
+    parser.add_option("temperature", "set the sampling temperature, 0 for greedy (default: 0)", 1);
+    parser.add_option("num-tokens", "set the number of generated tokens (default: 200)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using fms = std::chrono::duration<double, std::milli>;
+    const long num_tokens = dlib::get_option(parser, "num-tokens", 200);
+    const auto target = transformer::decoder_weights::random(
+        5000,
+        dlib::get_option(parser, "num-layers", 12),
+        8,
+        dlib::get_option(parser, "embedding-dim", 256),
+        num_tokens + 32);
+    // Without a trained pair of models, the draft is the target with only its first blocks,
+    // which keeps their predictions related.
+    auto draft = target;
+    draft.blocks.resize(dlib::get_option(parser, "draft-layers", 2));
+
+    transformer::speculative_options options;
+    options.num_draft_tokens = dlib::get_option(parser, "num-draft-tokens", 4);
+    options.temperature = dlib::get_option(parser, "temperature", 0.0);
+    const std::vector<int> prompt{1, 2, 3, 4, 5, 6, 7, 8};
+
+    std::cout << std::fixed << std::setprecision(3);
+    auto t0 = std::chrono::steady_clock::now();
+    const auto reference = generate_greedy(target, prompt, num_tokens);
+    auto t1 = std::chrono::steady_clock::now();
+    const double baseline_ms = std::chrono::duration_cast<fms>(t1 - t0).count();
+    std::cout << "target only: " << baseline_ms << " ms, " << reference.size() / baseline_ms * 1000 << " tokens/s\n";
+
+    transformer::speculative_decoder decoder(target, draft, options);
+    t0 = std::chrono::steady_clock::now();
+    const auto tokens = decoder.generate(prompt, num_tokens);
+    t1 = std::chrono::steady_clock::now();
+    const double speculative_ms = std::chrono::duration_cast<fms>(t1 - t0).count();
+    std::cout << "speculative: " << speculative_ms << " ms, " << tokens.size() / speculative_ms * 1000 << " tokens/s (speedup: "
+              << baseline_ms / speculative_ms << ")\n";
+    std::cout << decoder.get_stats() << '\n';
+    if (options.temperature == 0)
+        std::cout << "same tokens as the target model alone: " << (tokens == reference ? "yes" : "no") << '\n';
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
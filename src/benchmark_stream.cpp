@@ -0,0 +1,136 @@
+#include "detection/stream_pipeline.h"
+#include "detection/yolov5.h"
+#include "detection/yolov7.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Compares the sequential decode/preprocess/forward/postprocess loop with the pipelined one on
+// a synthetic 1080p stream.
+template <typename net_type> void benchmark_stream(
+    const std::string& name,
+    net_type& net,
+    const long image_size,
+    const size_t num_frames,
+    const stream::drop_policy policy,
+    const size_t queue_size)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    dlib::matrix<dlib::rgb_pixel> frame(1080, 1920);
+    dlib::rand rnd(0);
+    for (auto& p : frame)
+        p = dlib::rgb_pixel(rnd.get_random_8bit_number(), rnd.get_random_8bit_number(), rnd.get_random_8bit_number());
+
+    // warm up, so that both runs start with allocated tensors
+    {
+        dlib::resizable_tensor x;
+        preprocess::letterbox_loader loader(image_size, image_size, dlib::input_layer(net));
+        loader.load_images({frame}, x);
+        net.forward(x);
+    }
+
+    dlib::running_stats<double> rs;
+    {
+        dlib::resizable_tensor x;
+        preprocess::letterbox_loader loader(image_size, image_size, dlib::input_layer(net));
+        const auto t0 = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < num_frames; ++i)
+        {
+            const auto f0 = std::chrono::steady_clock::now();
+            const auto box = loader.load_images({frame}, x)[0];
+            net.forward(x);
+            auto dets = yolo::postprocess(net, x)[0];
+            for (auto& d : dets)
+                d.rect = box.to_image(d.rect);
+            rs.add(std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - f0).count());
+        }
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << name << " sequential: " << num_frames / seconds << " fps, latency: " << rs.mean() << " ms\n";
+    }
+
+    size_t num_read = 0, num_emitted = 0;
+    stream::detection_pipeline<net_type> pipeline(
+        net,
+        image_size,
+        [&](dlib::matrix<dlib::rgb_pixel>& image)
+        {
+            if (num_read == num_frames)
+                return false;
+            ++num_read;
+            image = frame;
+            return true;
+        },
+        [&](stream::detection_frame&) { ++num_emitted; },
+        policy,
+        0.25,
+        queue_size);
+    pipeline.run();
+    const double seconds = pipeline.get_pipeline().elapsed_seconds();
+    std::cout << name << " pipelined:  " << num_emitted / seconds << " fps (" << num_emitted << "/" << num_frames
+              << " frames emitted)\n";
+    pipeline.print_metrics(std::cout);
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("image-size", "set the image size (default: 640)", 1);
+    parser.add_option("num-frames", "number of frames of the stream (default: 200)", 1);
+    parser.add_option("policy", "block, drop-newest or keep-latest (default: block)", 1);
+    parser.add_option("queue-size", "frames buffered between stages (default: 2)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const long image_size = dlib::get_option(parser, "image-size", 640);
+    const size_t num_frames = dlib::get_option(parser, "num-frames", 200);
+    const size_t queue_size = dlib::get_option(parser, "queue-size", 2);
+    const std::string policy_name = dlib::get_option(parser, "policy", "block");
+    stream::drop_policy policy;
+    if (policy_name == "block")
+        policy = stream::drop_policy::block;
+    else if (policy_name == "drop-newest")
+        policy = stream::drop_policy::drop_newest;
+    else if (policy_name == "keep-latest")
+        policy = stream::drop_policy::keep_latest;
+    else
+        throw std::invalid_argument("unknown policy: " + policy_name);
+    std::cout << std::fixed << std::setprecision(3);
+
+    {
+        dlib::yolo_options options;
+        options.labels = yolo::coco_labels();
+        options.add_anchors<yolov5::ytag3>({{10, 13}, {16, 30}, {33, 23}});
+        options.add_anchors<yolov5::ytag4>({{30, 61}, {62, 45}, {59, 119}});
+        options.add_anchors<yolov5::ytag5>({{116, 90}, {156, 198}, {373, 326}});
+        yolov5::infer_type_s net(options);
+        const long num_filters = 3 * (options.labels.size() + 5);
+        dlib::layer<yolov5::ytag3, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5::ytag4, 2>(net).layer_details().set_num_filters(num_filters);
+        dlib::layer<yolov5::ytag5, 2>(net).layer_details().set_num_filters(num_filters);
+        benchmark_stream("yolov5s", net, image_size, num_frames, policy, queue_size);
+    }
+    {
+        dlib::yolo_options options;
+        options.labels = yolo::coco_labels();
+        options.add_anchors<yolov7::ytag3>({{12, 16}, {19, 36}, {40, 28}});
+        options.add_anchors<yolov7::ytag4>({{36, 75}, {76, 55}, {72, 146}});
+        options.add_anchors<yolov7::ytag5>({{142, 110}, {192, 243}, {459, 401}});
+        yolov7::infer_type net(options);
+        benchmark_stream("yolov7 ", net, image_size, num_frames, policy, queue_size);
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,92 @@
+#include "lm/token_dataset.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Resident memory of the process, in MiB.
+double resident_mib()
+{
+    std::ifstream statm("/proc/self/statm");
+    long pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE) / 1024.0 / 1024.0;
+}
+
+void write_corpus(const std::string& path, const long num_tokens, const long vocab_size)
+{
+    std::mt19937 rng(0);
+    transformer::token_dataset_writer writer(path, vocab_size);
+    std::vector<int> document;
+    for (long written = 0; written < num_tokens; written += document.size())
+    {
+        document.resize(std::min<long>(num_tokens - written, 200 + rng() % 4000));
+        for (auto& token : document)
+            token = rng() % vocab_size;
+        writer.add_document(document);
+    }
+    writer.close();
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("corpus", "token file to read, created with random tokens if missing (default: corpus.tok)", 1);
+    parser.add_option("num-tokens", "number of tokens of the created corpus (default: 100000000)", 1);
+    parser.add_option("seq-len", "set the window length (default: 100)", 1);
+    parser.add_option("batch-size", "set the batch size (default: 64)", 1);
+    parser.add_option("num-batches", "set the number of batches read per setting (default: 2000)", 1);
+    parser.add_option("step-time", "simulated training step in ms (default: 0)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using fms = std::chrono::duration<double, std::milli>;
+    const std::string path = dlib::get_option(parser, "corpus", "corpus.tok");
+    if (!std::ifstream(path).good())
+    {
+        std::cout << "writing " << path << '\n';
+        write_corpus(path, dlib::get_option(parser, "num-tokens", 100000000), 5000);
+    }
+    const transformer::token_dataset data(path);
+    std::cout << path << ": " << data.num_documents() << " documents, " << data.num_tokens() << " tokens of "
+              << data.token_bytes() << " bytes\n";
+
+    const long num_batches = dlib::get_option(parser, "num-batches", 2000);
+    const double step_time = dlib::get_option(parser, "step-time", 0.0);
+    std::cout << std::fixed << std::setprecision(3);
+    for (const size_t num_threads : {1, 2, 4, 8})
+    {
+        transformer::token_loader_options options;
+        options.seq_len = dlib::get_option(parser, "seq-len", 100);
+        options.batch_size = dlib::get_option(parser, "batch-size", 64);
+        options.num_threads = num_threads;
+        transformer::token_batch_loader loader(data, options);
+        std::vector<dlib::matrix<int, 0, 1>> samples;
+        std::vector<unsigned long> labels;
+        const auto t0 = std::chrono::steady_clock::now();
+        for (long i = 0; i < num_batches; ++i)
+        {
+            loader.get_batch(samples, labels);
+            if (step_time > 0)
+                std::this_thread::sleep_for(fms(step_time));
+        }
+        const double elapsed = std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "threads: " << num_threads << " batches/s: " << num_batches / elapsed * 1000
+                  << " windows/s: " << num_batches * options.batch_size / elapsed * 1000
+                  << " trainer waits: " << loader.get_waits() << " resident memory: " << resident_mib() << " MiB\n";
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
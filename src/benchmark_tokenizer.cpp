@@ -0,0 +1,167 @@
+#include "lm/bpe_tokenizer.h"
+#include "lm/token_dataset.h"
+
+#include <dlib/cmd_line_parser.h>
+
+// Documents of made-up words with a Zipf distribution, like the words of natural text.
+std::vector<std::string> make_corpus(const size_t num_bytes)
+{
+    const std::vector<std::string> syllables{"ka", "ri", "to", "men", "sa", "lo", "de", "tion", "an", "es", "ing", "pre", "ver",
+                                             "qu", "al", "th", "er", "on", "im", "ble", "st", "ou", "ch", "el"};
+    std::mt19937 rng(0);
+    std::vector<std::string> lexicon(30000);
+    for (auto& word : lexicon)
+    {
+        for (int s = 1 + rng() % 4; s > 0; --s)
+            word += syllables[rng() % syllables.size()];
+    }
+    std::vector<double> weights(lexicon.size());
+    for (size_t i = 0; i < weights.size(); ++i)
+        weights[i] = 1.0 / (i + 1);
+    std::discrete_distribution<size_t> zipf(weights.begin(), weights.end());
+
+    std::vector<std::string> documents;
+    size_t total = 0;
+    while (total < num_bytes)
+    {
+        std::string document;
+        const size_t length = 1000 + rng() % 8000;
+        bool capitalize = true;
+        while (document.size() < length)
+        {
+            std::string word = lexicon[zipf(rng)];
+            if (capitalize)
+                word[0] -= 'a' - 'A';
+            document += word;
+            capitalize = false;
+            switch (rng() % 40)
+            {
+                case 0: document += ". "; capitalize = true; break;
+                case 1: document += ", "; break;
+                case 2: document += " " + std::to_string(rng() % 2000) + " "; break;
+                case 3: document += ".\n\n"; capitalize = true; break;
+                default: document += ' ';
+            }
+        }
+        total += document.size();
+        documents.push_back(std::move(document));
+    }
+    return documents;
+}
+
+std::vector<std::string> read_documents(const std::string& path)
+{
+    // documents are separated by empty lines
+    std::ifstream in(path);
+    if (!in)
+        throw std::runtime_error("could not open " + path);
+    std::vector<std::string> documents(1);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.empty() && !documents.back().empty())
+            documents.emplace_back();
+        else
+            documents.back() += line + '\n';
+    }
+    if (documents.back().empty())
+        documents.pop_back();
+    return documents;
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("text", "text file to tokenize, documents separated by empty lines (default: random words)", 1);
+    parser.add_option("size", "size in MB of the random text (default: 32)", 1);
+    parser.add_option("vocab-size", "set the vocabulary size (default: 8000)", 1);
+    parser.add_option("train-size", "size in MB of the text the tokenizer is trained on (default: 4)", 1);
+    parser.add_option("cache-size", "words cached per encoding thread (default: 50000)", 1);
+    parser.add_option("output", "write the tokens to this token file", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using fms = std::chrono::duration<double, std::milli>;
+    const auto documents = parser.option("text") ? read_documents(parser.option("text").argument())
+                                                 : make_corpus(dlib::get_option(parser, "size", 32) * 1000000);
+    size_t num_bytes = 0;
+    for (const auto& document : documents)
+        num_bytes += document.size();
+    const double megabytes = num_bytes / 1e6;
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << documents.size() << " documents, " << megabytes << " MB\n";
+
+    const size_t train_bytes = dlib::get_option(parser, "train-size", 4) * 1000000;
+    std::vector<std::string> train_documents;
+    for (size_t i = 0, size = 0; i < documents.size() && size < train_bytes; size += documents[i++].size())
+        train_documents.push_back(documents[i]);
+    const size_t cache_size = dlib::get_option(parser, "cache-size", 50000);
+    auto t0 = std::chrono::steady_clock::now();
+    auto tokenizer = transformer::bpe_tokenizer::train(train_documents, dlib::get_option(parser, "vocab-size", 8000), 2, cache_size);
+    auto t1 = std::chrono::steady_clock::now();
+    std::cout << "training on " << train_documents.size() << " documents: " << std::chrono::duration_cast<fms>(t1 - t0).count()
+              << " ms, vocabulary: " << tokenizer.vocab_size() << '\n';
+
+    const auto report = [&](const std::string& name, const std::chrono::steady_clock::time_point& begin)
+    {
+        const double ms = std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << std::setw(24) << name << ": " << std::setw(10) << megabytes / ms * 1000 << " MB/s\n";
+    };
+
+    // a copy without cache, through serialization
+    transformer::bpe_tokenizer uncached(0);
+    std::istringstream stream([&] { std::ostringstream out; serialize(tokenizer, out); return out.str(); }());
+    deserialize(uncached, stream);
+    std::vector<int> ids;
+    t0 = std::chrono::steady_clock::now();
+    for (const auto& document : documents)
+        uncached.encode(document, ids);
+    report("encode, no cache", t0);
+
+    size_t num_tokens = 0;
+    t0 = std::chrono::steady_clock::now();
+    for (const auto& document : documents)
+    {
+        tokenizer.encode(document, ids);
+        num_tokens += ids.size();
+    }
+    report("encode, 1 thread", t0);
+
+    std::vector<dlib::matrix<int, 0, 1>> inputs;
+    t0 = std::chrono::steady_clock::now();
+    tokenizer.encode(documents, inputs);
+    report("encode, " + std::to_string(dlib::default_thread_pool().num_threads_in_pool()) + " threads", t0);
+
+    bool same = true;
+    t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < documents.size(); ++i)
+        same = tokenizer.decode(inputs[i]) == documents[i] && same;
+    report("decode", t0);
+    std::cout << "bytes per token: " << static_cast<double>(num_bytes) / num_tokens
+              << ", decoded text identical: " << (same ? "yes" : "no") << '\n';
+
+    if (parser.option("output"))
+    {
+        transformer::token_dataset_writer writer(parser.option("output").argument(), tokenizer.vocab_size());
+        for (const auto& input : inputs)
+            writer.add_document(input);
+        writer.close();
+        std::cout << "wrote " << num_tokens << " tokens to " << parser.option("output").argument() << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
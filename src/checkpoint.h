@@ -0,0 +1,455 @@
+#ifndef Checkpoint_H
+#define Checkpoint_H
+
+#include <dlib/dnn.h>
+
+#include <array>
+#include <cstdlib>
+#include <sstream>
+#include <type_traits>
+
+// Activation recomputation (gradient checkpointing): checkpoint<BLOCK, SUBNET> runs BLOCK as a
+// network of its own and frees its intermediate outputs right after the forward pass, so that
+// only the input and the output of the block stay in memory until the backward pass, which runs
+// the forward pass of the block again before back-propagating through it.  Around each block of
+// a deep repeat<> stack this trades one more forward pass of the blocks, about a third of the
+// training step, for the activations of all but one block.
+namespace checkpointing
+{
+    using namespace dlib;
+
+    // Input layer of the wrapped blocks.  They are run on the output of the layer below with
+    // forward(), to_tensor() only sets them up for one sample per input.
+    class checkpoint_input
+    {
+        public:
+        typedef matrix<float> input_type;
+
+        template <typename forward_iterator>
+        void to_tensor(forward_iterator ibegin, forward_iterator iend, resizable_tensor& data) const
+        {
+            DLIB_CASSERT(std::distance(ibegin, iend) > 0);
+            data.set_size(std::distance(ibegin, iend), 1, ibegin->nr(), ibegin->nc());
+            float* out = data.host_write_only();
+            for (auto i = ibegin; i != iend; ++i)
+            {
+                DLIB_CASSERT(i->nr() == ibegin->nr() && i->nc() == ibegin->nc(), "all the inputs must have the same size");
+                out = std::copy(i->begin(), i->end(), out);
+            }
+        }
+
+        friend void serialize(const checkpoint_input& /*item*/, std::ostream& out)
+        {
+            serialize("checkpoint_input", out);
+        }
+
+        friend void deserialize(checkpoint_input& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "checkpoint_input")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing checkpoint_input.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const checkpoint_input& /*item*/)
+        {
+            out << "checkpoint_input";
+            return out;
+        }
+
+        friend void to_xml(const checkpoint_input& /*item*/, std::ostream& out)
+        {
+            out << "<checkpoint_input/>\n";
+        }
+    };
+
+    /*!
+        dropout_ whose masks can be applied again: in replay mode, the forward pass multiplies its
+        input by the mask of the previous forward pass instead of drawing a new one, which is how
+        checkpoint_ recomputes a block.  It serializes as dropout_, so that the multiply layers of
+        the inference networks read it, and converts to multiply_ for the same reason.
+    !*/
+    template <int DROP_RATE_PERCENT>
+    class replayable_dropout_
+    {
+        static_assert(0 <= DROP_RATE_PERCENT && DROP_RATE_PERCENT < 100, "the drop rate is a percentage in [0, 100)");
+
+        public:
+        replayable_dropout_() : rnd(std::rand()) {}
+
+        replayable_dropout_(const replayable_dropout_& item) : drop_rate(item.drop_rate), mask(item.mask), rnd(std::rand()) {}
+        replayable_dropout_& operator=(const replayable_dropout_& item)
+        {
+            drop_rate = item.drop_rate;
+            mask = item.mask;
+            replay = false;
+            return *this;
+        }
+
+        operator dropout_() const { return dropout_(drop_rate); }
+
+        float get_drop_rate() const { return drop_rate; }
+        bool get_replay() const { return replay; }
+        void set_replay(const bool value) { replay = value; }
+
+        template <typename SUBNET> void setup(const SUBNET& /*sub*/) {}
+
+        void forward_inplace(const tensor& input, tensor& output)
+        {
+            if (replay)
+            {
+                DLIB_CASSERT(have_same_dimensions(mask, input), "replayable_dropout_: no mask to replay for this input");
+            }
+            else
+            {
+                mask.copy_size(input);
+                rnd.fill_uniform(mask);
+                tt::threshold(mask, drop_rate);
+            }
+            tt::multiply(false, output, input, mask);
+        }
+
+        void backward_inplace(const tensor& gradient_input, tensor& data_grad, tensor& /*params_grad*/)
+        {
+            if (is_same_object(gradient_input, data_grad))
+                tt::multiply(false, data_grad, mask, gradient_input);
+            else
+                tt::multiply(true, data_grad, mask, gradient_input);
+        }
+
+        inline dpoint map_input_to_output(const dpoint& p) const { return p; }
+        inline dpoint map_output_to_input(const dpoint& p) const { return p; }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const replayable_dropout_& item, std::ostream& out)
+        {
+            serialize("dropout_", out);
+            serialize(item.drop_rate, out);
+            serialize(item.mask, out);
+        }
+
+        friend void deserialize(replayable_dropout_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "dropout_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing replayable_dropout_.");
+            deserialize(item.drop_rate, in);
+            deserialize(item.mask, in);
+            item.replay = false;
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const replayable_dropout_& item)
+        {
+            out << "replayable_dropout\t (drop_rate=" << item.drop_rate << ")";
+            return out;
+        }
+
+        friend void to_xml(const replayable_dropout_& item, std::ostream& out)
+        {
+            out << "<replayable_dropout drop_rate='" << item.drop_rate << "'/>\n";
+        }
+
+        private:
+        float drop_rate = DROP_RATE_PERCENT / 100.0f;
+        bool replay = false;
+        resizable_tensor mask;
+        tt::tensor_rand rnd;
+        resizable_tensor params;  // unused
+    };
+
+    template <typename SUBNET>
+    using replayable_dropout = add_layer<replayable_dropout_<50>, SUBNET>;
+    template <typename SUBNET>
+    using replayable_dropout_10 = add_layer<replayable_dropout_<10>, SUBNET>;
+
+    namespace impl
+    {
+        template <typename T> struct is_replayable_dropout : std::false_type {};
+        template <int P> struct is_replayable_dropout<replayable_dropout_<P>> : std::true_type {};
+
+        template <typename NET> struct replay_dropout_of { using type = NET; };
+        template <typename SUBNET> struct replay_dropout_of<add_layer<dropout_, SUBNET>>
+        {
+            using type = add_layer<replayable_dropout_<50>, SUBNET>;
+        };
+        template <int P, typename SUBNET> struct replay_dropout_of<add_layer<dropout_rate_<P>, SUBNET>>
+        {
+            using type = add_layer<replayable_dropout_<P>, SUBNET>;
+        };
+    }
+
+    // DO with dlib's dropout layers replaced by replayable_dropout_ of the same rate, to build
+    // the blocks to checkpoint from the same template as the others: dropout and dropout_10
+    // become replayable_dropout and replayable_dropout_10, anything else is left as it is.
+    template <template <typename> class DO>
+    struct replayable
+    {
+        template <typename SUBNET>
+        using type = typename impl::replay_dropout_of<DO<SUBNET>>::type;
+    };
+
+    namespace impl
+    {
+        template <typename T> struct is_batch_norm : std::false_type {};
+        template <layer_mode mode> struct is_batch_norm<bn_<mode>> : std::true_type {};
+
+        // Calls f(layer_details, parameter_gradient) for every computational layer of a network.
+        template <typename F>
+        class visitor_layers
+        {
+            public:
+            visitor_layers(F& f) : f(f) {}
+
+            template <typename T> void operator()(size_t, T&) {}
+
+            template <typename LAYER, typename SUBNET>
+            void operator()(size_t, add_layer<LAYER, SUBNET>& l) { f(l.layer_details(), l.get_parameter_gradient()); }
+
+            private:
+            F& f;
+        };
+
+        template <typename net_type, typename F>
+        void for_each_layer(net_type& net, F&& f)
+        {
+            visit_layers(net, visitor_layers<F>(f));
+        }
+    }
+
+    /**
+     * @brief Runs BLOCK<checkpoint_input> without keeping its intermediate outputs.
+     *
+     * The solvers only see the layers of the outer network, so the parameters of all the layers
+     * of the block are gathered in one tensor, which this layer exposes and copies back into the
+     * block whenever a solver has changed it: the learning rate and weight decay multipliers of
+     * the inner layers are replaced by the ones of this layer.
+     *
+     * The recomputed forward pass must reproduce the first one.  The running statistics of the
+     * bn_ layers are restored before it so they are updated once per step, and the dropout layers
+     * of the block must be replayable_dropout_, which apply the masks of the first pass again:
+     * those masks are the only activations kept besides the output.  dlib's dropout_ would draw
+     * new ones, so blocks holding it do not compile; replayable<DO> swaps them.
+     */
+    template <template <typename> class BLOCK>
+    class checkpoint_
+    {
+        public:
+        using block_type = BLOCK<checkpoint_input>;
+
+        checkpoint_() { prepare(); }
+
+        checkpoint_(const checkpoint_& item) = default;
+        checkpoint_& operator=(const checkpoint_& item) = default;
+
+        // Converts a block to another one built from compatible layers, the training version of
+        // a block to the inference one for example (dropout to multiply, bn_con to affine).
+        template <template <typename> class OTHER>
+        checkpoint_(const checkpoint_<OTHER>& item) : block(item.get_block())
+        {
+            prepare();
+            gather_params();
+        }
+
+        const block_type& get_block() const
+        {
+            load_params();
+            return block;
+        }
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            // the first forward pass sets the layers of the block up
+            block.forward(sub.get_output());
+            block.clean();
+            gather_params();
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            load_params();
+            norm_states.clear();
+            impl::for_each_layer(block, [&](auto& details, tensor&)
+            {
+                if constexpr (impl::is_batch_norm<std::decay_t<decltype(details)>>::value)
+                {
+                    std::ostringstream state;
+                    serialize(details, state);
+                    norm_states.push_back(state.str());
+                }
+            });
+
+            const tensor& y = block.forward(sub.get_output());
+            output.copy_size(y);
+            memcpy(output, y);
+            // clean() keeps the masks of the dropout layers for the backward pass
+            block.clean();
+        }
+
+        template <typename SUBNET> void backward(const tensor& gradient_input, SUBNET& sub, tensor& params_grad)
+        {
+            const tensor& x = sub.get_output();
+            size_t i = 0;
+            impl::for_each_layer(block, [&](auto& details, tensor&)
+            {
+                if constexpr (impl::is_batch_norm<std::decay_t<decltype(details)>>::value)
+                {
+                    std::istringstream state(norm_states[i++]);
+                    deserialize(details, state);
+                }
+            });
+            set_replay(true);
+            block.forward(x);
+            set_replay(false);
+
+            block.back_propagate_error(x, gradient_input);
+            tt::add(1, sub.get_gradient_input(), 1, block.get_final_data_gradient());
+
+            size_t offset = 0;
+            float* out = params_grad.host();
+            impl::for_each_layer(block, [&](auto& details, tensor& grad)
+            {
+                const size_t size = details.get_layer_params().size();
+                if (grad.size() == size)
+                    std::copy(grad.host(), grad.host() + size, out + offset);
+                else
+                    std::fill(out + offset, out + offset + size, 0.f);
+                offset += size;
+            });
+            block.clean();
+            norm_states.clear();
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params()
+        {
+            // a solver is about to update them
+            params_changed = true;
+            return params;
+        }
+
+        friend void serialize(const checkpoint_& item, std::ostream& out)
+        {
+            // the block itself, so that running statistics are saved and the inference version
+            // of the block can read it
+            serialize("checkpoint_", out);
+            serialize(item.get_block(), out);
+        }
+
+        friend void deserialize(checkpoint_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "checkpoint_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing checkpoint_.");
+            deserialize(item.block, in);
+            item.prepare();
+            item.gather_params();
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const checkpoint_& item)
+        {
+            out << "checkpoint\t (layers=" << block_type::num_layers << ", params=" << item.params.size() << ")";
+            return out;
+        }
+
+        friend void to_xml(const checkpoint_& item, std::ostream& out)
+        {
+            out << "<checkpoint>\n";
+            net_to_xml(item.get_block(), out);
+            out << "</checkpoint>\n";
+        }
+
+        private:
+        template <template <typename> class> friend class checkpoint_;
+
+        void set_replay(const bool replay)
+        {
+            impl::for_each_layer(block, [&](auto& details, tensor&)
+            {
+                using layer_type = std::decay_t<decltype(details)>;
+                static_assert(!std::is_base_of<dropout_, layer_type>::value,
+                    "the masks of dropout_ can not be replayed in a checkpointed block, use replayable_dropout_");
+                if constexpr (impl::is_replayable_dropout<layer_type>::value)
+                    details.set_replay(replay);
+            });
+        }
+
+        void prepare() const
+        {
+            const std::array<matrix<float>, 1> sample{zeros_matrix<float>(1, 1)};
+            resizable_tensor x;
+            block.to_tensor(sample.begin(), sample.end(), x);
+        }
+
+        // copies the parameters of the layers of the block into params
+        void gather_params()
+        {
+            size_t size = 0;
+            impl::for_each_layer(block, [&](auto& details, tensor&) { size += details.get_layer_params().size(); });
+            if (size == 0)
+            {
+                params.clear();
+                return;
+            }
+            params.set_size(size);
+            float* out = params.host_write_only();
+            impl::for_each_layer(block, [&](auto& details, tensor&)
+            {
+                const tensor& p = details.get_layer_params();
+                out = std::copy(p.host(), p.host() + p.size(), out);
+            });
+            params_changed = false;
+        }
+
+        // copies params back into the layers of the block after a solver update
+        void load_params() const
+        {
+            if (!params_changed)
+                return;
+            const float* in = params.host();
+            impl::for_each_layer(block, [&](auto& details, tensor&)
+            {
+                tensor& p = details.get_layer_params();
+                std::copy(in, in + p.size(), p.host());
+                in += p.size();
+            });
+            params_changed = false;
+        }
+
+        mutable block_type block;
+        resizable_tensor params;                   // parameters of all the layers of the block
+        mutable bool params_changed = false;       // params differ from the ones in the block
+        std::vector<std::string> norm_states;      // bn_ layers before the forward pass
+    };
+
+    template <template <typename> class BLOCK, typename SUBNET>
+    using checkpoint = add_layer<checkpoint_<BLOCK>, SUBNET>;
+
+    // num BLOCK nested in one template, to recompute a segment of a repeat<> stack together:
+    // repeat<4, segment<3, BLOCK>::template checkpointed, SUBNET> runs 12 blocks, keeps the
+    // outputs of 4 of them and recomputes the others 3 by 3.
+    template <size_t num, template <typename> class BLOCK>
+    struct segment
+    {
+        template <typename SUBNET>
+        using type = BLOCK<typename segment<num - 1, BLOCK>::template type<SUBNET>>;
+
+        template <typename SUBNET>
+        using checkpointed = checkpoint<type, SUBNET>;
+    };
+
+    template <template <typename> class BLOCK>
+    struct segment<1, BLOCK>
+    {
+        template <typename SUBNET>
+        using type = BLOCK<SUBNET>;
+
+        template <typename SUBNET>
+        using checkpointed = checkpoint<BLOCK, SUBNET>;
+    };
+}
+
+#endif  // Checkpoint_H
@@ -1,6 +1,8 @@
 #ifndef ResNet_H
 #define ResNet_H
 
+#include "../checkpoint.h"
+
 #include <dlib/dnn.h>
 
 namespace resnet
@@ -37,6 +39,12 @@ namespace resnet
         template <typename SUBNET> using resbottleneck_2k = residual<bottleneck, 2 * k, SUBNET>;
         template <typename SUBNET> using resbottleneck_1k = residual<bottleneck, 1 * k, SUBNET>;
 
+        // residual blocks recomputed in the backward pass, see checkpoint.h
+        template <typename SUBNET> using cresbottleneck_8k = checkpointing::checkpoint<resbottleneck_8k, SUBNET>;
+        template <typename SUBNET> using cresbottleneck_4k = checkpointing::checkpoint<resbottleneck_4k, SUBNET>;
+        template <typename SUBNET> using cresbottleneck_2k = checkpointing::checkpoint<resbottleneck_2k, SUBNET>;
+        template <typename SUBNET> using cresbottleneck_1k = checkpointing::checkpoint<resbottleneck_1k, SUBNET>;
+
         template <long N8k, long N4k, long N2k, long N1k, typename INPUT>
         using backbone_basicblock = repeat<N8k, resbasicblock_8k, transition<basicblock, 8 * k, 1, 2,
                                     repeat<N4k, resbasicblock_4k, transition<basicblock, 4 * k, 1, 2,
@@ -51,12 +59,24 @@ namespace resnet
                                     repeat<N1k, resbottleneck_1k, transition<bottleneck, 1 * k, 4, 1,
                                     stem<INPUT>>>>>>>>>;
 
+        template <long N8k, long N4k, long N2k, long N1k, typename INPUT>
+        using backbone_bottleneck_checkpointed = repeat<N8k, cresbottleneck_8k, transition<bottleneck, 8 * k, 4, 2,
+                                                 repeat<N4k, cresbottleneck_4k, transition<bottleneck, 4 * k, 4, 2,
+                                                 repeat<N2k, cresbottleneck_2k, transition<bottleneck, 2 * k, 4, 2,
+                                                 repeat<N1k, cresbottleneck_1k, transition<bottleneck, 1 * k, 4, 1,
+                                                 stem<INPUT>>>>>>>>>;
+
         // the backbones for the classic architectures
         template <typename INPUT> using backbone_18  = backbone_basicblock<1, 1, 1, 1, INPUT>;
         template <typename INPUT> using backbone_34  = backbone_basicblock<2, 5, 3, 2, INPUT>;
         template <typename INPUT> using backbone_50  = backbone_bottleneck<2, 5, 3, 2, INPUT>;
         template <typename INPUT> using backbone_101 = backbone_bottleneck<2, 22, 3, 2, INPUT>;
         template <typename INPUT> using backbone_152 = backbone_bottleneck<2, 35, 7, 2, INPUT>;
+
+        // the same, keeping only the outputs of the residual blocks for the backward pass
+        template <typename INPUT> using backbone_50_checkpointed  = backbone_bottleneck_checkpointed<2, 5, 3, 2, INPUT>;
+        template <typename INPUT> using backbone_101_checkpointed = backbone_bottleneck_checkpointed<2, 22, 3, 2, INPUT>;
+        template <typename INPUT> using backbone_152_checkpointed = backbone_bottleneck_checkpointed<2, 35, 7, 2, INPUT>;
     };
     // clang-format on
 
@@ -73,6 +93,14 @@ namespace resnet
     using infer_101 = classification_head<def<affine, relu>::backbone_101<input_rgb_image>>;
     using train_152 = classification_head<def<bn_con, relu>::backbone_152<input_rgb_image>>;
     using infer_152 = classification_head<def<affine, relu>::backbone_152<input_rgb_image>>;
+
+    // an infer_*_checkpointed network can be assigned a trained train_*_checkpointed one
+    using train_50_checkpointed  = classification_head<def<bn_con, relu>::backbone_50_checkpointed<input_rgb_image>>;
+    using infer_50_checkpointed  = classification_head<def<affine, relu>::backbone_50_checkpointed<input_rgb_image>>;
+    using train_101_checkpointed = classification_head<def<bn_con, relu>::backbone_101_checkpointed<input_rgb_image>>;
+    using infer_101_checkpointed = classification_head<def<affine, relu>::backbone_101_checkpointed<input_rgb_image>>;
+    using train_152_checkpointed = classification_head<def<bn_con, relu>::backbone_152_checkpointed<input_rgb_image>>;
+    using infer_152_checkpointed = classification_head<def<affine, relu>::backbone_152_checkpointed<input_rgb_image>>;
 };  // namespace resnet
 
 #endif  // ResNet_H
@@ -0,0 +1,751 @@
+#ifndef ConvAutotune_H
+#define ConvAutotune_H
+
+#include <dlib/dnn.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <set>
+#include <thread>
+
+#ifdef __linux__
+// Thread count queries of the BLAS libraries dlib may be linked with, null when it is not.
+extern "C" int openblas_get_num_threads() __attribute__((weak));
+extern "C" int mkl_get_max_threads() __attribute__((weak));
+#endif
+
+namespace conv_autotune
+{
+    using namespace dlib;
+
+    // The CPU convolution algorithms we know how to time.  im2col_gemm is what dlib's con_
+    // layer runs on the CPU, so it is always available and used as the reference.
+    enum class conv_algorithm
+    {
+        im2col_gemm,
+        direct,
+        gemm_1x1,
+        winograd_3x3
+    };
+
+    inline std::string to_string(const conv_algorithm algo)
+    {
+        switch (algo)
+        {
+        case conv_algorithm::im2col_gemm: return "im2col_gemm";
+        case conv_algorithm::direct: return "direct";
+        case conv_algorithm::gemm_1x1: return "gemm_1x1";
+        case conv_algorithm::winograd_3x3: return "winograd_3x3";
+        }
+        return "unknown";
+    }
+
+    inline conv_algorithm algorithm_from_string(const std::string& name)
+    {
+        if (name == "im2col_gemm") return conv_algorithm::im2col_gemm;
+        if (name == "direct") return conv_algorithm::direct;
+        if (name == "gemm_1x1") return conv_algorithm::gemm_1x1;
+        if (name == "winograd_3x3") return conv_algorithm::winograd_3x3;
+        throw error("conv_autotune: unknown convolution algorithm: " + name);
+    }
+
+    const std::vector<conv_algorithm> all_algorithms{
+        conv_algorithm::im2col_gemm,
+        conv_algorithm::direct,
+        conv_algorithm::gemm_1x1,
+        conv_algorithm::winograd_3x3};
+
+    // Everything that determines the cost of a convolution: the input tensor dimensions and the
+    // con_ layer hyper-parameters.
+    struct conv_shape
+    {
+        long num_samples = 0;
+        long k = 0;
+        long nr = 0;
+        long nc = 0;
+        long num_filters = 0;
+        long filter_nr = 0;
+        long filter_nc = 0;
+        int stride_y = 1;
+        int stride_x = 1;
+        int padding_y = 0;
+        int padding_x = 0;
+
+        long out_nr() const { return 1 + (nr + 2 * padding_y - filter_nr) / stride_y; }
+        long out_nc() const { return 1 + (nc + 2 * padding_x - filter_nc) / stride_x; }
+
+        std::string key() const
+        {
+            std::ostringstream sout;
+            sout << num_samples << 'x' << k << 'x' << nr << 'x' << nc
+                 << ":con_<" << num_filters << ',' << filter_nr << ',' << filter_nc << ','
+                 << stride_y << ',' << stride_x << ',' << padding_y << ',' << padding_x << '>';
+            return sout.str();
+        }
+
+        bool operator<(const conv_shape& other) const { return key() < other.key(); }
+    };
+
+    inline bool is_supported(const conv_algorithm algo, const conv_shape& s)
+    {
+        switch (algo)
+        {
+        case conv_algorithm::im2col_gemm:
+        case conv_algorithm::direct:
+            return true;
+        case conv_algorithm::gemm_1x1:
+            return s.filter_nr == 1 && s.filter_nc == 1 && s.stride_y == 1 && s.stride_x == 1 &&
+                   s.padding_y == 0 && s.padding_x == 0;
+        case conv_algorithm::winograd_3x3:
+            return s.filter_nr == 3 && s.filter_nc == 3 && s.stride_y == 1 && s.stride_x == 1;
+        }
+        return false;
+    }
+
+    // A convolution that has been prepared for a given shape and set of filters.  Preparing may
+    // transform the filters (Winograd), so it is kept out of the timed region.  Biases are not
+    // part of the algorithm choice and are not handled here.
+    class conv_plan
+    {
+        public:
+        virtual ~conv_plan() = default;
+        virtual void operator()(resizable_tensor& output, const tensor& data) = 0;
+    };
+
+    class im2col_gemm_plan : public conv_plan
+    {
+        public:
+        im2col_gemm_plan(const conv_shape& s, const tensor& filters, const tensor& data)
+            : filters(filters)
+        {
+            conv.setup(data, filters, s.stride_y, s.stride_x, s.padding_y, s.padding_x);
+        }
+
+        void operator()(resizable_tensor& output, const tensor& data) override
+        {
+            conv(false, output, data, filters);
+        }
+
+        private:
+        const tensor& filters;
+        tt::tensor_conv conv;
+    };
+
+    class direct_plan : public conv_plan
+    {
+        public:
+        direct_plan(const conv_shape& s, const tensor& filters, thread_pool& tp)
+            : s(s), filters(filters), tp(tp)
+        {
+        }
+
+        void operator()(resizable_tensor& output, const tensor& data) override
+        {
+            const long out_nr = s.out_nr();
+            const long out_nc = s.out_nc();
+            output.set_size(data.num_samples(), s.num_filters, out_nr, out_nc);
+            const float* in = data.host();
+            const float* w = filters.host();
+            float* out = output.host_write_only();
+            // one task per output plane, the innermost loop runs along a contiguous output row
+            parallel_for(tp, 0, data.num_samples() * s.num_filters, [&](long i)
+            {
+                const long n = i / s.num_filters;
+                const long f = i % s.num_filters;
+                float* o = out + i * out_nr * out_nc;
+                std::fill(o, o + out_nr * out_nc, 0.f);
+                for (long c = 0; c < s.k; ++c)
+                {
+                    const float* ip = in + (n * s.k + c) * s.nr * s.nc;
+                    const float* wp = w + (f * s.k + c) * s.filter_nr * s.filter_nc;
+                    for (long ky = 0; ky < s.filter_nr; ++ky)
+                    {
+                        for (long kx = 0; kx < s.filter_nc; ++kx)
+                        {
+                            const float wv = wp[ky * s.filter_nc + kx];
+                            // valid output columns are the ones that map inside the input
+                            long ox_begin = 0;
+                            while (ox_begin < out_nc && ox_begin * s.stride_x - s.padding_x + kx < 0)
+                                ++ox_begin;
+                            long ox_end = out_nc;
+                            while (ox_end > ox_begin && (ox_end - 1) * s.stride_x - s.padding_x + kx >= s.nc)
+                                --ox_end;
+                            for (long oy = 0; oy < out_nr; ++oy)
+                            {
+                                const long iy = oy * s.stride_y - s.padding_y + ky;
+                                if (iy < 0 || iy >= s.nr)
+                                    continue;
+                                const float* irow = ip + iy * s.nc;
+                                float* orow = o + oy * out_nc;
+                                for (long ox = ox_begin; ox < ox_end; ++ox)
+                                    orow[ox] += wv * irow[ox * s.stride_x - s.padding_x + kx];
+                            }
+                        }
+                    }
+                }
+            });
+        }
+
+        private:
+        conv_shape s;
+        const tensor& filters;
+        thread_pool& tp;
+    };
+
+    // A 1x1 convolution with unit stride is a plain matrix product per sample:
+    // output[n] (num_filters x nr*nc) = filters (num_filters x k) * data[n] (k x nr*nc)
+    class gemm_1x1_plan : public conv_plan
+    {
+        public:
+        gemm_1x1_plan(const conv_shape& s, const tensor& filters)
+            : s(s), filters(filters), in_sample(s.k, s.nr * s.nc), out_sample(s.num_filters, s.nr * s.nc)
+        {
+        }
+
+        void operator()(resizable_tensor& output, const tensor& data) override
+        {
+            output.set_size(data.num_samples(), s.num_filters, s.nr, s.nc);
+            for (long n = 0; n < data.num_samples(); ++n)
+            {
+                auto out = out_sample(output, n * out_sample.size());
+                tt::gemm(0, out, 1, filters, false, in_sample(data, n * in_sample.size()), false);
+            }
+        }
+
+        private:
+        conv_shape s;
+        const tensor& filters;
+        alias_tensor in_sample;
+        alias_tensor out_sample;
+    };
+
+    // Winograd F(2x2, 3x3): every 2x2 output tile is computed from a 4x4 input tile with 16
+    // multiplications instead of 36.  The channel reduction becomes 16 independent GEMMs.
+    class winograd_3x3_plan : public conv_plan
+    {
+        public:
+        winograd_3x3_plan(const conv_shape& s, const tensor& filters, thread_pool& tp)
+            : s(s), tp(tp), u_slice(s.num_filters, s.k)
+        {
+            // U = G g G^T, stored as 16 matrices of num_filters x k
+            static const float G[4][3] = {{1, 0, 0}, {0.5f, 0.5f, 0.5f}, {0.5f, -0.5f, 0.5f}, {0, 0, 1}};
+            u.set_size(16 * s.num_filters * s.k);
+            float* pu = u.host_write_only();
+            const float* g = filters.host();
+            const long fk = s.num_filters * s.k;
+            for (long i = 0; i < fk; ++i)
+            {
+                const float* gi = g + i * 9;
+                float tmp[4][3];
+                for (int r = 0; r < 4; ++r)
+                    for (int c = 0; c < 3; ++c)
+                        tmp[r][c] = G[r][0] * gi[c] + G[r][1] * gi[3 + c] + G[r][2] * gi[6 + c];
+                for (int r = 0; r < 4; ++r)
+                    for (int c = 0; c < 4; ++c)
+                        pu[(r * 4 + c) * fk + i] = tmp[r][0] * G[c][0] + tmp[r][1] * G[c][1] + tmp[r][2] * G[c][2];
+            }
+        }
+
+        void operator()(resizable_tensor& output, const tensor& data) override
+        {
+            const long out_nr = s.out_nr();
+            const long out_nc = s.out_nc();
+            const long tiles_y = (out_nr + 1) / 2;
+            const long tiles_x = (out_nc + 1) / 2;
+            const long num_tiles = tiles_y * tiles_x;
+            output.set_size(data.num_samples(), s.num_filters, out_nr, out_nc);
+            v.set_size(16 * s.k * num_tiles);
+            m.set_size(16 * s.num_filters * num_tiles);
+            const alias_tensor v_slice(s.k, num_tiles);
+            const alias_tensor m_slice(s.num_filters, num_tiles);
+            float* out = output.host_write_only();
+            for (long n = 0; n < data.num_samples(); ++n)
+            {
+                const float* in = data.host() + n * s.k * s.nr * s.nc;
+                float* pv = v.host_write_only();
+                // V = B^T d B for every input channel and tile
+                parallel_for(tp, 0, s.k, [&](long c)
+                {
+                    const float* ip = in + c * s.nr * s.nc;
+                    for (long t = 0; t < num_tiles; ++t)
+                    {
+                        const long y0 = (t / tiles_x) * 2 - s.padding_y;
+                        const long x0 = (t % tiles_x) * 2 - s.padding_x;
+                        float d[4][4];
+                        for (int r = 0; r < 4; ++r)
+                        {
+                            for (int cc = 0; cc < 4; ++cc)
+                            {
+                                const long y = y0 + r;
+                                const long x = x0 + cc;
+                                d[r][cc] = (y >= 0 && y < s.nr && x >= 0 && x < s.nc) ? ip[y * s.nc + x] : 0.f;
+                            }
+                        }
+                        float tmp[4][4];
+                        for (int cc = 0; cc < 4; ++cc)
+                        {
+                            tmp[0][cc] = d[0][cc] - d[2][cc];
+                            tmp[1][cc] = d[1][cc] + d[2][cc];
+                            tmp[2][cc] = d[2][cc] - d[1][cc];
+                            tmp[3][cc] = d[1][cc] - d[3][cc];
+                        }
+                        for (int r = 0; r < 4; ++r)
+                        {
+                            float* dst = pv + (r * 4) * s.k * num_tiles + c * num_tiles + t;
+                            const long step = s.k * num_tiles;
+                            dst[0 * step] = tmp[r][0] - tmp[r][2];
+                            dst[1 * step] = tmp[r][1] + tmp[r][2];
+                            dst[2 * step] = tmp[r][2] - tmp[r][1];
+                            dst[3 * step] = tmp[r][1] - tmp[r][3];
+                        }
+                    }
+                });
+                // M[xi] = U[xi] * V[xi]
+                for (long xi = 0; xi < 16; ++xi)
+                {
+                    auto mm = m_slice(m, xi * m_slice.size());
+                    tt::gemm(0, mm, 1, u_slice(u, xi * u_slice.size()), false, v_slice(v, xi * v_slice.size()), false);
+                }
+                // Y = A^T M A, cropped at the right and bottom borders
+                const float* pm = m.host();
+                float* on = out + n * s.num_filters * out_nr * out_nc;
+                parallel_for(tp, 0, s.num_filters, [&](long f)
+                {
+                    float* of = on + f * out_nr * out_nc;
+                    const long step = s.num_filters * num_tiles;
+                    for (long t = 0; t < num_tiles; ++t)
+                    {
+                        const float* src = pm + f * num_tiles + t;
+                        float mt[4][4];
+                        for (int xi = 0; xi < 16; ++xi)
+                            mt[xi / 4][xi % 4] = src[xi * step];
+                        float tmp[2][4];
+                        for (int cc = 0; cc < 4; ++cc)
+                        {
+                            tmp[0][cc] = mt[0][cc] + mt[1][cc] + mt[2][cc];
+                            tmp[1][cc] = mt[1][cc] - mt[2][cc] - mt[3][cc];
+                        }
+                        const long oy = (t / tiles_x) * 2;
+                        const long ox = (t % tiles_x) * 2;
+                        for (int r = 0; r < 2 && oy + r < out_nr; ++r)
+                        {
+                            of[(oy + r) * out_nc + ox] = tmp[r][0] + tmp[r][1] + tmp[r][2];
+                            if (ox + 1 < out_nc)
+                                of[(oy + r) * out_nc + ox + 1] = tmp[r][1] - tmp[r][2] - tmp[r][3];
+                        }
+                    }
+                });
+            }
+        }
+
+        private:
+        conv_shape s;
+        thread_pool& tp;
+        alias_tensor u_slice;
+        resizable_tensor u;
+        resizable_tensor v;
+        resizable_tensor m;
+    };
+
+    inline std::unique_ptr<conv_plan> make_plan(
+        const conv_algorithm algo,
+        const conv_shape& s,
+        const tensor& filters,
+        const tensor& data,
+        thread_pool& tp)
+    {
+        DLIB_CASSERT(is_supported(algo, s), to_string(algo) << " does not support " << s.key());
+        switch (algo)
+        {
+        case conv_algorithm::im2col_gemm: return std::make_unique<im2col_gemm_plan>(s, filters, data);
+        case conv_algorithm::direct: return std::make_unique<direct_plan>(s, filters, tp);
+        case conv_algorithm::gemm_1x1: return std::make_unique<gemm_1x1_plan>(s, filters);
+        case conv_algorithm::winograd_3x3: return std::make_unique<winograd_3x3_plan>(s, filters, tp);
+        }
+        return nullptr;
+    }
+
+    inline std::string cpu_model_name()
+    {
+        std::ifstream fin("/proc/cpuinfo");
+        std::string line;
+        while (std::getline(fin, line))
+        {
+            if (line.rfind("model name", 0) == 0)
+            {
+                const auto pos = line.find(':');
+                if (pos != std::string::npos)
+                    return line.substr(line.find_first_not_of(" \t", pos + 1));
+            }
+        }
+        return "unknown cpu";
+    }
+
+    // Number of threads the BLAS library runs a gemm on, which changes the timings of the gemm
+    // based algorithms as much as the size of the thread pool: asked to OpenBLAS or MKL when the
+    // program is linked with them, else read from the environment variables they follow, else
+    // the number of cores, their default.
+    inline size_t blas_num_threads()
+    {
+#ifdef __linux__
+        if (openblas_get_num_threads)
+            return std::max(1, openblas_get_num_threads());
+        if (mkl_get_max_threads)
+            return std::max(1, mkl_get_max_threads());
+#endif
+        for (const char* name : {"OPENBLAS_NUM_THREADS", "MKL_NUM_THREADS", "OMP_NUM_THREADS"})
+        {
+            const char* value = std::getenv(name);
+            if (value && std::atoi(value) > 0)
+                return std::atoi(value);
+        }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    class visitor_collect_conv_shapes
+    {
+        public:
+        visitor_collect_conv_shapes(std::vector<conv_shape>& shapes) : shapes(shapes) {}
+        // ignore other layers
+        template <typename T> void operator()(size_t, T&) {}
+        template <long nf, long nr, long nc, int sy, int sx, int py, int px, typename SUBNET>
+        void operator()(size_t, dlib::add_layer<dlib::con_<nf, nr, nc, sy, sx, py, px>, SUBNET>& l)
+        {
+            const tensor& in = l.subnet().get_output();
+            const auto& details = l.layer_details();
+            conv_shape s;
+            s.num_samples = in.num_samples();
+            s.k = in.k();
+            s.nr = in.nr();
+            s.nc = in.nc();
+            s.num_filters = details.num_filters();
+            s.filter_nr = details.nr();
+            s.filter_nc = details.nc();
+            s.stride_y = details.stride_y();
+            s.stride_x = details.stride_x();
+            s.padding_y = details.padding_y();
+            s.padding_x = details.padding_x();
+            shapes.push_back(s);
+        }
+
+        private:
+        std::vector<conv_shape>& shapes;
+    };
+
+    struct tuning_record
+    {
+        conv_shape shape;
+        conv_algorithm algorithm = conv_algorithm::im2col_gemm;
+        double milliseconds = 0;
+        size_t num_layers = 0;
+    };
+
+    /*!
+        Times every supported algorithm for each distinct convolution shape in a network and
+        remembers the fastest one.  Results are persisted in a plain text cache file, keyed by
+        CPU model, number of threads and shape, so only new shapes are timed on later runs.
+        The number of threads is the one of the thread pool and the one of the BLAS library,
+        written "pool/blas": running with another OPENBLAS_NUM_THREADS tunes again.
+    !*/
+    class autotuner
+    {
+        public:
+        explicit autotuner(
+            const std::string& cache_file,
+            const size_t num_threads = std::thread::hardware_concurrency(),
+            const int iterations = 5)
+            : cache_file(cache_file),
+              num_threads(std::max<size_t>(num_threads, 1)),
+              iterations(iterations),
+              threads_key(std::to_string(this->num_threads) + "/" + std::to_string(blas_num_threads())),
+              cpu_model(cpu_model_name()),
+              tp(this->num_threads)
+        {
+            load();
+        }
+
+        // Runs the network once on x to get every layer input shape and tunes the new ones.  The
+        // layer counts of print_summary() are the ones of this network.
+        template <typename net_type>
+        void tune(net_type& net, const tensor& x, std::ostream& log = std::cout)
+        {
+            net.forward(x);
+            for (auto& r : records)
+                r.second.num_layers = 0;
+            std::vector<conv_shape> layer_shapes;
+            visit_layers(net, visitor_collect_conv_shapes(layer_shapes));
+            std::map<std::string, size_t> counts;
+            for (const auto& s : layer_shapes)
+                ++counts[s.key()];
+            std::set<std::string> done;
+            for (const auto& s : layer_shapes)
+            {
+                const auto key = s.key();
+                if (!done.insert(key).second)
+                    continue;
+                auto it = records.find(key);
+                if (it == records.end())
+                {
+                    tuning_record r = tune_shape(s);
+                    log << "tuned " << key << ": " << to_string(r.algorithm) << " (" << r.milliseconds << " ms)\n";
+                    it = records.emplace(key, r).first;
+                }
+                it->second.num_layers = counts[key];
+            }
+            save();
+        }
+
+        conv_algorithm get_algorithm(const conv_shape& s) const
+        {
+            const auto it = records.find(s.key());
+            if (it == records.end())
+                return conv_algorithm::im2col_gemm;
+            return it->second.algorithm;
+        }
+
+        const std::map<std::string, tuning_record>& get_records() const { return records; }
+
+        thread_pool& get_thread_pool() { return tp; }
+
+        void print_summary(std::ostream& out) const
+        {
+            for (const auto& r : records)
+            {
+                if (r.second.num_layers == 0)
+                    continue;
+                out << r.first << " x" << r.second.num_layers << " -> " << to_string(r.second.algorithm)
+                    << " (" << r.second.milliseconds << " ms)\n";
+            }
+        }
+
+        void save() const
+        {
+            if (cache_file.empty())
+                return;
+            std::ofstream fout(cache_file);
+            if (!fout)
+                throw error("conv_autotune: unable to write " + cache_file);
+            fout << "# cpu\tthreads\tshape\talgorithm\tms\n";
+            for (const auto& entry : foreign_entries)
+                fout << entry << '\n';
+            for (const auto& r : records)
+            {
+                fout << cpu_model << '\t' << threads_key << '\t' << r.first << '\t'
+                     << to_string(r.second.algorithm) << '\t' << r.second.milliseconds << '\n';
+            }
+        }
+
+        private:
+        void load()
+        {
+            std::ifstream fin(cache_file);
+            std::string line;
+            while (std::getline(fin, line))
+            {
+                if (line.empty() || line[0] == '#')
+                    continue;
+                std::istringstream sin(line);
+                std::string cpu, threads, key, algo, ms;
+                if (!std::getline(sin, cpu, '\t') || !std::getline(sin, threads, '\t') ||
+                    !std::getline(sin, key, '\t') || !std::getline(sin, algo, '\t') || !std::getline(sin, ms))
+                    continue;
+                // keep the entries for other machines and thread counts untouched
+                if (cpu != cpu_model || threads != threads_key)
+                {
+                    foreign_entries.push_back(line);
+                    continue;
+                }
+                tuning_record r;
+                r.algorithm = algorithm_from_string(algo);
+                r.milliseconds = std::stod(ms);
+                records[key] = r;
+            }
+        }
+
+        tuning_record tune_shape(const conv_shape& s)
+        {
+            using fms = std::chrono::duration<double, std::milli>;
+            resizable_tensor data(s.num_samples, s.k, s.nr, s.nc);
+            resizable_tensor filters(s.num_filters, s.k, s.filter_nr, s.filter_nc);
+            tt::tensor_rand rnd(0);
+            rnd.fill_uniform(data);
+            rnd.fill_uniform(filters);
+
+            resizable_tensor reference, output;
+            im2col_gemm_plan reference_plan(s, filters, data);
+            reference_plan(reference, data);
+
+            tuning_record best;
+            best.shape = s;
+            best.milliseconds = std::numeric_limits<double>::max();
+            for (const auto algo : all_algorithms)
+            {
+                if (!is_supported(algo, s))
+                    continue;
+                auto plan = make_plan(algo, s, filters, data, tp);
+                (*plan)(output, data);
+                // an algorithm that does not reproduce dlib's result is never selected
+                if (max_abs_difference(reference, output) > 1e-3f * std::max(1.f, max_abs(reference)))
+                    continue;
+                std::vector<double> times;
+                for (int i = 0; i < iterations; ++i)
+                {
+                    const auto t0 = std::chrono::steady_clock::now();
+                    (*plan)(output, data);
+                    output.host();
+                    const auto t1 = std::chrono::steady_clock::now();
+                    times.push_back(std::chrono::duration_cast<fms>(t1 - t0).count());
+                }
+                std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+                const double median = times[times.size() / 2];
+                if (median < best.milliseconds)
+                {
+                    best.milliseconds = median;
+                    best.algorithm = algo;
+                }
+            }
+            return best;
+        }
+
+        static float max_abs(const tensor& t)
+        {
+            float m = 0;
+            const float* p = t.host();
+            for (size_t i = 0; i < t.size(); ++i)
+                m = std::max(m, std::abs(p[i]));
+            return m;
+        }
+
+        static float max_abs_difference(const tensor& a, const tensor& b)
+        {
+            if (a.size() != b.size())
+                return std::numeric_limits<float>::infinity();
+            float m = 0;
+            const float* pa = a.host();
+            const float* pb = b.host();
+            for (size_t i = 0; i < a.size(); ++i)
+                m = std::max(m, std::abs(pa[i] - pb[i]));
+            return m;
+        }
+
+        std::string cache_file;
+        size_t num_threads;
+        int iterations;
+        std::string threads_key;  // threads of the pool and of the BLAS library
+        std::string cpu_model;
+        thread_pool tp;
+        std::map<std::string, tuning_record> records;
+        std::vector<std::string> foreign_entries;
+    };
+
+    /*!
+        The convolutions of a network run with chosen algorithms instead of dlib's con_: built
+        after a forward pass of the network, it prepares a plan for each con_ layer on a copy of
+        its filters, and run() applies them to the inputs of the layers and adds the biases, as
+        the forward pass of the network does.  With the algorithms of an autotuner and with
+        im2col_gemm, what con_ runs, the difference of the two run() times is what the tuned
+        algorithms save on a forward pass of the network.
+    !*/
+    class planned_convolutions
+    {
+        public:
+        template <typename net_type>
+        planned_convolutions(net_type& net, thread_pool& tp, const std::function<conv_algorithm(const conv_shape&)>& choose)
+        {
+            visit_layers(net, visitor_collect(layers));
+            for (auto& l : layers)
+            {
+                l.algorithm = choose(l.shape);
+                l.plan = make_plan(l.algorithm, l.shape, l.filters, *l.input, tp);
+            }
+        }
+
+        // every convolution with algo, im2col_gemm for the ones of dlib
+        template <typename net_type>
+        planned_convolutions(net_type& net, thread_pool& tp, const conv_algorithm algo)
+            : planned_convolutions(net, tp, [algo](const conv_shape&) { return algo; }) {}
+
+        // every convolution with the algorithm the autotuner chose for its shape
+        template <typename net_type>
+        planned_convolutions(net_type& net, autotuner& tuner)
+            : planned_convolutions(net, tuner.get_thread_pool(), [&tuner](const conv_shape& s) { return tuner.get_algorithm(s); }) {}
+
+        planned_convolutions(const planned_convolutions&) = delete;
+        planned_convolutions& operator=(const planned_convolutions&) = delete;
+
+        size_t size() const { return layers.size(); }
+
+        // number of convolutions run with algo
+        size_t count(const conv_algorithm algo) const
+        {
+            return std::count_if(layers.begin(), layers.end(), [algo](const layer& l) { return l.algorithm == algo; });
+        }
+
+        void run()
+        {
+            for (auto& l : layers)
+            {
+                (*l.plan)(l.output, *l.input);
+                if (l.biases.size() != 0)
+                    tt::add(1, l.output, 1, l.biases);
+            }
+            if (!layers.empty())
+                layers.back().output.host();
+        }
+
+        private:
+        struct layer
+        {
+            conv_shape shape;
+            conv_algorithm algorithm = conv_algorithm::im2col_gemm;
+            const tensor* input = nullptr;   // output of the layer below, set by the forward pass
+            resizable_tensor filters;
+            resizable_tensor biases;         // empty when the bias is disabled
+            resizable_tensor output;
+            std::unique_ptr<conv_plan> plan; // refers to filters
+        };
+
+        class visitor_collect
+        {
+            public:
+            visitor_collect(std::vector<layer>& layers) : layers(layers) {}
+            // ignore other layers
+            template <typename T> void operator()(size_t, T&) {}
+            template <long nf, long nr, long nc, int sy, int sx, int py, int px, typename SUBNET>
+            void operator()(size_t, dlib::add_layer<dlib::con_<nf, nr, nc, sy, sx, py, px>, SUBNET>& l)
+            {
+                std::vector<conv_shape> shapes;
+                visitor_collect_conv_shapes collect(shapes);
+                collect(0, l);
+                layer c;
+                c.shape = shapes.front();
+                c.input = &l.subnet().get_output();
+                const auto& details = l.layer_details();
+                const tensor& params = details.get_layer_params();
+                const alias_tensor filters(c.shape.num_filters, c.shape.k, c.shape.filter_nr, c.shape.filter_nc);
+                c.filters.set_size(filters.num_samples(), filters.k(), filters.nr(), filters.nc());
+                memcpy(c.filters, filters(params, 0));
+                if (!details.bias_is_disabled())
+                {
+                    const alias_tensor biases(1, c.shape.num_filters);
+                    c.biases.set_size(1, c.shape.num_filters);
+                    memcpy(c.biases, biases(params, filters.size()));
+                }
+                layers.push_back(std::move(c));
+            }
+
+            private:
+            std::vector<layer>& layers;
+        };
+
+        // the plans refer to the filters of the layers, which must not move once they are made
+        std::vector<layer> layers;
+    };
+}  // namespace conv_autotune
+
+#endif  // ConvAutotune_H
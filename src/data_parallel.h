@@ -0,0 +1,382 @@
+#ifndef DataParallel_H
+#define DataParallel_H
+
+#include <dlib/dnn.h>
+
+#include <atomic>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Data-parallel training on the cores of one machine.  dnn_trainer splits a batch across CUDA
+// devices only: on the CPU, one thread runs the whole batch and the layers are left with
+// whatever parallelism their BLAS calls have.  data_parallel::trainer holds num_replicas copies
+// of the network instead, each run by a thread pinned to its own group of cores on a slice of
+// the batch.  The gradients of the replicas are summed along a binary tree, the solvers update
+// the parameters of the first replica once, and the new parameters go back down the same tree.
+// The threads only wait on atomic step counters: no lock is taken during a step.
+namespace data_parallel
+{
+    using namespace dlib;
+
+    struct trainer_options
+    {
+        // 0 for one replica per core
+        size_t num_replicas = 0;
+        // 0 for the cores of the machine shared evenly between the replicas
+        size_t cores_per_replica = 0;
+        size_t first_core = 0;
+        // binds the thread of each replica to its cores (Linux only)
+        bool pin_threads = true;
+    };
+
+    namespace impl
+    {
+        // Spins for a while, then yields, then sleeps, until flag reaches value or stop is set.
+        inline bool wait_for(const std::atomic<size_t>& flag, const size_t value, const std::atomic<bool>& stop)
+        {
+            for (size_t count = 0; flag.load(std::memory_order_acquire) < value; ++count)
+            {
+                if (stop.load(std::memory_order_acquire))
+                    return false;
+                if (count < 64)
+                    ;
+                else if (count < 256)
+                    std::this_thread::yield();
+                else
+                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+            return true;
+        }
+
+        inline bool pin_current_thread(const size_t first_core, const size_t num_cores)
+        {
+#ifdef __linux__
+            cpu_set_t cores;
+            CPU_ZERO(&cores);
+            for (size_t c = first_core; c < first_core + num_cores && c < CPU_SETSIZE; ++c)
+                CPU_SET(c, &cores);
+            return pthread_setaffinity_np(pthread_self(), sizeof(cores), &cores) == 0;
+#else
+            (void)first_core;
+            (void)num_cores;
+            return false;
+#endif
+        }
+
+        // Collects the parameters of every computational layer and their gradients.
+        class visitor_parameters
+        {
+            public:
+            visitor_parameters(std::vector<tensor*>& params, std::vector<tensor*>& grads) : params(params), grads(grads) {}
+
+            template <typename T> void operator()(size_t, T&) {}
+
+            template <typename LAYER, typename SUBNET>
+            void operator()(size_t, add_layer<LAYER, SUBNET>& l)
+            {
+                if (l.layer_details().get_layer_params().size() == 0)
+                    return;
+                params.push_back(&l.layer_details().get_layer_params());
+                grads.push_back(&l.get_parameter_gradient());
+            }
+
+            private:
+            std::vector<tensor*>& params;
+            std::vector<tensor*>& grads;
+        };
+
+        // Layers that keep their parameters to themselves and update them with apply_update()
+        // (sparse_embeddings), driven by the trainer through these functions.
+        struct own_update_ops
+        {
+            void (*scale_gradient)(void* layer, float s);
+            void (*add_gradient)(void* layer, const void* other);
+            void (*apply_update)(void* layer);
+            void (*copy_update)(void* layer, const void* other);
+        };
+
+        template <typename T, typename = void> struct has_own_update : std::false_type {};
+        template <typename T>
+        struct has_own_update<T, std::void_t<decltype(std::declval<T&>().apply_update()),
+                                             decltype(std::declval<T&>().set_update_in_backward(false))>> : std::true_type {};
+
+        template <typename LAYER> own_update_ops make_own_update_ops()
+        {
+            own_update_ops ops;
+            ops.scale_gradient = [](void* l, const float s) { static_cast<LAYER*>(l)->scale_gradient(s); };
+            ops.add_gradient = [](void* l, const void* o) { static_cast<LAYER*>(l)->add_gradient(*static_cast<const LAYER*>(o)); };
+            ops.apply_update = [](void* l) { static_cast<LAYER*>(l)->apply_update(); };
+            ops.copy_update = [](void* l, const void* o) { static_cast<LAYER*>(l)->copy_update(*static_cast<const LAYER*>(o)); };
+            return ops;
+        }
+
+        // Collects those layers and stops them from updating themselves in the backward pass.
+        class visitor_own_updates
+        {
+            public:
+            visitor_own_updates(std::vector<void*>& layers, std::vector<own_update_ops>& ops) : layers(layers), ops(ops) {}
+
+            template <typename T> void operator()(size_t, T&) {}
+
+            template <typename LAYER, typename SUBNET>
+            void operator()(size_t, add_layer<LAYER, SUBNET>& l)
+            {
+                if constexpr (has_own_update<LAYER>::value)
+                {
+                    l.layer_details().set_update_in_backward(false);
+                    layers.push_back(&l.layer_details());
+                    ops.push_back(make_own_update_ops<LAYER>());
+                }
+            }
+
+            private:
+            std::vector<void*>& layers;
+            std::vector<own_update_ops>& ops;
+        };
+    }
+
+    /**
+     * @brief Trains a network with the same steps as dnn_trainer::train_one_step() on a whole
+     * batch, run by num_replicas copies of the network on slices of the batch.
+     *
+     * Replica k takes the k-th slice of the batch, computes its gradients scaled by the size of
+     * its slice over the size of the batch, then:
+     * - reduce: at level l = 1, 2, 4..., replica k (a multiple of 2l) adds the gradients of
+     *   replica k + l once that one has done the levels below, so replica 0 ends up with the
+     *   gradients of the whole batch, after log2(num_replicas) levels;
+     * - replica 0 runs the solvers, as dnn_trainer does;
+     * - broadcast: replica k copies the parameters of replica k & (k - 1), the one that reduced
+     *   its gradients, once that one has its new parameters.
+     *
+     * Like dnn_trainer on several devices, the batch normalization layers compute their
+     * statistics over the slice of their replica, and the running statistics used for
+     * inference are the ones of replica 0.  The sparse_embeddings layers go through the same
+     * steps: their row gradients are summed along the tree, replica 0 applies their update and
+     * the updated rows are copied down the tree.  Their update_in_backward is turned off in
+     * the replicas, so the network of get_net() only updates them through apply_update().
+     * dlib::embeddings updates itself in its backward pass, so each replica only trains its
+     * own copy of the table on its slice: it is not kept in sync.
+     *
+     * The BLAS library should run one thread per call, or as many as cores_per_replica (for
+     * example OPENBLAS_NUM_THREADS=1), as its threads are not bound to the cores of a replica.
+     */
+    template <typename net_type, typename solver_type = sgd>
+    class trainer
+    {
+        public:
+        using input_type = typename net_type::input_type;
+        using training_label_type = typename net_type::training_label_type;
+
+        trainer(
+            const net_type& net,
+            const solver_type& solver = solver_type(),
+            const trainer_options& options = trainer_options()
+        ) : options(options)
+        {
+            const size_t num_cores = std::max(1u, std::thread::hardware_concurrency());
+            if (this->options.num_replicas == 0)
+                this->options.num_replicas = num_cores;
+            if (this->options.cores_per_replica == 0)
+                this->options.cores_per_replica = std::max<size_t>(1, num_cores / this->options.num_replicas);
+
+            for (size_t k = 0; k < this->options.num_replicas; ++k)
+                replicas.push_back(std::make_unique<replica>(net));
+            solvers.assign(net_type::num_computational_layers, solver);
+            for (size_t k = 0; k < replicas.size(); ++k)
+                threads.emplace_back([this, k] { run(k); });
+        }
+
+        trainer(const trainer&) = delete;
+        trainer& operator=(const trainer&) = delete;
+
+        ~trainer()
+        {
+            stopping = true;
+            join_threads();
+        }
+
+        size_t get_num_replicas() const { return replicas.size(); }
+        const trainer_options& get_options() const { return options; }
+
+        double get_learning_rate() const { return learning_rate; }
+        void set_learning_rate(const double lr)
+        {
+            DLIB_CASSERT(lr > 0);
+            learning_rate = lr;
+        }
+
+        // The trained network, up to date between calls to train_one_step().
+        net_type& get_net() { return replicas[0]->net; }
+        const std::vector<solver_type>& get_solvers() const { return solvers; }
+
+        // One step over the whole batch, which needs at least one sample per replica.  Returns
+        // the loss of the batch before the update.
+        double train_one_step(const std::vector<input_type>& data, const std::vector<training_label_type>& labels)
+        {
+            DLIB_CASSERT(data.size() == labels.size());
+            DLIB_CASSERT(data.size() >= replicas.size(), "the batch must hold at least one sample per replica");
+            if (stopping)
+                throw std::runtime_error("data_parallel::trainer: a previous step failed");
+            batch_data = &data;
+            batch_labels = &labels;
+            const size_t step = ++num_steps;
+            published_step.store(step, std::memory_order_release);
+            if (!impl::wait_for(num_finished, step * replicas.size(), stopping))
+            {
+                // the other replicas may still be reading the batch
+                join_threads();
+                std::lock_guard<std::mutex> lock(error_mutex);
+                std::rethrow_exception(error);
+            }
+
+            double loss = 0;
+            for (const auto& r : replicas)
+                loss += r->loss * r->num_samples / data.size();
+            return loss;
+        }
+
+        private:
+        void join_threads()
+        {
+            for (auto& t : threads)
+                if (t.joinable())
+                    t.join();
+        }
+
+        struct alignas(64) replica
+        {
+            explicit replica(const net_type& net) : net(net)
+            {
+                visit_layers(this->net, impl::visitor_own_updates(own_layers, own_ops));
+            }
+            net_type net;
+            resizable_tensor x;
+            std::vector<tensor*> params;
+            std::vector<tensor*> grads;
+            std::vector<void*> own_layers;  // updated through own_ops instead of the solvers
+            std::vector<impl::own_update_ops> own_ops;
+            double loss = 0;
+            size_t num_samples = 0;
+            alignas(64) std::atomic<size_t> reduced{0};      // last step whose gradients are summed
+            alignas(64) std::atomic<size_t> broadcast{0};    // last step whose parameters are updated
+        };
+
+        void run(const size_t k)
+        {
+            if (options.pin_threads)
+                impl::pin_current_thread(options.first_core + k * options.cores_per_replica, options.cores_per_replica);
+
+            replica& r = *replicas[k];
+            for (size_t step = 1; impl::wait_for(published_step, step, stopping); ++step)
+            {
+                try
+                {
+                    compute_gradients(k);
+                    if (!reduce(k, step) || !update(k, step))
+                        return;
+                }
+                catch (...)
+                {
+                    // the other replicas cannot finish the step without this one
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    if (!error)
+                        error = std::current_exception();
+                    stopping = true;
+                    return;
+                }
+                r.broadcast.store(step, std::memory_order_release);
+                num_finished.fetch_add(1, std::memory_order_release);
+            }
+        }
+
+        void compute_gradients(const size_t k)
+        {
+            replica& r = *replicas[k];
+            const size_t n = batch_data->size();
+            const size_t begin = n * k / replicas.size();
+            const size_t end = n * (k + 1) / replicas.size();
+            r.num_samples = end - begin;
+            r.net.to_tensor(batch_data->begin() + begin, batch_data->begin() + end, r.x);
+            r.loss = r.net.compute_parameter_gradients(r.x, batch_labels->begin() + begin);
+            if (r.params.empty())
+                visit_layers(r.net, impl::visitor_parameters(r.params, r.grads));
+
+            // the loss is the mean over the slice, the update the one of the mean over the batch
+            const float scale = static_cast<float>(r.num_samples) / n;
+            for (tensor* g : r.grads)
+                for (float& v : *g)
+                    v *= scale;
+            for (size_t i = 0; i < r.own_layers.size(); ++i)
+                r.own_ops[i].scale_gradient(r.own_layers[i], scale);
+        }
+
+        bool reduce(const size_t k, const size_t step)
+        {
+            replica& r = *replicas[k];
+            for (size_t level = 1; level < replicas.size() && k % (2 * level) == 0; level *= 2)
+            {
+                if (k + level >= replicas.size())
+                    continue;
+                const replica& other = *replicas[k + level];
+                if (!impl::wait_for(other.reduced, step, stopping))
+                    return false;
+                for (size_t i = 0; i < r.grads.size(); ++i)
+                {
+                    float* out = r.grads[i]->host();
+                    const float* in = other.grads[i]->host();
+                    for (size_t j = 0; j < r.grads[i]->size(); ++j)
+                        out[j] += in[j];
+                }
+                for (size_t i = 0; i < r.own_layers.size(); ++i)
+                    r.own_ops[i].add_gradient(r.own_layers[i], other.own_layers[i]);
+            }
+            r.reduced.store(step, std::memory_order_release);
+            return true;
+        }
+
+        bool update(const size_t k, const size_t step)
+        {
+            replica& r = *replicas[k];
+            if (k == 0)
+            {
+                r.net.update_parameters(solvers, learning_rate);
+                for (size_t i = 0; i < r.own_layers.size(); ++i)
+                    r.own_ops[i].apply_update(r.own_layers[i]);
+                return true;
+            }
+            const replica& parent = *replicas[k & (k - 1)];
+            if (!impl::wait_for(parent.broadcast, step, stopping))
+                return false;
+            for (size_t i = 0; i < r.params.size(); ++i)
+                memcpy(*r.params[i], *parent.params[i]);
+            for (size_t i = 0; i < r.own_layers.size(); ++i)
+                r.own_ops[i].copy_update(r.own_layers[i], parent.own_layers[i]);
+            return true;
+        }
+
+        trainer_options options;
+        std::vector<std::unique_ptr<replica>> replicas;
+        std::vector<solver_type> solvers;
+        std::vector<std::thread> threads;
+        double learning_rate = 1e-2;
+
+        const std::vector<input_type>* batch_data = nullptr;
+        const std::vector<training_label_type>* batch_labels = nullptr;
+        size_t num_steps = 0;
+        alignas(64) std::atomic<size_t> published_step{0};
+        alignas(64) std::atomic<size_t> num_finished{0};
+        std::atomic<bool> stopping{false};
+        std::mutex error_mutex;
+        std::exception_ptr error;  // of the first replica that failed
+    };
+}
+
+#endif  // DataParallel_H
@@ -0,0 +1,529 @@
+#ifndef DepthFirst_H
+#define DepthFirst_H
+
+#include <dlib/dnn.h>
+
+#include <limits>
+
+namespace depth_first
+{
+    using namespace dlib;
+
+    enum class op_type
+    {
+        conv,
+        affine,
+        relu,
+        leaky_relu,
+        silu,
+        mish,
+        sigmoid,
+        max_pool
+    };
+
+    // One layer of a fused chain, with the shapes it saw during the reference forward pass.
+    struct chain_op
+    {
+        op_type type = op_type::relu;
+        size_t layer_index = 0;
+        long in_k = 0, in_nr = 0, in_nc = 0;
+        long out_k = 0, out_nr = 0, out_nc = 0;
+        long window_nr = 1, window_nc = 1;
+        long stride_y = 1, stride_x = 1;
+        long padding_y = 0, padding_x = 0;
+        float alpha = 0;
+        resizable_tensor filters;
+        std::vector<float> biases;
+        std::vector<float> gamma;
+        std::vector<float> beta;
+
+        bool is_spatial() const { return type == op_type::conv || type == op_type::max_pool; }
+        float padding_value() const
+        {
+            return type == op_type::max_pool ? -std::numeric_limits<float>::infinity() : 0.f;
+        }
+    };
+
+    // A half-open interval of rows or columns.  It may extend past the tensor borders, in which
+    // case the outside part is padding.
+    struct span
+    {
+        long begin = 0;
+        long end = 0;
+        long size() const { return end - begin; }
+        span clip(const long limit) const { return {std::max(begin, 0L), std::min(end, limit)}; }
+    };
+
+    // Input interval needed to produce the output interval out with a window of size k.
+    inline span input_span(const span& out, const long k, const long stride, const long padding)
+    {
+        return {out.begin * stride - padding, (out.end - 1) * stride - padding + k};
+    }
+
+    // Builds the op list from a network by walking it from the input upwards and stopping at the
+    // first layer that is not a plain convolution, affine, activation or max pooling (the first
+    // concat, add_prev, skip, fc, bn_con, ...).  Tags and repeat layers are transparent.
+    class visitor_collect_chain
+    {
+        public:
+        struct entry
+        {
+            bool supported = false;
+            bool transparent = false;
+            chain_op op;
+        };
+
+        visitor_collect_chain(std::vector<entry>& entries) : entries(entries) {}
+
+        // anything we do not know about breaks the chain
+        template <typename T> void operator()(size_t i, T&) { push(i, false, false); }
+
+        template <unsigned long ID, typename SUBNET>
+        void operator()(size_t i, add_tag_layer<ID, SUBNET>&) { push(i, false, true); }
+
+        template <size_t N, template <typename> class R, typename SUBNET>
+        void operator()(size_t i, repeat<N, R, SUBNET>&) { push(i, false, true); }
+
+        void operator()(size_t i, input_rgb_image&) { push(i, false, true); }
+
+        template <long nf, long nr, long nc, int sy, int sx, int py, int px, typename SUBNET>
+        void operator()(size_t i, add_layer<con_<nf, nr, nc, sy, sx, py, px>, SUBNET>& l)
+        {
+            const auto& d = l.layer_details();
+            chain_op op = make_op(i, op_type::conv, l);
+            op.out_k = d.num_filters();
+            op.window_nr = d.nr();
+            op.window_nc = d.nc();
+            op.stride_y = d.stride_y();
+            op.stride_x = d.stride_x();
+            op.padding_y = d.padding_y();
+            op.padding_x = d.padding_x();
+            const tensor& params = d.get_layer_params();
+            const size_t filters_size = op.out_k * op.in_k * op.window_nr * op.window_nc;
+            op.filters.set_size(op.out_k, op.in_k, op.window_nr, op.window_nc);
+            std::copy(params.host(), params.host() + filters_size, op.filters.host());
+            // con_ drops the biases from its parameters when they are disabled
+            if (params.size() == filters_size + op.out_k)
+                op.biases.assign(params.host() + filters_size, params.host() + params.size());
+            entries.push_back({true, false, std::move(op)});
+        }
+
+        template <typename SUBNET>
+        void operator()(size_t i, add_layer<affine_, SUBNET>& l)
+        {
+            chain_op op = make_op(i, op_type::affine, l);
+            const tensor& params = l.layer_details().get_layer_params();
+            // only the per channel (convolutional) mode can be tiled
+            if (params.size() != 2 * static_cast<size_t>(op.in_k))
+                return push(i, false, false);
+            op.gamma.assign(params.host(), params.host() + op.in_k);
+            op.beta.assign(params.host() + op.in_k, params.host() + 2 * op.in_k);
+            entries.push_back({true, false, std::move(op)});
+        }
+
+        template <typename SUBNET>
+        void operator()(size_t i, add_layer<relu_, SUBNET>& l) { push_op(make_op(i, op_type::relu, l)); }
+
+        template <typename SUBNET>
+        void operator()(size_t i, add_layer<leaky_relu_, SUBNET>& l)
+        {
+            chain_op op = make_op(i, op_type::leaky_relu, l);
+            op.alpha = l.layer_details().get_alpha();
+            push_op(std::move(op));
+        }
+
+        template <typename SUBNET>
+        void operator()(size_t i, add_layer<silu_, SUBNET>& l) { push_op(make_op(i, op_type::silu, l)); }
+
+        template <typename SUBNET>
+        void operator()(size_t i, add_layer<mish_, SUBNET>& l) { push_op(make_op(i, op_type::mish, l)); }
+
+        template <typename SUBNET>
+        void operator()(size_t i, add_layer<sig_, SUBNET>& l) { push_op(make_op(i, op_type::sigmoid, l)); }
+
+        template <long nr, long nc, int sy, int sx, int py, int px, typename SUBNET>
+        void operator()(size_t i, add_layer<max_pool_<nr, nc, sy, sx, py, px>, SUBNET>& l)
+        {
+            const auto& d = l.layer_details();
+            // global pooling has no spatial locality to exploit
+            if (d.nr() == 0 || d.nc() == 0)
+                return push(i, false, false);
+            chain_op op = make_op(i, op_type::max_pool, l);
+            op.window_nr = d.nr();
+            op.window_nc = d.nc();
+            op.stride_y = d.stride_y();
+            op.stride_x = d.stride_x();
+            op.padding_y = d.padding_y();
+            op.padding_x = d.padding_x();
+            push_op(std::move(op));
+        }
+
+        private:
+        template <typename LAYER>
+        static chain_op make_op(const size_t i, const op_type type, LAYER& l)
+        {
+            chain_op op;
+            op.type = type;
+            op.layer_index = i;
+            const tensor& in = l.subnet().get_output();
+            op.in_k = op.out_k = in.k();
+            op.in_nr = in.nr();
+            op.in_nc = in.nc();
+            return op;
+        }
+
+        void push(const size_t i, const bool supported, const bool transparent)
+        {
+            entry e;
+            e.supported = supported;
+            e.transparent = transparent;
+            e.op.layer_index = i;
+            entries.push_back(std::move(e));
+        }
+
+        void push_op(chain_op op) { entries.push_back({true, false, std::move(op)}); }
+
+        std::vector<entry>& entries;
+    };
+
+    class visitor_copy_output
+    {
+        public:
+        visitor_copy_output(const size_t index, resizable_tensor& output) : index(index), output(output) {}
+
+        template <typename T> void operator()(size_t, T&) {}
+
+        template <typename LAYER, typename SUBNET>
+        void operator()(size_t i, add_layer<LAYER, SUBNET>& l)
+        {
+            if (i == index)
+                output = l.get_output();
+        }
+
+        private:
+        size_t index;
+        resizable_tensor& output;
+    };
+
+    /*!
+        Runs the leading conv/affine/activation/max_pool layers of a network depth-first: the
+        output of the last fused layer is split into spatial tiles, and for each tile every layer
+        of the chain is evaluated on just the region (with its halo) the next one needs.  The
+        intermediates of a tile stay in cache instead of streaming full-resolution activations
+        through DRAM after every layer.
+
+        The chain reproduces the output of layer get_last_layer_index() of the network.  dlib has
+        no way to resume a forward pass from an intermediate tensor, so the remaining layers
+        have to be run by a network whose input layer is input_tensor.
+    !*/
+    class fused_chain
+    {
+        public:
+        // Runs the network on x once to record the layer shapes, then fuses at most max_ops
+        // layers, stopping earlier once the feature maps get smaller than min_size.
+        template <typename net_type>
+        fused_chain(
+            net_type& net,
+            const tensor& x,
+            const size_t max_ops = std::numeric_limits<size_t>::max(),
+            const long min_size = 1)
+        {
+            net.forward(x);
+            std::vector<visitor_collect_chain::entry> entries;
+            visit_layers(net, visitor_collect_chain(entries));
+            std::reverse(entries.begin(), entries.end());
+            for (auto& e : entries)
+            {
+                if (e.transparent)
+                    continue;
+                if (!e.supported || ops.size() == max_ops)
+                    break;
+                if (e.op.is_spatial())
+                {
+                    e.op.out_nr = 1 + (e.op.in_nr + 2 * e.op.padding_y - e.op.window_nr) / e.op.stride_y;
+                    e.op.out_nc = 1 + (e.op.in_nc + 2 * e.op.padding_x - e.op.window_nc) / e.op.stride_x;
+                }
+                else
+                {
+                    e.op.out_nr = e.op.in_nr;
+                    e.op.out_nc = e.op.in_nc;
+                }
+                if (std::min(e.op.out_nr, e.op.out_nc) < min_size)
+                    break;
+                ops.push_back(std::move(e.op));
+            }
+            if (ops.empty())
+                throw error("depth_first: the network does not start with a fusable layer");
+            num_samples = x.num_samples();
+            set_cache_budget(1024 * 1024);
+        }
+
+        size_t num_ops() const { return ops.size(); }
+        const std::vector<chain_op>& get_ops() const { return ops; }
+        size_t get_last_layer_index() const { return ops.back().layer_index; }
+
+        long tile_rows() const { return tile_nr; }
+        long tile_cols() const { return tile_nc; }
+
+        void set_tile_size(const long rows, const long cols)
+        {
+            DLIB_CASSERT(rows > 0 && cols > 0);
+            tile_nr = std::min(rows, ops.back().out_nr);
+            tile_nc = std::min(cols, ops.back().out_nc);
+        }
+
+        // Picks the largest square output tile whose biggest intermediate fits in bytes.
+        void set_cache_budget(const size_t bytes)
+        {
+            long size = std::max(ops.back().out_nr, ops.back().out_nc);
+            while (size > 1 && largest_intermediate(size, size) > bytes)
+                size = (size + 1) / 2;
+            set_tile_size(size, size);
+        }
+
+        // Bytes needed by the largest tile of the chain for an output tile of rows x cols.
+        size_t largest_intermediate(const long rows, const long cols) const
+        {
+            size_t largest = 0;
+            span ry{0, rows}, rx{0, cols};
+            for (auto op = ops.rbegin(); op != ops.rend(); ++op)
+            {
+                largest = std::max(largest, num_samples * op->out_k * ry.size() * rx.size() * sizeof(float));
+                if (op->is_spatial())
+                {
+                    ry = input_span(ry, op->window_nr, op->stride_y, op->padding_y);
+                    rx = input_span(rx, op->window_nc, op->stride_x, op->padding_x);
+                }
+            }
+            return std::max(largest, num_samples * ops.front().in_k * ry.size() * rx.size() * sizeof(float));
+        }
+
+        void operator()(const tensor& x, resizable_tensor& output, thread_pool& tp = default_thread_pool())
+        {
+            const chain_op& first = ops.front();
+            const chain_op& last = ops.back();
+            DLIB_CASSERT(x.k() == first.in_k && x.nr() == first.in_nr && x.nc() == first.in_nc);
+            output.set_size(x.num_samples(), last.out_k, last.out_nr, last.out_nc);
+            const long tiles_y = (last.out_nr + tile_nr - 1) / tile_nr;
+            const long tiles_x = (last.out_nc + tile_nc - 1) / tile_nc;
+            const float* in = x.host();
+            float* out = output.host();
+            parallel_for(tp, 0, tiles_y * tiles_x, [&](long t)
+            {
+                const long ty = t / tiles_x;
+                const long tx = t % tiles_x;
+                const span oy{ty * tile_nr, std::min((ty + 1) * tile_nr, last.out_nr)};
+                const span ox{tx * tile_nc, std::min((tx + 1) * tile_nc, last.out_nc)};
+                run_tile(x.num_samples(), in, oy, ox, out);
+            });
+        }
+
+        private:
+        struct scratch
+        {
+            resizable_tensor a;
+            resizable_tensor b;
+            tt::tensor_conv conv;
+            tt::pooling pool;
+        };
+
+        void run_tile(const long n, const float* in, const span& oy, const span& ox, float* out) const
+        {
+            thread_local scratch s;
+
+            // walk backwards to find the region every op has to produce
+            std::vector<span> out_y(ops.size()), out_x(ops.size());
+            span ry = oy, rx = ox;
+            for (size_t i = ops.size(); i-- > 0;)
+            {
+                const chain_op& op = ops[i];
+                out_y[i] = ry.clip(op.out_nr);
+                out_x[i] = rx.clip(op.out_nc);
+                if (op.is_spatial())
+                {
+                    ry = input_span(out_y[i], op.window_nr, op.stride_y, op.padding_y);
+                    rx = input_span(out_x[i], op.window_nc, op.stride_x, op.padding_x);
+                }
+                else
+                {
+                    ry = out_y[i];
+                    rx = out_x[i];
+                }
+            }
+
+            // cur holds the region (cy, cx) of the current feature map, already clipped
+            resizable_tensor* cur = &s.a;
+            resizable_tensor* next = &s.b;
+            const chain_op& first = ops.front();
+            span cy = ry.clip(first.in_nr), cx = rx.clip(first.in_nc);
+            cur->set_size(n, first.in_k, cy.size(), cx.size());
+            copy_region(in, first.in_nr, first.in_nc, cy, cx, *cur);
+
+            for (size_t i = 0; i < ops.size(); ++i)
+            {
+                const chain_op& op = ops[i];
+                if (op.is_spatial())
+                {
+                    const span iy = input_span(out_y[i], op.window_nr, op.stride_y, op.padding_y);
+                    const span ix = input_span(out_x[i], op.window_nc, op.stride_x, op.padding_x);
+                    pad_region(*cur, cy, cx, iy, ix, op.padding_value(), *next);
+                    std::swap(cur, next);
+                    if (op.type == op_type::conv)
+                    {
+                        s.conv.setup(*cur, op.filters, op.stride_y, op.stride_x, 0, 0);
+                        s.conv(false, *next, *cur, op.filters);
+                        if (!op.biases.empty())
+                            add_biases(op.biases, *next);
+                    }
+                    else
+                    {
+                        s.pool.setup_max_pooling(op.window_nr, op.window_nc, op.stride_y, op.stride_x, 0, 0);
+                        s.pool(*next, *cur);
+                    }
+                    std::swap(cur, next);
+                    cy = out_y[i];
+                    cx = out_x[i];
+                }
+                else
+                {
+                    apply_pointwise(op, *cur);
+                }
+            }
+
+            // write the tile into the output tensor
+            const chain_op& last = ops.back();
+            const float* src = cur->host();
+            for (long j = 0; j < n * last.out_k; ++j)
+            {
+                for (long r = cy.begin; r < cy.end; ++r)
+                {
+                    std::copy(src, src + cx.size(), out + (j * last.out_nr + r) * last.out_nc + cx.begin);
+                    src += cx.size();
+                }
+            }
+        }
+
+        static void copy_region(
+            const float* in, const long nr, const long nc, const span& y, const span& x, tensor& dest)
+        {
+            float* d = dest.host_write_only();
+            for (long j = 0; j < dest.num_samples() * dest.k(); ++j)
+            {
+                for (long r = y.begin; r < y.end; ++r)
+                {
+                    const float* s = in + (j * nr + r) * nc + x.begin;
+                    std::copy(s, s + x.size(), d);
+                    d += x.size();
+                }
+            }
+        }
+
+        // Embeds the clipped region (cy, cx) held in src into a tensor covering (y, x), filling
+        // whatever lies outside the feature map with value.
+        static void pad_region(
+            const tensor& src, const span& cy, const span& cx,
+            const span& y, const span& x, const float value, resizable_tensor& dest)
+        {
+            dest.set_size(src.num_samples(), src.k(), y.size(), x.size());
+            float* d = dest.host_write_only();
+            const float* s = src.host();
+            for (long j = 0; j < src.num_samples() * src.k(); ++j)
+            {
+                for (long r = y.begin; r < y.end; ++r)
+                {
+                    float* drow = d + (j * y.size() + r - y.begin) * x.size();
+                    if (r < cy.begin || r >= cy.end)
+                    {
+                        std::fill(drow, drow + x.size(), value);
+                        continue;
+                    }
+                    const float* srow = s + (j * cy.size() + r - cy.begin) * cx.size();
+                    std::fill(drow, drow + (cx.begin - x.begin), value);
+                    std::copy(srow, srow + cx.size(), drow + (cx.begin - x.begin));
+                    std::fill(drow + (cx.end - x.begin), drow + x.size(), value);
+                }
+            }
+        }
+
+        static void add_biases(const std::vector<float>& biases, tensor& t)
+        {
+            float* p = t.host();
+            const long plane = t.nr() * t.nc();
+            for (long n = 0; n < t.num_samples(); ++n)
+            {
+                for (long k = 0; k < t.k(); ++k)
+                {
+                    const float b = biases[k];
+                    for (long i = 0; i < plane; ++i)
+                        *p++ += b;
+                }
+            }
+        }
+
+        static void apply_pointwise(const chain_op& op, tensor& t)
+        {
+            float* p = t.host();
+            const long plane = t.nr() * t.nc();
+            for (long n = 0; n < t.num_samples(); ++n)
+            {
+                for (long k = 0; k < t.k(); ++k, p += plane)
+                {
+                    switch (op.type)
+                    {
+                    case op_type::affine:
+                        for (long i = 0; i < plane; ++i)
+                            p[i] = op.gamma[k] * p[i] + op.beta[k];
+                        break;
+                    case op_type::relu:
+                        for (long i = 0; i < plane; ++i)
+                            p[i] = std::max(p[i], 0.f);
+                        break;
+                    case op_type::leaky_relu:
+                        for (long i = 0; i < plane; ++i)
+                            p[i] = p[i] > 0 ? p[i] : op.alpha * p[i];
+                        break;
+                    case op_type::silu:
+                        for (long i = 0; i < plane; ++i)
+                            p[i] = p[i] / (1 + std::exp(-p[i]));
+                        break;
+                    case op_type::mish:
+                        for (long i = 0; i < plane; ++i)
+                            p[i] = p[i] * std::tanh(std::log1p(std::exp(p[i])));
+                        break;
+                    case op_type::sigmoid:
+                        for (long i = 0; i < plane; ++i)
+                            p[i] = 1 / (1 + std::exp(-p[i]));
+                        break;
+                    default:
+                        break;
+                    }
+                }
+            }
+        }
+
+        std::vector<chain_op> ops;
+        size_t num_samples = 1;
+        long tile_nr = 1;
+        long tile_nc = 1;
+    };
+
+    // Maximum absolute difference between the fused chain and the network's own output of the
+    // last fused layer, computed on x.
+    template <typename net_type>
+    float verify(fused_chain& chain, net_type& net, const tensor& x)
+    {
+        resizable_tensor expected, actual;
+        net.forward(x);
+        visit_layers(net, visitor_copy_output(chain.get_last_layer_index(), expected));
+        chain(x, actual);
+        DLIB_CASSERT(expected.size() == actual.size());
+        float diff = 0;
+        const float* e = expected.host();
+        const float* a = actual.host();
+        for (size_t i = 0; i < expected.size(); ++i)
+            diff = std::max(diff, std::abs(e[i] - a[i]));
+        return diff;
+    }
+}  // namespace depth_first
+
+#endif  // DepthFirst_H
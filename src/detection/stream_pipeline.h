@@ -0,0 +1,373 @@
+#ifndef stream_pipeline_h_INCLUDED
+#define stream_pipeline_h_INCLUDED
+
+#include "../preprocess.h"
+#include "yolo_postprocess.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace stream
+{
+    using namespace dlib;
+
+    /*!
+        Bounded single producer, single consumer ring buffer.  One slot is kept empty to tell a
+        full queue from an empty one, and head and tail live on different cache lines so that
+        the producer and the consumer do not keep stealing the line from each other.
+    !*/
+    template <typename T> class spsc_queue
+    {
+        public:
+        explicit spsc_queue(const size_t capacity) : slots(capacity + 1) { DLIB_CASSERT(capacity > 0); }
+
+        size_t capacity() const { return slots.size() - 1; }
+
+        // Moves item into the queue, unless it is full (in which case item is left untouched).
+        bool try_push(T& item)
+        {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            const size_t next = (t + 1) % slots.size();
+            if (next == head.load(std::memory_order_acquire))
+                return false;
+            slots[t] = std::move(item);
+            tail.store(next, std::memory_order_release);
+            return true;
+        }
+
+        bool try_pop(T& item)
+        {
+            const size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+            item = std::move(slots[h]);
+            head.store((h + 1) % slots.size(), std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+        // Called by the producer once it will not push anymore.
+        void close() { closed.store(true, std::memory_order_release); }
+        bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+        private:
+        std::vector<T> slots;
+        alignas(64) std::atomic<size_t> head{0};
+        alignas(64) std::atomic<size_t> tail{0};
+        std::atomic<bool> closed{false};
+    };
+
+    // Spins for a while, then yields, then sleeps: waits are short when the pipeline is
+    // balanced and do not burn a core when a stage is starved.
+    class backoff
+    {
+        public:
+        void wait()
+        {
+            if (count < 64)
+                ;
+            else if (count < 256)
+                std::this_thread::yield();
+            else
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            ++count;
+        }
+        void reset() { count = 0; }
+
+        private:
+        size_t count = 0;
+    };
+
+    /*!
+        What a stage does when frames arrive faster than it can process them:
+            - block: the previous stage waits for room in the queue, no frame is lost.
+            - drop_newest: the incoming frame is discarded when the queue is full.
+            - keep_latest: like drop_newest, and the stage also discards every queued frame but
+              the newest one before processing, so it always works on the freshest frame.  This
+              is what a live camera wants: old frames are worthless once a newer one exists.
+    !*/
+    enum class drop_policy
+    {
+        block,
+        drop_newest,
+        keep_latest
+    };
+
+    struct stage_metrics
+    {
+        explicit stage_metrics(const std::string& name = "") : name(name) {}
+        std::string name;
+        size_t processed = 0;
+        size_t dropped = 0;
+        running_stats<double> latency;  // ms spent in the stage per frame
+    };
+
+    template <typename frame_type> class pipeline
+    {
+        public:
+        // The source fills a frame and returns false once the stream is over.
+        using source_type = std::function<bool(frame_type&)>;
+        using stage_type = std::function<void(frame_type&)>;
+
+        pipeline(const std::string& source_name, source_type source) : source(std::move(source))
+        {
+            metrics.emplace_back(source_name);
+        }
+
+        pipeline(const pipeline&) = delete;
+        pipeline& operator=(const pipeline&) = delete;
+
+        // Appends a stage fed by a queue of queue_size frames.  The policy decides what happens
+        // to the frames that do not fit in that queue.
+        void add_stage(
+            const std::string& name,
+            stage_type fn,
+            const drop_policy policy = drop_policy::block,
+            const size_t queue_size = 2)
+        {
+            stages.push_back({std::move(fn), policy, std::make_unique<spsc_queue<item>>(queue_size)});
+            metrics.emplace_back(name);
+        }
+
+        // Runs the source and every stage on its own thread until the source is exhausted or
+        // stop() is called, and every frame still in flight has gone through the pipeline.
+        void run()
+        {
+            DLIB_CASSERT(!stages.empty());
+            stopping = false;
+            started = std::chrono::steady_clock::now();
+            std::vector<std::thread> threads;
+            threads.emplace_back([this] { run_source(); });
+            for (size_t i = 0; i < stages.size(); ++i)
+                threads.emplace_back([this, i] { run_stage(i); });
+            for (auto& t : threads)
+                t.join();
+            finished = std::chrono::steady_clock::now();
+        }
+
+        // Can be called from any thread, including from within a stage.
+        void stop() { stopping = true; }
+
+        // Consistent copy of the metrics of the source (first) and of every stage, which can be
+        // taken while the pipeline runs.
+        std::vector<stage_metrics> get_metrics() const
+        {
+            std::lock_guard<std::mutex> lock(metrics_mutex);
+            return metrics;
+        }
+
+        // ms from the moment the source produced a frame until the last stage was done with it
+        running_stats<double> get_end_to_end_latency() const
+        {
+            std::lock_guard<std::mutex> lock(metrics_mutex);
+            return end_to_end;
+        }
+
+        double elapsed_seconds() const
+        {
+            return std::chrono::duration<double>(finished - started).count();
+        }
+
+        void print_metrics(std::ostream& out) const
+        {
+            const auto mean = [](const running_stats<double>& rs) { return rs.current_n() ? rs.mean() : 0.0; };
+            const double seconds = elapsed_seconds();
+            for (const auto& m : get_metrics())
+            {
+                out << std::left << std::setw(12) << m.name << std::right
+                    << " processed: " << std::setw(6) << m.processed
+                    << " dropped: " << std::setw(6) << m.dropped
+                    << " latency: " << mean(m.latency) << " ms"
+                    << " throughput: " << (seconds > 0 ? m.processed / seconds : 0.0) << " fps\n";
+            }
+            out << "end-to-end latency: " << mean(get_end_to_end_latency()) << " ms\n";
+        }
+
+        private:
+        using clock = std::chrono::steady_clock;
+        using fms = std::chrono::duration<double, std::milli>;
+
+        struct item
+        {
+            frame_type frame;
+            clock::time_point created;
+        };
+
+        struct stage
+        {
+            stage_type fn;
+            drop_policy policy;
+            std::unique_ptr<spsc_queue<item>> queue;
+        };
+
+        void record(const size_t i, const clock::time_point t0, const clock::time_point t1)
+        {
+            std::lock_guard<std::mutex> lock(metrics_mutex);
+            ++metrics[i].processed;
+            metrics[i].latency.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+        }
+
+        void record_dropped(const size_t i, const size_t count)
+        {
+            std::lock_guard<std::mutex> lock(metrics_mutex);
+            metrics[i].dropped += count;
+        }
+
+        // Hands it over to stage i, following the policy of that stage.
+        void push(const size_t i, item& it)
+        {
+            auto& s = stages[i];
+            if (s.policy != drop_policy::block)
+            {
+                if (!s.queue->try_push(it))
+                    record_dropped(i + 1, 1);
+                return;
+            }
+            backoff b;
+            while (!s.queue->try_push(it))
+                b.wait();
+        }
+
+        void run_source()
+        {
+            while (!stopping)
+            {
+                item it;
+                const auto t0 = clock::now();
+                if (!source(it.frame))
+                    break;
+                const auto t1 = clock::now();
+                it.created = t0;
+                record(0, t0, t1);
+                push(0, it);
+            }
+            stages[0].queue->close();
+        }
+
+        void run_stage(const size_t i)
+        {
+            auto& s = stages[i];
+            item it;
+            backoff b;
+            while (true)
+            {
+                if (!s.queue->try_pop(it))
+                {
+                    // the producer closes the queue after its last push, so a closed queue
+                    // that is still empty has been drained for good
+                    if (s.queue->is_closed() && s.queue->empty())
+                        break;
+                    b.wait();
+                    continue;
+                }
+                b.reset();
+                if (s.policy == drop_policy::keep_latest)
+                {
+                    size_t skipped = 0;
+                    while (s.queue->try_pop(it))
+                        ++skipped;
+                    if (skipped)
+                        record_dropped(i + 1, skipped);
+                }
+
+                const auto t0 = clock::now();
+                s.fn(it.frame);
+                const auto t1 = clock::now();
+                record(i + 1, t0, t1);
+                if (i + 1 < stages.size())
+                {
+                    push(i + 1, it);
+                }
+                else
+                {
+                    std::lock_guard<std::mutex> lock(metrics_mutex);
+                    end_to_end.add(std::chrono::duration_cast<fms>(t1 - it.created).count());
+                }
+            }
+            if (i + 1 < stages.size())
+                stages[i + 1].queue->close();
+        }
+
+        source_type source;
+        std::vector<stage> stages;
+        std::atomic<bool> stopping{false};
+        clock::time_point started, finished;
+        mutable std::mutex metrics_mutex;
+        std::vector<stage_metrics> metrics;
+        running_stats<double> end_to_end;
+    };
+
+    struct detection_frame
+    {
+        size_t index = 0;
+        matrix<rgb_pixel> image;
+        resizable_tensor x;
+        preprocess::letterbox box;
+        yolo::head_outputs head;
+        std::vector<yolo_rect> detections;  // in image coordinates
+    };
+
+    /*!
+        Runs a YOLO detector (any network ending with loss_yolo) over a stream of frames with the
+        stages decode -> preprocess -> forward -> decode+NMS -> emit, each on its own thread, so
+        that letterboxing the next frame and decoding the previous one overlap with the forward
+        pass instead of leaving the cores idle.  The yolo outputs are copied out of the network
+        right after the forward pass, which frees the network for the next frame.
+    !*/
+    template <typename net_type> class detection_pipeline
+    {
+        public:
+        using decode_type = std::function<bool(matrix<rgb_pixel>&)>;
+        using emit_type = std::function<void(detection_frame&)>;
+
+        detection_pipeline(
+            net_type& net,
+            const long input_size,
+            decode_type decode,
+            emit_type emit,
+            const drop_policy policy = drop_policy::keep_latest,
+            const double threshold = 0.25,
+            const size_t queue_size = 2)
+            : loader(input_size, input_size, input_layer(net)),
+              frames("decode", [this, decode = std::move(decode)](detection_frame& f)
+              {
+                  f.index = num_decoded++;
+                  return decode(f.image);
+              })
+        {
+            frames.add_stage("preprocess", [this, input_size](detection_frame& f)
+            {
+                f.x.set_size(1, 3, input_size, input_size);
+                f.box = loader.write(f.image, f.x, 0);
+            }, policy, queue_size);
+            frames.add_stage("forward", [&net](detection_frame& f)
+            {
+                net.forward(f.x);
+                yolo::copy_head_outputs(net, f.x, f.head);
+            }, policy, queue_size);
+            frames.add_stage("postprocess", [&net, threshold](detection_frame& f)
+            {
+                f.detections = std::move(yolo::postprocess(net.loss_details().get_options(), f.head, threshold)[0]);
+                for (auto& d : f.detections)
+                    d.rect = f.box.to_image(d.rect);
+            }, policy, queue_size);
+            // the sink never drops: whatever survived so far is worth reporting
+            frames.add_stage("emit", std::move(emit), drop_policy::block, queue_size);
+        }
+
+        void run() { frames.run(); }
+        void stop() { frames.stop(); }
+        const pipeline<detection_frame>& get_pipeline() const { return frames; }
+        void print_metrics(std::ostream& out) const { frames.print_metrics(out); }
+
+        private:
+        preprocess::letterbox_loader loader;
+        size_t num_decoded = 0;
+        pipeline<detection_frame> frames;
+    };
+}  // namespace stream
+
+#endif  // stream_pipeline_h_INCLUDED
@@ -0,0 +1,318 @@
+#ifndef tiled_inference_h_INCLUDED
+#define tiled_inference_h_INCLUDED
+
+#include "yolo_postprocess.h"
+
+#include <future>
+#include <numeric>
+
+namespace tiled
+{
+    using namespace dlib;
+
+    /*!
+        Splits a length into tiles of tile_size pixels that overlap by at least overlap pixels,
+        spread evenly so that the first and last tiles touch the borders.  A length smaller than
+        a tile gives a single, shorter tile (the rest of the input is padded).
+    !*/
+    inline std::vector<std::pair<long, long>> split(const long length, const long tile_size, const long overlap)
+    {
+        DLIB_CASSERT(tile_size > overlap && overlap >= 0);
+        if (length <= tile_size)
+            return {{0, length}};
+        const long n = (length - overlap + tile_size - overlap - 1) / (tile_size - overlap);
+        std::vector<std::pair<long, long>> spans;
+        for (long i = 0; i < n; ++i)
+        {
+            const long begin = std::lround(static_cast<double>(i) * (length - tile_size) / (n - 1));
+            spans.emplace_back(begin, tile_size);
+        }
+        return spans;
+    }
+
+    inline std::vector<rectangle> make_tiles(const long nr, const long nc, const long tile_size, const long overlap)
+    {
+        std::vector<rectangle> tiles;
+        for (const auto& r : split(nr, tile_size, overlap))
+            for (const auto& c : split(nc, tile_size, overlap))
+                tiles.emplace_back(c.first, r.first, c.first + c.second - 1, r.first + r.second - 1);
+        return tiles;
+    }
+
+    struct tiling_options
+    {
+        // side of the square network input, the native size of the net (1280 for yolov5p6)
+        long tile_size = 1280;
+        // must be larger than the objects of interest, so that each one is whole in some tile
+        long overlap = 256;
+        // tiles per forward pass, 0 means tuned on the first image
+        size_t batch_size = 0;
+        // the batch sizes tried by the tuning, which also bound the memory used
+        std::vector<size_t> batch_candidates{1, 2, 4, 8, 16};
+        double threshold = 0.25;
+        // a box closer than this to an edge of its tile that is not an image border is cut
+        double border_margin = 2;
+        // how the merged detections of all the tiles are suppressed
+        test_box_overlap merge_overlap{0.45, 0.9};
+        bool classwise = true;
+    };
+
+    struct tiling_timings
+    {
+        running_stats<double> preprocess;
+        running_stats<double> forward;
+        running_stats<double> postprocess;
+        running_stats<double> merge;
+        running_stats<double> total;
+    };
+
+    /*!
+        Runs a YOLO detector over images much larger than its input by cutting them into
+        overlapping tiles at the native resolution of the network, without any resizing.  Tiles
+        go through the network in batches, and the next batch is cropped into a second input
+        tensor while the current one runs, so memory only depends on the batch size and not on
+        the size of the image.  The detections are mapped back to the image, the pieces of an
+        object cut by a tile edge are joined, and everything goes through a final NMS.
+    !*/
+    template <typename net_type> class tiled_detector
+    {
+        public:
+        tiled_detector(net_type& net, const tiling_options& options = tiling_options())
+            : net(net),
+              options(options),
+              avg_red(input_layer(net).get_avg_red()),
+              avg_green(input_layer(net).get_avg_green()),
+              avg_blue(input_layer(net).get_avg_blue())
+        {
+        }
+
+        const tiling_options& get_options() const { return options; }
+        const tiling_timings& get_timings() const { return timings; }
+        size_t get_batch_size() const { return options.batch_size; }
+
+        /*!
+            Picks the batch size with the highest throughput in tiles per second, among the
+            candidates that are not larger than max_tiles.  The search stops as soon as the
+            throughput drops, since it only gets worse once the caches or the memory bandwidth
+            are saturated.
+        !*/
+        size_t tune_batch_size(const size_t max_tiles = std::numeric_limits<size_t>::max(), const int iterations = 3)
+        {
+            using fs = std::chrono::duration<double>;
+            double best_throughput = 0;
+            size_t best = 1;
+            resizable_tensor x;
+            for (const auto b : options.batch_candidates)
+            {
+                if (b > max_tiles && best_throughput > 0)
+                    break;
+                x.set_size(b, 3, options.tile_size, options.tile_size);
+                x = 0;
+                net.forward(x);
+                const auto t0 = std::chrono::steady_clock::now();
+                for (int i = 0; i < iterations; ++i)
+                    net.forward(x);
+                const auto t1 = std::chrono::steady_clock::now();
+                const double throughput = b * iterations / std::chrono::duration_cast<fs>(t1 - t0).count();
+                if (throughput > best_throughput)
+                {
+                    best_throughput = throughput;
+                    best = b;
+                }
+                else
+                {
+                    break;
+                }
+            }
+            options.batch_size = best;
+            return best;
+        }
+
+        std::vector<yolo_rect> operator()(const matrix<rgb_pixel>& image)
+        {
+            using fms = std::chrono::duration<double, std::milli>;
+            const auto start = std::chrono::steady_clock::now();
+            const auto tiles = make_tiles(image.nr(), image.nc(), options.tile_size, options.overlap);
+            if (options.batch_size == 0)
+                tune_batch_size(tiles.size());
+            const size_t batch_size = std::min(options.batch_size, tiles.size());
+            const size_t num_batches = (tiles.size() + batch_size - 1) / batch_size;
+
+            std::vector<yolo_rect> dets;
+            std::vector<size_t> det_tiles;
+            std::vector<std::vector<yolo_rect>> batch_dets;
+            const auto crop = [&](const size_t batch, resizable_tensor& x)
+            {
+                const auto t0 = std::chrono::steady_clock::now();
+                const size_t begin = batch * batch_size;
+                const size_t end = std::min(begin + batch_size, tiles.size());
+                write_tiles(image, tiles, begin, end, x);
+                return std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count();
+            };
+
+            timings.preprocess.add(crop(0, inputs[0]));
+            for (size_t batch = 0; batch < num_batches; ++batch)
+            {
+                auto& x = inputs[batch % 2];
+                std::future<double> next;
+                if (batch + 1 < num_batches)
+                    next = std::async(std::launch::async, crop, batch + 1, std::ref(inputs[(batch + 1) % 2]));
+
+                const auto t0 = std::chrono::steady_clock::now();
+                net.forward(x);
+                const auto t1 = std::chrono::steady_clock::now();
+                yolo::postprocess(net.loss_details(), x, net.subnet(), options.threshold, batch_dets, default_thread_pool());
+                for (size_t n = 0; n < batch_dets.size(); ++n)
+                {
+                    const size_t t = batch * batch_size + n;
+                    const dpoint offset(tiles[t].left(), tiles[t].top());
+                    for (auto& d : batch_dets[n])
+                    {
+                        d.rect = translate_rect(d.rect, offset);
+                        dets.push_back(std::move(d));
+                        det_tiles.push_back(t);
+                    }
+                }
+                const auto t2 = std::chrono::steady_clock::now();
+                timings.forward.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+                timings.postprocess.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+                if (next.valid())
+                    timings.preprocess.add(next.get());
+            }
+
+            const auto t0 = std::chrono::steady_clock::now();
+            merge(image, tiles, dets, det_tiles);
+            const auto t1 = std::chrono::steady_clock::now();
+            timings.merge.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            timings.total.add(std::chrono::duration_cast<fms>(t1 - start).count());
+            return dets;
+        }
+
+        private:
+        // Copies tiles [begin, end) into x without resizing, applying the input_rgb_image
+        // normalization and padding the tiles that stick out of the image.
+        void write_tiles(
+            const matrix<rgb_pixel>& image,
+            const std::vector<rectangle>& tiles,
+            const size_t begin,
+            const size_t end,
+            resizable_tensor& x) const
+        {
+            const long size = options.tile_size;
+            x.set_size(end - begin, 3, size, size);
+            float* out = x.host_write_only();
+            const float pad_r = (114 - avg_red) / 256.0f;
+            const float pad_g = (114 - avg_green) / 256.0f;
+            const float pad_b = (114 - avg_blue) / 256.0f;
+            parallel_for(default_thread_pool(), 0, (end - begin) * size, [&](long i)
+            {
+                const long n = i / size;
+                const long r = i % size;
+                const rectangle& tile = tiles[begin + n];
+                float* red = out + (n * 3 * size + r) * size;
+                float* green = red + size * size;
+                float* blue = green + size * size;
+                long c = 0;
+                if (r < tile.height())
+                {
+                    const rgb_pixel* row = &image(tile.top() + r, tile.left());
+                    for (; c < tile.width(); ++c)
+                    {
+                        red[c] = (row[c].red - avg_red) / 256.0f;
+                        green[c] = (row[c].green - avg_green) / 256.0f;
+                        blue[c] = (row[c].blue - avg_blue) / 256.0f;
+                    }
+                }
+                std::fill(red + c, red + size, pad_r);
+                std::fill(green + c, green + size, pad_g);
+                std::fill(blue + c, blue + size, pad_b);
+            });
+        }
+
+        // True if the box touches an edge of its tile that lies inside the image.
+        bool is_cut(const drectangle& r, const rectangle& tile, const matrix<rgb_pixel>& image) const
+        {
+            const double m = options.border_margin;
+            return (tile.left() > 0 && r.left() < tile.left() + m) ||
+                   (tile.top() > 0 && r.top() < tile.top() + m) ||
+                   (tile.right() < image.nc() - 1 && r.right() > tile.right() - m) ||
+                   (tile.bottom() < image.nr() - 1 && r.bottom() > tile.bottom() - m);
+        }
+
+        /*!
+            Objects larger than the overlap are cut in every tile that sees them.  Two pieces
+            from different tiles are the same object when they agree inside the region that
+            both tiles see, since there the network looked at the very same pixels, so they are
+            joined into their union.  Then whole boxes and joined pieces go through the usual
+            NMS, which also removes the duplicates of objects that were whole in several tiles.
+        !*/
+        void merge(
+            const matrix<rgb_pixel>& image,
+            const std::vector<rectangle>& tiles,
+            std::vector<yolo_rect>& dets,
+            const std::vector<size_t>& det_tiles) const
+        {
+            std::vector<yolo_rect> merged;
+            std::vector<size_t> cut;
+            for (size_t i = 0; i < dets.size(); ++i)
+            {
+                if (is_cut(dets[i].rect, tiles[det_tiles[i]], image))
+                    cut.push_back(i);
+                else
+                    merged.push_back(std::move(dets[i]));
+            }
+
+            std::vector<size_t> parent(cut.size());
+            std::iota(parent.begin(), parent.end(), 0);
+            const std::function<size_t(size_t)> find = [&](const size_t i) { return parent[i] == i ? i : parent[i] = find(parent[i]); };
+            const test_box_overlap agree(0.5);
+            for (size_t a = 0; a < cut.size(); ++a)
+            {
+                for (size_t b = a + 1; b < cut.size(); ++b)
+                {
+                    const auto& da = dets[cut[a]];
+                    const auto& db = dets[cut[b]];
+                    if (det_tiles[cut[a]] == det_tiles[cut[b]] || (options.classwise && da.label != db.label))
+                        continue;
+                    const drectangle shared = drectangle(tiles[det_tiles[cut[a]]]).intersect(tiles[det_tiles[cut[b]]]);
+                    const drectangle ra = da.rect.intersect(shared);
+                    const drectangle rb = db.rect.intersect(shared);
+                    if (!ra.is_empty() && !rb.is_empty() && agree(ra, rb))
+                        parent[find(a)] = find(b);
+                }
+            }
+            std::vector<long> group(cut.size(), -1);
+            for (size_t i = 0; i < cut.size(); ++i)
+            {
+                auto& d = dets[cut[i]];
+                const size_t root = find(i);
+                if (group[root] < 0)
+                {
+                    group[root] = merged.size();
+                    merged.push_back(std::move(d));
+                    continue;
+                }
+                auto& m = merged[group[root]];
+                m.rect = m.rect + d.rect;
+                if (d.detection_confidence > m.detection_confidence)
+                {
+                    m.detection_confidence = d.detection_confidence;
+                    m.label = d.label;
+                    m.labels = d.labels;
+                }
+            }
+            yolo::nms(merged, options.merge_overlap, options.classwise);
+            dets.swap(merged);
+        }
+
+        net_type& net;
+        tiling_options options;
+        float avg_red;
+        float avg_green;
+        float avg_blue;
+        resizable_tensor inputs[2];
+        tiling_timings timings;
+    };
+}  // namespace tiled
+
+#endif  // tiled_inference_h_INCLUDED
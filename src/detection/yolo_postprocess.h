@@ -0,0 +1,307 @@
+#ifndef yolo_postprocess_h_INCLUDED
+#define yolo_postprocess_h_INCLUDED
+
+#include <dlib/dnn.h>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace yolo
+{
+    using namespace dlib;
+
+    // Labels for the 80 outputs per anchor of the networks trained on COCO, class_0 to class_79,
+    // for the benchmarks and tests that run them with random weights.
+    inline std::vector<std::string> coco_labels()
+    {
+        std::vector<std::string> labels;
+        for (int i = 0; i < 80; ++i)
+            labels.push_back("class_" + std::to_string(i));
+        return labels;
+    }
+
+    // Appends to candidates the indices of the elements of plane[0, size) that are above
+    // threshold.  Almost every objectness score of a trained detector is below the threshold,
+    // so this is the only loop that touches every cell.
+    inline void find_above_threshold(
+        const float* plane,
+        const long size,
+        const float threshold,
+        std::vector<long>& candidates)
+    {
+        long i = 0;
+#if defined(__AVX__)
+        const __m256 thresh = _mm256_set1_ps(threshold);
+        for (; i + 8 <= size; i += 8)
+        {
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(plane + i), thresh, _CMP_GT_OQ));
+            while (mask)
+            {
+                const int bit = __builtin_ctz(mask);
+                candidates.push_back(i + bit);
+                mask &= mask - 1;
+            }
+        }
+#endif
+        for (; i < size; ++i)
+        {
+            if (plane[i] > threshold)
+                candidates.push_back(i);
+        }
+    }
+
+    // Decodes the detections of one anchor of one yolo output for sample n, with the same box
+    // parametrization as loss_yolo_: the network outputs are already passed through sig.
+    inline void decode_anchor(
+        const long input_nr,
+        const long input_nc,
+        const tensor& output_tensor,
+        const long n,
+        const long anchor,
+        const yolo_options::anchor_box_details& anchor_box,
+        const std::vector<std::string>& labels,
+        const float threshold,
+        std::vector<long>& candidates,
+        std::vector<yolo_rect>& dets)
+    {
+        DLIB_CASSERT(!labels.empty(), "yolo::decode_anchor: the yolo_options have no labels");
+        const long num_feats = labels.size() + 5;
+        const long plane_size = output_tensor.nr() * output_tensor.nc();
+        const double stride_x = static_cast<double>(input_nc) / output_tensor.nc();
+        const double stride_y = static_cast<double>(input_nr) / output_tensor.nr();
+        const float* out = output_tensor.host() + (n * output_tensor.k() + anchor * num_feats) * plane_size;
+
+        candidates.clear();
+        find_above_threshold(out + 4 * plane_size, plane_size, threshold, candidates);
+        for (const long i : candidates)
+        {
+            const float obj = out[4 * plane_size + i];
+            // the confidence of a class is obj * p(class), so only the best class needs to pass
+            long best = 0;
+            for (size_t j = 1; j < labels.size(); ++j)
+            {
+                if (out[(5 + j) * plane_size + i] > out[(5 + best) * plane_size + i])
+                    best = j;
+            }
+            if (obj * out[(5 + best) * plane_size + i] <= threshold)
+                continue;
+
+            const long r = i / output_tensor.nc();
+            const long c = i % output_tensor.nc();
+            const double x = out[i] * 2.0 - 0.5;
+            const double y = out[plane_size + i] * 2.0 - 0.5;
+            const double w = out[2 * plane_size + i];
+            const double h = out[3 * plane_size + i];
+            yolo_rect det(centered_drect(
+                dpoint((x + c) * stride_x, (y + r) * stride_y),
+                w / (1 - w) * anchor_box.width,
+                h / (1 - h) * anchor_box.height));
+            for (size_t j = 0; j < labels.size(); ++j)
+            {
+                const float conf = obj * out[(5 + j) * plane_size + i];
+                if (conf > threshold)
+                    det.labels.emplace_back(conf, labels[j]);
+            }
+            std::sort(det.labels.rbegin(), det.labels.rend());
+            det.detection_confidence = det.labels[0].first;
+            det.label = det.labels[0].second;
+            dets.push_back(std::move(det));
+        }
+    }
+
+    /*!
+        Non-maximum suppression with the same semantics as loss_yolo_ (boxes are visited by
+        decreasing confidence and dropped if they overlap a kept box), but the kept boxes are
+        stored in a uniform grid so each box is only compared against its neighbours instead
+        of every kept box.  Boxes that do not intersect can never overlap, so this is exact.
+    !*/
+    inline void nms(std::vector<yolo_rect>& dets, const test_box_overlap& overlaps, const bool classwise)
+    {
+        std::stable_sort(dets.begin(), dets.end(), [](const yolo_rect& a, const yolo_rect& b)
+                         { return a.detection_confidence > b.detection_confidence; });
+        if (dets.size() < 2)
+            return;
+
+        double left = dets[0].rect.left(), top = dets[0].rect.top();
+        double right = dets[0].rect.right(), bottom = dets[0].rect.bottom();
+        double mean_size = 0;
+        for (const auto& d : dets)
+        {
+            left = std::min(left, d.rect.left());
+            top = std::min(top, d.rect.top());
+            right = std::max(right, d.rect.right());
+            bottom = std::max(bottom, d.rect.bottom());
+            mean_size += std::max(d.rect.width(), d.rect.height());
+        }
+        mean_size /= dets.size();
+        const long max_cells = 64;
+        const double cell = std::max({mean_size, (right - left) / max_cells, (bottom - top) / max_cells, 1.0});
+        const long cols = std::min<long>(max_cells, (right - left) / cell + 1);
+        const long rows = std::min<long>(max_cells, (bottom - top) / cell + 1);
+        const auto to_col = [&](const double x) { return std::min<long>(cols - 1, std::max<long>(0, (x - left) / cell)); };
+        const auto to_row = [&](const double y) { return std::min<long>(rows - 1, std::max<long>(0, (y - top) / cell)); };
+
+        std::vector<std::vector<uint32_t>> grid(rows * cols);
+        std::vector<yolo_rect> kept;
+        std::vector<size_t> last_visit;
+        for (size_t i = 0; i < dets.size(); ++i)
+        {
+            auto& det = dets[i];
+            const long c0 = to_col(det.rect.left()), c1 = to_col(det.rect.right());
+            const long r0 = to_row(det.rect.top()), r1 = to_row(det.rect.bottom());
+            bool suppressed = false;
+            for (long r = r0; r <= r1 && !suppressed; ++r)
+            {
+                for (long c = c0; c <= c1 && !suppressed; ++c)
+                {
+                    for (const auto j : grid[r * cols + c])
+                    {
+                        // a kept box spanning several cells is only tested once per candidate
+                        if (last_visit[j] == i + 1)
+                            continue;
+                        last_visit[j] = i + 1;
+                        const auto& k = kept[j];
+                        if ((!classwise || k.label == det.label) && overlaps(k.rect, det.rect))
+                        {
+                            suppressed = true;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (suppressed)
+                continue;
+            for (long r = r0; r <= r1; ++r)
+                for (long c = c0; c <= c1; ++c)
+                    grid[r * cols + c].push_back(kept.size());
+            kept.push_back(std::move(det));
+            last_visit.push_back(0);
+        }
+        dets.swap(kept);
+    }
+
+    // Decodes and suppresses the detections of the yolo outputs (one per entry of tag_ids) of a
+    // network whose input tensor had input_nr x input_nc pixels.
+    inline void postprocess(
+        const yolo_options& options,
+        const long input_nr,
+        const long input_nc,
+        const std::vector<const tensor*>& outputs,
+        const std::vector<int>& tag_ids,
+        const double threshold,
+        std::vector<std::vector<yolo_rect>>& dets,
+        thread_pool& tp)
+    {
+        DLIB_CASSERT(!outputs.empty() && outputs.size() == tag_ids.size());
+        const long num_samples = outputs[0]->num_samples();
+        std::vector<const std::vector<yolo_options::anchor_box_details>*> anchors;
+        for (const auto id : tag_ids)
+            anchors.push_back(&options.anchors.at(id));
+
+        // one task per (sample, output, anchor) plane, then one NMS task per sample
+        struct plane
+        {
+            long n;
+            size_t output;
+            long anchor;
+        };
+        std::vector<plane> planes;
+        for (long n = 0; n < num_samples; ++n)
+            for (size_t o = 0; o < outputs.size(); ++o)
+                for (size_t a = 0; a < anchors[o]->size(); ++a)
+                    planes.push_back({n, o, static_cast<long>(a)});
+
+        std::vector<std::vector<yolo_rect>> plane_dets(planes.size());
+        parallel_for(tp, 0, planes.size(), [&](long i)
+        {
+            thread_local std::vector<long> candidates;
+            const auto& p = planes[i];
+            DLIB_CASSERT(static_cast<size_t>(outputs[p.output]->k()) == anchors[p.output]->size() * (options.labels.size() + 5));
+            decode_anchor(input_nr, input_nc, *outputs[p.output], p.n, p.anchor, (*anchors[p.output])[p.anchor],
+                          options.labels, threshold, candidates, plane_dets[i]);
+        });
+
+        dets.assign(num_samples, {});
+        for (size_t i = 0; i < planes.size(); ++i)
+        {
+            auto& d = dets[planes[i].n];
+            d.insert(d.end(), std::make_move_iterator(plane_dets[i].begin()), std::make_move_iterator(plane_dets[i].end()));
+        }
+        parallel_for(tp, 0, dets.size(), [&](long n)
+        {
+            nms(dets[n], options.overlaps_nms, options.classwise_nms);
+        });
+    }
+
+    template <template <typename> class... TAGS, typename SUBNET>
+    void postprocess(
+        const loss_yolo_<TAGS...>& loss,
+        const tensor& input_tensor,
+        const SUBNET& sub,
+        const double threshold,
+        std::vector<std::vector<yolo_rect>>& dets,
+        thread_pool& tp)
+    {
+        const std::vector<const tensor*> outputs{&layer<TAGS>(sub).get_output()...};
+        const std::vector<int> tag_ids{static_cast<int>(tag_id<TAGS>::id)...};
+        postprocess(loss.get_options(), input_tensor.nr(), input_tensor.nc(), outputs, tag_ids, threshold, dets, tp);
+    }
+
+    // The yolo outputs of a network, copied so that they can be decoded while the network
+    // already runs on the next input.
+    struct head_outputs
+    {
+        long input_nr = 0;
+        long input_nc = 0;
+        std::vector<int> tag_ids;
+        std::vector<resizable_tensor> tensors;
+    };
+
+    template <template <typename> class... TAGS, typename SUBNET>
+    void copy_head_outputs(const loss_yolo_<TAGS...>&, const tensor& input_tensor, const SUBNET& sub, head_outputs& head)
+    {
+        head.input_nr = input_tensor.nr();
+        head.input_nc = input_tensor.nc();
+        head.tag_ids = {static_cast<int>(tag_id<TAGS>::id)...};
+        head.tensors.resize(sizeof...(TAGS));
+        size_t i = 0;
+        ((head.tensors[i++] = layer<TAGS>(sub).get_output()), ...);
+    }
+
+    // Call right after net.forward(x).
+    template <typename net_type>
+    void copy_head_outputs(const net_type& net, const tensor& x, head_outputs& head)
+    {
+        copy_head_outputs(net.loss_details(), x, net.subnet(), head);
+    }
+
+    inline std::vector<std::vector<yolo_rect>> postprocess(
+        const yolo_options& options,
+        const head_outputs& head,
+        const double threshold = 0.25,
+        thread_pool& tp = default_thread_pool())
+    {
+        std::vector<const tensor*> outputs;
+        for (const auto& t : head.tensors)
+            outputs.push_back(&t);
+        std::vector<std::vector<yolo_rect>> dets;
+        postprocess(options, head.input_nr, head.input_nc, outputs, head.tag_ids, threshold, dets, tp);
+        return dets;
+    }
+
+    // Fast replacement for net.loss_details().to_label(): call it right after net.forward(x).
+    template <typename net_type>
+    std::vector<std::vector<yolo_rect>> postprocess(
+        const net_type& net,
+        const tensor& x,
+        const double threshold = 0.25,
+        thread_pool& tp = default_thread_pool())
+    {
+        std::vector<std::vector<yolo_rect>> dets;
+        postprocess(net.loss_details(), x, net.subnet(), threshold, dets, tp);
+        return dets;
+    }
+}  // namespace yolo
+
+#endif  // yolo_postprocess_h_INCLUDED
@@ -1,5 +1,5 @@
-#ifndef yolov5_h_INCLUDED
-#define yolov5_h_INCLUDED
+#ifndef yolov5p6_h_INCLUDED
+#define yolov5p6_h_INCLUDED
 
 #include <dlib/dnn.h>
 
@@ -123,4 +123,4 @@ namespace yolov5p6
     using infer_type_x = def<silu, affine, 4, 3, 5, 4>::net_type;
 }
 
-#endif // yolov5_h_INCLUDED
+#endif // yolov5p6_h_INCLUDED
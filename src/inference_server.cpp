@@ -0,0 +1,168 @@
+#include "classification/darknet.h"
+#include "classification/repvgg.h"
+#include "classification/resnet.h"
+#include "classification/vovnet.h"
+#include "inference_server.h"
+
+#include <dlib/cmd_line_parser.h>
+
+#include <csignal>
+
+// Sends single image requests from several client threads and reports the throughput.
+void load_test(const std::string& socket, const long image_size, const size_t num_clients, const size_t num_requests)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    dlib::matrix<dlib::rgb_pixel> image(image_size, image_size);
+    dlib::rand rnd(0);
+    for (auto& p : image)
+        p = dlib::rgb_pixel(rnd.get_random_8bit_number(), rnd.get_random_8bit_number(), rnd.get_random_8bit_number());
+
+    std::mutex mutex;
+    dlib::running_stats<double> latency;
+    std::vector<std::thread> clients;
+    const auto t0 = std::chrono::steady_clock::now();
+    for (size_t c = 0; c < num_clients; ++c)
+    {
+        clients.emplace_back([&]()
+        {
+            serving::unix_socket_client client(socket);
+            for (size_t i = 0; i < num_requests; ++i)
+            {
+                const auto r0 = std::chrono::steady_clock::now();
+                client.infer(image);
+                const auto r1 = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> lock(mutex);
+                latency.add(std::chrono::duration_cast<fms>(r1 - r0).count());
+            }
+        });
+    }
+    for (auto& t : clients)
+        t.join();
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    std::cout << num_clients << " clients: " << num_clients * num_requests / seconds << " images/s, latency: "
+              << latency.mean() << " ms (max " << latency.max() << " ms)\n";
+    std::cout << serving::unix_socket_client(socket).stats();
+}
+
+template <typename net_type> void serve(net_type& net, const dlib::command_line_parser& parser)
+{
+    const std::string socket = dlib::get_option(parser, "socket", "/tmp/dnn.sock");
+    const long image_size = dlib::get_option(parser, "image-size", 224);
+    serving::batching_options options;
+    options.max_batch_size = dlib::get_option(parser, "max-batch-size", 16);
+    options.max_queue_delay = std::chrono::microseconds(dlib::get_option(parser, "max-queue-delay", 2000));
+    options.max_queue_size = dlib::get_option(parser, "max-queue-size", 1024);
+    if (parser.option("weights"))
+        dlib::deserialize(parser.option("weights").argument()) >> net;
+
+    // run a full batch once, so that the first requests do not pay for the allocations
+    {
+        dlib::resizable_tensor x;
+        const std::vector<dlib::matrix<dlib::rgb_pixel>> batch(options.max_batch_size, dlib::matrix<dlib::rgb_pixel>(image_size, image_size));
+        net.to_tensor(batch.begin(), batch.end(), x);
+        net.forward(x);
+    }
+
+    // SIGINT and SIGTERM are only delivered to a thread waiting for them, which stops the server
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (!parser.option("load-test"))
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    serving::dynamic_batcher<net_type> batcher(net, options);
+    serving::unix_socket_server<net_type> server(socket, batcher, image_size, dlib::get_option(parser, "max-connections", 256));
+    std::cout << "listening on " << socket << " (max batch size: " << options.max_batch_size
+              << ", max queue delay: " << options.max_queue_delay.count() << " us)\n";
+    if (parser.option("load-test"))
+    {
+        std::thread server_thread([&server] { server.run(); });
+        load_test(socket, image_size, dlib::get_option(parser, "load-test", 16), dlib::get_option(parser, "num-requests", 100));
+        server.stop();
+        server_thread.join();
+        return;
+    }
+    std::thread signal_thread([&]()
+    {
+        int signal;
+        sigwait(&signals, &signal);
+        server.stop();
+    });
+    server.run();
+    // run() also returns on an accept error, with the signal thread still waiting
+    pthread_kill(signal_thread.native_handle(), SIGTERM);
+    signal_thread.join();
+    std::cout << batcher.get_stats();
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("net", "resnet18, resnet50, darknet53, vovnet39 or repvgg_b1 (default: resnet50)", 1);
+    parser.add_option("weights", "load the network from this file", 1);
+    parser.add_option("num-outputs", "set the number of fc outputs (default: 1000)", 1);
+    parser.add_option("image-size", "set the image size (default: 224)", 1);
+    parser.add_option("socket", "path of the Unix domain socket (default: /tmp/dnn.sock)", 1);
+    parser.add_option("max-batch-size", "largest batch run at once (default: 16)", 1);
+    parser.add_option("max-queue-delay", "microseconds a request may wait for a batch (default: 2000)", 1);
+    parser.add_option("max-queue-size", "requests queued before rejecting new ones (default: 1024)", 1);
+    parser.add_option("max-connections", "connections served at once, the next ones wait (default: 256)", 1);
+    parser.add_option("load-test", "serve <arg> local clients sending one image at a time and exit", 1);
+    parser.add_option("num-requests", "requests per load test client (default: 100)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    const std::string name = dlib::get_option(parser, "net", "resnet50");
+    const size_t num_outputs = dlib::get_option(parser, "num-outputs", 1000);
+    if (name == "resnet18")
+    {
+        resnet::infer_18 net;
+        net.subnet().layer_details().set_num_outputs(num_outputs);
+        serve(net, parser);
+    }
+    else if (name == "resnet50")
+    {
+        resnet::infer_50 net;
+        net.subnet().layer_details().set_num_outputs(num_outputs);
+        serve(net, parser);
+    }
+    else if (name == "darknet53")
+    {
+        darknet::infer_53 net;
+        net.subnet().layer_details().set_num_outputs(num_outputs);
+        serve(net, parser);
+    }
+    else if (name == "vovnet39")
+    {
+        vovnet::infer_39 net;
+        net.subnet().layer_details().set_num_outputs(num_outputs);
+        serve(net, parser);
+    }
+    else if (name == "repvgg_b1")
+    {
+        repvgg::infer_b1 net;
+        net.subnet().layer_details().set_num_outputs(num_outputs);
+        serve(net, parser);
+    }
+    else
+    {
+        throw std::invalid_argument("unknown network: " + name);
+    }
+
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
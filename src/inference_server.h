@@ -0,0 +1,555 @@
+#ifndef inference_server_h_INCLUDED
+#define inference_server_h_INCLUDED
+
+#include <dlib/dnn.h>
+#include <dlib/image_transforms.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace serving
+{
+    using namespace dlib;
+
+    struct batching_options
+    {
+        // largest batch given to a single forward pass
+        size_t max_batch_size = 16;
+        // how long the oldest request may wait for others to join its batch
+        std::chrono::microseconds max_queue_delay{2000};
+        // requests beyond this are rejected instead of queued
+        size_t max_queue_size = 1024;
+    };
+
+    struct batching_stats
+    {
+        size_t requests = 0;
+        size_t rejected = 0;
+        size_t batches = 0;
+        // number of batches of each size, indexed by the batch size
+        std::vector<size_t> batch_sizes;
+        // number of batches formed while the queue held [2^i, 2^(i+1)) requests
+        std::vector<size_t> queue_depths;
+        running_stats<double> queue_delay;  // ms from submission to the start of its batch
+        running_stats<double> forward;      // ms per batch
+
+        friend std::ostream& operator<<(std::ostream& out, const batching_stats& s)
+        {
+            const auto mean = [](const running_stats<double>& rs) { return rs.current_n() ? rs.mean() : 0.0; };
+            out << "requests: " << s.requests << " rejected: " << s.rejected << " batches: " << s.batches;
+            out << " mean batch: " << (s.batches ? static_cast<double>(s.requests - s.rejected) / s.batches : 0.0) << '\n';
+            out << "queue delay: " << mean(s.queue_delay) << " ms, forward: " << mean(s.forward) << " ms per batch\n";
+            out << "batch size histogram:";
+            for (size_t i = 1; i < s.batch_sizes.size(); ++i)
+            {
+                if (s.batch_sizes[i])
+                    out << ' ' << i << ':' << s.batch_sizes[i];
+            }
+            out << "\nqueue depth histogram:";
+            for (size_t i = 0; i < s.queue_depths.size(); ++i)
+            {
+                if (s.queue_depths[i])
+                    out << " [" << (1ul << i) << ',' << (1ul << (i + 1)) << "):" << s.queue_depths[i];
+            }
+            out << '\n';
+            return out;
+        }
+    };
+
+    /*!
+        Collects single image requests from any number of threads into batches and runs one
+        forward pass per batch on a worker thread.  A batch is started as soon as it is full or
+        the oldest request in it has waited max_queue_delay, so a lone request pays at most that
+        delay while a busy server runs at the batch size where the network is most efficient.
+        Each request gets back the output of the last layer before the loss for its sample.
+    !*/
+    template <typename net_type> class dynamic_batcher
+    {
+        public:
+        using result_type = std::vector<float>;
+
+        dynamic_batcher(net_type& net, const batching_options& options = batching_options())
+            : net(net), options(options)
+        {
+            DLIB_CASSERT(options.max_batch_size > 0);
+            stats.batch_sizes.resize(options.max_batch_size + 1);
+            worker = std::thread([this] { run(); });
+        }
+
+        dynamic_batcher(const dynamic_batcher&) = delete;
+        dynamic_batcher& operator=(const dynamic_batcher&) = delete;
+
+        ~dynamic_batcher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+
+        // All the images must have the input size of the network.
+        std::future<result_type> submit(matrix<rgb_pixel> image)
+        {
+            request req{std::move(image), {}, clock::now()};
+            auto result = req.promise.get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++stats.requests;
+                if (queue.size() >= options.max_queue_size || stopping)
+                {
+                    ++stats.rejected;
+                    req.promise.set_exception(std::make_exception_ptr(std::runtime_error("inference queue is full")));
+                    return result;
+                }
+                queue.push_back(std::move(req));
+            }
+            cv.notify_one();
+            return result;
+        }
+
+        batching_stats get_stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stats;
+        }
+
+        size_t queue_depth() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return queue.size();
+        }
+
+        private:
+        using clock = std::chrono::steady_clock;
+        using fms = std::chrono::duration<double, std::milli>;
+
+        struct request
+        {
+            matrix<rgb_pixel> image;
+            std::promise<result_type> promise;
+            clock::time_point submitted;
+        };
+
+        void run()
+        {
+            std::vector<request> batch;
+            std::vector<matrix<rgb_pixel>> images;
+            resizable_tensor x;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [this] { return stopping || !queue.empty(); });
+                    if (queue.empty())
+                        return;
+                    const auto deadline = queue.front().submitted + options.max_queue_delay;
+                    cv.wait_until(lock, deadline, [this] { return stopping || queue.size() >= options.max_batch_size; });
+
+                    const size_t depth = queue.size();
+                    size_t bucket = 0;
+                    while ((2ul << bucket) <= depth)
+                        ++bucket;
+                    if (stats.queue_depths.size() <= bucket)
+                        stats.queue_depths.resize(bucket + 1);
+                    ++stats.queue_depths[bucket];
+
+                    const size_t n = std::min(depth, options.max_batch_size);
+                    const auto now = clock::now();
+                    batch.clear();
+                    for (size_t i = 0; i < n; ++i)
+                    {
+                        stats.queue_delay.add(std::chrono::duration_cast<fms>(now - queue.front().submitted).count());
+                        batch.push_back(std::move(queue.front()));
+                        queue.pop_front();
+                    }
+                }
+
+                const auto t0 = clock::now();
+                try
+                {
+                    images.resize(batch.size());
+                    for (size_t i = 0; i < batch.size(); ++i)
+                        images[i].swap(batch[i].image);
+                    net.to_tensor(images.begin(), images.end(), x);
+                    net.forward(x);
+                    const tensor& out = net.subnet().get_output();
+                    const long sample_size = out.k() * out.nr() * out.nc();
+                    const float* p = out.host();
+                    for (size_t i = 0; i < batch.size(); ++i)
+                        batch[i].promise.set_value(result_type(p + i * sample_size, p + (i + 1) * sample_size));
+                }
+                catch (...)
+                {
+                    for (auto& req : batch)
+                        req.promise.set_exception(std::current_exception());
+                }
+                const auto t1 = clock::now();
+
+                std::lock_guard<std::mutex> lock(mutex);
+                ++stats.batches;
+                ++stats.batch_sizes[batch.size()];
+                stats.forward.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            }
+        }
+
+        net_type& net;
+        batching_options options;
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<request> queue;
+        bool stopping = false;
+        batching_stats stats;
+        std::thread worker;
+    };
+
+    /*!
+        Wire format of the Unix domain socket protocol, in host byte order since both ends are
+        on the same machine.  A connection carries any number of requests, one after the other:
+            request:  uint32 type, then for infer: uint32 rows, uint32 cols, rows*cols*3 bytes of RGB
+            response: uint32 status (0 on success), uint32 size, then for infer size floats,
+                      for stats and errors size bytes of text
+    !*/
+    enum class message_type : uint32_t
+    {
+        infer = 1,
+        stats = 2
+    };
+
+    inline bool read_all(const int fd, void* data, size_t size)
+    {
+        char* p = static_cast<char*>(data);
+        while (size > 0)
+        {
+            const ssize_t n = ::read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    inline bool write_all(const int fd, const void* data, size_t size)
+    {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0)
+        {
+            const ssize_t n = ::send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    inline bool write_message(const int fd, const uint32_t status, const void* data, const uint32_t size)
+    {
+        return write_all(fd, &status, sizeof(status)) && write_all(fd, &size, sizeof(size)) && write_all(fd, data, size);
+    }
+
+    /*!
+        Serves a dynamic_batcher over a Unix domain socket, with one thread per connection.
+        Images that do not have the input size of the network are resized on the connection
+        thread, so that the batching thread only runs the network.
+
+        At most max_connections connections are served at once, the next ones wait in the
+        listen backlog.  A connection that ends closes its descriptor, and run() joins its
+        thread before accepting the next one.
+    !*/
+    template <typename net_type> class unix_socket_server
+    {
+        public:
+        // largest number of rows or columns of a request, which must be at most
+        // max_image_side * max_image_side * 3 bytes
+        static constexpr uint32_t max_image_side = 8192;
+
+        unix_socket_server(
+            const std::string& path,
+            dynamic_batcher<net_type>& batcher,
+            const long image_size,
+            const size_t max_connections = 256)
+            : path(path), batcher(batcher), image_size(image_size), max_connections(max_connections)
+        {
+            DLIB_CASSERT(max_connections > 0);
+            listen_fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (listen_fd < 0)
+                throw std::runtime_error("could not create socket");
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            if (path.size() >= sizeof(addr.sun_path))
+            {
+                ::close(listen_fd);
+                throw std::runtime_error("socket path too long: " + path);
+            }
+            std::strcpy(addr.sun_path, path.c_str());
+            ::unlink(path.c_str());
+            if (::bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(listen_fd, 128) < 0)
+            {
+                ::close(listen_fd);
+                throw std::runtime_error("could not listen on " + path);
+            }
+        }
+
+        unix_socket_server(const unix_socket_server&) = delete;
+        unix_socket_server& operator=(const unix_socket_server&) = delete;
+
+        // run() must have returned by now.
+        ~unix_socket_server()
+        {
+            stop();
+            std::unique_lock<std::mutex> lock(mutex);
+            connection_closed.wait(lock, [this] { return connections.empty(); });
+            lock.unlock();
+            reap();
+            ::close(listen_fd);
+            ::unlink(path.c_str());
+        }
+
+        // Accepts connections until stop() is called from another thread.
+        void run()
+        {
+            while (true)
+            {
+                reap();
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    connection_closed.wait(lock, [this] { return stopped || connections.size() < max_connections; });
+                    if (stopped)
+                        break;
+                }
+                const int fd = ::accept(listen_fd, nullptr, nullptr);
+                if (fd < 0)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                        continue;
+                    if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+                    {
+                        // out of descriptors or memory: the pending connections wait until one
+                        // of the open ones closes, or a little while
+                        std::unique_lock<std::mutex> lock(mutex);
+                        connection_closed.wait_for(lock, std::chrono::milliseconds(100));
+                        continue;
+                    }
+                    // the listening socket was shut down by stop()
+                    break;
+                }
+                std::lock_guard<std::mutex> lock(mutex);
+                if (stopped)
+                {
+                    ::close(fd);
+                    break;
+                }
+                const uint64_t id = next_id++;
+                try
+                {
+                    // created under the lock, so that serve() finds its entry when it ends
+                    connections.emplace(id, connection{fd, std::thread([this, id, fd] { serve(id, fd); })});
+                }
+                catch (const std::system_error&)
+                {
+                    ::close(fd);
+                }
+            }
+            reap();
+        }
+
+        // Stops accepting connections and ends the open ones, which makes run() return.
+        void stop()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopped)
+                return;
+            stopped = true;
+            ::shutdown(listen_fd, SHUT_RDWR);
+            for (const auto& c : connections)
+                ::shutdown(c.second.fd, SHUT_RDWR);
+            connection_closed.notify_all();
+        }
+
+        // Number of connections being served.
+        size_t num_connections() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return connections.size();
+        }
+
+        private:
+        struct connection
+        {
+            int fd;
+            std::thread thread;
+        };
+
+        void serve(const uint64_t id, const int fd)
+        {
+            matrix<rgb_pixel> image, resized;
+            uint32_t type;
+            while (read_all(fd, &type, sizeof(type)))
+            {
+                if (type == static_cast<uint32_t>(message_type::stats))
+                {
+                    std::ostringstream sout;
+                    sout << batcher.get_stats() << "current queue depth: " << batcher.queue_depth() << '\n';
+                    const std::string text = sout.str();
+                    if (!write_message(fd, 0, text.data(), text.size()))
+                        break;
+                    continue;
+                }
+                uint32_t dims[2];
+                if (type != static_cast<uint32_t>(message_type::infer) || !read_all(fd, dims, sizeof(dims)))
+                    break;
+                try
+                {
+                    if (dims[0] == 0 || dims[1] == 0 || dims[0] > max_image_side || dims[1] > max_image_side)
+                    {
+                        throw std::invalid_argument("invalid image size " + std::to_string(dims[0]) + "x" + std::to_string(dims[1]) +
+                                                    ", the sides must be between 1 and " + std::to_string(max_image_side));
+                    }
+                    image.set_size(dims[0], dims[1]);
+                }
+                catch (const std::exception& e)
+                {
+                    // the pixels that follow cannot be skipped safely: the connection ends
+                    const std::string what = e.what();
+                    write_message(fd, 1, what.data(), what.size());
+                    break;
+                }
+                if (!read_all(fd, image_data(image), image.size() * sizeof(rgb_pixel)))
+                    break;
+                try
+                {
+                    if (image.nr() != image_size || image.nc() != image_size)
+                    {
+                        resized.set_size(image_size, image_size);
+                        resize_image(image, resized);
+                        image.swap(resized);
+                    }
+                    const auto result = batcher.submit(std::move(image)).get();
+                    if (!write_message(fd, 0, result.data(), result.size() * sizeof(float)))
+                        break;
+                }
+                catch (const std::exception& e)
+                {
+                    const std::string what = e.what();
+                    if (!write_message(fd, 1, what.data(), what.size()))
+                        break;
+                }
+            }
+            // closed under the lock, so that stop() never shuts down a reused descriptor; the
+            // thread is joined by run() or by the destructor
+            std::lock_guard<std::mutex> lock(mutex);
+            ::close(fd);
+            auto c = connections.find(id);
+            finished.push_back(std::move(c->second.thread));
+            connections.erase(c);
+            connection_closed.notify_all();
+        }
+
+        // Joins the threads of the connections that have ended.
+        void reap()
+        {
+            std::vector<std::thread> threads;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                threads.swap(finished);
+            }
+            for (auto& t : threads)
+                t.join();
+        }
+
+        std::string path;
+        dynamic_batcher<net_type>& batcher;
+        long image_size;
+        size_t max_connections;
+        int listen_fd = -1;
+        mutable std::mutex mutex;
+        std::condition_variable connection_closed;
+        bool stopped = false;
+        uint64_t next_id = 0;
+        std::map<uint64_t, connection> connections;  // open connections
+        std::vector<std::thread> finished;            // threads of the closed connections, to join
+    };
+
+    // Blocking client for unix_socket_server, one request at a time.
+    class unix_socket_client
+    {
+        public:
+        explicit unix_socket_client(const std::string& path)
+        {
+            fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr{};
+            addr.sun_family = AF_UNIX;
+            std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+            if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+            {
+                if (fd >= 0)
+                    ::close(fd);
+                throw std::runtime_error("could not connect to " + path);
+            }
+        }
+
+        unix_socket_client(const unix_socket_client&) = delete;
+        unix_socket_client& operator=(const unix_socket_client&) = delete;
+
+        ~unix_socket_client() { ::close(fd); }
+
+        std::vector<float> infer(const matrix<rgb_pixel>& image)
+        {
+            const uint32_t header[3] = {static_cast<uint32_t>(message_type::infer),
+                                        static_cast<uint32_t>(image.nr()),
+                                        static_cast<uint32_t>(image.nc())};
+            if (!write_all(fd, header, sizeof(header)) || !write_all(fd, image_data(image), image.size() * sizeof(rgb_pixel)))
+                throw std::runtime_error("connection lost");
+            std::string payload;
+            if (read_response(payload) != 0)
+                throw std::runtime_error(payload);
+            std::vector<float> result(payload.size() / sizeof(float));
+            std::memcpy(result.data(), payload.data(), result.size() * sizeof(float));
+            return result;
+        }
+
+        std::string stats()
+        {
+            const uint32_t type = static_cast<uint32_t>(message_type::stats);
+            if (!write_all(fd, &type, sizeof(type)))
+                throw std::runtime_error("connection lost");
+            std::string text;
+            read_response(text);
+            return text;
+        }
+
+        private:
+        uint32_t read_response(std::string& payload)
+        {
+            uint32_t header[2];
+            if (!read_all(fd, header, sizeof(header)))
+                throw std::runtime_error("connection lost");
+            payload.resize(header[1]);
+            if (!read_all(fd, &payload[0], payload.size()))
+                throw std::runtime_error("connection lost");
+            return header[0];
+        }
+
+        int fd = -1;
+    };
+}  // namespace serving
+
+#endif  // inference_server_h_INCLUDED
@@ -0,0 +1,488 @@
+#ifndef BpeTokenizer_H
+#define BpeTokenizer_H
+
+/**
+ * @file bpe_tokenizer.h
+ * @brief Byte-level BPE tokenizer producing the input<matrix<int, 0, 1>> of a transformer_config
+ *
+ * Text is first split into words: an optional leading space followed by a run of letters, of
+ * digits or of other symbols, and runs of whitespace.  Every byte is a token of its own (ids
+ * 0 to 255, so any input can be encoded and decoded back exactly), and training adds merged
+ * tokens for the most frequent adjacent pairs inside words until the vocabulary size is
+ * reached.  Bytes above 127 count as letters, so UTF-8 words are not split.
+ *
+ * Encoding looks up the merges of adjacent tokens in a hash table keyed by the pair, and
+ * keeps the tokens of recently seen words in an LRU cache: in natural text most words are
+ * repeated, so most of them skip the merges altogether.  Batches of texts are encoded in
+ * parallel, each thread with its own cache, directly into the matrices fed to the network.
+ */
+
+#include <dlib/dnn.h>
+
+#include <list>
+#include <queue>
+#include <string_view>
+#include <unordered_map>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    namespace impl
+    {
+        // Calls f(begin, end) for each word of [begin, end).
+        template <typename F>
+        void split_words(const char* begin, const char* end, F&& f)
+        {
+            enum char_class { space, letter, digit, other };
+            const auto get_class = [](const unsigned char c)
+            {
+                if (c == ' ' || (c >= '\t' && c <= '\r'))
+                    return space;
+                if ((c | 0x20) >= 'a' && (c | 0x20) <= 'z')
+                    return letter;
+                if (c >= 0x80)
+                    return letter;
+                if (c >= '0' && c <= '9')
+                    return digit;
+                return other;
+            };
+
+            const char* p = begin;
+            while (p != end)
+            {
+                const char* start = p;
+                char_class c = get_class(*p);
+                if (c == space)
+                {
+                    while (p != end && get_class(*p) == space)
+                        ++p;
+                    // leave a single space before a word to that word
+                    if (p != end && p[-1] == ' ')
+                    {
+                        if (p - start == 1)
+                        {
+                            c = get_class(*p);
+                            while (p != end && get_class(*p) == c)
+                                ++p;
+                        }
+                        else
+                        {
+                            --p;
+                        }
+                    }
+                }
+                else
+                {
+                    while (p != end && get_class(*p) == c)
+                        ++p;
+                }
+                f(start, p);
+            }
+        }
+
+        // Least recently used words are evicted first.
+        class word_cache
+        {
+            public:
+            explicit word_cache(const size_t capacity = 0) : capacity(capacity) {}
+            // the index views the strings of the entries, so copies start empty
+            word_cache(const word_cache& item) : capacity(item.capacity) {}
+            word_cache& operator=(const word_cache& item)
+            {
+                clear();
+                capacity = item.capacity;
+                return *this;
+            }
+            word_cache(word_cache&&) = default;
+            word_cache& operator=(word_cache&&) = default;
+
+            const std::vector<int>* find(const std::string_view word)
+            {
+                const auto i = index.find(word);
+                if (i == index.end())
+                    return nullptr;
+                entries.splice(entries.begin(), entries, i->second);
+                return &i->second->second;
+            }
+
+            void insert(const std::string_view word, const std::vector<int>& ids)
+            {
+                if (capacity == 0)
+                    return;
+                if (entries.size() == capacity)
+                {
+                    index.erase(entries.back().first);
+                    entries.pop_back();
+                }
+                entries.emplace_front(std::string(word), ids);
+                // the key views the string of the list node, which does not move
+                index.emplace(entries.front().first, entries.begin());
+            }
+
+            void clear()
+            {
+                index.clear();
+                entries.clear();
+            }
+
+            private:
+            size_t capacity;
+            std::list<std::pair<std::string, std::vector<int>>> entries;
+            std::unordered_map<std::string_view, std::list<std::pair<std::string, std::vector<int>>>::iterator> index;
+        };
+
+        // What a thread needs to encode text.
+        struct encoder_state
+        {
+            explicit encoder_state(const size_t cache_size) : cache(cache_size) {}
+            word_cache cache;
+            std::vector<int> word, merged_ids, tokens;
+        };
+
+        inline uint64_t pair_key(const int a, const int b)
+        {
+            return (static_cast<uint64_t>(a) << 32) | static_cast<uint32_t>(b);
+        }
+    }
+
+    /**
+     * @brief Trains, encodes and decodes byte-level BPE tokens.
+     *
+     * Usage:
+     *   auto tokenizer = bpe_tokenizer::train(texts, net_type::VOCAB_SIZE);
+     *   std::vector<matrix<int, 0, 1>> inputs;
+     *   tokenizer.encode(texts, inputs);
+     *   std::string text = tokenizer.decode(inputs[0]);
+     *
+     * An instance holds the word caches it encodes with, so it must not encode from several
+     * threads at once; encode() on a batch already uses all the threads of the pool.
+     */
+    class bpe_tokenizer
+    {
+        public:
+        // words cached per encoding thread, 0 to disable the cache
+        explicit bpe_tokenizer(const size_t cache_size = 50000) : cache_size(cache_size)
+        {
+            token_bytes.reserve(256);
+            for (int b = 0; b < 256; ++b)
+                token_bytes.emplace_back(1, static_cast<char>(b));
+        }
+
+        /**
+         * Learns merges from texts until the vocabulary has vocab_size tokens, or no pair of
+         * tokens appears min_frequency times any more.
+         */
+        static bpe_tokenizer train(
+            const std::vector<std::string>& texts,
+            const long vocab_size,
+            const long min_frequency = 2,
+            const size_t cache_size = 50000)
+        {
+            DLIB_CASSERT(vocab_size >= 256, "The 256 bytes are always part of the vocabulary");
+            bpe_tokenizer tokenizer(cache_size);
+
+            // count the words in parallel, each part of the texts in its own table
+            const long num_parts = std::max<long>(1, std::min<long>(texts.size(), default_thread_pool().num_threads_in_pool()));
+            std::vector<std::unordered_map<std::string_view, long>> part_counts(num_parts);
+            parallel_for(default_thread_pool(), 0, num_parts, [&](long p)
+            {
+                for (size_t t = p * texts.size() / num_parts; t < (p + 1) * texts.size() / num_parts; ++t)
+                {
+                    const auto& text = texts[t];
+                    impl::split_words(text.data(), text.data() + text.size(), [&](const char* b, const char* e)
+                    {
+                        ++part_counts[p][std::string_view(b, e - b)];
+                    });
+                }
+            });
+            std::unordered_map<std::string_view, long> word_counts = std::move(part_counts[0]);
+            for (long p = 1; p < num_parts; ++p)
+            {
+                for (const auto& wc : part_counts[p])
+                    word_counts[wc.first] += wc.second;
+            }
+
+            std::vector<std::vector<int>> words;
+            std::vector<long> counts;
+            words.reserve(word_counts.size());
+            counts.reserve(word_counts.size());
+            for (const auto& wc : word_counts)
+            {
+                words.emplace_back(wc.first.begin(), wc.first.end());
+                for (auto& token : words.back())
+                    token = static_cast<unsigned char>(token);
+                counts.push_back(wc.second);
+            }
+            word_counts.clear();
+
+            // occurrences of each pair, weighted by the word counts, and the words holding it
+            std::unordered_map<uint64_t, long> pair_counts;
+            std::unordered_map<uint64_t, std::vector<long>> pair_words;
+            for (size_t w = 0; w < words.size(); ++w)
+            {
+                for (size_t i = 0; i + 1 < words[w].size(); ++i)
+                {
+                    const auto key = impl::pair_key(words[w][i], words[w][i + 1]);
+                    pair_counts[key] += counts[w];
+                    pair_words[key].push_back(w);
+                }
+            }
+            // most frequent pair first, ties to the pair of smaller tokens; entries whose
+            // count changed since they were pushed are skipped
+            using entry = std::pair<long, uint64_t>;
+            const auto worse = [](const entry& a, const entry& b)
+            {
+                return a.first < b.first || (a.first == b.first && a.second > b.second);
+            };
+            std::priority_queue<entry, std::vector<entry>, decltype(worse)> queue(worse);
+            for (const auto& pc : pair_counts)
+                queue.emplace(pc.second, pc.first);
+
+            std::vector<long> last_merge(words.size(), -1);
+            std::vector<uint64_t> changed;
+            while (tokenizer.vocab_size() < vocab_size && !queue.empty())
+            {
+                const entry top = queue.top();
+                queue.pop();
+                const auto current = pair_counts.find(top.second);
+                if (current == pair_counts.end() || current->second != top.first)
+                    continue;
+                if (top.first < min_frequency)
+                    break;
+
+                const int a = top.second >> 32;
+                const int b = top.second & 0xffffffff;
+                const int merged = tokenizer.add_merge(a, b);
+                const long step = merged;
+                changed.clear();
+                for (const long w : pair_words[top.second])
+                {
+                    // a word is listed once per occurrence of the pair, and maybe stale
+                    if (last_merge[w] == step)
+                        continue;
+                    last_merge[w] = step;
+                    auto& word = words[w];
+                    bool found = false;
+                    for (size_t i = 0; i + 1 < word.size() && !found; ++i)
+                        found = word[i] == a && word[i + 1] == b;
+                    if (!found)
+                        continue;
+
+                    for (size_t i = 0; i + 1 < word.size(); ++i)
+                    {
+                        const auto key = impl::pair_key(word[i], word[i + 1]);
+                        pair_counts[key] -= counts[w];
+                        changed.push_back(key);
+                    }
+                    size_t out = 0;
+                    for (size_t i = 0; i < word.size(); ++i)
+                    {
+                        if (i + 1 < word.size() && word[i] == a && word[i + 1] == b)
+                        {
+                            word[out++] = merged;
+                            ++i;
+                        }
+                        else
+                        {
+                            word[out++] = word[i];
+                        }
+                    }
+                    word.resize(out);
+                    for (size_t i = 0; i + 1 < word.size(); ++i)
+                    {
+                        const auto key = impl::pair_key(word[i], word[i + 1]);
+                        pair_counts[key] += counts[w];
+                        changed.push_back(key);
+                        if (word[i] == merged || word[i + 1] == merged)
+                            pair_words[key].push_back(w);
+                    }
+                }
+                pair_counts.erase(top.second);
+                pair_words.erase(top.second);
+                std::sort(changed.begin(), changed.end());
+                changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+                for (const auto key : changed)
+                {
+                    const auto pc = pair_counts.find(key);
+                    if (pc == pair_counts.end())
+                        continue;
+                    if (pc->second > 0)
+                    {
+                        queue.emplace(pc->second, key);
+                    }
+                    else
+                    {
+                        pair_counts.erase(pc);
+                        pair_words.erase(key);
+                    }
+                }
+            }
+            return tokenizer;
+        }
+
+        long vocab_size() const { return token_bytes.size(); }
+
+        // The bytes a token stands for.
+        const std::string& token(const int id) const { return token_bytes.at(id); }
+
+        void encode(const std::string& text, std::vector<int>& ids)
+        {
+            ids.clear();
+            if (states.empty())
+                states.emplace_back(cache_size);
+            encode(text, ids, states[0]);
+        }
+
+        std::vector<int> encode(const std::string& text)
+        {
+            std::vector<int> ids;
+            encode(text, ids);
+            return ids;
+        }
+
+        void encode(const std::string& text, matrix<int, 0, 1>& ids)
+        {
+            if (states.empty())
+                states.emplace_back(cache_size);
+            auto& tokens = states[0].tokens;
+            tokens.clear();
+            encode(text, tokens, states[0]);
+            ids.set_size(tokens.size());
+            std::copy(tokens.begin(), tokens.end(), ids.begin());
+        }
+
+        // Encodes a batch of texts in parallel.
+        void encode(const std::vector<std::string>& texts, std::vector<matrix<int, 0, 1>>& ids)
+        {
+            ids.resize(texts.size());
+            const long num_parts = std::max<long>(1, std::min<long>(texts.size(), default_thread_pool().num_threads_in_pool()));
+            while (static_cast<long>(states.size()) < num_parts)
+                states.emplace_back(cache_size);
+            parallel_for(default_thread_pool(), 0, num_parts, [&](long p)
+            {
+                auto& tokens = states[p].tokens;
+                for (size_t t = p * texts.size() / num_parts; t < (p + 1) * texts.size() / num_parts; ++t)
+                {
+                    tokens.clear();
+                    encode(texts[t], tokens, states[p]);
+                    ids[t].set_size(tokens.size());
+                    std::copy(tokens.begin(), tokens.end(), ids[t].begin());
+                }
+            });
+        }
+
+        // Works with std::vector<int> and matrix<int, 0, 1>.
+        template <typename container>
+        std::string decode(const container& ids) const
+        {
+            std::string text;
+            for (const int id : ids)
+            {
+                DLIB_CASSERT(0 <= id && id < vocab_size(), "Token " << id << " is not in the vocabulary");
+                text += token_bytes[id];
+            }
+            return text;
+        }
+
+        friend void serialize(const bpe_tokenizer& item, std::ostream& out)
+        {
+            serialize("bpe_tokenizer", out);
+            serialize(item.merges.size(), out);
+            for (const auto& m : item.merges)
+            {
+                serialize(m.first, out);
+                serialize(m.second, out);
+            }
+        }
+
+        friend void deserialize(bpe_tokenizer& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "bpe_tokenizer")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing bpe_tokenizer.");
+            size_t num_merges = 0;
+            deserialize(num_merges, in);
+            bpe_tokenizer tokenizer(item.cache_size);
+            for (size_t i = 0; i < num_merges; ++i)
+            {
+                int a = 0, b = 0;
+                deserialize(a, in);
+                deserialize(b, in);
+                if (a < 0 || b < 0 || a >= tokenizer.vocab_size() || b >= tokenizer.vocab_size())
+                    throw serialization_error("Invalid merge found while deserializing bpe_tokenizer.");
+                tokenizer.add_merge(a, b);
+            }
+            item = std::move(tokenizer);
+        }
+
+        private:
+        int add_merge(const int a, const int b)
+        {
+            const int id = token_bytes.size();
+            merges.emplace_back(a, b);
+            merge_ids[impl::pair_key(a, b)] = id;
+            token_bytes.push_back(token_bytes[a] + token_bytes[b]);
+            return id;
+        }
+
+        void encode(const std::string& text, std::vector<int>& ids, impl::encoder_state& state) const
+        {
+            auto& cache = state.cache;
+            auto& word = state.word;
+            impl::split_words(text.data(), text.data() + text.size(), [&](const char* b, const char* e)
+            {
+                const std::string_view key(b, e - b);
+                if (const auto cached = cache.find(key))
+                {
+                    ids.insert(ids.end(), cached->begin(), cached->end());
+                    return;
+                }
+                word.assign(b, e);
+                for (auto& token : word)
+                    token = static_cast<unsigned char>(token);
+                merge_word(word, state.merged_ids);
+                cache.insert(key, word);
+                ids.insert(ids.end(), word.begin(), word.end());
+            });
+        }
+
+        int merged_id(const int a, const int b) const
+        {
+            const auto m = merge_ids.find(impl::pair_key(a, b));
+            return m != merge_ids.end() ? m->second : std::numeric_limits<int>::max();
+        }
+
+        // Applies the merges in the order they were learned: merged ids grow with that order,
+        // so the pair to merge next is the leftmost one with the smallest merged id.  Only the
+        // two pairs around a merge change, so the table is looked up twice per merge.
+        void merge_word(std::vector<int>& word, std::vector<int>& ids) const
+        {
+            ids.resize(word.size());
+            for (size_t i = 0; i + 1 < word.size(); ++i)
+                ids[i] = merged_id(word[i], word[i + 1]);
+            while (word.size() > 1)
+            {
+                const size_t i = std::min_element(ids.begin(), ids.begin() + word.size() - 1) - ids.begin();
+                if (ids[i] == std::numeric_limits<int>::max())
+                    return;
+                word[i] = ids[i];
+                word.erase(word.begin() + i + 1);
+                ids.erase(ids.begin() + i + 1);
+                if (i > 0)
+                    ids[i - 1] = merged_id(word[i - 1], word[i]);
+                if (i + 1 < word.size())
+                    ids[i] = merged_id(word[i], word[i + 1]);
+            }
+        }
+
+        size_t cache_size;
+        std::vector<std::string> token_bytes;
+        std::vector<std::pair<int, int>> merges;
+        std::unordered_map<uint64_t, int> merge_ids;
+        std::vector<impl::encoder_state> states;  // one per encoding thread
+    };
+}
+
+#endif // BpeTokenizer_H
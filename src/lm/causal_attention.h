@@ -0,0 +1,288 @@
+#ifndef CausalAttention_H
+#define CausalAttention_H
+
+/**
+ * @file causal_attention.h
+ * @brief Fused causal multi-head attention for the CPU
+ *
+ * Replaces the multm_prev / scale_weights / tril_mask / softmaxm / multm_prev chain with a
+ * single layer.  The chain materializes a seq_len x seq_len score matrix per head, several
+ * times over, and half of it is masked away.  This layer walks over blocks of queries and
+ * keys instead, skips the blocks above the diagonal, and keeps a running maximum and sum
+ * per query row (online softmax), so the scores only ever exist one block at a time.  The
+ * backward pass recomputes the scores block by block from the saved log-sum-exp of each row,
+ * as in FlashAttention-2.
+ */
+
+#include <dlib/dnn.h>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    /**
+     * @brief Causal scaled dot-product attention over a packed QKV tensor.
+     *
+     * Input: (N, 1, seq_len, d_model + 2 * num_kv_heads * d_k), each row holding the query,
+     * key and value of one token, as produced by token_fc_no_bias, with d_k =
+     * d_model / num_heads.  Output: (N, 1, seq_len, d_model) with the heads concatenated.
+     * Query head h uses the columns [h * d_k, (h + 1) * d_k) of the query part, and the key
+     * and value head h / (num_heads / num_kv_heads) of the other two parts.  num_kv_heads ==
+     * num_heads is the usual multi-head attention, fewer key/value heads give grouped-query
+     * attention and a single one multi-query attention.
+     *
+     * Template parameters:
+     * @param num_heads: Number of attention (query) heads
+     * @param d_model: Model dimension
+     * @param num_kv_heads: Number of key/value heads, a divisor of num_heads
+     */
+    template <long num_heads, long d_model, long num_kv_heads = num_heads>
+    class causal_attention_
+    {
+        static_assert(num_heads > 0 && d_model % num_heads == 0, "d_model must be divisible by num_heads");
+        static_assert(num_kv_heads > 0 && num_heads % num_kv_heads == 0, "num_heads must be a multiple of num_kv_heads");
+
+        public:
+        static constexpr long d_k = d_model / num_heads;
+        static constexpr long kv_dim = num_kv_heads * d_k;
+        static constexpr long qkv_stride = d_model + 2 * kv_dim;
+        // query heads sharing one key/value head
+        static constexpr long group_size = num_heads / num_kv_heads;
+        // rows of queries and keys processed together, so that a block of Q, K and V plus the
+        // scores fit in L2 for the usual head sizes
+        static constexpr long block_size = 64;
+
+        causal_attention_() = default;
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.k() == 1 && in.nc() == qkv_stride, "causal_attention expects (N, 1, seq_len, d_model + 2 * num_kv_heads * d_k)");
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.k() == 1 && in.nc() == qkv_stride);
+            const long seq_len = in.nr();
+            output.set_size(in.num_samples(), 1, seq_len, d_model);
+            lse.set_size(in.num_samples(), num_heads, seq_len);
+            const float* qkv = in.host();
+            float* out = output.host_write_only();
+            float* row_lse = lse.host_write_only();
+            parallel_for(default_thread_pool(), 0, in.num_samples() * num_heads, [&](long task)
+            {
+                const long n = task / num_heads;
+                const long h = task % num_heads;
+                const float* sample = qkv + n * seq_len * qkv_stride;
+                forward_head(
+                    sample + h * d_k,
+                    sample + d_model + h / group_size * d_k,
+                    sample + d_model + kv_dim + h / group_size * d_k,
+                    out + n * seq_len * d_model + h * d_k,
+                    row_lse + (n * num_heads + h) * seq_len,
+                    seq_len);
+            });
+        }
+
+        template <typename SUBNET>
+        void backward(const tensor& computed_output, const tensor& gradient_input, SUBNET& sub, tensor& /*params_grad*/)
+        {
+            const tensor& in = sub.get_output();
+            tensor& grad = sub.get_gradient_input();
+            const long seq_len = in.nr();
+            const float* qkv = in.host();
+            const float* out = computed_output.host();
+            const float* dout = gradient_input.host();
+            const float* row_lse = lse.host();
+            float* dqkv = grad.host();
+            // each task owns one key/value head and the query heads of its group, so the
+            // columns they write never overlap
+            parallel_for(default_thread_pool(), 0, in.num_samples() * num_kv_heads, [&](long task)
+            {
+                const long n = task / num_kv_heads;
+                const long g = task % num_kv_heads;
+                const long kv_offset = n * seq_len * qkv_stride + d_model + g * d_k;
+                for (long h = g * group_size; h < (g + 1) * group_size; ++h)
+                {
+                    const long q_offset = n * seq_len * qkv_stride + h * d_k;
+                    backward_head(
+                        qkv + q_offset,
+                        qkv + kv_offset,
+                        qkv + kv_offset + kv_dim,
+                        out + n * seq_len * d_model + h * d_k,
+                        dout + n * seq_len * d_model + h * d_k,
+                        row_lse + (n * num_heads + h) * seq_len,
+                        dqkv + q_offset,
+                        dqkv + kv_offset,
+                        dqkv + kv_offset + kv_dim,
+                        seq_len);
+                }
+            });
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const causal_attention_& /*item*/, std::ostream& out)
+        {
+            serialize("causal_attention_", out);
+        }
+
+        friend void deserialize(causal_attention_& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "causal_attention_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::causal_attention_.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const causal_attention_& /*item*/)
+        {
+            out << "causal_attention\t (num_heads=" << num_heads << ", d_model=" << d_model << ", num_kv_heads=" << num_kv_heads << ")";
+            return out;
+        }
+
+        friend void to_xml(const causal_attention_& /*item*/, std::ostream& out)
+        {
+            out << "<causal_attention num_heads='" << num_heads << "' d_model='" << d_model << "' num_kv_heads='" << num_kv_heads << "'/>\n";
+        }
+
+        private:
+        // Q, K and V of one head start at q, k and v, one token every qkv_stride floats; the
+        // output rows are d_model floats apart.
+        static void forward_head(const float* q_head, const float* k_head, const float* v_head, float* out, float* row_lse, const long seq_len)
+        {
+            const float scale = 1.0f / std::sqrt(static_cast<float>(d_k));
+            thread_local std::vector<float> scores, acc, row_max, row_sum;
+            scores.resize(block_size * block_size);
+            acc.resize(block_size * d_k);
+            row_max.resize(block_size);
+            row_sum.resize(block_size);
+
+            for (long i0 = 0; i0 < seq_len; i0 += block_size)
+            {
+                const long rows = std::min(block_size, seq_len - i0);
+                std::fill(acc.begin(), acc.end(), 0.0f);
+                std::fill(row_max.begin(), row_max.end(), -std::numeric_limits<float>::infinity());
+                std::fill(row_sum.begin(), row_sum.end(), 0.0f);
+                // key blocks past the last query row of this block are entirely masked
+                for (long j0 = 0; j0 <= i0 + rows - 1; j0 += block_size)
+                {
+                    const long cols = std::min(block_size, seq_len - j0);
+                    for (long r = 0; r < rows; ++r)
+                    {
+                        const long i = i0 + r;
+                        const float* q = q_head + i * qkv_stride;
+                        const long last = std::min(cols, i - j0 + 1);
+                        if (last <= 0)
+                            continue;
+                        float* s = &scores[r * block_size];
+                        float block_max = -std::numeric_limits<float>::infinity();
+                        for (long c = 0; c < last; ++c)
+                        {
+                            const float* k = k_head + (j0 + c) * qkv_stride;
+                            float dot = 0;
+                            for (long e = 0; e < d_k; ++e)
+                                dot += q[e] * k[e];
+                            s[c] = dot * scale;
+                            block_max = std::max(block_max, s[c]);
+                        }
+                        // rescale what was accumulated so far to the new running maximum
+                        const float new_max = std::max(row_max[r], block_max);
+                        const float correction = std::exp(row_max[r] - new_max);
+                        row_max[r] = new_max;
+                        row_sum[r] *= correction;
+                        float* a = &acc[r * d_k];
+                        for (long e = 0; e < d_k; ++e)
+                            a[e] *= correction;
+                        for (long c = 0; c < last; ++c)
+                        {
+                            const float p = std::exp(s[c] - new_max);
+                            row_sum[r] += p;
+                            const float* v = v_head + (j0 + c) * qkv_stride;
+                            for (long e = 0; e < d_k; ++e)
+                                a[e] += p * v[e];
+                        }
+                    }
+                }
+                for (long r = 0; r < rows; ++r)
+                {
+                    const float inv = 1.0f / row_sum[r];
+                    float* o = out + (i0 + r) * d_model;
+                    for (long e = 0; e < d_k; ++e)
+                        o[e] = acc[r * d_k + e] * inv;
+                    row_lse[i0 + r] = row_max[r] + std::log(row_sum[r]);
+                }
+            }
+        }
+
+        static void backward_head(
+            const float* q_head,
+            const float* k_head,
+            const float* v_head,
+            const float* out,
+            const float* dout,
+            const float* row_lse,
+            float* dq_head,
+            float* dk_head,
+            float* dv_head,
+            const long seq_len)
+        {
+            const float scale = 1.0f / std::sqrt(static_cast<float>(d_k));
+            thread_local std::vector<float> delta;
+            // D_i = dO_i . O_i, the correction term of the softmax gradient
+            delta.resize(seq_len);
+            for (long i = 0; i < seq_len; ++i)
+            {
+                float d = 0;
+                for (long e = 0; e < d_k; ++e)
+                    d += dout[i * d_model + e] * out[i * d_model + e];
+                delta[i] = d;
+            }
+
+            // for each block of keys, visit the query rows that can see it
+            for (long j0 = 0; j0 < seq_len; j0 += block_size)
+            {
+                const long cols = std::min(block_size, seq_len - j0);
+                for (long i = j0; i < seq_len; ++i)
+                {
+                    const float* q = q_head + i * qkv_stride;
+                    const float* d_o = dout + i * d_model;
+                    float* dq = dq_head + i * qkv_stride;
+                    const long last = std::min(cols, i - j0 + 1);
+                    for (long c = 0; c < last; ++c)
+                    {
+                        const long j = j0 + c;
+                        const float* k = k_head + j * qkv_stride;
+                        const float* v = v_head + j * qkv_stride;
+                        float* dk = dk_head + j * qkv_stride;
+                        float* dv = dv_head + j * qkv_stride;
+                        float s = 0, dp = 0;
+                        for (long e = 0; e < d_k; ++e)
+                        {
+                            s += q[e] * k[e];
+                            dp += d_o[e] * v[e];
+                        }
+                        const float p = std::exp(s * scale - row_lse[i]);
+                        const float ds = p * (dp - delta[i]) * scale;
+                        for (long e = 0; e < d_k; ++e)
+                        {
+                            dv[e] += p * d_o[e];
+                            dq[e] += ds * k[e];
+                            dk[e] += ds * q[e];
+                        }
+                    }
+                }
+            }
+        }
+
+        resizable_tensor params;  // unused, the layer has no parameters
+        resizable_tensor lse;     // (N, num_heads, seq_len) log-sum-exp of each row of scores
+    };
+
+    template <long num_heads, long d_model, long num_kv_heads, typename SUBNET>
+    using causal_attention = add_layer<causal_attention_<num_heads, d_model, num_kv_heads>, SUBNET>;
+}
+
+#endif // CausalAttention_H
@@ -0,0 +1,308 @@
+#ifndef ContinuousBatching_H
+#define ContinuousBatching_H
+
+/**
+ * @file continuous_batching.h
+ * @brief Serving loop that decodes many sequences of different lengths together
+ *
+ * Batching whole padded sequences wastes the padding, and a batch lasts as long as its
+ * longest sequence, so short requests wait behind long ones.  Here the batch is rebuilt at
+ * every decoding step instead: the sequences in flight each contribute their next token, new
+ * requests take the slots of finished ones as soon as they are free, and their prompts are
+ * fed in pieces that fit in the token budget of the step.  All the tokens of a step are
+ * packed without padding and run by forward_batch(), where each sequence only attends to its
+ * own keys and values.
+ */
+
+#include "incremental_decoder.h"
+
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+
+namespace transformer
+{
+    struct continuous_batching_options
+    {
+        // sequences decoded together, each owns a key/value cache of max_seq_len tokens
+        size_t max_sequences = 16;
+        // new tokens per step, prompts are split to fit what generation leaves of it
+        long max_step_tokens = 256;
+        // requests beyond this are rejected instead of queued
+        size_t max_queue_size = 1024;
+        // generation stops after this token, -1 for none
+        int end_token = -1;
+    };
+
+    struct generation_result
+    {
+        std::vector<int> tokens;           // generated tokens, the prompt excluded
+        double time_to_first_token = 0;    // ms from submission to the first generated token
+        double latency = 0;                // ms from submission to the last generated token
+    };
+
+    struct continuous_batching_stats
+    {
+        size_t requests = 0;
+        size_t rejected = 0;
+        size_t completed = 0;
+        size_t steps = 0;
+        size_t prompt_tokens = 0;
+        size_t generated_tokens = 0;
+        running_stats<double> active_sequences;     // per step
+        running_stats<double> step_tokens;          // per step
+        running_stats<double> step_time;            // ms per step
+        running_stats<double> time_to_first_token;  // ms per request
+        running_stats<double> latency;              // ms per request
+
+        friend std::ostream& operator<<(std::ostream& out, const continuous_batching_stats& s)
+        {
+            const auto mean = [](const running_stats<double>& rs) { return rs.current_n() ? rs.mean() : 0.0; };
+            out << "requests: " << s.requests << " rejected: " << s.rejected << " completed: " << s.completed << '\n';
+            out << "steps: " << s.steps << " prompt tokens: " << s.prompt_tokens << " generated tokens: " << s.generated_tokens << '\n';
+            out << "per step: " << mean(s.active_sequences) << " sequences, " << mean(s.step_tokens) << " tokens, "
+                << mean(s.step_time) << " ms\n";
+            out << "time to first token: " << mean(s.time_to_first_token) << " ms, latency: " << mean(s.latency) << " ms\n";
+            return out;
+        }
+    };
+
+    /**
+     * @brief Generates tokens for requests submitted from any number of threads, with one
+     * worker thread running the batched decoding steps.
+     *
+     * Tokens are picked greedily.  A request ends after max_new_tokens tokens, after the end
+     * token, or when its sequence reaches max_seq_len.
+     *
+     * Usage:
+     *   const auto weights = extract_decoder_weights<vslm>(net);
+     *   continuous_batcher batcher(weights);
+     *   auto result = batcher.submit(prompt, 50);
+     *   const auto tokens = result.get().tokens;
+     */
+    class continuous_batcher
+    {
+        public:
+        explicit continuous_batcher(
+            const decoder_weights& weights,
+            const continuous_batching_options& options = continuous_batching_options())
+            : weights(weights), options(options)
+        {
+            DLIB_CASSERT(options.max_sequences > 0 && options.max_step_tokens >= static_cast<long>(options.max_sequences));
+            slots.resize(options.max_sequences);
+            for (auto& slot : slots)
+                slot.cache = kv_cache(weights);
+            worker = std::thread([this] { run(); });
+        }
+
+        continuous_batcher(const continuous_batcher&) = delete;
+        continuous_batcher& operator=(const continuous_batcher&) = delete;
+
+        // Finishes the requests already submitted before returning.
+        ~continuous_batcher()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            worker.join();
+        }
+
+        std::future<generation_result> submit(std::vector<int> prompt, const long max_new_tokens)
+        {
+            request req{std::move(prompt), max_new_tokens, {}, clock::now()};
+            auto result = req.promise.get_future();
+            const auto reject = [&](const char* reason)
+            {
+                ++stats.rejected;
+                req.promise.set_exception(std::make_exception_ptr(std::runtime_error(reason)));
+                return std::move(result);
+            };
+            std::lock_guard<std::mutex> lock(mutex);
+            ++stats.requests;
+            if (req.prompt.empty() || max_new_tokens <= 0)
+                return reject("continuous_batcher: empty prompt or nothing to generate");
+            if (static_cast<long>(req.prompt.size()) > weights.max_seq_len)
+                return reject("continuous_batcher: the prompt is longer than max_seq_len");
+            if (queue.size() >= options.max_queue_size || stopping)
+                return reject("continuous_batcher: the queue is full");
+            queue.push_back(std::move(req));
+            cv.notify_one();
+            return result;
+        }
+
+        continuous_batching_stats get_stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stats;
+        }
+
+        size_t queue_depth() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return queue.size();
+        }
+
+        private:
+        using clock = std::chrono::steady_clock;
+        using fms = std::chrono::duration<double, std::milli>;
+
+        struct request
+        {
+            std::vector<int> prompt;
+            long max_new_tokens = 0;
+            std::promise<generation_result> promise;
+            clock::time_point submitted;
+        };
+
+        struct sequence
+        {
+            bool active = false;
+            request req;
+            kv_cache cache;
+            long prompt_fed = 0;
+            generation_result result;
+            std::vector<float> logits;
+        };
+
+        static int argmax(const std::vector<float>& logits)
+        {
+            return std::max_element(logits.begin(), logits.end()) - logits.begin();
+        }
+
+        double since(const sequence& seq) const
+        {
+            return std::chrono::duration_cast<fms>(clock::now() - seq.req.submitted).count();
+        }
+
+        void run()
+        {
+            std::vector<decode_chunk> chunks;
+            std::vector<sequence*> batch;
+            std::vector<bool> has_logits;
+            size_t active = 0;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return stopping || !queue.empty() || active > 0; });
+                    if (queue.empty() && active == 0)
+                        return;
+                    // new requests take the free slots between two steps
+                    for (auto& slot : slots)
+                    {
+                        if (queue.empty())
+                            break;
+                        if (slot.active)
+                            continue;
+                        slot.req = std::move(queue.front());
+                        queue.pop_front();
+                        slot.active = true;
+                        slot.cache.clear();
+                        slot.prompt_fed = 0;
+                        slot.result = generation_result();
+                        ++active;
+                    }
+                }
+
+                // generating sequences first, one token each, then pieces of prompts in the
+                // rest of the token budget
+                chunks.clear();
+                batch.clear();
+                has_logits.clear();
+                long budget = options.max_step_tokens;
+                for (auto& slot : slots)
+                {
+                    if (slot.active && slot.prompt_fed == static_cast<long>(slot.req.prompt.size()))
+                    {
+                        chunks.push_back(decode_chunk{&slot.cache, &slot.result.tokens.back(), 1, &slot.logits});
+                        batch.push_back(&slot);
+                        --budget;
+                    }
+                }
+                size_t prompt_tokens = 0;
+                for (auto& slot : slots)
+                {
+                    const long remaining = slot.req.prompt.size() - slot.prompt_fed;
+                    if (!slot.active || remaining == 0 || budget == 0)
+                        continue;
+                    const long n = std::min(remaining, budget);
+                    const bool last_piece = n == remaining;
+                    chunks.push_back(decode_chunk{&slot.cache, slot.req.prompt.data() + slot.prompt_fed, n, last_piece ? &slot.logits : nullptr});
+                    batch.push_back(&slot);
+                    slot.prompt_fed += n;
+                    prompt_tokens += n;
+                    budget -= n;
+                }
+
+                const auto t0 = clock::now();
+                try
+                {
+                    forward_batch(weights, chunks);
+                }
+                catch (...)
+                {
+                    // a failed step fails the requests that were in it
+                    std::lock_guard<std::mutex> lock(mutex);
+                    for (auto* seq : batch)
+                    {
+                        seq->req.promise.set_exception(std::current_exception());
+                        seq->active = false;
+                        --active;
+                    }
+                    continue;
+                }
+                const auto t1 = clock::now();
+
+                size_t generated = 0;
+                std::lock_guard<std::mutex> lock(mutex);
+                for (size_t i = 0; i < batch.size(); ++i)
+                {
+                    sequence& seq = *batch[i];
+                    if (chunks[i].logits == nullptr)
+                        continue;
+                    const int token = argmax(seq.logits);
+                    seq.result.tokens.push_back(token);
+                    ++generated;
+                    if (seq.result.tokens.size() == 1)
+                    {
+                        seq.result.time_to_first_token = since(seq);
+                        stats.time_to_first_token.add(seq.result.time_to_first_token);
+                    }
+                    if (static_cast<long>(seq.result.tokens.size()) == seq.req.max_new_tokens ||
+                        token == options.end_token ||
+                        seq.cache.size() == seq.cache.capacity())
+                    {
+                        seq.result.latency = since(seq);
+                        stats.latency.add(seq.result.latency);
+                        ++stats.completed;
+                        seq.req.promise.set_value(std::move(seq.result));
+                        seq.active = false;
+                        --active;
+                    }
+                }
+                ++stats.steps;
+                stats.prompt_tokens += prompt_tokens;
+                stats.generated_tokens += generated;
+                stats.active_sequences.add(batch.size());
+                stats.step_tokens.add(options.max_step_tokens - budget);
+                stats.step_time.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            }
+        }
+
+        const decoder_weights& weights;
+        continuous_batching_options options;
+        std::vector<sequence> slots;
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        std::deque<request> queue;
+        bool stopping = false;
+        continuous_batching_stats stats;
+        std::thread worker;
+    };
+}
+
+#endif // ContinuousBatching_H
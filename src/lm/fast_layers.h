@@ -0,0 +1,266 @@
+#ifndef FastLayers_H
+#define FastLayers_H
+
+/**
+ * @file fast_layers.h
+ * @brief rms_norm, softmaxm and gelu layers running on the vectorized kernels
+ *
+ * Each transformer block goes through two rms_norm, a GELU over the 4 * d_model hidden
+ * features and, without the fused attention, a softmax over every row of scores.  These
+ * layers compute them on the CPU with the kernels of kernels.h, which pick AVX2 or AVX-512
+ * at runtime.  When dlib is built with CUDA the tensors live on the GPU, where the kernels
+ * do not apply, and the layers call the tt:: functions instead.
+ *
+ * fast_gelu and fast_softmaxm compute the same functions as gelu and softmaxm and serialize
+ * the same way, so a network saved with one loads in place of the other.  fast_gelu is
+ * opt-in, through the activation_func of transformer_config.
+ *
+ * fast_rms_norm is not a replacement for rms_norm: it normalizes each row of nc values on
+ * its own, one token of a (N, 1, seq_len, d_model) tensor, with one gamma per feature, while
+ * rms_norm normalizes whole samples.  The blocks need the per-token normalization to stay
+ * causal, and it is the one the incremental decoder applies; it keeps its own tag.
+ */
+
+#include "kernels.h"
+
+#include <dlib/dnn.h>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    /**
+     * @brief out = x / sqrt(mean(x^2) + eps) * gamma over each row of nc values.
+     */
+    class fast_rms_norm_
+    {
+        public:
+        explicit fast_rms_norm_(const float eps = 1e-5f) : eps(eps) {}
+
+        float get_eps() const { return eps; }
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            params.set_size(1, 1, 1, sub.get_output().nc());
+            params = 1;
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.nc() == params.nc(), "fast_rms_norm was set up for rows of " << params.nc() << " values, got " << in.nc());
+            const long rows = in.size() / in.nc();
+            output.copy_size(in);
+#ifdef DLIB_USE_CUDA
+            // one sample of nc channels per row is a per-token normalization for rms_normalize
+            tt::rms_normalize(eps, rows_output, inv_rms, alias_tensor(rows, in.nc())(in), alias_tensor(1, in.nc())(params));
+            memcpy(output, rows_output);
+#else
+            inv_rms.set_size(rows);
+            kernels::rms_norm_forward(in.host(), params.host(), rows, in.nc(), eps, output.host_write_only(), inv_rms.host_write_only());
+#endif
+        }
+
+        template <typename SUBNET> void backward(const tensor& gradient_input, SUBNET& sub, tensor& params_grad)
+        {
+            const tensor& in = sub.get_output();
+            const long rows = in.size() / in.nc();
+#ifdef DLIB_USE_CUDA
+            auto gamma_grad = alias_tensor(1, in.nc())(params_grad);
+            auto in_grad = alias_tensor(rows, in.nc())(sub.get_gradient_input());
+            tt::rms_normalize_gradient(
+                alias_tensor(rows, in.nc())(gradient_input), inv_rms, alias_tensor(rows, in.nc())(in), alias_tensor(1, in.nc())(params),
+                in_grad, gamma_grad, dscale);
+#else
+            params_grad = 0;
+            kernels::rms_norm_backward(
+                in.host(), params.host(), inv_rms.host(), gradient_input.host(), rows, in.nc(),
+                sub.get_gradient_input().host(), params_grad.host(), true);
+#endif
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const fast_rms_norm_& item, std::ostream& out)
+        {
+            serialize("fast_rms_norm_", out);
+            serialize(item.params, out);
+            serialize(item.eps, out);
+        }
+
+        friend void deserialize(fast_rms_norm_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "fast_rms_norm_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::fast_rms_norm_.");
+            deserialize(item.params, in);
+            deserialize(item.eps, in);
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const fast_rms_norm_& item)
+        {
+            out << "fast_rms_norm\t (eps=" << item.eps << ")";
+            return out;
+        }
+
+        friend void to_xml(const fast_rms_norm_& item, std::ostream& out)
+        {
+            out << "<fast_rms_norm eps='" << item.eps << "'>\n";
+            out << mat(item.params);
+            out << "</fast_rms_norm>\n";
+        }
+
+        private:
+        resizable_tensor params;   // gamma, one per feature
+        resizable_tensor inv_rms;  // 1 / rms of each row, for the backward pass
+#ifdef DLIB_USE_CUDA
+        resizable_tensor rows_output, dscale;
+#endif
+        float eps;
+    };
+
+    template <typename SUBNET>
+    using fast_rms_norm = add_layer<fast_rms_norm_, SUBNET>;
+
+    /**
+     * @brief Softmax over each row of nc values, like softmaxm.
+     */
+    class fast_softmaxm_
+    {
+        public:
+        fast_softmaxm_() = default;
+
+        template <typename SUBNET> void setup(const SUBNET& /*sub*/) {}
+
+        void forward_inplace(const tensor& input, tensor& output)
+        {
+#ifdef DLIB_USE_CUDA
+            tt::softmax(output, input, operation_mode::PLANE_WISE);
+#else
+            kernels::softmax_forward(input.host(), input.size() / input.nc(), input.nc(), output.host());
+#endif
+        }
+
+        void backward_inplace(const tensor& computed_output, const tensor& gradient_input, tensor& data_grad, tensor& /*params_grad*/)
+        {
+            // the gradient replaces gradient_input when it is computed in place
+#ifdef DLIB_USE_CUDA
+            tt::softmax_gradient(data_grad, computed_output, gradient_input, operation_mode::PLANE_WISE);
+#else
+            kernels::softmax_backward(
+                computed_output.host(), gradient_input.host(), computed_output.size() / computed_output.nc(), computed_output.nc(),
+                data_grad.host(), !is_same_object(data_grad, gradient_input));
+#endif
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        // same format as softmaxm_, the files written under the old tag still load
+        friend void serialize(const fast_softmaxm_& /*item*/, std::ostream& out)
+        {
+            serialize("softmaxm_", out);
+        }
+
+        friend void deserialize(fast_softmaxm_& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "softmaxm_" && version != "fast_softmaxm_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::fast_softmaxm_.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const fast_softmaxm_& /*item*/)
+        {
+            out << "fast_softmaxm";
+            return out;
+        }
+
+        friend void to_xml(const fast_softmaxm_& /*item*/, std::ostream& out)
+        {
+            out << "<fast_softmaxm/>\n";
+        }
+
+        private:
+        resizable_tensor params;
+    };
+
+    template <typename SUBNET>
+    using fast_softmaxm = add_layer<fast_softmaxm_, SUBNET>;
+
+    /**
+     * @brief GELU, with erf like gelu, or with the tanh approximation of GPT-2.
+     */
+    template <kernels::gelu_approximation approx>
+    class fast_gelu_
+    {
+        public:
+        fast_gelu_() = default;
+
+        template <typename SUBNET> void setup(const SUBNET& /*sub*/) {}
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& in = sub.get_output();
+            output.copy_size(in);
+#ifdef DLIB_USE_CUDA
+            static_assert(approx == kernels::gelu_approximation::exact, "fast_gelu_tanh has no CUDA implementation, use fast_gelu");
+            tt::gelu(output, in);
+#else
+            kernels::gelu_forward(in.host(), in.size(), output.host_write_only(), approx);
+#endif
+        }
+
+        template <typename SUBNET> void backward(const tensor& gradient_input, SUBNET& sub, tensor& /*params_grad*/)
+        {
+            const tensor& in = sub.get_output();
+#ifdef DLIB_USE_CUDA
+            tt::gelu_gradient(sub.get_gradient_input(), in, gradient_input);
+#else
+            kernels::gelu_backward(in.host(), gradient_input.host(), in.size(), sub.get_gradient_input().host(), approx, true);
+#endif
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        // the exact GELU has the format of gelu_, the files written under the old tag still load
+        friend void serialize(const fast_gelu_& /*item*/, std::ostream& out)
+        {
+            serialize(approx == kernels::gelu_approximation::exact ? "gelu_" : "fast_gelu_tanh_", out);
+        }
+
+        friend void deserialize(fast_gelu_& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            const bool known = approx == kernels::gelu_approximation::exact ? version == "gelu_" || version == "fast_gelu_" : version == "fast_gelu_tanh_";
+            if (!known)
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::fast_gelu_.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const fast_gelu_& /*item*/)
+        {
+            out << (approx == kernels::gelu_approximation::exact ? "fast_gelu" : "fast_gelu_tanh");
+            return out;
+        }
+
+        friend void to_xml(const fast_gelu_& /*item*/, std::ostream& out)
+        {
+            out << (approx == kernels::gelu_approximation::exact ? "<fast_gelu/>\n" : "<fast_gelu_tanh/>\n");
+        }
+
+        private:
+        resizable_tensor params;
+    };
+
+    template <typename SUBNET>
+    using fast_gelu = add_layer<fast_gelu_<kernels::gelu_approximation::exact>, SUBNET>;
+
+    template <typename SUBNET>
+    using fast_gelu_tanh = add_layer<fast_gelu_<kernels::gelu_approximation::tanh>, SUBNET>;
+}
+
+#endif // FastLayers_H
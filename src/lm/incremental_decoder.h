@@ -0,0 +1,1119 @@
+#ifndef IncrementalDecoder_H
+#define IncrementalDecoder_H
+
+/**
+ * @file incremental_decoder.h
+ * @brief Autoregressive decoding with a per-layer key/value cache
+ *
+ * Running network_type<false> once per generated token recomputes the Q, K and V
+ * projections and the attention of every previous token.  With causal attention the
+ * keys and values of a token never change once it has been seen, so this engine keeps
+ * them in a cache and only runs the new token through the projections, the attention
+ * over the cached keys/values and the feed-forward network.
+ *
+ * The weights are read out of a trained network with visit_layers().  The projections and
+ * the feed-forward layers of the blocks are token_fc layers, applied to each position
+ * separately, and the classification head only reads the last token of the window, so once
+ * the decoder has seen the max_seq_len tokens of a window its logits are the ones of
+ * network_type<false> on that window.  A network whose layers do not have these shapes is
+ * rejected with an exception.
+ */
+
+#include "../checkpoint.h"
+#include "fast_layers.h"
+#include "mixture_of_experts.h"
+#include "quantization.h"
+#include "softmax_heads.h"
+#include "sparse_embeddings.h"
+#include "token_fc.h"
+
+#include <dlib/dnn.h>
+
+#include <cmath>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    enum class ffn_activation
+    {
+        gelu,
+        relu,
+        silu,
+        mish,
+        gelu_tanh
+    };
+
+    inline float activate(const ffn_activation act, const float x)
+    {
+        switch (act)
+        {
+        case ffn_activation::gelu:
+            return 0.5f * x * (1.0f + std::erf(x / std::sqrt(2.0f)));
+        case ffn_activation::relu:
+            return std::max(0.0f, x);
+        case ffn_activation::silu:
+            return x / (1.0f + std::exp(-x));
+        case ffn_activation::mish:
+            return x * std::tanh(std::log1p(std::exp(x)));
+        case ffn_activation::gelu_tanh:
+            return kernels::scalar::gelu(x, kernels::gelu_approximation::tanh);
+        }
+        return x;
+    }
+
+    // A fully connected layer applied to each token: out = in * weights + biases.
+    struct dense_weights
+    {
+        resizable_tensor weights;    // (num_inputs, num_outputs), empty once quantized
+        resizable_tensor biases;     // (1, num_outputs), empty without bias
+        quantized_matrix quantized;  // replaces weights after decoder_weights::quantize()
+        bool activation_after = false;
+
+        long num_inputs() const { return quantized.empty() ? weights.num_samples() : quantized.num_inputs(); }
+        long num_outputs() const { return quantized.empty() ? weights.k() : quantized.num_outputs(); }
+
+        void quantize(const weight_format format, const long group_size)
+        {
+            // also nothing to do for the unused ffn_in and ffn_out of a mixture-of-experts block;
+            // int4 packs blocks of 32 inputs, narrower layers (such as those of the squeezing
+            // head) stay in float
+            if (format == weight_format::f32 || !quantized.empty() || weights.size() == 0 ||
+                (format == weight_format::int4 && num_inputs() % 32 != 0))
+                return;
+            quantized = quantized_matrix(weights, format, group_size);
+            weights = resizable_tensor();
+        }
+
+        friend void serialize(const dense_weights& item, std::ostream& out)
+        {
+            serialize("dense_weights", out);
+            serialize(item.weights, out);
+            serialize(item.biases, out);
+            serialize(item.quantized, out);
+            serialize(item.activation_after, out);
+        }
+
+        friend void deserialize(dense_weights& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "dense_weights")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dense_weights.");
+            deserialize(item.weights, in);
+            deserialize(item.biases, in);
+            deserialize(item.quantized, in);
+            deserialize(item.activation_after, in);
+        }
+    };
+
+    // The experts of a moe_feed_forward layer and their router.
+    struct moe_weights
+    {
+        dense_weights router;                   // d_model -> num_experts, no bias
+        std::vector<dense_weights> experts_in;  // d_model -> d_hidden, then the GELU
+        std::vector<dense_weights> experts_out; // d_hidden -> d_model
+        long top_k = 0;
+
+        bool empty() const { return experts_in.empty(); }
+        long num_experts() const { return experts_in.size(); }
+
+        void quantize(const weight_format format, const long group_size)
+        {
+            // the router is small and its choices sensitive, it stays in float
+            for (auto& dense : experts_in)
+                dense.quantize(format, group_size);
+            for (auto& dense : experts_out)
+                dense.quantize(format, group_size);
+        }
+
+        friend void serialize(const moe_weights& item, std::ostream& out)
+        {
+            serialize("moe_weights", out);
+            serialize(item.router, out);
+            serialize(item.experts_in, out);
+            serialize(item.experts_out, out);
+            serialize(item.top_k, out);
+        }
+
+        friend void deserialize(moe_weights& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "moe_weights")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing moe_weights.");
+            deserialize(item.router, in);
+            deserialize(item.experts_in, in);
+            deserialize(item.experts_out, in);
+            deserialize(item.top_k, in);
+        }
+    };
+
+    struct block_weights
+    {
+        resizable_tensor attention_norm;  // (1, d_model) rms_norm gamma
+        dense_weights qkv;                // d_model -> d_model + 2 * kv_dim, no bias
+        resizable_tensor ffn_norm;
+        dense_weights ffn_in;             // d_model -> 4 * d_model
+        dense_weights ffn_out;            // 4 * d_model -> d_model
+        moe_weights moe;                  // replaces ffn_in and ffn_out in a mixture-of-experts block
+        // the multiply layers that replace dropout in the inference network
+        float attention_dropout = 1;      // on the attention weights
+        float attention_output = 1;       // on the attention output, before the residual
+        float ffn_output = 1;             // on the feed-forward output, before the residual
+
+        friend void serialize(const block_weights& item, std::ostream& out)
+        {
+            serialize("block_weights2", out);
+            serialize(item.attention_norm, out);
+            serialize(item.qkv, out);
+            serialize(item.ffn_norm, out);
+            serialize(item.ffn_in, out);
+            serialize(item.ffn_out, out);
+            serialize(item.attention_dropout, out);
+            serialize(item.attention_output, out);
+            serialize(item.ffn_output, out);
+            serialize(item.moe, out);
+        }
+
+        friend void deserialize(block_weights& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "block_weights" && version != "block_weights2")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing block_weights.");
+            deserialize(item.attention_norm, in);
+            deserialize(item.qkv, in);
+            deserialize(item.ffn_norm, in);
+            deserialize(item.ffn_in, in);
+            deserialize(item.ffn_out, in);
+            deserialize(item.attention_dropout, in);
+            deserialize(item.attention_output, in);
+            deserialize(item.ffn_output, in);
+            // block_weights has no experts
+            item.moe = moe_weights();
+            if (version == "block_weights2")
+                deserialize(item.moe, in);
+        }
+    };
+
+    /**
+     * @brief Everything the incremental decoder needs from a network, shared by all the
+     * sequences being decoded.
+     */
+    struct decoder_weights
+    {
+        long vocab_size = 0;
+        long num_heads = 0;
+        long num_kv_heads = 0;
+        long d_model = 0;
+        long max_seq_len = 0;
+        float norm_eps = 1e-5f;
+        ffn_activation activation = ffn_activation::gelu;
+        resizable_tensor embeddings;  // (vocab_size, d_model)
+        resizable_tensor positional;  // (max_seq_len, d_model)
+        std::vector<block_weights> blocks;
+        resizable_tensor final_norm;
+        std::vector<dense_weights> head;
+
+        long num_layers() const { return blocks.size(); }
+        long head_dim() const { return d_model / num_heads; }
+        // width of the keys (and of the values) of one token, all key/value heads together
+        long kv_dim() const { return num_kv_heads * head_dim(); }
+
+        // Same sinusoidal encodings as positional_encodings_.
+        void init_positional()
+        {
+            positional.set_size(max_seq_len, d_model);
+            float* pe = positional.host();
+            for (long r = 0; r < max_seq_len; ++r)
+            {
+                for (long c = 0; c < d_model; ++c)
+                {
+                    const float theta = r / std::pow(10000.0f, static_cast<float>(c) / d_model);
+                    pe[r * d_model + c] = (c % 2 == 0) ? std::sin(theta) : std::cos(theta);
+                }
+            }
+        }
+
+        /**
+         * @brief Replaces the weights of the fc layers of the blocks, and of the
+         * classification head unless include_head is false, by group-wise int8 or int4
+         * weights (see quantization.h).  The embeddings and the norms stay in float.
+         *
+         * Usage:
+         *   auto weights = extract_decoder_weights<vslm>(net);
+         *   weights.quantize(weight_format::int4);
+         *   serialize("vslm_int4.dat") << weights;
+         */
+        void quantize(const weight_format format, const long group_size = 64, const bool include_head = true)
+        {
+            for (auto& b : blocks)
+            {
+                b.qkv.quantize(format, group_size);
+                b.ffn_in.quantize(format, group_size);
+                b.ffn_out.quantize(format, group_size);
+                b.moe.quantize(format, group_size);
+            }
+            if (include_head)
+            {
+                for (auto& dense : head)
+                    dense.quantize(format, group_size);
+            }
+        }
+
+        friend void serialize(const decoder_weights& item, std::ostream& out)
+        {
+            serialize("decoder_weights", out);
+            serialize(item.vocab_size, out);
+            serialize(item.num_heads, out);
+            serialize(item.num_kv_heads, out);
+            serialize(item.d_model, out);
+            serialize(item.max_seq_len, out);
+            serialize(item.norm_eps, out);
+            serialize(static_cast<int>(item.activation), out);
+            serialize(item.embeddings, out);
+            serialize(item.blocks, out);
+            serialize(item.final_norm, out);
+            serialize(item.head, out);
+        }
+
+        // The positional encodings are not stored, they are computed again.
+        friend void deserialize(decoder_weights& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "decoder_weights")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing decoder_weights.");
+            deserialize(item.vocab_size, in);
+            deserialize(item.num_heads, in);
+            deserialize(item.num_kv_heads, in);
+            deserialize(item.d_model, in);
+            deserialize(item.max_seq_len, in);
+            deserialize(item.norm_eps, in);
+            int activation = 0;
+            deserialize(activation, in);
+            item.activation = static_cast<ffn_activation>(activation);
+            deserialize(item.embeddings, in);
+            deserialize(item.blocks, in);
+            deserialize(item.final_norm, in);
+            deserialize(item.head, in);
+            item.init_positional();
+        }
+
+        /**
+         * @brief Random weights with the shapes of a transformer_config, to measure the
+         * decoding speed without a trained network.  With num_experts > 0 the blocks have
+         * a mixture of num_experts feed-forward experts, experts_per_token per token.
+         */
+        static decoder_weights random(
+            const long vocab_size,
+            const long num_layers,
+            const long num_heads,
+            const long d_model,
+            const long max_seq_len,
+            const long num_kv_heads = 0,
+            const unsigned long long seed = 0,
+            const long num_experts = 0,
+            const long experts_per_token = 2)
+        {
+            DLIB_CASSERT(d_model % num_heads == 0);
+            DLIB_CASSERT(num_kv_heads >= 0 && (num_kv_heads == 0 || num_heads % num_kv_heads == 0));
+            tt::tensor_rand rnd(seed);
+            decoder_weights w;
+            w.vocab_size = vocab_size;
+            w.num_heads = num_heads;
+            w.num_kv_heads = num_kv_heads == 0 ? num_heads : num_kv_heads;
+            w.d_model = d_model;
+            w.max_seq_len = max_seq_len;
+            const auto init_dense = [&](dense_weights& dense, const long n_in, const long n_out, const bool bias)
+            {
+                dense.weights.set_size(n_in, n_out);
+                rnd.fill_gaussian(dense.weights, 0, 1 / std::sqrt(static_cast<float>(n_in)));
+                if (bias)
+                {
+                    dense.biases.set_size(1, n_out);
+                    dense.biases = 0;
+                }
+            };
+            const auto init_norm = [&](resizable_tensor& gamma)
+            {
+                gamma.set_size(1, d_model);
+                gamma = 1;
+            };
+            w.embeddings.set_size(vocab_size, d_model);
+            rnd.fill_gaussian(w.embeddings);
+            w.init_positional();
+            w.blocks.resize(num_layers);
+            for (auto& b : w.blocks)
+            {
+                init_norm(b.attention_norm);
+                init_dense(b.qkv, d_model, d_model + 2 * w.kv_dim(), false);
+                init_norm(b.ffn_norm);
+                if (num_experts == 0)
+                {
+                    init_dense(b.ffn_in, d_model, 4 * d_model, true);
+                    init_dense(b.ffn_out, 4 * d_model, d_model, true);
+                    continue;
+                }
+                init_dense(b.moe.router, d_model, num_experts, false);
+                b.moe.experts_in.resize(num_experts);
+                b.moe.experts_out.resize(num_experts);
+                for (long e = 0; e < num_experts; ++e)
+                {
+                    init_dense(b.moe.experts_in[e], d_model, 4 * d_model, true);
+                    b.moe.experts_in[e].activation_after = true;
+                    init_dense(b.moe.experts_out[e], 4 * d_model, d_model, true);
+                }
+                b.moe.top_k = experts_per_token;
+            }
+            init_norm(w.final_norm);
+            w.head.resize(1);
+            init_dense(w.head[0], d_model, vocab_size, true);
+            return w;
+        }
+    };
+
+    namespace impl
+    {
+        // One parameterized layer of the network, in the order of visit_layers().
+        struct layer_record
+        {
+            enum kind_type
+            {
+                embeddings,
+                norm,
+                dense,
+                scale,
+                activation,
+                experts
+            } kind;
+            resizable_tensor params;
+            resizable_tensor biases;
+            long num_inputs = 0;
+            long num_outputs = 0;
+            float value = 0;
+            ffn_activation act = ffn_activation::gelu;
+            moe_weights moe;
+        };
+
+        class visitor_collect_decoder_layers
+        {
+            public:
+            visitor_collect_decoder_layers(std::vector<layer_record>& records) : records(records) {}
+
+            // ignore other layers
+            template <typename T> void operator()(size_t, T&) {}
+
+            // the layers of a checkpointed block, in place of the block
+            template <template <typename> class BLOCK, typename SUBNET>
+            void operator()(size_t, const add_layer<checkpointing::checkpoint_<BLOCK>, SUBNET>& l)
+            {
+                visit_layers(l.layer_details().get_block(), *this);
+            }
+
+            // the layers of the head
+            template <unsigned long num_outputs, fc_bias_mode bias_mode, typename SUBNET>
+            void operator()(size_t, const add_layer<fc_<num_outputs, bias_mode>, SUBNET>& l)
+            {
+                add_dense(l.layer_details(), bias_mode == FC_HAS_BIAS);
+            }
+
+            // the projections and feed-forward layers of the blocks
+            template <unsigned long num_outputs, fc_bias_mode bias_mode, typename SUBNET>
+            void operator()(size_t, const add_layer<token_fc_<num_outputs, bias_mode>, SUBNET>& l)
+            {
+                add_dense(l.layer_details(), bias_mode == FC_HAS_BIAS);
+            }
+
+            // the fc<vocab_size> it was trained in place of
+            template <long vocab_size, long num_sampled, typename SUBNET>
+            void operator()(size_t, const add_layer<sampled_softmax_<vocab_size, num_sampled>, SUBNET>& l)
+            {
+                layer_record r;
+                r.kind = layer_record::dense;
+                const auto& head = l.layer_details();
+                r.num_inputs = head.get_num_inputs();
+                r.num_outputs = vocab_size;
+                r.params.set_size(r.num_inputs, r.num_outputs);
+                std::copy(head.get_weights().host(), head.get_weights().host() + r.params.size(), r.params.host());
+                r.biases.set_size(1, r.num_outputs);
+                std::copy(head.get_biases().host(), head.get_biases().host() + r.biases.size(), r.biases.host());
+                records.push_back(std::move(r));
+            }
+
+            template <long vocab_size, long head_size, typename SUBNET>
+            void operator()(size_t, const add_layer<adaptive_softmax_<vocab_size, head_size>, SUBNET>&)
+            {
+                throw std::runtime_error("incremental_decoder: adaptive_softmax heads are not supported, the head must end with fc<vocab_size>");
+            }
+
+            template <typename SUBNET> void operator()(size_t, const add_layer<rms_norm_, SUBNET>& l)
+            {
+                layer_record r;
+                r.kind = layer_record::norm;
+                r.params = l.layer_details().get_layer_params();
+                r.value = l.layer_details().get_eps();
+                records.push_back(std::move(r));
+            }
+
+            template <typename SUBNET> void operator()(size_t, const add_layer<fast_rms_norm_, SUBNET>& l)
+            {
+                layer_record r;
+                r.kind = layer_record::norm;
+                r.params = l.layer_details().get_layer_params();
+                r.value = l.layer_details().get_eps();
+                records.push_back(std::move(r));
+            }
+
+            template <unsigned long num_embeddings, unsigned long embedding_length, typename SUBNET>
+            void operator()(size_t, const add_layer<embeddings_<num_embeddings, embedding_length>, SUBNET>& l)
+            {
+                layer_record r;
+                r.kind = layer_record::embeddings;
+                r.params = l.layer_details().get_embeddings();
+                r.num_inputs = num_embeddings;
+                r.num_outputs = embedding_length;
+                records.push_back(std::move(r));
+            }
+
+            template <long num_embeddings, long embedding_length, typename SUBNET>
+            void operator()(size_t, const add_layer<sparse_embeddings_<num_embeddings, embedding_length>, SUBNET>& l)
+            {
+                layer_record r;
+                r.kind = layer_record::embeddings;
+                r.params = l.layer_details().get_embeddings();
+                r.num_inputs = num_embeddings;
+                r.num_outputs = embedding_length;
+                records.push_back(std::move(r));
+            }
+
+            template <long num_experts, long top_k, long d_model, long d_hidden, typename SUBNET>
+            void operator()(size_t, const add_layer<moe_feed_forward_<num_experts, top_k, d_model, d_hidden>, SUBNET>& l)
+            {
+                const auto copy = [](const tensor& t, const long n_in, const long n_out, resizable_tensor& out)
+                {
+                    out.set_size(n_in, n_out);
+                    std::copy(t.host(), t.host() + out.size(), out.host());
+                };
+                const auto& moe = l.layer_details();
+                layer_record r;
+                r.kind = layer_record::experts;
+                copy(moe.get_router_weights(), d_model, num_experts, r.moe.router.weights);
+                r.moe.experts_in.resize(num_experts);
+                r.moe.experts_out.resize(num_experts);
+                for (long e = 0; e < num_experts; ++e)
+                {
+                    copy(moe.get_expert_in_weights(e), d_model, d_hidden, r.moe.experts_in[e].weights);
+                    copy(moe.get_expert_in_biases(e), 1, d_hidden, r.moe.experts_in[e].biases);
+                    r.moe.experts_in[e].activation_after = true;
+                    copy(moe.get_expert_out_weights(e), d_hidden, d_model, r.moe.experts_out[e].weights);
+                    copy(moe.get_expert_out_biases(e), 1, d_model, r.moe.experts_out[e].biases);
+                }
+                r.moe.top_k = top_k;
+                records.push_back(std::move(r));
+            }
+
+            template <typename SUBNET> void operator()(size_t, const add_layer<multiply_, SUBNET>& l)
+            {
+                layer_record r;
+                r.kind = layer_record::scale;
+                r.value = l.layer_details().get_multiply_value();
+                records.push_back(std::move(r));
+            }
+
+            template <typename SUBNET> void operator()(size_t, const add_layer<gelu_, SUBNET>&) { add_activation(ffn_activation::gelu); }
+            template <typename SUBNET> void operator()(size_t, const add_layer<relu_, SUBNET>&) { add_activation(ffn_activation::relu); }
+            template <typename SUBNET> void operator()(size_t, const add_layer<silu_, SUBNET>&) { add_activation(ffn_activation::silu); }
+            template <typename SUBNET> void operator()(size_t, const add_layer<mish_, SUBNET>&) { add_activation(ffn_activation::mish); }
+            template <typename SUBNET> void operator()(size_t, const fast_gelu<SUBNET>&) { add_activation(ffn_activation::gelu); }
+            template <typename SUBNET> void operator()(size_t, const fast_gelu_tanh<SUBNET>&) { add_activation(ffn_activation::gelu_tanh); }
+
+            private:
+            // fc_ and token_fc_ have the same parameter layout
+            template <typename FC> void add_dense(const FC& fc, const bool has_bias)
+            {
+                layer_record r;
+                r.kind = layer_record::dense;
+                r.num_inputs = fc.get_num_inputs();
+                r.num_outputs = fc.get_num_outputs();
+                r.params.set_size(r.num_inputs, r.num_outputs);
+                std::copy(fc.get_layer_params().host(), fc.get_layer_params().host() + r.params.size(), r.params.host());
+                if (has_bias)
+                {
+                    r.biases.set_size(1, r.num_outputs);
+                    std::copy(fc.get_layer_params().host() + r.params.size(), fc.get_layer_params().host() + r.params.size() + r.biases.size(), r.biases.host());
+                }
+                records.push_back(std::move(r));
+            }
+
+            void add_activation(const ffn_activation act)
+            {
+                layer_record r;
+                r.kind = layer_record::activation;
+                r.act = act;
+                records.push_back(std::move(r));
+            }
+
+            std::vector<layer_record>& records;
+        };
+
+        // Reads layer records from the input towards the loss.
+        class record_reader
+        {
+            public:
+            record_reader(std::vector<layer_record>& records) : records(records) {}
+
+            bool done() const { return pos == records.size(); }
+
+            layer_record& next(const layer_record::kind_type kind, const char* what)
+            {
+                if (done() || records[pos].kind != kind)
+                    throw std::runtime_error(std::string("incremental_decoder: expected ") + what);
+                return records[pos++];
+            }
+
+            bool peek(const layer_record::kind_type kind) const { return !done() && records[pos].kind == kind; }
+
+            private:
+            std::vector<layer_record>& records;
+            size_t pos = 0;
+        };
+
+        inline void read_norm(record_reader& reader, const long d_model, resizable_tensor& gamma, float& eps)
+        {
+            auto& r = reader.next(layer_record::norm, "an rms_norm layer");
+            gamma.set_size(1, d_model);
+            if (r.params.size() == static_cast<size_t>(d_model))
+                std::copy(r.params.host(), r.params.host() + d_model, gamma.host());
+            else if (r.params.size() == 1)
+                gamma = r.params.host()[0];
+            else
+                throw std::runtime_error("incremental_decoder: rms_norm gamma must have one value per feature");
+            eps = r.value;
+        }
+
+        inline void read_dense(record_reader& reader, const long num_inputs, const long num_outputs, dense_weights& dense)
+        {
+            auto& r = reader.next(layer_record::dense, "an fc layer");
+            if (r.num_inputs != num_inputs || (num_outputs > 0 && r.num_outputs != num_outputs))
+            {
+                std::ostringstream sout;
+                sout << "incremental_decoder: expected an fc layer mapping each token from " << num_inputs
+                     << " features, got " << r.num_inputs << " inputs and " << r.num_outputs << " outputs";
+                throw std::runtime_error(sout.str());
+            }
+            dense.weights.swap(r.params);
+            dense.biases.swap(r.biases);
+        }
+    }
+
+    /**
+     * @brief Extracts the weights of a network_type<false> of the given transformer_config.
+     *
+     * Usage:
+     *   auto weights = extract_decoder_weights<vslm>(net);
+     */
+    template <typename config, typename net_type>
+    decoder_weights extract_decoder_weights(const net_type& net)
+    {
+        std::vector<impl::layer_record> records;
+        visit_layers(net, impl::visitor_collect_decoder_layers(records));
+        std::reverse(records.begin(), records.end());
+
+        decoder_weights w;
+        w.vocab_size = config::VOCAB_SIZE;
+        w.num_heads = config::NUM_HEADS;
+        w.num_kv_heads = config::NUM_KV_HEADS;
+        w.d_model = config::EMBEDDING_DIM;
+        w.max_seq_len = config::MAX_SEQ_LEN;
+        const long d = w.d_model;
+
+        impl::record_reader reader(records);
+        auto& emb = reader.next(impl::layer_record::embeddings, "an embeddings layer");
+        w.embeddings.swap(emb.params);
+        w.init_positional();
+
+        w.blocks.resize(config::NUM_LAYERS);
+        for (auto& b : w.blocks)
+        {
+            impl::read_norm(reader, d, b.attention_norm, w.norm_eps);
+            impl::read_dense(reader, d, d + 2 * w.kv_dim(), b.qkv);
+            // the unfused attention also has a dropout on the attention weights
+            const float first = reader.next(impl::layer_record::scale, "the attention dropout").value;
+            if (reader.peek(impl::layer_record::scale))
+            {
+                b.attention_dropout = first;
+                b.attention_output = reader.next(impl::layer_record::scale, "the attention dropout").value;
+            }
+            else
+            {
+                b.attention_output = first;
+            }
+            impl::read_norm(reader, d, b.ffn_norm, w.norm_eps);
+            if (reader.peek(impl::layer_record::experts))
+            {
+                b.moe = std::move(reader.next(impl::layer_record::experts, "a moe_feed_forward layer").moe);
+            }
+            else
+            {
+                impl::read_dense(reader, d, 4 * d, b.ffn_in);
+                w.activation = reader.next(impl::layer_record::activation, "the feed-forward activation").act;
+                b.ffn_in.activation_after = true;
+                impl::read_dense(reader, 4 * d, d, b.ffn_out);
+            }
+            b.ffn_output = reader.next(impl::layer_record::scale, "the feed-forward dropout").value;
+        }
+
+        impl::read_norm(reader, d, w.final_norm, w.norm_eps);
+        long width = d;
+        while (!reader.done())
+        {
+            w.head.emplace_back();
+            impl::read_dense(reader, width, 0, w.head.back());
+            width = w.head.back().num_outputs();
+            if (reader.peek(impl::layer_record::activation))
+            {
+                reader.next(impl::layer_record::activation, "an activation");
+                w.head.back().activation_after = true;
+            }
+        }
+        if (w.head.empty() || width != w.vocab_size)
+            throw std::runtime_error("incremental_decoder: the classification head must end with vocab_size outputs");
+        return w;
+    }
+
+    /**
+     * @brief Keys and values of every layer for the tokens of one sequence seen so far.
+     */
+    class kv_cache
+    {
+        public:
+        kv_cache() = default;
+
+        explicit kv_cache(const decoder_weights& w) : capacity_(w.max_seq_len)
+        {
+            keys.resize(w.num_layers());
+            values.resize(w.num_layers());
+            for (long l = 0; l < w.num_layers(); ++l)
+            {
+                keys[l].set_size(capacity_, w.kv_dim());
+                values[l].set_size(capacity_, w.kv_dim());
+            }
+        }
+
+        long size() const { return length; }
+        long capacity() const { return capacity_; }
+        void clear() { length = 0; }
+
+        // Keeps the first n positions: shrinking forgets tokens, growing makes the rows that
+        // were filled through key() and value() part of the sequence.
+        void resize(const long n)
+        {
+            DLIB_CASSERT(0 <= n && n <= capacity_);
+            length = n;
+        }
+
+        float* key(const long layer, const long pos) { return keys[layer].host() + pos * keys[layer].k(); }
+        float* value(const long layer, const long pos) { return values[layer].host() + pos * values[layer].k(); }
+
+        private:
+        long capacity_ = 0;
+        long length = 0;
+        std::vector<resizable_tensor> keys;    // (capacity, kv_dim) per layer
+        std::vector<resizable_tensor> values;
+    };
+
+    namespace impl
+    {
+        inline void rms_norm_rows(const tensor& x, const tensor& gamma, const float eps, resizable_tensor& out)
+        {
+            out.copy_size(x);
+            const long rows = x.num_samples();
+            const long d = x.size() / rows;
+            kernels::rms_norm_forward(x.host(), gamma.host(), rows, d, eps, out.host(), nullptr);
+        }
+
+        inline void apply_dense(const dense_weights& dense, const tensor& in, const ffn_activation act, resizable_tensor& out)
+        {
+            out.set_size(in.num_samples(), dense.num_outputs());
+            if (dense.quantized.empty())
+                tt::gemm(0, out, 1, in, false, dense.weights, false);
+            else
+                dense.quantized.multiply(in.host(), in.num_samples(), out.host());
+            float* o = out.host();
+            const long n = dense.num_outputs();
+            for (long r = 0; r < in.num_samples(); ++r, o += n)
+            {
+                if (dense.biases.size() != 0)
+                {
+                    const float* b = dense.biases.host();
+                    for (long i = 0; i < n; ++i)
+                        o[i] += b[i];
+                }
+                if (!dense.activation_after)
+                    continue;
+                if (act == ffn_activation::gelu || act == ffn_activation::gelu_tanh)
+                {
+                    const auto approx = act == ffn_activation::gelu ? kernels::gelu_approximation::exact : kernels::gelu_approximation::tanh;
+                    kernels::gelu_forward(o, n, o, approx);
+                }
+                else
+                {
+                    for (long i = 0; i < n; ++i)
+                        o[i] = activate(act, o[i]);
+                }
+            }
+        }
+
+        /*
+            out = the experts of moe applied to each row of in, weighted by the router.  The
+            rows are grouped by expert so that each expert is one matrix product over its rows.
+        */
+        inline void apply_moe(const moe_weights& moe, const tensor& in, resizable_tensor& out)
+        {
+            thread_local resizable_tensor probs, xs, hidden, ys;
+            thread_local std::vector<long> choice, expert_begin, assignment;
+            thread_local std::vector<float> gates;
+            const long rows = in.num_samples();
+            const long d = in.size() / rows;
+            const long num_experts = moe.num_experts();
+            const long top_k = moe.top_k;
+            apply_dense(moe.router, in, ffn_activation::gelu, probs);
+            kernels::softmax_forward(probs.host(), rows, num_experts, probs.host());
+
+            choice.resize(rows * top_k);
+            gates.resize(rows * top_k);
+            expert_begin.assign(num_experts + 1, 0);
+            std::vector<long> order(num_experts);
+            for (long r = 0; r < rows; ++r)
+            {
+                const float* p = probs.host() + r * num_experts;
+                std::iota(order.begin(), order.end(), 0);
+                std::partial_sort(order.begin(), order.begin() + top_k, order.end(), [&](long a, long b) { return p[a] > p[b]; });
+                float sum = 0;
+                for (long j = 0; j < top_k; ++j)
+                    sum += p[order[j]];
+                for (long j = 0; j < top_k; ++j)
+                {
+                    choice[r * top_k + j] = order[j];
+                    gates[r * top_k + j] = p[order[j]] / sum;
+                    ++expert_begin[order[j] + 1];
+                }
+            }
+            std::partial_sum(expert_begin.begin(), expert_begin.end(), expert_begin.begin());
+            assignment.resize(rows * top_k);
+            std::vector<long> next(expert_begin.begin(), expert_begin.end() - 1);
+            for (long a = 0; a < rows * top_k; ++a)
+                assignment[next[choice[a]]++] = a;
+
+            out.set_size(rows, d);
+            out = 0;
+            for (long e = 0; e < num_experts; ++e)
+            {
+                const long n = expert_begin[e + 1] - expert_begin[e];
+                if (n == 0)
+                    continue;
+                xs.set_size(n, d);
+                for (long i = 0; i < n; ++i)
+                {
+                    const float* row = in.host() + assignment[expert_begin[e] + i] / top_k * d;
+                    std::copy(row, row + d, xs.host() + i * d);
+                }
+                apply_dense(moe.experts_in[e], xs, ffn_activation::gelu, hidden);
+                apply_dense(moe.experts_out[e], hidden, ffn_activation::gelu, ys);
+                for (long i = 0; i < n; ++i)
+                {
+                    const long a = assignment[expert_begin[e] + i];
+                    float* o = out.host() + a / top_k * d;
+                    const float* y = ys.host() + i * d;
+                    for (long c = 0; c < d; ++c)
+                        o[c] += gates[a] * y[c];
+                }
+            }
+        }
+
+        struct decode_scratch
+        {
+            resizable_tensor x, h, qkv, att, ffn, out;
+        };
+    }
+
+    /**
+     * @brief New tokens of one sequence in a call to forward_batch().
+     */
+    struct decode_chunk
+    {
+        kv_cache* cache = nullptr;
+        const int* tokens = nullptr;
+        long n = 0;
+        // receives the logits of the last token, or nullptr when they are not needed (for
+        // instance a piece of a prompt that is not its end)
+        std::vector<float>* logits = nullptr;
+        // receive the logits of all n tokens instead, one vocab_size row after the other
+        bool every_token = false;
+        // receives the input of the last layer of the classification head for the last
+        // token, for a sampler that computes only the logits it needs (see sampling.h)
+        std::vector<float>* features = nullptr;
+    };
+
+    /**
+     * @brief Runs the new tokens of several sequences through the network in one pass,
+     * appending their keys and values to the cache of each sequence, and writes the logits
+     * of the last token of each (or of all its tokens, with every_token).
+     *
+     * The tokens of all the sequences are packed one after the other, without padding, so the
+     * projections and the feed-forward layers are a single matrix product over all of them.
+     * Only the attention is per sequence: each token attends to the cached tokens of its own
+     * sequence and to the new tokens before it, which is the causal mask of every sequence
+     * at its own offset.  Sequences may be at different lengths and feed different numbers
+     * of tokens, so prompts (prefill) and single generated tokens can share a batch.
+     */
+    inline void forward_batch(const decoder_weights& w, const std::vector<decode_chunk>& chunks)
+    {
+        thread_local impl::decode_scratch s;
+        thread_local std::vector<long> row_chunk, row_pos, last_rows;
+        const long d = w.d_model;
+
+        row_chunk.clear();
+        row_pos.clear();
+        for (size_t c = 0; c < chunks.size(); ++c)
+        {
+            const auto& chunk = chunks[c];
+            DLIB_CASSERT(chunk.cache != nullptr && chunk.n > 0);
+            if (chunk.cache->size() + chunk.n > chunk.cache->capacity())
+                throw std::length_error("incremental_decoder: the sequence is longer than max_seq_len");
+            for (long i = 0; i < chunk.n; ++i)
+            {
+                row_chunk.push_back(c);
+                row_pos.push_back(chunk.cache->size() + i);
+            }
+        }
+        const long rows = row_chunk.size();
+        if (rows == 0)
+            return;
+
+        s.x.set_size(rows, d);
+        float* x = s.x.host();
+        for (long r = 0; r < rows; ++r)
+        {
+            const auto& chunk = chunks[row_chunk[r]];
+            const int token = chunk.tokens[row_pos[r] - chunk.cache->size()];
+            DLIB_CASSERT(0 <= token && token < w.vocab_size);
+            const float* e = w.embeddings.host() + token * d;
+            const float* pe = w.positional.host() + row_pos[r] * d;
+            for (long c = 0; c < d; ++c)
+                x[r * d + c] = e[c] + pe[c];
+        }
+
+        const long num_heads = w.num_heads;
+        const long dk = w.head_dim();
+        const long kv_dim = w.kv_dim();
+        const long qkv_width = d + 2 * kv_dim;
+        const long group_size = num_heads / w.num_kv_heads;
+        const float scale = 1.0f / std::sqrt(static_cast<float>(dk));
+        for (long l = 0; l < w.num_layers(); ++l)
+        {
+            const auto& b = w.blocks[l];
+            impl::rms_norm_rows(s.x, b.attention_norm, w.norm_eps, s.h);
+            impl::apply_dense(b.qkv, s.h, w.activation, s.qkv);
+            const float* qkv = s.qkv.host();
+            for (long r = 0; r < rows; ++r)
+            {
+                kv_cache& cache = *chunks[row_chunk[r]].cache;
+                const float* row = qkv + r * qkv_width;
+                std::copy(row + d, row + d + kv_dim, cache.key(l, row_pos[r]));
+                std::copy(row + d + kv_dim, row + d + 2 * kv_dim, cache.value(l, row_pos[r]));
+            }
+
+            s.att.set_size(rows, d);
+            float* att = s.att.host();
+            parallel_for(default_thread_pool(), 0, rows * num_heads, [&](long task)
+            {
+                thread_local std::vector<float> scores;
+                const long r = task / num_heads;
+                const long head = task % num_heads;
+                const long pos = row_pos[r];
+                kv_cache& cache = *chunks[row_chunk[r]].cache;
+                const float* keys = cache.key(l, 0);
+                const float* values = cache.value(l, 0);
+                const long kv_offset = head / group_size * dk;
+                const float* q = qkv + r * qkv_width + head * dk;
+                scores.resize(pos + 1);
+                for (long j = 0; j <= pos; ++j)
+                {
+                    const float* k = keys + j * kv_dim + kv_offset;
+                    float dot = 0;
+                    for (long c = 0; c < dk; ++c)
+                        dot += q[c] * k[c];
+                    scores[j] = dot * scale;
+                }
+                kernels::softmax_forward(scores.data(), 1, pos + 1, scores.data());
+                const float norm = b.attention_dropout;
+                float* o = att + r * d + head * dk;
+                std::fill(o, o + dk, 0.0f);
+                for (long j = 0; j <= pos; ++j)
+                {
+                    const float p = scores[j] * norm;
+                    const float* v = values + j * kv_dim + kv_offset;
+                    for (long c = 0; c < dk; ++c)
+                        o[c] += p * v[c];
+                }
+            });
+            for (long i = 0; i < rows * d; ++i)
+                x[i] += b.attention_output * att[i];
+
+            impl::rms_norm_rows(s.x, b.ffn_norm, w.norm_eps, s.h);
+            if (b.moe.empty())
+            {
+                impl::apply_dense(b.ffn_in, s.h, w.activation, s.ffn);
+                impl::apply_dense(b.ffn_out, s.ffn, w.activation, s.out);
+            }
+            else
+            {
+                impl::apply_moe(b.moe, s.h, s.out);
+            }
+            const float* y = s.out.host();
+            for (long i = 0; i < rows * d; ++i)
+                x[i] += b.ffn_output * y[i];
+        }
+
+        // usually only the last token of each sequence needs logits; the rows that want
+        // logits come first and those that want features after them
+        last_rows.clear();
+        long offset = 0, num_logits = 0;
+        for (const auto& chunk : chunks)
+        {
+            chunk.cache->resize(chunk.cache->size() + chunk.n);
+            offset += chunk.n;
+            if (chunk.logits)
+            {
+                for (long r = chunk.every_token ? offset - chunk.n : offset - 1; r < offset; ++r)
+                    last_rows.push_back(r);
+            }
+        }
+        num_logits = last_rows.size();
+        offset = 0;
+        for (const auto& chunk : chunks)
+        {
+            offset += chunk.n;
+            if (chunk.features)
+                last_rows.push_back(offset - 1);
+        }
+        if (last_rows.empty())
+            return;
+        s.h.set_size(last_rows.size(), d);
+        for (size_t i = 0; i < last_rows.size(); ++i)
+            std::copy(x + last_rows[i] * d, x + (last_rows[i] + 1) * d, s.h.host() + i * d);
+        impl::rms_norm_rows(s.h, w.final_norm, w.norm_eps, s.out);
+        for (size_t l = 0; l + 1 < w.head.size(); ++l)
+        {
+            impl::apply_dense(w.head[l], s.out, w.activation, s.h);
+            s.out.swap(s.h);
+        }
+
+        const long width = s.out.size() / last_rows.size();
+        long i = num_logits;
+        for (const auto& chunk : chunks)
+        {
+            if (chunk.features)
+            {
+                chunk.features->assign(s.out.host() + i * width, s.out.host() + (i + 1) * width);
+                ++i;
+            }
+        }
+        if (num_logits == 0)
+            return;
+        s.h.set_size(num_logits, width);
+        std::copy(s.out.host(), s.out.host() + num_logits * width, s.h.host());
+        impl::apply_dense(w.head.back(), s.h, w.activation, s.out);
+        const long vocab = w.head.back().num_outputs();
+        i = 0;
+        for (const auto& chunk : chunks)
+        {
+            if (chunk.logits)
+            {
+                const long n = chunk.every_token ? chunk.n : 1;
+                chunk.logits->assign(s.out.host() + i * vocab, s.out.host() + (i + n) * vocab);
+                i += n;
+            }
+        }
+    }
+
+    /**
+     * @brief Runs n new tokens of one sequence through the network, appending their keys and
+     * values to the cache, and writes the logits of the last one.
+     *
+     * Each new token attends to every cached token and to the new tokens before it, so a
+     * prompt can be fed in one call (prefill) and generation one token at a time.
+     */
+    inline void forward_tokens(
+        const decoder_weights& w,
+        kv_cache& cache,
+        const int* tokens,
+        const long n,
+        std::vector<float>& logits)
+    {
+        DLIB_CASSERT(n > 0);
+        forward_batch(w, {decode_chunk{&cache, tokens, n, &logits}});
+    }
+
+    /**
+     * @brief Decodes a single sequence with a key/value cache.
+     *
+     * Usage:
+     *   const auto weights = extract_decoder_weights<vslm>(net);
+     *   incremental_decoder decoder(weights);
+     *   auto logits = decoder.prefill(prompt);
+     *   while (...) logits = decoder.step(next_token(logits));
+     */
+    class incremental_decoder
+    {
+        public:
+        explicit incremental_decoder(const decoder_weights& weights) : weights(weights), cache(weights) {}
+
+        // Starts a new sequence with the given prompt and returns the logits of the next token.
+        const std::vector<float>& prefill(const std::vector<int>& tokens)
+        {
+            cache.clear();
+            forward_tokens(weights, cache, tokens.data(), tokens.size(), logits);
+            return logits;
+        }
+
+        // Appends one token and returns the logits of the next one.
+        const std::vector<float>& step(const int token)
+        {
+            forward_tokens(weights, cache, &token, 1, logits);
+            return logits;
+        }
+
+        // Same as prefill() and step(), but return the input of the last layer of the head
+        // instead of the logits, for a token_sampler (sampling.h).
+        const std::vector<float>& prefill_features(const std::vector<int>& tokens)
+        {
+            DLIB_CASSERT(!tokens.empty());
+            cache.clear();
+            forward_batch(weights, {decode_chunk{&cache, tokens.data(), static_cast<long>(tokens.size()), nullptr, false, &features}});
+            return features;
+        }
+
+        const std::vector<float>& step_features(const int token)
+        {
+            forward_batch(weights, {decode_chunk{&cache, &token, 1, nullptr, false, &features}});
+            return features;
+        }
+
+        void reset() { cache.clear(); }
+        long size() const { return cache.size(); }
+        long max_length() const { return cache.capacity(); }
+        kv_cache& get_cache() { return cache; }
+        const decoder_weights& get_weights() const { return weights; }
+
+        private:
+        const decoder_weights& weights;
+        kv_cache cache;
+        std::vector<float> logits, features;
+    };
+}
+
+#endif // IncrementalDecoder_H
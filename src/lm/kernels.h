@@ -0,0 +1,403 @@
+#ifndef Kernels_H
+#define Kernels_H
+
+/**
+ * @file kernels.h
+ * @brief Row-wise rms_norm, softmax and GELU kernels with runtime CPU dispatch
+ *
+ * At small embedding dimensions the normalizations and activations of a transformer block
+ * cost as much as its matrix products.  These kernels work on contiguous rows of d values
+ * (one token, or one row of attention scores) and come in three versions:
+ *  - scalar: plain loops with std::exp, std::erf and std::tanh, the reference,
+ *  - avx2: 8 floats per instruction, with FMA,
+ *  - avx512: 16 floats per instruction.
+ * The vector versions evaluate exp with a degree 6 polynomial after range reduction
+ * (relative error below 2e-7), erf with Abramowitz and Stegun 7.1.26 (absolute error below
+ * 1.5e-7) and tanh from exp, and handle the end of a row that does not fill a vector with the
+ * scalar code.
+ *
+ * The best instruction set the CPU supports is selected the first time a kernel runs, so a
+ * binary built without -march=native still uses AVX2 or AVX-512, and falls back to the scalar
+ * version elsewhere.  use_instruction_set() forces a version, to compare them.
+ *
+ * Backward kernels add into grad_x when accumulate is true and overwrite it otherwise, in
+ * which case grad_x may be the same buffer as grad_out.  Gradients of parameters are always
+ * added.
+ */
+
+#include <dlib/dnn.h>
+
+#include <cmath>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TRANSFORMER_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace transformer
+{
+    namespace kernels
+    {
+        enum class instruction_set
+        {
+            scalar,
+            avx2,
+            avx512
+        };
+
+        inline std::string to_string(const instruction_set isa)
+        {
+            switch (isa)
+            {
+            case instruction_set::scalar:
+                return "scalar";
+            case instruction_set::avx2:
+                return "avx2";
+            case instruction_set::avx512:
+                return "avx512";
+            }
+            return "unknown";
+        }
+
+        enum class gelu_approximation
+        {
+            exact,  // x * Phi(x), with erf
+            tanh    // 0.5 * x * (1 + tanh(sqrt(2 / pi) * (x + 0.044715 * x^3)))
+        };
+
+        inline bool is_supported(const instruction_set isa)
+        {
+            switch (isa)
+            {
+            case instruction_set::scalar:
+                return true;
+#ifdef TRANSFORMER_KERNELS_X86
+            case instruction_set::avx2:
+                return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+            case instruction_set::avx512:
+                return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("fma");
+#endif
+            default:
+                return false;
+            }
+        }
+
+        inline instruction_set best_instruction_set()
+        {
+            if (is_supported(instruction_set::avx512))
+                return instruction_set::avx512;
+            if (is_supported(instruction_set::avx2))
+                return instruction_set::avx2;
+            return instruction_set::scalar;
+        }
+
+        namespace scalar
+        {
+            inline float gelu(const float x, const gelu_approximation approx)
+            {
+                if (approx == gelu_approximation::exact)
+                    return 0.5f * x * (1 + std::erf(x * 0.70710678f));
+                return 0.5f * x * (1 + std::tanh(0.79788456f * (x + 0.044715f * x * x * x)));
+            }
+
+            inline float gelu_derivative(const float x, const gelu_approximation approx)
+            {
+                if (approx == gelu_approximation::exact)
+                    return 0.5f * (1 + std::erf(x * 0.70710678f)) + x * 0.39894228f * std::exp(-0.5f * x * x);
+                const float t = std::tanh(0.79788456f * (x + 0.044715f * x * x * x));
+                return 0.5f * (1 + t) + 0.5f * x * (1 - t * t) * 0.79788456f * (1 + 3 * 0.044715f * x * x);
+            }
+
+            inline void rms_norm_forward(const float* x, const float* gamma, const long rows, const long d, const float eps, float* out, float* inv_rms)
+            {
+                for (long r = 0; r < rows; ++r, x += d, out += d)
+                {
+                    float ss = 0;
+                    for (long i = 0; i < d; ++i)
+                        ss += x[i] * x[i];
+                    const float s = 1 / std::sqrt(ss / d + eps);
+                    if (inv_rms)
+                        inv_rms[r] = s;
+                    for (long i = 0; i < d; ++i)
+                        out[i] = x[i] * s * gamma[i];
+                }
+            }
+
+            // grad_x = s * gamma * grad_out - x * s^3 / d * sum(grad_out * gamma * x)
+            inline void rms_norm_backward(
+                const float* x, const float* gamma, const float* inv_rms, const float* grad_out,
+                const long rows, const long d, float* grad_x, float* grad_gamma, const bool accumulate)
+            {
+                for (long r = 0; r < rows; ++r, x += d, grad_out += d, grad_x += d)
+                {
+                    const float s = inv_rms[r];
+                    float dot = 0;
+                    for (long i = 0; i < d; ++i)
+                    {
+                        dot += grad_out[i] * gamma[i] * x[i];
+                        grad_gamma[i] += grad_out[i] * x[i] * s;
+                    }
+                    const float c = dot * s * s * s / d;
+                    for (long i = 0; i < d; ++i)
+                    {
+                        const float g = s * gamma[i] * grad_out[i] - c * x[i];
+                        grad_x[i] = accumulate ? grad_x[i] + g : g;
+                    }
+                }
+            }
+
+            inline void softmax_forward(const float* x, const long rows, const long d, float* out)
+            {
+                for (long r = 0; r < rows; ++r, x += d, out += d)
+                {
+                    float max_value = -std::numeric_limits<float>::infinity();
+                    for (long i = 0; i < d; ++i)
+                        max_value = std::max(max_value, x[i]);
+                    float sum = 0;
+                    for (long i = 0; i < d; ++i)
+                        sum += (out[i] = std::exp(x[i] - max_value));
+                    for (long i = 0; i < d; ++i)
+                        out[i] /= sum;
+                }
+            }
+
+            // grad_x = y * (grad_out - sum(grad_out * y))
+            inline void softmax_backward(const float* y, const float* grad_out, const long rows, const long d, float* grad_x, const bool accumulate)
+            {
+                for (long r = 0; r < rows; ++r, y += d, grad_out += d, grad_x += d)
+                {
+                    float dot = 0;
+                    for (long i = 0; i < d; ++i)
+                        dot += grad_out[i] * y[i];
+                    for (long i = 0; i < d; ++i)
+                    {
+                        const float g = y[i] * (grad_out[i] - dot);
+                        grad_x[i] = accumulate ? grad_x[i] + g : g;
+                    }
+                }
+            }
+
+            inline void gelu_forward(const float* x, const long n, float* out, const gelu_approximation approx)
+            {
+                for (long i = 0; i < n; ++i)
+                    out[i] = gelu(x[i], approx);
+            }
+
+            inline void gelu_backward(const float* x, const float* grad_out, const long n, float* grad_x, const gelu_approximation approx, const bool accumulate)
+            {
+                for (long i = 0; i < n; ++i)
+                {
+                    const float g = grad_out[i] * gelu_derivative(x[i], approx);
+                    grad_x[i] = accumulate ? grad_x[i] + g : g;
+                }
+            }
+        }
+
+        struct kernel_table
+        {
+            decltype(&scalar::rms_norm_forward) rms_norm_forward;
+            decltype(&scalar::rms_norm_backward) rms_norm_backward;
+            decltype(&scalar::softmax_forward) softmax_forward;
+            decltype(&scalar::softmax_backward) softmax_backward;
+            decltype(&scalar::gelu_forward) gelu_forward;
+            decltype(&scalar::gelu_backward) gelu_backward;
+        };
+
+#ifdef TRANSFORMER_KERNELS_X86
+        // Each instruction set compiles the kernels of kernels_simd.h with its own vector type,
+        // whatever the flags of the translation unit.
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+        namespace avx2
+        {
+            struct simd
+            {
+                using type = __m256;
+                static constexpr long width = 8;
+                static type zero() { return _mm256_setzero_ps(); }
+                static type set1(const float v) { return _mm256_set1_ps(v); }
+                static type load(const float* p) { return _mm256_loadu_ps(p); }
+                static void store(float* p, const type v) { _mm256_storeu_ps(p, v); }
+                static type add(const type a, const type b) { return _mm256_add_ps(a, b); }
+                static type sub(const type a, const type b) { return _mm256_sub_ps(a, b); }
+                static type mul(const type a, const type b) { return _mm256_mul_ps(a, b); }
+                static type div(const type a, const type b) { return _mm256_div_ps(a, b); }
+                static type fmadd(const type a, const type b, const type c) { return _mm256_fmadd_ps(a, b, c); }
+                static type max(const type a, const type b) { return _mm256_max_ps(a, b); }
+                static type min(const type a, const type b) { return _mm256_min_ps(a, b); }
+                static type abs(const type a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+                // the sign of b on the magnitude of a
+                static type copy_sign(const type a, const type b)
+                {
+                    const type sign = _mm256_set1_ps(-0.0f);
+                    return _mm256_or_ps(_mm256_andnot_ps(sign, a), _mm256_and_ps(sign, b));
+                }
+                static type round(const type a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+                // 2^n for integral n in [-126, 127]
+                static type pow2(const type n)
+                {
+                    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23));
+                }
+                static float reduce_add(const type v)
+                {
+                    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+                    sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+                    return _mm_cvtss_f32(sum);
+                }
+                static float reduce_max(const type v)
+                {
+                    __m128 m = _mm_max_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+                    m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+                    m = _mm_max_ss(m, _mm_movehdup_ps(m));
+                    return _mm_cvtss_f32(m);
+                }
+            };
+#include "kernels_simd.h"
+        }
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#if defined(__clang__)
+#pragma clang attribute push(__attribute__((target("avx512f,avx2,fma"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx2,fma")
+#endif
+        namespace avx512
+        {
+            struct simd
+            {
+                using type = __m512;
+                static constexpr long width = 16;
+                static type zero() { return _mm512_setzero_ps(); }
+                static type set1(const float v) { return _mm512_set1_ps(v); }
+                static type load(const float* p) { return _mm512_loadu_ps(p); }
+                static void store(float* p, const type v) { _mm512_storeu_ps(p, v); }
+                static type add(const type a, const type b) { return _mm512_add_ps(a, b); }
+                static type sub(const type a, const type b) { return _mm512_sub_ps(a, b); }
+                static type mul(const type a, const type b) { return _mm512_mul_ps(a, b); }
+                static type div(const type a, const type b) { return _mm512_div_ps(a, b); }
+                static type fmadd(const type a, const type b, const type c) { return _mm512_fmadd_ps(a, b, c); }
+                static type max(const type a, const type b) { return _mm512_max_ps(a, b); }
+                static type min(const type a, const type b) { return _mm512_min_ps(a, b); }
+                static type abs(const type a)
+                {
+                    return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x7fffffff)));
+                }
+                static type copy_sign(const type a, const type b)
+                {
+                    const __m512i sign = _mm512_set1_epi32(0x80000000);
+                    return _mm512_castsi512_ps(_mm512_or_si512(
+                        _mm512_andnot_si512(sign, _mm512_castps_si512(a)), _mm512_and_si512(sign, _mm512_castps_si512(b))));
+                }
+                static type round(const type a) { return _mm512_roundscale_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+                static type pow2(const type n)
+                {
+                    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23));
+                }
+                static float reduce_add(const type v) { return _mm512_reduce_add_ps(v); }
+                static float reduce_max(const type v) { return _mm512_reduce_max_ps(v); }
+            };
+#include "kernels_simd.h"
+        }
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+#endif // TRANSFORMER_KERNELS_X86
+
+        inline const kernel_table& get_kernel_table(const instruction_set isa)
+        {
+            static const kernel_table scalar_table{
+                scalar::rms_norm_forward, scalar::rms_norm_backward, scalar::softmax_forward,
+                scalar::softmax_backward, scalar::gelu_forward, scalar::gelu_backward};
+#ifdef TRANSFORMER_KERNELS_X86
+            static const kernel_table avx2_table{
+                avx2::rms_norm_forward, avx2::rms_norm_backward, avx2::softmax_forward,
+                avx2::softmax_backward, avx2::gelu_forward, avx2::gelu_backward};
+            static const kernel_table avx512_table{
+                avx512::rms_norm_forward, avx512::rms_norm_backward, avx512::softmax_forward,
+                avx512::softmax_backward, avx512::gelu_forward, avx512::gelu_backward};
+            if (isa == instruction_set::avx512)
+                return avx512_table;
+            if (isa == instruction_set::avx2)
+                return avx2_table;
+#endif
+            return scalar_table;
+        }
+
+        namespace impl
+        {
+            inline const kernel_table*& active_table()
+            {
+                static const kernel_table* table = &get_kernel_table(best_instruction_set());
+                return table;
+            }
+
+            inline instruction_set& active_instruction_set()
+            {
+                static instruction_set isa = best_instruction_set();
+                return isa;
+            }
+        }
+
+        // Makes the kernels below run with the given instruction set, which the CPU must support.
+        inline void use_instruction_set(const instruction_set isa)
+        {
+            DLIB_CASSERT(is_supported(isa), "This CPU does not support " << to_string(isa));
+            impl::active_instruction_set() = isa;
+            impl::active_table() = &get_kernel_table(isa);
+        }
+
+        inline instruction_set get_instruction_set() { return impl::active_instruction_set(); }
+
+        // out = x / sqrt(mean(x^2) + eps) * gamma for each row of d values; inv_rms receives the
+        // 1 / sqrt(mean(x^2) + eps) of each row for the backward pass, unless it is nullptr.
+        inline void rms_norm_forward(const float* x, const float* gamma, const long rows, const long d, const float eps, float* out, float* inv_rms)
+        {
+            impl::active_table()->rms_norm_forward(x, gamma, rows, d, eps, out, inv_rms);
+        }
+
+        inline void rms_norm_backward(
+            const float* x, const float* gamma, const float* inv_rms, const float* grad_out,
+            const long rows, const long d, float* grad_x, float* grad_gamma, const bool accumulate)
+        {
+            impl::active_table()->rms_norm_backward(x, gamma, inv_rms, grad_out, rows, d, grad_x, grad_gamma, accumulate);
+        }
+
+        // softmax of each row of d values; out may be x
+        inline void softmax_forward(const float* x, const long rows, const long d, float* out)
+        {
+            impl::active_table()->softmax_forward(x, rows, d, out);
+        }
+
+        inline void softmax_backward(const float* y, const float* grad_out, const long rows, const long d, float* grad_x, const bool accumulate)
+        {
+            impl::active_table()->softmax_backward(y, grad_out, rows, d, grad_x, accumulate);
+        }
+
+        // out may be x
+        inline void gelu_forward(const float* x, const long n, float* out, const gelu_approximation approx = gelu_approximation::exact)
+        {
+            impl::active_table()->gelu_forward(x, n, out, approx);
+        }
+
+        inline void gelu_backward(
+            const float* x, const float* grad_out, const long n, float* grad_x,
+            const gelu_approximation approx = gelu_approximation::exact, const bool accumulate = true)
+        {
+            impl::active_table()->gelu_backward(x, grad_out, n, grad_x, approx, accumulate);
+        }
+    }
+}
+
+#endif // Kernels_H
@@ -0,0 +1,237 @@
+// Kernels written against a vector type `simd`, included by kernels.h once per instruction set
+// inside the namespace defining `simd`.  No include guard on purpose.
+
+// exp(x) = 2^n * exp(r), with n = round(x / ln 2) and |r| <= ln(2) / 2 (Cephes expf)
+inline simd::type exp(simd::type x)
+{
+    x = simd::max(simd::min(x, simd::set1(88.3762626647949f)), simd::set1(-87.3365478515625f));
+    const simd::type n = simd::round(simd::mul(x, simd::set1(1.44269504088896341f)));
+    x = simd::fmadd(n, simd::set1(-0.693359375f), x);
+    x = simd::fmadd(n, simd::set1(2.12194440e-4f), x);
+    simd::type p = simd::set1(1.9875691500e-4f);
+    p = simd::fmadd(p, x, simd::set1(1.3981999507e-3f));
+    p = simd::fmadd(p, x, simd::set1(8.3334519073e-3f));
+    p = simd::fmadd(p, x, simd::set1(4.1665795894e-2f));
+    p = simd::fmadd(p, x, simd::set1(1.6666665459e-1f));
+    p = simd::fmadd(p, x, simd::set1(5.0000001201e-1f));
+    p = simd::fmadd(p, simd::mul(x, x), simd::add(x, simd::set1(1)));
+    return simd::mul(p, simd::pow2(n));
+}
+
+// Abramowitz and Stegun 7.1.26
+inline simd::type erf(const simd::type x)
+{
+    const simd::type a = simd::abs(x);
+    const simd::type t = simd::div(simd::set1(1), simd::fmadd(a, simd::set1(0.3275911f), simd::set1(1)));
+    simd::type p = simd::set1(1.061405429f);
+    p = simd::fmadd(p, t, simd::set1(-1.453152027f));
+    p = simd::fmadd(p, t, simd::set1(1.421413741f));
+    p = simd::fmadd(p, t, simd::set1(-0.284496736f));
+    p = simd::fmadd(p, t, simd::set1(0.254829592f));
+    p = simd::mul(p, t);
+    const simd::type e = exp(simd::sub(simd::zero(), simd::mul(a, a)));
+    return simd::copy_sign(simd::sub(simd::set1(1), simd::mul(p, e)), x);
+}
+
+// tanh(x) = 1 - 2 / (exp(2|x|) + 1), with the sign of x
+inline simd::type tanh(const simd::type x)
+{
+    const simd::type e = exp(simd::mul(simd::abs(x), simd::set1(2)));
+    const simd::type t = simd::sub(simd::set1(1), simd::div(simd::set1(2), simd::add(e, simd::set1(1))));
+    return simd::copy_sign(t, x);
+}
+
+inline void rms_norm_forward(const float* x, const float* gamma, const long rows, const long d, const float eps, float* out, float* inv_rms)
+{
+    constexpr long w = simd::width;
+    for (long r = 0; r < rows; ++r, x += d, out += d)
+    {
+        simd::type acc0 = simd::zero(), acc1 = simd::zero();
+        long i = 0;
+        for (; i + 2 * w <= d; i += 2 * w)
+        {
+            const simd::type v0 = simd::load(x + i), v1 = simd::load(x + i + w);
+            acc0 = simd::fmadd(v0, v0, acc0);
+            acc1 = simd::fmadd(v1, v1, acc1);
+        }
+        for (; i + w <= d; i += w)
+        {
+            const simd::type v = simd::load(x + i);
+            acc0 = simd::fmadd(v, v, acc0);
+        }
+        float ss = simd::reduce_add(simd::add(acc0, acc1));
+        for (; i < d; ++i)
+            ss += x[i] * x[i];
+        const float s = 1 / std::sqrt(ss / d + eps);
+        if (inv_rms)
+            inv_rms[r] = s;
+        const simd::type vs = simd::set1(s);
+        for (i = 0; i + w <= d; i += w)
+            simd::store(out + i, simd::mul(simd::mul(simd::load(x + i), vs), simd::load(gamma + i)));
+        for (; i < d; ++i)
+            out[i] = x[i] * s * gamma[i];
+    }
+}
+
+inline void rms_norm_backward(
+    const float* x, const float* gamma, const float* inv_rms, const float* grad_out,
+    const long rows, const long d, float* grad_x, float* grad_gamma, const bool accumulate)
+{
+    constexpr long w = simd::width;
+    for (long r = 0; r < rows; ++r, x += d, grad_out += d, grad_x += d)
+    {
+        const float s = inv_rms[r];
+        const simd::type vs = simd::set1(s);
+        simd::type acc = simd::zero();
+        long i = 0;
+        for (; i + w <= d; i += w)
+        {
+            const simd::type go = simd::load(grad_out + i), vx = simd::load(x + i);
+            acc = simd::fmadd(simd::mul(go, simd::load(gamma + i)), vx, acc);
+            simd::store(grad_gamma + i, simd::fmadd(simd::mul(go, vx), vs, simd::load(grad_gamma + i)));
+        }
+        float dot = simd::reduce_add(acc);
+        for (; i < d; ++i)
+        {
+            dot += grad_out[i] * gamma[i] * x[i];
+            grad_gamma[i] += grad_out[i] * x[i] * s;
+        }
+        const float c = dot * s * s * s / d;
+        const simd::type vc = simd::set1(c);
+        for (i = 0; i + w <= d; i += w)
+        {
+            simd::type g = simd::mul(simd::mul(vs, simd::load(gamma + i)), simd::load(grad_out + i));
+            g = simd::sub(g, simd::mul(vc, simd::load(x + i)));
+            simd::store(grad_x + i, accumulate ? simd::add(simd::load(grad_x + i), g) : g);
+        }
+        for (; i < d; ++i)
+        {
+            const float g = s * gamma[i] * grad_out[i] - c * x[i];
+            grad_x[i] = accumulate ? grad_x[i] + g : g;
+        }
+    }
+}
+
+inline void softmax_forward(const float* x, const long rows, const long d, float* out)
+{
+    constexpr long w = simd::width;
+    for (long r = 0; r < rows; ++r, x += d, out += d)
+    {
+        float max_value = -std::numeric_limits<float>::infinity();
+        long i = 0;
+        if (d >= w)
+        {
+            simd::type vmax = simd::load(x);
+            for (i = w; i + w <= d; i += w)
+                vmax = simd::max(vmax, simd::load(x + i));
+            max_value = simd::reduce_max(vmax);
+        }
+        for (; i < d; ++i)
+            max_value = std::max(max_value, x[i]);
+
+        const simd::type vmax = simd::set1(max_value);
+        simd::type acc = simd::zero();
+        for (i = 0; i + w <= d; i += w)
+        {
+            const simd::type e = exp(simd::sub(simd::load(x + i), vmax));
+            simd::store(out + i, e);
+            acc = simd::add(acc, e);
+        }
+        float sum = simd::reduce_add(acc);
+        for (; i < d; ++i)
+            sum += (out[i] = std::exp(x[i] - max_value));
+
+        const simd::type inv_sum = simd::set1(1 / sum);
+        for (i = 0; i + w <= d; i += w)
+            simd::store(out + i, simd::mul(simd::load(out + i), inv_sum));
+        for (; i < d; ++i)
+            out[i] /= sum;
+    }
+}
+
+inline void softmax_backward(const float* y, const float* grad_out, const long rows, const long d, float* grad_x, const bool accumulate)
+{
+    constexpr long w = simd::width;
+    for (long r = 0; r < rows; ++r, y += d, grad_out += d, grad_x += d)
+    {
+        simd::type acc = simd::zero();
+        long i = 0;
+        for (; i + w <= d; i += w)
+            acc = simd::fmadd(simd::load(grad_out + i), simd::load(y + i), acc);
+        float dot = simd::reduce_add(acc);
+        for (; i < d; ++i)
+            dot += grad_out[i] * y[i];
+
+        const simd::type vdot = simd::set1(dot);
+        for (i = 0; i + w <= d; i += w)
+        {
+            const simd::type g = simd::mul(simd::load(y + i), simd::sub(simd::load(grad_out + i), vdot));
+            simd::store(grad_x + i, accumulate ? simd::add(simd::load(grad_x + i), g) : g);
+        }
+        for (; i < d; ++i)
+        {
+            const float g = y[i] * (grad_out[i] - dot);
+            grad_x[i] = accumulate ? grad_x[i] + g : g;
+        }
+    }
+}
+
+inline void gelu_forward(const float* x, const long n, float* out, const gelu_approximation approx)
+{
+    constexpr long w = simd::width;
+    const simd::type half = simd::set1(0.5f), one = simd::set1(1);
+    long i = 0;
+    if (approx == gelu_approximation::exact)
+    {
+        for (; i + w <= n; i += w)
+        {
+            const simd::type v = simd::load(x + i);
+            simd::store(out + i, simd::mul(simd::mul(half, v), simd::add(one, erf(simd::mul(v, simd::set1(0.70710678f))))));
+        }
+    }
+    else
+    {
+        for (; i + w <= n; i += w)
+        {
+            const simd::type v = simd::load(x + i);
+            const simd::type u = simd::mul(simd::set1(0.79788456f), simd::fmadd(simd::mul(simd::set1(0.044715f), v), simd::mul(v, v), v));
+            simd::store(out + i, simd::mul(simd::mul(half, v), simd::add(one, tanh(u))));
+        }
+    }
+    for (; i < n; ++i)
+        out[i] = scalar::gelu(x[i], approx);
+}
+
+inline void gelu_backward(const float* x, const float* grad_out, const long n, float* grad_x, const gelu_approximation approx, const bool accumulate)
+{
+    constexpr long w = simd::width;
+    const simd::type half = simd::set1(0.5f), one = simd::set1(1);
+    long i = 0;
+    for (; i + w <= n; i += w)
+    {
+        const simd::type v = simd::load(x + i);
+        simd::type derivative;
+        if (approx == gelu_approximation::exact)
+        {
+            // Phi(x) + x * phi(x)
+            const simd::type cdf = simd::mul(half, simd::add(one, erf(simd::mul(v, simd::set1(0.70710678f)))));
+            const simd::type pdf = simd::mul(simd::set1(0.39894228f), exp(simd::mul(simd::set1(-0.5f), simd::mul(v, v))));
+            derivative = simd::fmadd(v, pdf, cdf);
+        }
+        else
+        {
+            const simd::type v2 = simd::mul(v, v);
+            const simd::type t = tanh(simd::mul(simd::set1(0.79788456f), simd::fmadd(simd::mul(simd::set1(0.044715f), v), v2, v)));
+            const simd::type du = simd::mul(simd::set1(0.79788456f), simd::fmadd(simd::set1(3 * 0.044715f), v2, one));
+            // 0.5 * (1 + t) + 0.5 * x * (1 - t^2) * du
+            derivative = simd::fmadd(simd::mul(simd::mul(half, v), simd::sub(one, simd::mul(t, t))), du, simd::mul(half, simd::add(one, t)));
+        }
+        const simd::type g = simd::mul(simd::load(grad_out + i), derivative);
+        simd::store(grad_x + i, accumulate ? simd::add(simd::load(grad_x + i), g) : g);
+    }
+    for (; i < n; ++i)
+    {
+        const float g = grad_out[i] * scalar::gelu_derivative(x[i], approx);
+        grad_x[i] = accumulate ? grad_x[i] + g : g;
+    }
+}
@@ -0,0 +1,350 @@
+#ifndef MixtureOfExperts_H
+#define MixtureOfExperts_H
+
+/**
+ * @file mixture_of_experts.h
+ * @brief Sparse mixture-of-experts feed-forward layer
+ *
+ * The dense feed-forward network applies the same d_model -> 4 * d_model -> d_model
+ * transformation to every token.  This layer holds num_experts such networks instead and a
+ * learned router that sends each token to top_k of them only, so the parameters grow with
+ * num_experts while the computation per token stays that of top_k networks.
+ *
+ * The outputs of the chosen experts are summed, weighted by the router probabilities
+ * renormalized over them.  Tokens are grouped by expert before the experts run, so each
+ * expert multiplies all its tokens with one gemm per weight matrix rather than one product
+ * per token.
+ *
+ * A router trained only through the outputs tends to send most tokens to a few experts and
+ * leave the others untrained.  The Switch Transformer load-balancing loss
+ *     balance_weight * num_experts * sum_e f_e * P_e,
+ * with f_e the fraction of assignments to expert e and P_e its mean router probability, is
+ * minimal when the load is uniform.  Its gradient is added to the router in the backward
+ * pass (the trainer does not see its value, which get_balance_loss() returns).
+ */
+
+#include "kernels.h"
+
+#include <dlib/dnn.h>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    /**
+     * @brief Mixture of num_experts feed-forward networks d_model -> d_hidden -> d_model with
+     * a GELU, each token going through top_k of them.
+     *
+     * Input and output: (N, 1, seq_len, d_model), each row a token.
+     *
+     * Template parameters:
+     * @param num_experts: Number of expert networks
+     * @param top_k: Number of experts per token
+     * @param d_model: Model dimension
+     * @param d_hidden: Hidden dimension of each expert
+     */
+    template <long num_experts, long top_k, long d_model, long d_hidden = 4 * d_model>
+    class moe_feed_forward_
+    {
+        static_assert(num_experts > 0 && 0 < top_k && top_k <= num_experts, "top_k must be between 1 and num_experts");
+
+        public:
+        static constexpr long expert_size = d_model * d_hidden + d_hidden + d_hidden * d_model + d_model;
+
+        explicit moe_feed_forward_(const float balance_weight = 0.01f)
+            : balance_weight(balance_weight),
+              router(d_model, num_experts),
+              w_in(d_model, d_hidden),
+              b_in(1, d_hidden),
+              w_out(d_hidden, d_model),
+              b_out(1, d_model)
+        {
+        }
+
+        float get_balance_weight() const { return balance_weight; }
+        // load-balancing loss of the last forward pass
+        float get_balance_loss() const { return balance_loss; }
+        // fraction of the token assignments that went to each expert in the last forward pass
+        const std::vector<float>& get_expert_load() const { return load; }
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            DLIB_CASSERT(sub.get_output().nc() == d_model, "moe_feed_forward expects rows of d_model = " << d_model << " values");
+            params.set_size(d_model * num_experts + num_experts * expert_size);
+            tt::tensor_rand rnd(std::rand());
+            auto router_w = router(params, 0);
+            rnd.fill_gaussian(router_w, 0, 1 / std::sqrt(static_cast<float>(d_model)));
+            for (long e = 0; e < num_experts; ++e)
+            {
+                auto wi = w_in(params, in_offset(e));
+                rnd.fill_gaussian(wi, 0, 1 / std::sqrt(static_cast<float>(d_model)));
+                b_in(params, in_offset(e) + w_in.size()) = 0;
+                auto wo = w_out(params, out_offset(e));
+                rnd.fill_gaussian(wo, 0, 1 / std::sqrt(static_cast<float>(d_hidden)));
+                b_out(params, out_offset(e) + w_out.size()) = 0;
+            }
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.nc() == d_model);
+            const long rows = in.size() / d_model;
+            output.copy_size(in);
+            output = 0;
+
+            // router probabilities and the top_k experts of each token
+            probs.set_size(rows, num_experts);
+            tt::gemm(0, probs, 1, alias_tensor(rows, d_model)(in), false, router(params, 0), false);
+            kernels::softmax_forward(probs.host(), rows, num_experts, probs.host());
+            choice.resize(rows * top_k);
+            gates.resize(rows * top_k);
+            std::array<long, num_experts> order;
+            for (long r = 0; r < rows; ++r)
+            {
+                const float* p = probs.host() + r * num_experts;
+                std::iota(order.begin(), order.end(), 0);
+                std::partial_sort(order.begin(), order.begin() + top_k, order.end(), [&](long a, long b) { return p[a] > p[b]; });
+                float sum = 0;
+                for (long j = 0; j < top_k; ++j)
+                    sum += p[order[j]];
+                for (long j = 0; j < top_k; ++j)
+                {
+                    choice[r * top_k + j] = order[j];
+                    gates[r * top_k + j] = p[order[j]] / sum;
+                }
+            }
+            group_by_expert(rows);
+
+            // f_e and P_e of the load-balancing loss
+            load.assign(num_experts, 0);
+            balance_loss = 0;
+            for (long e = 0; e < num_experts; ++e)
+            {
+                load[e] = static_cast<float>(expert_begin[e + 1] - expert_begin[e]) / (rows * top_k);
+                float mean_prob = 0;
+                for (long r = 0; r < rows; ++r)
+                    mean_prob += probs.host()[r * num_experts + e];
+                balance_loss += load[e] * mean_prob / rows;
+            }
+            balance_loss *= balance_weight * num_experts;
+
+            const float* x = in.host();
+            float* out = output.host();
+            for (long e = 0; e < num_experts; ++e)
+            {
+                const long n = expert_begin[e + 1] - expert_begin[e];
+                if (n == 0)
+                    continue;
+                auto& xs = expert_in[e];
+                xs.set_size(n, d_model);
+                for (long i = 0; i < n; ++i)
+                {
+                    const float* row = x + assignment[expert_begin[e] + i] / top_k * d_model;
+                    std::copy(row, row + d_model, xs.host() + i * d_model);
+                }
+                run_expert(e, n);
+                const float* y = expert_out[e].host();
+                for (long i = 0; i < n; ++i)
+                {
+                    const long a = assignment[expert_begin[e] + i];
+                    float* o = out + a / top_k * d_model;
+                    const float g = gates[a];
+                    for (long c = 0; c < d_model; ++c)
+                        o[c] += g * y[i * d_model + c];
+                }
+            }
+        }
+
+        template <typename SUBNET> void backward(const tensor& gradient_input, SUBNET& sub, tensor& params_grad)
+        {
+            const tensor& in = sub.get_output();
+            const long rows = in.size() / d_model;
+            const float* dout = gradient_input.host();
+            float* dx = sub.get_gradient_input().host();
+            params_grad = 0;
+            std::vector<float> dgates(rows * top_k, 0);
+            resizable_tensor dy, dh, dxs;
+            for (long e = 0; e < num_experts; ++e)
+            {
+                const long n = expert_begin[e + 1] - expert_begin[e];
+                if (n == 0)
+                    continue;
+                // the gradient of each assignment, weighted by its gate
+                dy.set_size(n, d_model);
+                const float* y = expert_out[e].host();
+                for (long i = 0; i < n; ++i)
+                {
+                    const long a = assignment[expert_begin[e] + i];
+                    const float* go = dout + a / top_k * d_model;
+                    float dot = 0;
+                    for (long c = 0; c < d_model; ++c)
+                    {
+                        dy.host()[i * d_model + c] = gates[a] * go[c];
+                        dot += go[c] * y[i * d_model + c];
+                    }
+                    dgates[a] = dot;
+                }
+
+                auto g_w_out = w_out(params_grad, out_offset(e));
+                tt::gemm(0, g_w_out, 1, expert_act[e], true, dy, false);
+                add_column_sums(dy, params_grad.host() + out_offset(e) + w_out.size(), d_model);
+                dh.set_size(n, d_hidden);
+                tt::gemm(0, dh, 1, dy, false, w_out(params, out_offset(e)), true);
+                kernels::gelu_backward(expert_hidden[e].host(), dh.host(), dh.size(), dh.host(), kernels::gelu_approximation::exact, false);
+                auto g_w_in = w_in(params_grad, in_offset(e));
+                tt::gemm(0, g_w_in, 1, expert_in[e], true, dh, false);
+                add_column_sums(dh, params_grad.host() + in_offset(e) + w_in.size(), d_hidden);
+                dxs.set_size(n, d_model);
+                tt::gemm(0, dxs, 1, dh, false, w_in(params, in_offset(e)), true);
+                for (long i = 0; i < n; ++i)
+                {
+                    float* d = dx + assignment[expert_begin[e] + i] / top_k * d_model;
+                    for (long c = 0; c < d_model; ++c)
+                        d[c] += dxs.host()[i * d_model + c];
+                }
+            }
+
+            // gates are the softmax of the chosen logits: dl_j = g_j * (dg_j - sum_m g_m * dg_m)
+            resizable_tensor dlogits(rows, num_experts);
+            dlogits = 0;
+            for (long r = 0; r < rows; ++r)
+            {
+                float dot = 0;
+                for (long j = 0; j < top_k; ++j)
+                    dot += gates[r * top_k + j] * dgates[r * top_k + j];
+                for (long j = 0; j < top_k; ++j)
+                    dlogits.host()[r * num_experts + choice[r * top_k + j]] = gates[r * top_k + j] * (dgates[r * top_k + j] - dot);
+            }
+            // the load-balancing loss through the softmax of all the logits, f_e held constant
+            if (balance_weight != 0)
+            {
+                resizable_tensor dprobs(rows, num_experts);
+                for (long r = 0; r < rows; ++r)
+                {
+                    for (long e = 0; e < num_experts; ++e)
+                        dprobs.host()[r * num_experts + e] = balance_weight * num_experts * load[e] / rows;
+                }
+                kernels::softmax_backward(probs.host(), dprobs.host(), rows, num_experts, dlogits.host(), true);
+            }
+            auto g_router = router(params_grad, 0);
+            tt::gemm(0, g_router, 1, alias_tensor(rows, d_model)(in), true, dlogits, false);
+            auto dx_rows = alias_tensor(rows, d_model)(sub.get_gradient_input());
+            tt::gemm(1, dx_rows, 1, dlogits, false, router(params, 0), true);
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        // Views of the parameters, for the incremental decoder.
+        alias_tensor_const_instance get_router_weights() const { return router(params, 0); }
+        alias_tensor_const_instance get_expert_in_weights(const long e) const { return w_in(params, in_offset(e)); }
+        alias_tensor_const_instance get_expert_in_biases(const long e) const { return b_in(params, in_offset(e) + w_in.size()); }
+        alias_tensor_const_instance get_expert_out_weights(const long e) const { return w_out(params, out_offset(e)); }
+        alias_tensor_const_instance get_expert_out_biases(const long e) const { return b_out(params, out_offset(e) + w_out.size()); }
+
+        friend void serialize(const moe_feed_forward_& item, std::ostream& out)
+        {
+            serialize("moe_feed_forward_", out);
+            serialize(item.params, out);
+            serialize(item.balance_weight, out);
+        }
+
+        friend void deserialize(moe_feed_forward_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "moe_feed_forward_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::moe_feed_forward_.");
+            deserialize(item.params, in);
+            deserialize(item.balance_weight, in);
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const moe_feed_forward_& item)
+        {
+            out << "moe_feed_forward\t (num_experts=" << num_experts << ", top_k=" << top_k << ", d_model=" << d_model
+                << ", d_hidden=" << d_hidden << ", balance_weight=" << item.balance_weight << ")";
+            return out;
+        }
+
+        friend void to_xml(const moe_feed_forward_& item, std::ostream& out)
+        {
+            out << "<moe_feed_forward num_experts='" << num_experts << "' top_k='" << top_k << "' d_model='" << d_model
+                << "' d_hidden='" << d_hidden << "' balance_weight='" << item.balance_weight << "'>\n";
+            out << mat(item.params);
+            out << "</moe_feed_forward>\n";
+        }
+
+        private:
+        static long in_offset(const long e) { return d_model * num_experts + e * expert_size; }
+        static long out_offset(const long e) { return in_offset(e) + d_model * d_hidden + d_hidden; }
+
+        // Sorts the assignments (token * top_k + j) by expert, counting sort.
+        void group_by_expert(const long rows)
+        {
+            expert_begin.assign(num_experts + 1, 0);
+            for (const long e : choice)
+                ++expert_begin[e + 1];
+            std::partial_sum(expert_begin.begin(), expert_begin.end(), expert_begin.begin());
+            assignment.resize(rows * top_k);
+            std::vector<long> next(expert_begin.begin(), expert_begin.end() - 1);
+            for (long a = 0; a < rows * top_k; ++a)
+                assignment[next[choice[a]]++] = a;
+        }
+
+        // expert_out[e] = gelu(expert_in[e] * w_in + b_in) * w_out + b_out, keeping the
+        // hidden values before and after the GELU for the backward pass
+        void run_expert(const long e, const long n)
+        {
+            auto& h = expert_hidden[e];
+            auto& a = expert_act[e];
+            auto& y = expert_out[e];
+            h.set_size(n, d_hidden);
+            tt::gemm(0, h, 1, expert_in[e], false, w_in(params, in_offset(e)), false);
+            add_bias(h, params.host() + in_offset(e) + w_in.size(), d_hidden);
+            a.copy_size(h);
+            kernels::gelu_forward(h.host(), h.size(), a.host());
+            y.set_size(n, d_model);
+            tt::gemm(0, y, 1, a, false, w_out(params, out_offset(e)), false);
+            add_bias(y, params.host() + out_offset(e) + w_out.size(), d_model);
+        }
+
+        static void add_bias(tensor& t, const float* b, const long cols)
+        {
+            float* p = t.host();
+            for (long r = 0; r < t.num_samples(); ++r, p += cols)
+            {
+                for (long c = 0; c < cols; ++c)
+                    p[c] += b[c];
+            }
+        }
+
+        static void add_column_sums(const tensor& t, float* sums, const long cols)
+        {
+            const float* p = t.host();
+            for (long r = 0; r < t.num_samples(); ++r, p += cols)
+            {
+                for (long c = 0; c < cols; ++c)
+                    sums[c] += p[c];
+            }
+        }
+
+        float balance_weight;
+        float balance_loss = 0;
+        resizable_tensor params;  // router (d_model, num_experts), then w_in, b_in, w_out, b_out of each expert
+        alias_tensor router, w_in, b_in, w_out, b_out;
+
+        // state of the last forward pass, for the backward pass
+        resizable_tensor probs;     // (rows, num_experts) router probabilities
+        std::vector<long> choice;   // (rows, top_k) chosen experts
+        std::vector<float> gates;   // (rows, top_k) their weights
+        std::vector<long> expert_begin, assignment;
+        std::vector<float> load;
+        std::array<resizable_tensor, num_experts> expert_in, expert_hidden, expert_act, expert_out;
+    };
+
+    template <long num_experts, long top_k, long d_model, typename SUBNET>
+    using moe_feed_forward = add_layer<moe_feed_forward_<num_experts, top_k, d_model>, SUBNET>;
+}
+
+#endif // MixtureOfExperts_H
@@ -0,0 +1,309 @@
+#ifndef QkvViews_H
+#define QkvViews_H
+
+/**
+ * @file qkv_views.h
+ * @brief Attention layers that read the heads straight from the packed QKV projection
+ *
+ * The unfused attention used to extract Q, K and V into three new tensors per layer and per
+ * step before any product was computed, and their gradients were copied back the same way.
+ * The layers below address the heads of the token_fc_no_bias QKV projection in place, as
+ * strided views: with d_k = d_model / num_heads and kv_dim = num_kv_heads * d_k, query head
+ * h is the d_k columns starting at h * d_k of each token row, and key and value head g the
+ * d_k columns starting at d_model + g * d_k and d_model + kv_dim + g * d_k.  Query head h
+ * reads key/value head h / (num_heads / num_kv_heads).  Their gradients are added in place
+ * into the gradient of that same buffer, so nothing is copied in either direction.
+ */
+
+#include <dlib/dnn.h>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    /**
+     * @brief Per-head attention scores Q * K^T over a packed QKV tensor.
+     *
+     * Input: (N, 1, seq_len, d_model + 2 * kv_dim).  Output: (N, num_heads, seq_len,
+     * seq_len), the unscaled scores of each head, ready for scale_weights, tril_mask and
+     * softmaxm.
+     *
+     * Template parameters:
+     * @param num_heads: Number of attention (query) heads
+     * @param d_model: Model dimension
+     * @param num_kv_heads: Number of key/value heads, a divisor of num_heads
+     */
+    template <long num_heads, long d_model, long num_kv_heads = num_heads>
+    class qk_scores_
+    {
+        static_assert(num_heads > 0 && d_model % num_heads == 0, "d_model must be divisible by num_heads");
+        static_assert(num_kv_heads > 0 && num_heads % num_kv_heads == 0, "num_heads must be a multiple of num_kv_heads");
+
+        public:
+        static constexpr long d_k = d_model / num_heads;
+        static constexpr long kv_dim = num_kv_heads * d_k;
+        static constexpr long qkv_stride = d_model + 2 * kv_dim;
+        static constexpr long group_size = num_heads / num_kv_heads;
+
+        qk_scores_() = default;
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.k() == 1 && in.nc() == qkv_stride, "qk_scores expects (N, 1, seq_len, d_model + 2 * kv_dim)");
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.k() == 1 && in.nc() == qkv_stride);
+            const long seq_len = in.nr();
+            output.set_size(in.num_samples(), num_heads, seq_len, seq_len);
+            const float* qkv = in.host();
+            float* scores = output.host_write_only();
+            parallel_for(default_thread_pool(), 0, in.num_samples() * num_heads, [&](long task)
+            {
+                const long n = task / num_heads;
+                const long h = task % num_heads;
+                const float* q = qkv + n * seq_len * qkv_stride + h * d_k;
+                const float* k = qkv + n * seq_len * qkv_stride + d_model + h / group_size * d_k;
+                float* s = scores + task * seq_len * seq_len;
+                for (long i = 0; i < seq_len; ++i)
+                {
+                    for (long j = 0; j < seq_len; ++j)
+                    {
+                        float dot = 0;
+                        for (long e = 0; e < d_k; ++e)
+                            dot += q[i * qkv_stride + e] * k[j * qkv_stride + e];
+                        s[i * seq_len + j] = dot;
+                    }
+                }
+            });
+        }
+
+        template <typename SUBNET>
+        void backward(const tensor& gradient_input, SUBNET& sub, tensor& /*params_grad*/)
+        {
+            const tensor& in = sub.get_output();
+            const long seq_len = in.nr();
+            const float* qkv = in.host();
+            const float* dscores = gradient_input.host();
+            float* dqkv = sub.get_gradient_input().host();
+            // each task owns one key head and the query heads of its group
+            parallel_for(default_thread_pool(), 0, in.num_samples() * num_kv_heads, [&](long task)
+            {
+                const long n = task / num_kv_heads;
+                const long kv_head = task % num_kv_heads;
+                const long k_offset = n * seq_len * qkv_stride + d_model + kv_head * d_k;
+                const float* k = qkv + k_offset;
+                float* dk = dqkv + k_offset;
+                for (long h = kv_head * group_size; h < (kv_head + 1) * group_size; ++h)
+                {
+                    const long q_offset = n * seq_len * qkv_stride + h * d_k;
+                    const float* q = qkv + q_offset;
+                    float* dq = dqkv + q_offset;
+                    const float* ds = dscores + (n * num_heads + h) * seq_len * seq_len;
+                    for (long i = 0; i < seq_len; ++i)
+                    {
+                        for (long j = 0; j < seq_len; ++j)
+                        {
+                            const float g = ds[i * seq_len + j];
+                            if (g == 0)
+                                continue;
+                            for (long e = 0; e < d_k; ++e)
+                            {
+                                dq[i * qkv_stride + e] += g * k[j * qkv_stride + e];
+                                dk[j * qkv_stride + e] += g * q[i * qkv_stride + e];
+                            }
+                        }
+                    }
+                }
+            });
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const qk_scores_& /*item*/, std::ostream& out)
+        {
+            serialize("qk_scores_", out);
+        }
+
+        friend void deserialize(qk_scores_& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "qk_scores_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::qk_scores_.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const qk_scores_& /*item*/)
+        {
+            out << "qk_scores\t (num_heads=" << num_heads << ", d_model=" << d_model << ", num_kv_heads=" << num_kv_heads << ")";
+            return out;
+        }
+
+        friend void to_xml(const qk_scores_& /*item*/, std::ostream& out)
+        {
+            out << "<qk_scores num_heads='" << num_heads << "' d_model='" << d_model << "' num_kv_heads='" << num_kv_heads << "'/>\n";
+        }
+
+        private:
+        resizable_tensor params;  // unused, the layer has no parameters
+    };
+
+    template <long num_heads, long d_model, long num_kv_heads, typename SUBNET>
+    using qk_scores = add_layer<qk_scores_<num_heads, d_model, num_kv_heads>, SUBNET>;
+
+    /**
+     * @brief Attention weights times V, with V read from the packed QKV tensor at tag.
+     *
+     * Input: (N, num_heads, seq_len, seq_len) attention weights.  The layer at tag must
+     * output the (N, 1, seq_len, d_model + 2 * kv_dim) projection.  Output: (N, 1, seq_len,
+     * d_model) with the heads concatenated, so no extra layer is needed to merge them.
+     *
+     * Template parameters:
+     * @param tag: Tag of the QKV projection
+     * @param num_heads: Number of attention (query) heads
+     * @param d_model: Model dimension
+     * @param num_kv_heads: Number of key/value heads, a divisor of num_heads
+     */
+    template <template <typename> class tag, long num_heads, long d_model, long num_kv_heads = num_heads>
+    class attend_values_
+    {
+        static_assert(num_heads > 0 && d_model % num_heads == 0, "d_model must be divisible by num_heads");
+        static_assert(num_kv_heads > 0 && num_heads % num_kv_heads == 0, "num_heads must be a multiple of num_kv_heads");
+
+        public:
+        static constexpr long d_k = d_model / num_heads;
+        static constexpr long kv_dim = num_kv_heads * d_k;
+        static constexpr long qkv_stride = d_model + 2 * kv_dim;
+        static constexpr long group_size = num_heads / num_kv_heads;
+
+        attend_values_() = default;
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            const tensor& weights = sub.get_output();
+            const tensor& qkv = layer<tag>(sub).get_output();
+            DLIB_CASSERT(qkv.k() == 1 && qkv.nc() == qkv_stride, "attend_values expects (N, 1, seq_len, d_model + 2 * kv_dim) at tag");
+            DLIB_CASSERT(weights.k() == num_heads && weights.nr() == qkv.nr() && weights.nc() == qkv.nr());
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& weights = sub.get_output();
+            const tensor& qkv = layer<tag>(sub).get_output();
+            DLIB_CASSERT(weights.num_samples() == qkv.num_samples() && weights.k() == num_heads);
+            const long seq_len = qkv.nr();
+            output.set_size(qkv.num_samples(), 1, seq_len, d_model);
+            const float* p_all = weights.host();
+            const float* v_all = qkv.host();
+            float* out_all = output.host_write_only();
+            parallel_for(default_thread_pool(), 0, qkv.num_samples() * num_heads, [&](long task)
+            {
+                const long n = task / num_heads;
+                const long h = task % num_heads;
+                const float* p = p_all + task * seq_len * seq_len;
+                const float* v = v_all + n * seq_len * qkv_stride + d_model + kv_dim + h / group_size * d_k;
+                float* out = out_all + n * seq_len * d_model + h * d_k;
+                for (long i = 0; i < seq_len; ++i)
+                {
+                    float* o = out + i * d_model;
+                    std::fill(o, o + d_k, 0.0f);
+                    for (long j = 0; j < seq_len; ++j)
+                    {
+                        const float w = p[i * seq_len + j];
+                        if (w == 0)
+                            continue;
+                        for (long e = 0; e < d_k; ++e)
+                            o[e] += w * v[j * qkv_stride + e];
+                    }
+                }
+            });
+        }
+
+        template <typename SUBNET>
+        void backward(const tensor& gradient_input, SUBNET& sub, tensor& /*params_grad*/)
+        {
+            const tensor& weights = sub.get_output();
+            auto& qkv_layer = layer<tag>(sub);
+            const tensor& qkv = qkv_layer.get_output();
+            const long seq_len = qkv.nr();
+            const float* p_all = weights.host();
+            const float* v_all = qkv.host();
+            const float* dout_all = gradient_input.host();
+            float* dp_all = sub.get_gradient_input().host();
+            float* dv_all = qkv_layer.get_gradient_input().host();
+            // each task owns one value head, and the weight gradients of the query heads of
+            // its group
+            parallel_for(default_thread_pool(), 0, qkv.num_samples() * num_kv_heads, [&](long task)
+            {
+                const long n = task / num_kv_heads;
+                const long kv_head = task % num_kv_heads;
+                const long v_offset = n * seq_len * qkv_stride + d_model + kv_dim + kv_head * d_k;
+                const float* v = v_all + v_offset;
+                float* dv = dv_all + v_offset;
+                for (long h = kv_head * group_size; h < (kv_head + 1) * group_size; ++h)
+                {
+                    const float* p = p_all + (n * num_heads + h) * seq_len * seq_len;
+                    const float* dout = dout_all + n * seq_len * d_model + h * d_k;
+                    float* dp = dp_all + (n * num_heads + h) * seq_len * seq_len;
+                    for (long i = 0; i < seq_len; ++i)
+                    {
+                        const float* d_o = dout + i * d_model;
+                        for (long j = 0; j < seq_len; ++j)
+                        {
+                            const float w = p[i * seq_len + j];
+                            float g = 0;
+                            for (long e = 0; e < d_k; ++e)
+                            {
+                                g += d_o[e] * v[j * qkv_stride + e];
+                                dv[j * qkv_stride + e] += w * d_o[e];
+                            }
+                            dp[i * seq_len + j] += g;
+                        }
+                    }
+                }
+            });
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const attend_values_& /*item*/, std::ostream& out)
+        {
+            serialize("attend_values_", out);
+        }
+
+        friend void deserialize(attend_values_& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "attend_values_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::attend_values_.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const attend_values_& /*item*/)
+        {
+            out << "attend_values\t (num_heads=" << num_heads << ", d_model=" << d_model << ", num_kv_heads=" << num_kv_heads << ")";
+            return out;
+        }
+
+        friend void to_xml(const attend_values_& /*item*/, std::ostream& out)
+        {
+            out << "<attend_values num_heads='" << num_heads << "' d_model='" << d_model << "' num_kv_heads='" << num_kv_heads << "'/>\n";
+        }
+
+        private:
+        resizable_tensor params;  // unused, the layer has no parameters
+    };
+
+    template <template <typename> class tag, long num_heads, long d_model, long num_kv_heads, typename SUBNET>
+    using attend_values = add_layer<attend_values_<tag, num_heads, d_model, num_kv_heads>, SUBNET>;
+
+    template <long num_heads, long d_model, long num_kv_heads, typename SUBNET>
+    using attend_values2 = attend_values<tag2, num_heads, d_model, num_kv_heads, SUBNET>;
+}
+
+#endif // QkvViews_H
@@ -0,0 +1,329 @@
+#ifndef Quantization_H
+#define Quantization_H
+
+/**
+ * @file quantization.h
+ * @brief Group-wise weight-only int8/int4 quantization of fc weights
+ *
+ * Decoding one token is a matrix-vector product per fc layer, and it is bound by the memory
+ * traffic of the weights rather than by the arithmetic: every weight is read once and used
+ * once.  Storing them on 8 or 4 bits instead of 32 divides that traffic by 4 or 8.
+ *
+ * The weights of each output are split in groups of group_size consecutive inputs, and each
+ * group has its own float scale, the largest magnitude of the group mapped to the largest
+ * integer (symmetric quantization, no zero point).  Activations stay in float: the kernel
+ * dequantizes the weights on the fly in the dot products, so no float copy of the weights is
+ * ever made for a single token.  For batches of many rows (prompts), the weights are
+ * dequantized once into a float matrix and multiplied with tt::gemm instead.
+ *
+ * int4 values are packed two per byte, in blocks of 32 inputs: byte c of a block holds input
+ * c in its low nibble and input c + 16 in its high nibble, so that both halves multiply
+ * contiguous inputs.
+ */
+
+#include <dlib/dnn.h>
+
+#include <cstdint>
+#include <limits>
+
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+
+namespace transformer
+{
+    using namespace dlib;
+
+    enum class weight_format
+    {
+        f32,
+        int8,
+        int4
+    };
+
+    inline std::string to_string(const weight_format format)
+    {
+        switch (format)
+        {
+        case weight_format::f32:
+            return "f32";
+        case weight_format::int8:
+            return "int8";
+        case weight_format::int4:
+            return "int4";
+        }
+        return "unknown";
+    }
+
+    /**
+     * @brief Quantized copy of the (num_inputs, num_outputs) weights of an fc layer, stored
+     * one output after the other so that each output is a contiguous dot product.
+     */
+    class quantized_matrix
+    {
+        public:
+        // rows up to which the dequantize-GEMV kernel is used instead of a float gemm
+        static constexpr long max_kernel_rows = 8;
+
+        quantized_matrix() = default;
+
+        quantized_matrix(const tensor& weights, const weight_format format, const long group_size = 64)
+            : format(format), n_in(weights.num_samples()), n_out(weights.size() / weights.num_samples()), group(group_size)
+        {
+            DLIB_CASSERT(format != weight_format::f32, "f32 weights are not quantized");
+            DLIB_CASSERT(group_size > 0 && group_size % 32 == 0, "group_size must be a multiple of 32");
+            DLIB_CASSERT(format != weight_format::int4 || n_in % 32 == 0,
+                "int4 quantization needs a multiple of 32 inputs, got " << n_in);
+            const float max_int = format == weight_format::int8 ? 127 : 7;
+            row_bytes = format == weight_format::int8 ? n_in : n_in / 2;
+            data.assign(n_out * row_bytes, 0);
+            scales.assign(n_out * num_groups(), 0);
+
+            const float* w = weights.host();
+            parallel_for(default_thread_pool(), 0, n_out, [&](long o)
+            {
+                int8_t* row = data.data() + o * row_bytes;
+                for (long g = 0; g < num_groups(); ++g)
+                {
+                    const long i0 = g * group;
+                    const long i1 = std::min(n_in, i0 + group);
+                    float max_abs = 0;
+                    for (long i = i0; i < i1; ++i)
+                        max_abs = std::max(max_abs, std::abs(w[i * n_out + o]));
+                    const float scale = max_abs / max_int;
+                    scales[o * num_groups() + g] = scale;
+                    const float inv_scale = scale > 0 ? 1 / scale : 0;
+                    for (long i = i0; i < i1; ++i)
+                    {
+                        const int q = static_cast<int>(std::max(-max_int, std::min(max_int, std::round(w[i * n_out + o] * inv_scale))));
+                        if (format == weight_format::int8)
+                        {
+                            row[i] = q;
+                        }
+                        else
+                        {
+                            // block of 32 inputs: byte c holds inputs c and c + 16
+                            const long block = i / 32, c = i % 32;
+                            uint8_t& byte = reinterpret_cast<uint8_t&>(row[block * 16 + c % 16]);
+                            byte |= static_cast<uint8_t>(q + 8) << (c < 16 ? 0 : 4);
+                        }
+                    }
+                }
+            });
+        }
+
+        bool empty() const { return data.empty(); }
+        weight_format get_format() const { return format; }
+        long num_inputs() const { return n_in; }
+        long num_outputs() const { return n_out; }
+        long group_size() const { return group; }
+        long num_groups() const { return (n_in + group - 1) / group; }
+        // bytes read to multiply by the whole matrix
+        size_t size_bytes() const { return data.size() + scales.size() * sizeof(float); }
+
+        // Output o of the layer for the input vector x.
+        float dot(const long o, const float* x) const
+        {
+            return format == weight_format::int8 ? dot_int8(o, x) : dot_int4(o, x);
+        }
+
+        // out (rows, num_outputs) = in (rows, num_inputs) * weights
+        void multiply(const float* in, const long rows, float* out) const
+        {
+            if (rows > max_kernel_rows)
+            {
+                thread_local resizable_tensor x, w, y;
+                x.set_size(rows, n_in);
+                std::copy(in, in + rows * n_in, x.host());
+                dequantize(w);
+                y.set_size(rows, n_out);
+                tt::gemm(0, y, 1, x, false, w, false);
+                std::copy(y.host(), y.host() + rows * n_out, out);
+                return;
+            }
+            // blocks of outputs, each weight row read once for all the input rows
+            const long block = 32;
+            parallel_for(default_thread_pool(), 0, (n_out + block - 1) / block, [&](long t)
+            {
+                for (long o = t * block; o < std::min(n_out, (t + 1) * block); ++o)
+                {
+                    for (long r = 0; r < rows; ++r)
+                        out[r * n_out + o] = dot(o, in + r * n_in);
+                }
+            });
+        }
+
+        // Back to float, as (num_inputs, num_outputs) weights.
+        void dequantize(resizable_tensor& weights) const
+        {
+            weights.set_size(n_in, n_out);
+            float* w = weights.host();
+            for (long o = 0; o < n_out; ++o)
+            {
+                const int8_t* row = data.data() + o * row_bytes;
+                for (long i = 0; i < n_in; ++i)
+                {
+                    int q;
+                    if (format == weight_format::int8)
+                    {
+                        q = row[i];
+                    }
+                    else
+                    {
+                        const uint8_t b = row[i / 32 * 16 + i % 16];
+                        q = (i % 32 < 16 ? (b & 15) : (b >> 4)) - 8;
+                    }
+                    w[i * n_out + o] = scales[o * num_groups() + i / group] * q;
+                }
+            }
+        }
+
+        friend void serialize(const quantized_matrix& item, std::ostream& out)
+        {
+            serialize("quantized_matrix", out);
+            serialize(static_cast<int>(item.format), out);
+            serialize(item.n_in, out);
+            serialize(item.n_out, out);
+            serialize(item.group, out);
+            serialize(item.scales, out);
+            out.write(reinterpret_cast<const char*>(item.data.data()), item.data.size());
+            if (!out)
+                throw serialization_error("Error serializing quantized_matrix.");
+        }
+
+        friend void deserialize(quantized_matrix& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "quantized_matrix")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing quantized_matrix.");
+            int format = 0;
+            deserialize(format, in);
+            item.format = static_cast<weight_format>(format);
+            deserialize(item.n_in, in);
+            deserialize(item.n_out, in);
+            deserialize(item.group, in);
+            deserialize(item.scales, in);
+            // an empty matrix, as held by the dense layers that are not quantized
+            if (item.format == weight_format::f32 && item.n_in == 0 && item.n_out == 0 && item.scales.empty())
+            {
+                item.row_bytes = 0;
+                item.data.clear();
+                return;
+            }
+            if ((item.format != weight_format::int8 && item.format != weight_format::int4) ||
+                item.n_in <= 0 || item.n_out <= 0 || item.group <= 0 || item.group % 32 != 0 ||
+                (item.format == weight_format::int4 && item.n_in % 32 != 0) ||
+                item.n_in > std::numeric_limits<long>::max() / item.n_out ||
+                item.scales.size() != static_cast<size_t>(item.n_out) * item.num_groups())
+                throw serialization_error("Invalid format or sizes found while deserializing quantized_matrix.");
+            item.row_bytes = item.format == weight_format::int8 ? item.n_in : item.n_in / 2;
+            item.data.resize(item.n_out * item.row_bytes);
+            in.read(reinterpret_cast<char*>(item.data.data()), item.data.size());
+            if (!in)
+                throw serialization_error("Error deserializing quantized_matrix.");
+        }
+
+        private:
+#if defined(__AVX2__) && defined(__FMA__)
+        static float horizontal_sum(const __m256 v)
+        {
+            __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+            sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+            sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+            return _mm_cvtss_f32(sum);
+        }
+
+        // 8 signed bytes to 8 floats
+        static __m256 to_float(const __m128i bytes)
+        {
+            return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(bytes));
+        }
+#endif
+
+        float dot_int8(const long o, const float* x) const
+        {
+            const int8_t* row = data.data() + o * row_bytes;
+            const float* s = scales.data() + o * num_groups();
+            float sum = 0;
+            long g = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+            __m256 total = _mm256_setzero_ps();
+            for (; (g + 1) * group <= n_in; ++g)
+            {
+                __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+                for (long i = g * group; i < (g + 1) * group; i += 16)
+                {
+                    const __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+                    acc0 = _mm256_fmadd_ps(to_float(q), _mm256_loadu_ps(x + i), acc0);
+                    acc1 = _mm256_fmadd_ps(to_float(_mm_srli_si128(q, 8)), _mm256_loadu_ps(x + i + 8), acc1);
+                }
+                total = _mm256_fmadd_ps(_mm256_set1_ps(s[g]), _mm256_add_ps(acc0, acc1), total);
+            }
+            sum = horizontal_sum(total);
+#endif
+            // the groups left, or all of them without AVX2
+            for (; g < num_groups(); ++g)
+            {
+                float acc = 0;
+                for (long i = g * group; i < std::min(n_in, (g + 1) * group); ++i)
+                    acc += row[i] * x[i];
+                sum += s[g] * acc;
+            }
+            return sum;
+        }
+
+        float dot_int4(const long o, const float* x) const
+        {
+            const uint8_t* row = reinterpret_cast<const uint8_t*>(data.data()) + o * row_bytes;
+            const float* s = scales.data() + o * num_groups();
+#if defined(__AVX2__) && defined(__FMA__)
+            const __m128i mask = _mm_set1_epi8(15);
+            const __m128i offset = _mm_set1_epi8(8);
+            __m256 total = _mm256_setzero_ps();
+            for (long g = 0; g < num_groups(); ++g)
+            {
+                __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+                // the last group is shorter when group_size does not divide the number of
+                // inputs, which is always a multiple of 32
+                for (long i = g * group; i < std::min(n_in, (g + 1) * group); i += 32)
+                {
+                    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i / 2));
+                    const __m128i lo = _mm_sub_epi8(_mm_and_si128(b, mask), offset);
+                    const __m128i hi = _mm_sub_epi8(_mm_and_si128(_mm_srli_epi16(b, 4), mask), offset);
+                    acc0 = _mm256_fmadd_ps(to_float(lo), _mm256_loadu_ps(x + i), acc0);
+                    acc1 = _mm256_fmadd_ps(to_float(_mm_srli_si128(lo, 8)), _mm256_loadu_ps(x + i + 8), acc1);
+                    acc0 = _mm256_fmadd_ps(to_float(hi), _mm256_loadu_ps(x + i + 16), acc0);
+                    acc1 = _mm256_fmadd_ps(to_float(_mm_srli_si128(hi, 8)), _mm256_loadu_ps(x + i + 24), acc1);
+                }
+                total = _mm256_fmadd_ps(_mm256_set1_ps(s[g]), _mm256_add_ps(acc0, acc1), total);
+            }
+            return horizontal_sum(total);
+#else
+            float sum = 0;
+            for (long g = 0; g < num_groups(); ++g)
+            {
+                float acc = 0;
+                for (long i = g * group; i < std::min(n_in, (g + 1) * group); i += 32)
+                {
+                    const uint8_t* b = row + i / 2;
+                    for (long c = 0; c < 16; ++c)
+                        acc += ((b[c] & 15) - 8) * x[i + c] + ((b[c] >> 4) - 8) * x[i + 16 + c];
+                }
+                sum += s[g] * acc;
+            }
+            return sum;
+#endif
+        }
+
+        weight_format format = weight_format::f32;
+        long n_in = 0;
+        long n_out = 0;
+        long group = 0;
+        long row_bytes = 0;
+        std::vector<int8_t> data;    // (num_outputs, row_bytes)
+        std::vector<float> scales;   // (num_outputs, num_groups)
+    };
+}
+
+#endif // Quantization_H
@@ -0,0 +1,238 @@
+#ifndef Sampling_H
+#define Sampling_H
+
+/**
+ * @file sampling.h
+ * @brief Picks the next token without computing the full softmax over the vocabulary
+ *
+ * The classification head ends in fc<VOCAB_SIZE>, and picking a token from its output the
+ * usual way computes all the logits, a softmax over all of them and often a sort, for each
+ * generated token.  With 32k to 50k tokens that is a large part of the decoding time.  The
+ * sampler below fuses the last fc layer with the selection: it computes the logits one tile
+ * of the vocabulary at a time, in parallel, and only keeps
+ *  - the best token for greedy decoding,
+ *  - the best token after adding Gumbel noise for plain temperature sampling, which is an
+ *    exact sample of the softmax (Gumbel-max trick),
+ *  - the k best tokens for top-k, and for top-p a bounded number of candidates plus the
+ *    running maximum and sum of the softmax, so the nucleus is taken with the true
+ *    probabilities.
+ * Only the candidates are normalized and sorted.
+ */
+
+#include "incremental_decoder.h"
+
+#include <random>
+
+namespace transformer
+{
+    struct sampling_options
+    {
+        // 0 picks the most likely token
+        float temperature = 1;
+        // sample among the top_k most likely tokens, 0 for no limit
+        long top_k = 0;
+        // sample among the most likely tokens whose probabilities add up to top_p, 1 for no limit
+        float top_p = 1;
+        // tokens kept to build the top_p nucleus when there is no top_k; if they do not reach
+        // top_p, the nucleus is all of them
+        long max_candidates = 256;
+        unsigned long seed = 0;
+    };
+
+    /**
+     * @brief Selects tokens from the features of the last head layer, computing its logits
+     * tile by tile.
+     *
+     * Usage:
+     *   token_sampler sampler(options);
+     *   int token = sampler(weights.head.back(), decoder.prefill_features(prompt));
+     *   while (...) token = sampler(weights.head.back(), decoder.step_features(token));
+     */
+    class token_sampler
+    {
+        public:
+        // columns of the vocabulary whose logits are computed together, small enough to stay in L1
+        static constexpr long tile_size = 1024;
+
+        explicit token_sampler(const sampling_options& options = sampling_options()) : options(options), rng(options.seed)
+        {
+            DLIB_CASSERT(options.temperature >= 0 && options.top_k >= 0 && options.max_candidates > 0);
+            DLIB_CASSERT(0 < options.top_p && options.top_p <= 1);
+        }
+
+        int operator()(const dense_weights& fc, const std::vector<float>& features)
+        {
+            DLIB_CASSERT(static_cast<long>(features.size()) == fc.num_inputs());
+            const bool greedy = options.temperature == 0 || options.top_k == 1;
+            const bool truncated = options.top_k > 0 || options.top_p < 1;
+            const bool gumbel = !greedy && !truncated;
+            const long keep = (greedy || gumbel) ? 1 : (options.top_k > 0 ? options.top_k : options.max_candidates);
+            const bool full_normalizer = !greedy && options.top_k == 0 && options.top_p < 1;
+            scan(fc, features.data(), keep, gumbel, full_normalizer);
+            if (greedy || gumbel)
+                return candidates.front().second;
+
+            // candidates are sorted, most likely first
+            const float max_logit = candidates.front().first;
+            float sum = 0;
+            probs.resize(candidates.size());
+            for (size_t i = 0; i < candidates.size(); ++i)
+                sum += (probs[i] = std::exp((candidates[i].first - max_logit) / options.temperature));
+            // top_p on the distribution that top_k left, or on the full softmax without top_k
+            const float normalizer = full_normalizer ? total * std::exp(total_max - max_logit / options.temperature) : sum;
+            size_t nucleus = candidates.size();
+            if (options.top_p < 1)
+            {
+                float cumulative = 0;
+                for (size_t i = 0; i < candidates.size(); ++i)
+                {
+                    cumulative += probs[i] / normalizer;
+                    if (cumulative >= options.top_p)
+                    {
+                        nucleus = i + 1;
+                        break;
+                    }
+                }
+            }
+            float mass = 0;
+            for (size_t i = 0; i < nucleus; ++i)
+                mass += probs[i];
+            float u = std::uniform_real_distribution<float>(0, mass)(rng);
+            for (size_t i = 0; i < nucleus; ++i)
+            {
+                u -= probs[i];
+                if (u < 0)
+                    return candidates[i].second;
+            }
+            return candidates[nucleus - 1].second;
+        }
+
+        const sampling_options& get_options() const { return options; }
+
+        private:
+        using candidate = std::pair<float, int>;  // (logit, token)
+
+        struct partial
+        {
+            std::vector<candidate> heap;  // min-heap of the best tokens of the part
+            float max_score = -std::numeric_limits<float>::infinity();
+            float sum = 0;                // of exp((logit - max_score) / temperature)
+            std::mt19937 rng;
+            std::vector<float> tile;
+        };
+
+        // Computes the logits tile by tile, keeping the `keep` best of each part, and merges
+        // the parts into candidates, sorted by decreasing logit.
+        void scan(const dense_weights& fc, const float* x, const long keep, const bool gumbel, const bool normalizer)
+        {
+            const long n_in = fc.num_inputs();
+            const long vocab = fc.num_outputs();
+            const bool quantized = !fc.quantized.empty();
+            const float* weights = quantized ? nullptr : fc.weights.host();
+            const float* biases = fc.biases.size() != 0 ? fc.biases.host() : nullptr;
+            const long num_tiles = (vocab + tile_size - 1) / tile_size;
+            const long num_parts = std::min<long>(num_tiles, std::max<long>(1, default_thread_pool().num_threads_in_pool()));
+            parts.resize(num_parts);
+            for (auto& part : parts)
+            {
+                part.heap.clear();
+                part.max_score = -std::numeric_limits<float>::infinity();
+                part.sum = 0;
+                if (gumbel)
+                    part.rng.seed(rng());
+            }
+            const float inv_temperature = options.temperature > 0 ? 1 / options.temperature : 1;
+
+            parallel_for(default_thread_pool(), 0, num_parts, [&](long p)
+            {
+                partial& part = parts[p];
+                std::uniform_real_distribution<float> uniform(std::numeric_limits<float>::min(), 1);
+                part.tile.resize(tile_size);
+                for (long t = p * num_tiles / num_parts; t < (p + 1) * num_tiles / num_parts; ++t)
+                {
+                    const long v0 = t * tile_size;
+                    const long cols = std::min(tile_size, vocab - v0);
+                    float* logits = part.tile.data();
+                    if (biases)
+                        std::copy(biases + v0, biases + v0 + cols, logits);
+                    else
+                        std::fill(logits, logits + cols, 0.0f);
+                    if (quantized)
+                    {
+                        // quantized weights are stored per output (quantization.h)
+                        for (long c = 0; c < cols; ++c)
+                            logits[c] += fc.quantized.dot(v0 + c, x);
+                    }
+                    else
+                    {
+                        // weights are (n_in, vocab), so each input adds a contiguous row piece
+                        for (long i = 0; i < n_in; ++i)
+                        {
+                            const float xi = x[i];
+                            const float* w = weights + i * vocab + v0;
+                            for (long c = 0; c < cols; ++c)
+                                logits[c] += xi * w[c];
+                        }
+                    }
+                    for (long c = 0; c < cols; ++c)
+                    {
+                        float score = logits[c];
+                        if (normalizer)
+                        {
+                            const float s = score * inv_temperature;
+                            if (s > part.max_score)
+                            {
+                                part.sum = part.sum * std::exp(part.max_score - s) + 1;
+                                part.max_score = s;
+                            }
+                            else
+                            {
+                                part.sum += std::exp(s - part.max_score);
+                            }
+                        }
+                        if (gumbel)
+                            score = score * inv_temperature - std::log(-std::log(uniform(part.rng)));
+                        if (static_cast<long>(part.heap.size()) < keep)
+                        {
+                            part.heap.emplace_back(score, v0 + c);
+                            std::push_heap(part.heap.begin(), part.heap.end(), std::greater<candidate>());
+                        }
+                        else if (score > part.heap.front().first)
+                        {
+                            std::pop_heap(part.heap.begin(), part.heap.end(), std::greater<candidate>());
+                            part.heap.back() = candidate(score, v0 + c);
+                            std::push_heap(part.heap.begin(), part.heap.end(), std::greater<candidate>());
+                        }
+                    }
+                }
+            });
+
+            candidates.clear();
+            total_max = -std::numeric_limits<float>::infinity();
+            for (const auto& part : parts)
+            {
+                candidates.insert(candidates.end(), part.heap.begin(), part.heap.end());
+                total_max = std::max(total_max, part.max_score);
+            }
+            total = 0;
+            for (const auto& part : parts)
+            {
+                if (part.sum > 0)
+                    total += part.sum * std::exp(part.max_score - total_max);
+            }
+            const long n = std::min<long>(keep, candidates.size());
+            std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(), std::greater<candidate>());
+            candidates.resize(n);
+        }
+
+        sampling_options options;
+        std::mt19937 rng;
+        std::vector<partial> parts;
+        std::vector<candidate> candidates;
+        std::vector<float> probs;
+        float total_max = 0;  // softmax maximum and sum over the whole vocabulary, when needed
+        float total = 0;
+    };
+}
+
+#endif // Sampling_H
@@ -14,10 +14,20 @@
  * - RMS normalization for enhanced stability
  * - Optimized residual connections
  * - Causal masking for autoregressive attention
+ * - Per-token rms_norm and softmax on AVX2/AVX-512 kernels picked at runtime
  */
 
 #include <dlib/dnn.h>
 
+#include "../checkpoint.h"
+#include "causal_attention.h"
+#include "fast_layers.h"
+#include "mixture_of_experts.h"
+#include "qkv_views.h"
+#include "softmax_heads.h"
+#include "sparse_embeddings.h"
+#include "token_fc.h"
+
 namespace transformer
 {
     using namespace dlib;
@@ -33,31 +43,20 @@ namespace transformer
     using scale_weights = add_layer<scale_weights_<d_k>, SUBNET>;
 
     namespace def {
-        template <long num_heads, long d_model, typename SUBNET>
-        using query = extract<0, num_heads, d_model / num_heads, 1, SUBNET>;
-
-        template <long num_heads, long d_model, typename SUBNET>
-        using key = extract<d_model, num_heads, 1, d_model / num_heads, SUBNET>;
-
-        template <long num_heads, long d_model, typename SUBNET>
-        using value = extract<(d_model * 2), num_heads, d_model / num_heads, 1, SUBNET>;
-
         /**
          * Multi-Head Attention Layer
          *
          * Structure:
          * 1. Input processing
          *    - RMS normalization
-         *    - Single linear projection (d_model -> 3*d_model) for Q,K,V
-         * 2. Parallel head processing (num_heads)
-         *    - Split into Q, K, V tensors
-         *    - Key transposition for attention computation
-         * 3. Attention mechanism
-         *    - Scaled dot-product (Q*K^T / sqrt(d_k))
-         *    - Causal masking (tril_mask)
-         *    - Softmax normalization
+         *    - Single linear projection for Q,K,V (d_model -> d_model + 2*num_kv_heads*d_k),
+         *      applied to each token (token_fc.h)
+         * 2. Fused causal attention (causal_attention.h), for each of the num_heads heads
+         *    - Query heads grouped over the num_kv_heads key/value heads
+         *    - Scaled dot-product (Q*K^T / sqrt(d_k)) over the lower triangle only
+         *    - Online softmax, the score matrix is never materialized
          *    - Value weighting
-         * 4. Output
+         * 3. Output
          *    - Head concatenation
          *    - Residual connection
          *
@@ -66,18 +65,31 @@ namespace transformer
          * @param DO: Dropout layer type
          * @param d_model: Model dimension
          * @param num_heads: Number of attention heads
+         * @param num_kv_heads: Number of key/value heads shared by the attention heads
          * @param SUBNET: Input subnet type
          */
         template <template <typename> class ACT, template <typename> class DO,
-            long d_model, long num_heads, typename SUBNET>
-        using multihead_attention = add_prev1<DO<extract<0, 1, 1, d_model, multm_prev3<
-            DO<softmaxm<tril_mask<
+            long d_model, long num_heads, long num_kv_heads, typename SUBNET>
+        using multihead_attention = add_prev1<DO<causal_attention<num_heads, d_model, num_kv_heads,
+            token_fc_no_bias<d_model + 2 * (d_model / num_heads) * num_kv_heads, fast_rms_norm<
+            tag1<SUBNET>>>>>>;
+
+        /**
+         * Unfused Multi-Head Attention Layer
+         *
+         * The same attention built from generic layers: the per-head scores are read from
+         * the projection in place (qkv_views.h) and go through scale_weights, tril_mask and
+         * softmaxm as a full seq_len x seq_len matrix per head.  Unlike the fused layer it can
+         * apply dropout to the attention weights.  Kept as a reference for multihead_attention.
+         */
+        template <template <typename> class ACT, template <typename> class DO,
+            long d_model, long num_heads, long num_kv_heads, typename SUBNET>
+        using multihead_attention_unfused = add_prev1<DO<attend_values2<num_heads, d_model, num_kv_heads,
+            DO<fast_softmaxm<tril_mask<
             scale_weights<d_model / num_heads,
-            multm_prev4<query<num_heads, d_model, skip2<
-            tag4<key<num_heads, d_model, skip2<
-            tag3<value<num_heads, d_model,
-            tag2<fc_no_bias<d_model * 3, rms_norm<
-            tag1<SUBNET>>>>>>>>>>>>>>>>>>>>;
+            qk_scores<num_heads, d_model, num_kv_heads,
+            tag2<token_fc_no_bias<d_model + 2 * (d_model / num_heads) * num_kv_heads, fast_rms_norm<
+            tag1<SUBNET>>>>>>>>>>>>;
 
         /**
          * Feed-Forward Network Layer
@@ -86,7 +98,7 @@ namespace transformer
          * 1. Input processing
          *    - RMS normalization
          *    - Input tagged for residual connection
-         * 2. Transformation
+         * 2. Transformation, applied to each token (token_fc.h)
          *    - Expansion layer (d_model -> 4*d_model)
          *    - Activation function
          *    - Projection layer (4*d_model -> d_model)
@@ -103,52 +115,121 @@ namespace transformer
         template <template <typename> class ACT, template <typename> class DO, long d_model, typename SUBNET>
         using feed_forward =
             add_prev5<
-            DO<extract<0, 1, 1, d_model,
-            fc<d_model, ACT<fc<d_model * 4, rms_norm<
-            tag5<SUBNET>>>>>>>>;
+            DO<token_fc<d_model, ACT<token_fc<d_model * 4, fast_rms_norm<
+            tag5<SUBNET>>>>>>>;
+
+        /**
+         * Sparse Mixture-of-Experts Feed-Forward Layer
+         *
+         * The feed-forward network replaced by num_experts GELU networks of the same shape,
+         * each token going through the experts_per_token of them that a learned router picks
+         * (mixture_of_experts.h), with a load-balancing loss on the router.
+         *
+         * Template parameters:
+         * @param DO: Dropout layer type
+         * @param d_model: Model dimension
+         * @param num_experts: Number of expert networks
+         * @param experts_per_token: Number of experts applied to each token
+         * @param SUBNET: Input subnet type
+         */
+        template <template <typename> class DO, long d_model, long num_experts, long experts_per_token, typename SUBNET>
+        using sparse_feed_forward =
+            add_prev5<
+            DO<moe_feed_forward<num_experts, experts_per_token, d_model, fast_rms_norm<
+            tag5<SUBNET>>>>>;
+
+        // dense feed_forward without experts, sparse_feed_forward otherwise
+        template <long num_experts, long experts_per_token, template <typename> class ACT, template <typename> class DO, long d_model, typename SUBNET>
+        struct feed_forward_impl
+        {
+            using type = sparse_feed_forward<DO, d_model, num_experts, experts_per_token, SUBNET>;
+        };
+        template <long experts_per_token, template <typename> class ACT, template <typename> class DO, long d_model, typename SUBNET>
+        struct feed_forward_impl<0, experts_per_token, ACT, DO, d_model, SUBNET>
+        {
+            using type = feed_forward<ACT, DO, d_model, SUBNET>;
+        };
 
         /**
          * Transformer Block
          *
          * Combines sequentially:
          * 1. Multi-head attention layer
-         * 2. Feed-forward network
+         * 2. Feed-forward network, or mixture of experts when num_experts > 0
          *
          * Template parameters:
          * @param ACT: Activation function type
          * @param DO: Dropout layer type
          * @param d_model: Model dimension
          * @param num_heads: Number of attention heads
+         * @param num_kv_heads: Number of key/value heads
+         * @param num_experts: Number of feed-forward experts, 0 for the dense network
+         * @param experts_per_token: Number of experts applied to each token
          * @param SUBNET: Input subnet type
          */
-        template <template <typename> class ACT, template <typename> class DO, long seq_len, long d_model, long num_heads, typename SUBNET>
+        template <template <typename> class ACT, template <typename> class DO, long seq_len, long d_model, long num_heads, long num_kv_heads,
+            long num_experts, long experts_per_token, typename SUBNET>
         using transformer_block =
-            feed_forward<ACT, DO, d_model,
-            multihead_attention<ACT, DO, d_model, num_heads, SUBNET>>;
+            typename feed_forward_impl<num_experts, experts_per_token, ACT, DO, d_model,
+            multihead_attention<ACT, DO, d_model, num_heads, num_kv_heads, SUBNET>>::type;
     }
 
     // Positional Embeddings
     template <long num_embeddings, long embedding_length, typename SUBNET>
     using positional_embeddings = positional_encodings<embeddings<num_embeddings, embedding_length, SUBNET>>;
+    // with the table updated row by row, by the layer itself (sparse_embeddings.h)
+    template <long num_embeddings, long embedding_length, typename SUBNET>
+    using positional_sparse_embeddings = positional_encodings<sparse_embeddings<num_embeddings, embedding_length, SUBNET>>;
 
     // Classification Head   
     template <template <typename> class ACT, long embedding_length, typename SUBNET>
     using squeezing = fc<embedding_length / 4, ACT<fc<embedding_length / 8, SUBNET>>>;
 
-    template <bool USE_SQUEEZING, template <typename> class ACT, long num_logits, long embedding_length, typename SUBNET>
+    // Output layer and loss over the vocabulary
+    enum class softmax_head
+    {
+        full,      // fc<num_logits> and loss_multiclass_log, the exact softmax
+        adaptive,  // adaptive_softmax, rare tokens in clusters behind a small head (softmax_heads.h)
+        sampled    // sampled_softmax, the fc<num_logits> weights trained on sampled tokens (softmax_heads.h)
+    };
+
+    template <softmax_head HEAD, long num_logits, typename SUBNET>
+    struct output_head_impl
+    {
+        using type = loss_multiclass_log<fc<num_logits, SUBNET>>;
+    };
+    template <long num_logits, typename SUBNET>
+    struct output_head_impl<softmax_head::adaptive, num_logits, SUBNET>
+    {
+        using type = loss_adaptive_softmax<num_logits, std::min(2048L, num_logits), SUBNET>;
+    };
+    template <long num_logits, typename SUBNET>
+    struct output_head_impl<softmax_head::sampled, num_logits, SUBNET>
+    {
+        using type = loss_sampled_softmax<num_logits, std::min(1024L, num_logits), SUBNET>;
+    };
+    template <softmax_head HEAD, long num_logits, typename SUBNET>
+    using output_head = typename output_head_impl<HEAD, num_logits, SUBNET>::type;
+
+    // The next token is predicted from the features of the last token of the window only, as
+    // a (N, embedding_length, 1, 1) tensor: rms_norm normalizes it with one gamma per feature.
+    template <long seq_len, long embedding_length, typename SUBNET>
+    using last_token = rms_norm<extract<(seq_len - 1) * embedding_length, embedding_length, 1, 1, SUBNET>>;
+
+    template <bool USE_SQUEEZING, softmax_head HEAD, template <typename> class ACT, long num_logits, long embedding_length, long seq_len, typename SUBNET>
     struct classification_head_impl;
-    template <template <typename> class ACT, long num_logits, long embedding_length, typename SUBNET>
-    struct classification_head_impl<true, ACT, num_logits, embedding_length, SUBNET>
+    template <softmax_head HEAD, template <typename> class ACT, long num_logits, long embedding_length, long seq_len, typename SUBNET>
+    struct classification_head_impl<true, HEAD, ACT, num_logits, embedding_length, seq_len, SUBNET>
     {
-        using type = loss_multiclass_log<fc<num_logits, squeezing<ACT, embedding_length, rms_norm<SUBNET>>>>;
+        using type = output_head<HEAD, num_logits, squeezing<ACT, embedding_length, last_token<seq_len, embedding_length, SUBNET>>>;
     };
-    template <template <typename> class ACT, long num_logits, long embedding_length, typename SUBNET>
-    struct classification_head_impl<false, ACT, num_logits, embedding_length, SUBNET>
+    template <softmax_head HEAD, template <typename> class ACT, long num_logits, long embedding_length, long seq_len, typename SUBNET>
+    struct classification_head_impl<false, HEAD, ACT, num_logits, embedding_length, seq_len, SUBNET>
     {
-        using type = loss_multiclass_log<fc<num_logits, rms_norm<SUBNET>>>;
+        using type = output_head<HEAD, num_logits, last_token<seq_len, embedding_length, SUBNET>>;
     };
-    template <bool USE_SQUEEZING, template <typename> class ACT, long num_logits, long embedding_length, typename SUBNET>
-    using classification_head = typename classification_head_impl<USE_SQUEEZING, ACT, num_logits, embedding_length, SUBNET>::type;
+    template <bool USE_SQUEEZING, softmax_head HEAD, template <typename> class ACT, long num_logits, long embedding_length, long seq_len, typename SUBNET>
+    using classification_head = typename classification_head_impl<USE_SQUEEZING, HEAD, ACT, num_logits, embedding_length, seq_len, SUBNET>::type;
 
     /**
      * @brief Transformer Model Configuration Template
@@ -163,8 +244,19 @@ namespace transformer
      * @param embedding_dim Dimension of token embeddings
      * @param max_seq_len Maximum sequence length
      * @param use_squeezing Use squeezing layer
-     * @param activation_func Activation function type
+     * @param activation_func Activation function type, fast_gelu for the GELU of kernels.h
      * @param dropout_policy Dropout regularization policy
+     * @param num_kv_heads Number of key/value heads, num_heads for multi-head attention, a
+     *        divisor of it for grouped-query attention, 1 for multi-query attention
+     * @param num_experts Number of feed-forward experts per block, 0 for a dense feed-forward
+     *        network
+     * @param experts_per_token Number of experts each token goes through when num_experts > 0
+     * @param use_checkpointing Recompute the activations of each block in the backward pass
+     *        instead of keeping them (checkpoint.h), for larger batches or sequences
+     * @param output_softmax Softmax over the vocabulary: the exact one, or the adaptive or
+     *        sampled softmax for faster training with large vocabularies
+     * @param use_sparse_embeddings Update only the embeddings of the tokens of each batch, with
+     *        the lazy Adam or SGD of sparse_embeddings instead of the trainer's solver
      */
     template <
         long vocab_size = 5000,                                 // Default vocabulary size
@@ -174,16 +266,28 @@ namespace transformer
         long max_seq_len = 100,                                 // Default maximum sequence length
         bool use_squeezing = false,                             // Default use squeezing layer
         template <typename> class activation_func = gelu,       // Default activation function
-        template <typename> class dropout_policy = dropout_10   // Default dropout policy
+        template <typename> class dropout_policy = dropout_10,  // Default dropout policy
+        long num_kv_heads = num_heads,                          // Default one key/value head per attention head
+        long num_experts = 0,                                   // Default dense feed-forward network
+        long experts_per_token = 2,                             // Default experts per token with num_experts > 0
+        bool use_checkpointing = false,                         // Default keep the activations of the blocks
+        softmax_head output_softmax = softmax_head::full,       // Default exact softmax over the vocabulary
+        bool use_sparse_embeddings = false                      // Default dlib embeddings
     >
     struct transformer_config {
         // Core model parameters
         static constexpr long VOCAB_SIZE = vocab_size;
         static constexpr long NUM_LAYERS = num_layers;
         static constexpr long NUM_HEADS = num_heads;
+        static constexpr long NUM_KV_HEADS = num_kv_heads;
+        static constexpr long NUM_EXPERTS = num_experts;
+        static constexpr long EXPERTS_PER_TOKEN = experts_per_token;
         static constexpr long EMBEDDING_DIM = embedding_dim;
         static constexpr long MAX_SEQ_LEN = max_seq_len;
         static constexpr bool USE_SQUEEZING = use_squeezing;
+        static constexpr bool USE_CHECKPOINTING = use_checkpointing;
+        static constexpr softmax_head OUTPUT_SOFTMAX = output_softmax;
+        static constexpr bool USE_SPARSE_EMBEDDINGS = use_sparse_embeddings;
 
         /**
          * @brief Compile-time validation of model configuration
@@ -195,6 +299,11 @@ namespace transformer
             static_assert(NUM_LAYERS > 0, "Number of layers must be positive");
             static_assert(NUM_HEADS > 0, "Number of attention heads must be positive");
             static_assert(EMBEDDING_DIM% NUM_HEADS == 0, "Embedding dimension must be divisible by number of heads");
+            static_assert(NUM_KV_HEADS > 0, "Number of key/value heads must be positive");
+            static_assert(NUM_HEADS% NUM_KV_HEADS == 0, "Number of heads must be divisible by number of key/value heads");
+            static_assert(NUM_EXPERTS >= 0, "Number of experts must not be negative");
+            static_assert(NUM_EXPERTS == 0 || (0 < EXPERTS_PER_TOKEN && EXPERTS_PER_TOKEN <= NUM_EXPERTS),
+                "Experts per token must be between 1 and the number of experts");
         };
 
         /**
@@ -207,18 +316,32 @@ namespace transformer
          * @tparam is_training Determines training or inference network type
          */
         template <typename SUBNET>
-        using t_transformer_block = def::transformer_block<activation_func, dropout_policy, MAX_SEQ_LEN, EMBEDDING_DIM, NUM_HEADS, SUBNET>;
+        using t_transformer_block = def::transformer_block<activation_func, dropout_policy, MAX_SEQ_LEN, EMBEDDING_DIM, NUM_HEADS, NUM_KV_HEADS, NUM_EXPERTS, EXPERTS_PER_TOKEN, SUBNET>;
+        template <typename SUBNET>
+        using i_transformer_block = def::transformer_block<activation_func, multiply, MAX_SEQ_LEN, EMBEDDING_DIM, NUM_HEADS, NUM_KV_HEADS, NUM_EXPERTS, EXPERTS_PER_TOKEN, SUBNET>;
+
+        // the training block to checkpoint, whose dropout masks are replayed in its recomputation
+        template <typename SUBNET>
+        using c_transformer_block = def::transformer_block<activation_func, checkpointing::replayable<dropout_policy>::template type, MAX_SEQ_LEN, EMBEDDING_DIM, NUM_HEADS, NUM_KV_HEADS, NUM_EXPERTS, EXPERTS_PER_TOKEN, SUBNET>;
+
+        // the blocks of the stack, checkpointed in both networks so that they share their layout
         template <typename SUBNET>
-        using i_transformer_block = def::transformer_block<activation_func, multiply, MAX_SEQ_LEN, EMBEDDING_DIM, NUM_HEADS, SUBNET>;
+        using t_block = std::conditional_t<USE_CHECKPOINTING, checkpointing::checkpoint<c_transformer_block, SUBNET>, t_transformer_block<SUBNET>>;
+        template <typename SUBNET>
+        using i_block = std::conditional_t<USE_CHECKPOINTING, checkpointing::checkpoint<i_transformer_block, SUBNET>, i_transformer_block<SUBNET>>;
+
+        using input_embeddings = std::conditional_t<USE_SPARSE_EMBEDDINGS,
+            positional_sparse_embeddings<VOCAB_SIZE, EMBEDDING_DIM, input<matrix<int, 0, 1>>>,
+            positional_embeddings<VOCAB_SIZE, EMBEDDING_DIM, input<matrix<int, 0, 1>>>>;
 
         template<bool is_training>
         using network_type = std::conditional_t<is_training,
-            classification_head<USE_SQUEEZING, activation_func, VOCAB_SIZE, EMBEDDING_DIM,
-            repeat<NUM_LAYERS, t_transformer_block,
-            positional_embeddings<VOCAB_SIZE, EMBEDDING_DIM, input<matrix<int, 0, 1>>>>>,
-            classification_head<USE_SQUEEZING, activation_func, VOCAB_SIZE, EMBEDDING_DIM,
-            repeat<NUM_LAYERS, i_transformer_block,
-            positional_embeddings<VOCAB_SIZE, EMBEDDING_DIM, input<matrix<int, 0, 1>>>>>
+            classification_head<USE_SQUEEZING, OUTPUT_SOFTMAX, activation_func, VOCAB_SIZE, EMBEDDING_DIM, MAX_SEQ_LEN,
+            repeat<NUM_LAYERS, t_block,
+            input_embeddings>>,
+            classification_head<USE_SQUEEZING, OUTPUT_SOFTMAX, activation_func, VOCAB_SIZE, EMBEDDING_DIM, MAX_SEQ_LEN,
+            repeat<NUM_LAYERS, i_block,
+            input_embeddings>>
             >;
 
         /**
@@ -238,8 +361,19 @@ namespace transformer
                     << "- vocabulary size: " << VOCAB_SIZE << "\n"
                     << "- layers: " << NUM_LAYERS << "\n"
                     << "- attention heads: " << NUM_HEADS << "\n"
+                    << "- key/value heads: " << NUM_KV_HEADS << "\n"
                     << "- embedding dimension: " << EMBEDDING_DIM << "\n"
                     << "- max sequence length: " << MAX_SEQ_LEN;
+                if (NUM_EXPERTS > 0)
+                    ss << "\n- feed-forward experts: " << NUM_EXPERTS << " (" << EXPERTS_PER_TOKEN << " per token)";
+                if (USE_CHECKPOINTING)
+                    ss << "\n- activations recomputed in the backward pass";
+                if (OUTPUT_SOFTMAX == softmax_head::adaptive)
+                    ss << "\n- adaptive softmax";
+                else if (OUTPUT_SOFTMAX == softmax_head::sampled)
+                    ss << "\n- sampled softmax";
+                if (USE_SPARSE_EMBEDDINGS)
+                    ss << "\n- sparse embedding updates";
                 return ss.str();
             }
         };
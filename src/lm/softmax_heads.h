@@ -0,0 +1,685 @@
+#ifndef SoftmaxHeads_H
+#define SoftmaxHeads_H
+
+/**
+ * @file softmax_heads.h
+ * @brief Adaptive and sampled softmax output layers for large vocabularies
+ *
+ * With loss_multiclass_log<fc<VOCAB_SIZE>>, every training sample computes the logits of the
+ * whole vocabulary, their softmax and their gradient, and the gradient of the whole output
+ * matrix: with 32k tokens this is most of the training step of a small model.  The two layers
+ * below compute the loss from a small part of the vocabulary instead.  They need the labels to
+ * choose it, so they go under loss_softmax_head, which hands them the labels, and compute the
+ * gradients of their parameters along with the loss:
+ *
+ * - adaptive_softmax (Grave et al., 2017) ranks the tokens by frequency and keeps the head_size
+ *   most frequent ones in a head that also has one entry per tail cluster.  The rarer tokens are
+ *   split into clusters 4 times larger each, reached through projections 4 times smaller each.
+ *   The probability of a rare token is that of its cluster in the head times its probability in
+ *   the cluster, so a sample goes through the head and, when its label is rare, one cluster.
+ * - sampled_softmax (Jean et al., 2015) keeps the output matrix and biases of fc<VOCAB_SIZE>
+ *   but takes the softmax over the labels of the batch and num_sampled tokens drawn from a
+ *   log-uniform (Zipf) distribution over the frequency ranks, each logit corrected by the log of
+ *   the expected number of draws of its token.
+ *
+ * Both define the softmax over the whole vocabulary, which to_label() and log_probabilities()
+ * compute exactly, for evaluation.  The ranks come from set_token_counts() (count_tokens() of
+ * token_dataset.h), or are the token ids themselves, which the merges of a BPE vocabulary
+ * roughly are.
+ */
+
+#include "kernels.h"
+
+#include <dlib/dnn.h>
+
+#include <cmath>
+#include <numeric>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    /**
+     * @brief Token ids in decreasing order of frequency, and the rank of each token.
+     */
+    class vocabulary_ranking
+    {
+        public:
+        vocabulary_ranking() = default;
+
+        explicit vocabulary_ranking(const long vocab_size) : token_rank(vocab_size), ranked_tokens(vocab_size)
+        {
+            std::iota(token_rank.begin(), token_rank.end(), 0);
+            std::iota(ranked_tokens.begin(), ranked_tokens.end(), 0);
+        }
+
+        void set_counts(const std::vector<uint64_t>& counts)
+        {
+            DLIB_CASSERT(counts.size() == ranked_tokens.size(), "expected one count per token of the vocabulary");
+            std::iota(ranked_tokens.begin(), ranked_tokens.end(), 0);
+            std::stable_sort(ranked_tokens.begin(), ranked_tokens.end(), [&](long a, long b) { return counts[a] > counts[b]; });
+            for (size_t r = 0; r < ranked_tokens.size(); ++r)
+                token_rank[ranked_tokens[r]] = r;
+        }
+
+        long size() const { return ranked_tokens.size(); }
+        long rank(const long token) const { return token_rank[token]; }
+        long token(const long rank) const { return ranked_tokens[rank]; }
+
+        friend void serialize(const vocabulary_ranking& item, std::ostream& out)
+        {
+            serialize(item.ranked_tokens, out);
+        }
+
+        friend void deserialize(vocabulary_ranking& item, std::istream& in)
+        {
+            deserialize(item.ranked_tokens, in);
+            item.token_rank.resize(item.ranked_tokens.size());
+            for (size_t r = 0; r < item.ranked_tokens.size(); ++r)
+                item.token_rank[item.ranked_tokens[r]] = r;
+        }
+
+        private:
+        std::vector<long> token_rank;
+        std::vector<long> ranked_tokens;
+    };
+
+    namespace impl
+    {
+        // Replaces each row of logits by scale * (softmax - one_hot(target)) and returns scale
+        // times the sum of the -log(softmax[target]).
+        inline double softmax_cross_entropy(float* logits, const long rows, const long cols, const long* targets, const float scale)
+        {
+            kernels::softmax_forward(logits, rows, cols, logits);
+            double loss = 0;
+            for (long r = 0; r < rows; ++r)
+            {
+                float* p = logits + r * cols;
+                loss -= std::log(std::max(p[targets[r]], std::numeric_limits<float>::min()));
+                p[targets[r]] -= 1;
+                for (long c = 0; c < cols; ++c)
+                    p[c] *= scale;
+            }
+            return loss * scale;
+        }
+
+        inline void log_softmax_rows(float* x, const long rows, const long cols)
+        {
+            for (long r = 0; r < rows; ++r, x += cols)
+            {
+                const float m = *std::max_element(x, x + cols);
+                double sum = 0;
+                for (long c = 0; c < cols; ++c)
+                    sum += std::exp(x[c] - m);
+                const float lse = m + std::log(sum);
+                for (long c = 0; c < cols; ++c)
+                    x[c] -= lse;
+            }
+        }
+
+        inline void argmax_rows(const tensor& t, std::vector<unsigned long>& out)
+        {
+            const long cols = t.size() / t.num_samples();
+            out.resize(t.num_samples());
+            for (long r = 0; r < t.num_samples(); ++r)
+            {
+                const float* row = t.host() + r * cols;
+                out[r] = std::max_element(row, row + cols) - row;
+            }
+        }
+    }
+
+    /**
+     * @brief Adaptive softmax over vocab_size tokens, with the head_size most frequent ones in
+     * the head.  The layer passes its input through; loss_softmax_head computes the loss and
+     * the gradients.
+     *
+     * Input: (N, k, nr, nc), the k * nr * nc values of each sample being its features, as for
+     * fc.  The head is a (features, head_size + clusters) matrix and cluster t has a (features,
+     * features / 4^(t+1)) projection and a (features / 4^(t+1), cluster size) output matrix, all
+     * without biases.
+     */
+    template <long vocab_size, long head_size = 2048>
+    class adaptive_softmax_
+    {
+        static_assert(0 < head_size && head_size <= vocab_size, "the head must hold between 1 and vocab_size tokens");
+
+        public:
+        adaptive_softmax_() : ranking(vocab_size) {}
+
+        // Ranks the tokens by these counts, from the training data, before training.
+        void set_token_counts(const std::vector<uint64_t>& counts) { ranking.set_counts(counts); }
+        const vocabulary_ranking& get_ranking() const { return ranking; }
+        long get_num_inputs() const { return num_inputs; }
+        long num_clusters() const { return cluster_begin.size() - 1; }
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            num_inputs = sub.get_output().size() / sub.get_output().num_samples();
+            init_layout();
+            params.set_size(layout_size);
+            tt::tensor_rand rnd(std::rand());
+            auto w = head(params, 0);
+            rnd.fill_gaussian(w, 0, 1 / std::sqrt(static_cast<float>(num_inputs)));
+            for (long t = 0; t < num_clusters(); ++t)
+            {
+                auto p = proj[t](params, proj_offset[t]);
+                rnd.fill_gaussian(p, 0, 1 / std::sqrt(static_cast<float>(num_inputs)));
+                auto o = out[t](params, out_offset[t]);
+                rnd.fill_gaussian(o, 0, 1 / std::sqrt(static_cast<float>(proj_dim[t])));
+            }
+        }
+
+        void forward_inplace(const tensor& input, tensor& output)
+        {
+            if (!is_same_object(input, output))
+                memcpy(output, input);
+        }
+
+        void backward_inplace(const tensor& /*computed_output*/, const tensor& gradient_input, tensor& data_grad, tensor& params_grad)
+        {
+            // computed by compute_loss(), which knew the labels
+            if (loss_params_grad.size() == params_grad.size())
+                memcpy(params_grad, loss_params_grad);
+            else
+                params_grad = 0;
+            if (!is_same_object(data_grad, gradient_input))
+                tt::add(1, data_grad, 1, gradient_input);
+        }
+
+        /**
+         * @brief Mean negative log-likelihood of the labels, its gradient with respect to
+         * the input written to grad_input and the one of the parameters kept for the backward
+         * pass.
+         */
+        template <typename const_label_iterator>
+        double compute_loss(const tensor& input, const_label_iterator truth, tensor& grad_input) const
+        {
+            const long n = input.num_samples();
+            const long num_tails = num_clusters();
+            const long head_cols = head_size + num_tails;
+            const float scale = 1.0f / n;
+
+            // where each label is: head column, and cluster and column in the cluster
+            std::vector<long> head_target(n), tail_target(n), cluster(n, -1);
+            for (long i = 0; i < n; ++i, ++truth)
+            {
+                DLIB_CASSERT(*truth < static_cast<unsigned long>(vocab_size), "label " << *truth << " outside the vocabulary");
+                const long r = ranking.rank(*truth);
+                if (r < head_size)
+                {
+                    head_target[i] = r;
+                    continue;
+                }
+                const long t = std::upper_bound(cluster_begin.begin(), cluster_begin.end(), r) - cluster_begin.begin() - 1;
+                head_target[i] = head_size + t;
+                cluster[i] = t;
+                tail_target[i] = r - cluster_begin[t];
+            }
+
+            loss_params_grad.copy_size(params);
+            loss_params_grad = 0;
+            const auto x = alias_tensor(n, num_inputs)(input);
+            auto dx = alias_tensor(n, num_inputs)(grad_input);
+            resizable_tensor logits(n, head_cols);
+            tt::gemm(0, logits, 1, x, false, head(params, 0), false);
+            double loss = impl::softmax_cross_entropy(logits.host(), n, head_cols, head_target.data(), scale);
+            auto g_head = head(loss_params_grad, 0);
+            tt::gemm(0, g_head, 1, x, true, logits, false);
+            tt::gemm(0, dx, 1, logits, false, head(params, 0), true);
+
+            resizable_tensor xt, z, dz, dxt;
+            std::vector<long> rows, targets;
+            for (long t = 0; t < num_tails; ++t)
+            {
+                rows.clear();
+                targets.clear();
+                for (long i = 0; i < n; ++i)
+                {
+                    if (cluster[i] == t)
+                    {
+                        rows.push_back(i);
+                        targets.push_back(tail_target[i]);
+                    }
+                }
+                const long m = rows.size();
+                if (m == 0)
+                    continue;
+                const long dim = proj_dim[t];
+                const long size = cluster_begin[t + 1] - cluster_begin[t];
+                xt.set_size(m, num_inputs);
+                for (long j = 0; j < m; ++j)
+                    std::copy(input.host() + rows[j] * num_inputs, input.host() + (rows[j] + 1) * num_inputs, xt.host() + j * num_inputs);
+                z.set_size(m, dim);
+                tt::gemm(0, z, 1, xt, false, proj[t](params, proj_offset[t]), false);
+                logits.set_size(m, size);
+                tt::gemm(0, logits, 1, z, false, out[t](params, out_offset[t]), false);
+                loss += impl::softmax_cross_entropy(logits.host(), m, size, targets.data(), scale);
+
+                auto g_out = out[t](loss_params_grad, out_offset[t]);
+                tt::gemm(0, g_out, 1, z, true, logits, false);
+                dz.set_size(m, dim);
+                tt::gemm(0, dz, 1, logits, false, out[t](params, out_offset[t]), true);
+                auto g_proj = proj[t](loss_params_grad, proj_offset[t]);
+                tt::gemm(0, g_proj, 1, xt, true, dz, false);
+                dxt.set_size(m, num_inputs);
+                tt::gemm(0, dxt, 1, dz, false, proj[t](params, proj_offset[t]), true);
+                for (long j = 0; j < m; ++j)
+                {
+                    float* d = grad_input.host() + rows[j] * num_inputs;
+                    const float* s = dxt.host() + j * num_inputs;
+                    for (long c = 0; c < num_inputs; ++c)
+                        d[c] += s[c];
+                }
+            }
+            return loss;
+        }
+
+        /**
+         * @brief log p(token | sample) of every token of the vocabulary, (N, vocab_size),
+         * columns in token id order.
+         */
+        void log_probabilities(const tensor& input, resizable_tensor& log_probs) const
+        {
+            const long n = input.num_samples();
+            const long head_cols = head_size + num_clusters();
+            const auto x = alias_tensor(n, num_inputs)(input);
+            log_probs.set_size(n, vocab_size);
+            float* lp = log_probs.host();
+            resizable_tensor logits(n, head_cols);
+            tt::gemm(0, logits, 1, x, false, head(params, 0), false);
+            impl::log_softmax_rows(logits.host(), n, head_cols);
+            for (long i = 0; i < n; ++i)
+            {
+                for (long r = 0; r < head_size; ++r)
+                    lp[i * vocab_size + ranking.token(r)] = logits.host()[i * head_cols + r];
+            }
+
+            resizable_tensor z, tail_logits;
+            for (long t = 0; t < num_clusters(); ++t)
+            {
+                const long size = cluster_begin[t + 1] - cluster_begin[t];
+                z.set_size(n, proj_dim[t]);
+                tt::gemm(0, z, 1, x, false, proj[t](params, proj_offset[t]), false);
+                tail_logits.set_size(n, size);
+                tt::gemm(0, tail_logits, 1, z, false, out[t](params, out_offset[t]), false);
+                impl::log_softmax_rows(tail_logits.host(), n, size);
+                for (long i = 0; i < n; ++i)
+                {
+                    const float cluster_lp = logits.host()[i * head_cols + head_size + t];
+                    for (long j = 0; j < size; ++j)
+                        lp[i * vocab_size + ranking.token(cluster_begin[t] + j)] = cluster_lp + tail_logits.host()[i * size + j];
+                }
+            }
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const adaptive_softmax_& item, std::ostream& out)
+        {
+            serialize("adaptive_softmax_", out);
+            serialize(item.params, out);
+            serialize(item.num_inputs, out);
+            serialize(item.ranking, out);
+        }
+
+        friend void deserialize(adaptive_softmax_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "adaptive_softmax_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::adaptive_softmax_.");
+            deserialize(item.params, in);
+            deserialize(item.num_inputs, in);
+            deserialize(item.ranking, in);
+            if (item.num_inputs > 0)
+                item.init_layout();
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const adaptive_softmax_& item)
+        {
+            out << "adaptive_softmax\t (vocab_size=" << vocab_size << ", head_size=" << head_size
+                << ", clusters=" << item.num_clusters() << ")";
+            return out;
+        }
+
+        friend void to_xml(const adaptive_softmax_& item, std::ostream& out)
+        {
+            out << "<adaptive_softmax vocab_size='" << vocab_size << "' head_size='" << head_size << "'>\n";
+            out << mat(item.params);
+            out << "</adaptive_softmax>\n";
+        }
+
+        private:
+        // clusters of 4 times more tokens, through projections 4 times smaller, up to vocab_size
+        void init_layout()
+        {
+            cluster_begin.assign(1, head_size);
+            while (cluster_begin.back() < vocab_size)
+                cluster_begin.push_back(std::min(vocab_size, cluster_begin.back() * 4));
+            head = alias_tensor(num_inputs, head_size + num_clusters());
+            size_t offset = head.size();
+            proj.clear();
+            out.clear();
+            proj_dim.clear();
+            proj_offset.clear();
+            out_offset.clear();
+            long dim = num_inputs;
+            for (long t = 0; t < num_clusters(); ++t)
+            {
+                dim = std::max(1L, dim / 4);
+                proj_dim.push_back(dim);
+                proj.emplace_back(num_inputs, dim);
+                proj_offset.push_back(offset);
+                offset += proj.back().size();
+                out.emplace_back(dim, cluster_begin[t + 1] - cluster_begin[t]);
+                out_offset.push_back(offset);
+                offset += out.back().size();
+            }
+            layout_size = offset;
+        }
+
+        resizable_tensor params;
+        long num_inputs = 0;
+        vocabulary_ranking ranking;
+
+        std::vector<long> cluster_begin;  // first rank of each cluster, then vocab_size
+        std::vector<long> proj_dim;
+        alias_tensor head;
+        std::vector<alias_tensor> proj, out;
+        std::vector<size_t> proj_offset, out_offset;
+        size_t layout_size = 0;
+
+        mutable resizable_tensor loss_params_grad;
+    };
+
+    /**
+     * @brief Softmax over vocab_size tokens trained on the labels of the batch and num_sampled
+     * tokens drawn by frequency rank.  The layer passes its input through; loss_softmax_head
+     * computes the loss and the gradients.
+     *
+     * The parameters are those of fc<vocab_size>: a (features, vocab_size) matrix followed by
+     * the biases.
+     */
+    template <long vocab_size, long num_sampled = 1024>
+    class sampled_softmax_
+    {
+        static_assert(0 < num_sampled && num_sampled <= vocab_size, "num_sampled must be between 1 and vocab_size");
+
+        public:
+        sampled_softmax_() : ranking(vocab_size), slot(vocab_size, -1) {}
+
+        sampled_softmax_(const sampled_softmax_& item)
+            : params(item.params),
+              num_inputs(item.num_inputs),
+              ranking(item.ranking),
+              weights(item.weights),
+              biases(item.biases),
+              slot(vocab_size, -1)
+        {
+        }
+
+        sampled_softmax_& operator=(const sampled_softmax_& item)
+        {
+            params = item.params;
+            num_inputs = item.num_inputs;
+            ranking = item.ranking;
+            weights = item.weights;
+            biases = item.biases;
+            return *this;
+        }
+
+        // Ranks the tokens by these counts, from the training data, before training.
+        void set_token_counts(const std::vector<uint64_t>& counts) { ranking.set_counts(counts); }
+        const vocabulary_ranking& get_ranking() const { return ranking; }
+        long get_num_inputs() const { return num_inputs; }
+        long get_num_outputs() const { return vocab_size; }
+
+        // Views of the parameters, laid out as those of fc_.
+        alias_tensor_const_instance get_weights() const { return weights(params, 0); }
+        alias_tensor_const_instance get_biases() const { return biases(params, weights.size()); }
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            num_inputs = sub.get_output().size() / sub.get_output().num_samples();
+            weights = alias_tensor(num_inputs, vocab_size);
+            biases = alias_tensor(1, vocab_size);
+            params.set_size(num_inputs + 1, vocab_size);
+            tt::tensor_rand rnd(std::rand());
+            auto w = weights(params, 0);
+            rnd.fill_gaussian(w, 0, 1 / std::sqrt(static_cast<float>(num_inputs)));
+            biases(params, weights.size()) = 0;
+        }
+
+        void forward_inplace(const tensor& input, tensor& output)
+        {
+            if (!is_same_object(input, output))
+                memcpy(output, input);
+        }
+
+        void backward_inplace(const tensor& /*computed_output*/, const tensor& gradient_input, tensor& data_grad, tensor& params_grad)
+        {
+            // computed by compute_loss(), which knew the labels
+            if (loss_params_grad.size() == params_grad.size())
+                memcpy(params_grad, loss_params_grad);
+            else
+                params_grad = 0;
+            if (!is_same_object(data_grad, gradient_input))
+                tt::add(1, data_grad, 1, gradient_input);
+        }
+
+        /**
+         * @brief Mean sampled softmax loss of the labels, its gradient with respect to the
+         * input written to grad_input and the one of the parameters kept for the backward pass.
+         */
+        template <typename const_label_iterator>
+        double compute_loss(const tensor& input, const_label_iterator truth, tensor& grad_input) const
+        {
+            const long n = input.num_samples();
+            const float scale = 1.0f / n;
+
+            // the labels of the batch, then the sampled tokens, each once
+            std::vector<long> candidates, targets(n);
+            const auto add = [&](const long token)
+            {
+                if (slot[token] < 0)
+                {
+                    slot[token] = candidates.size();
+                    candidates.push_back(token);
+                }
+                return slot[token];
+            };
+            for (long i = 0; i < n; ++i, ++truth)
+            {
+                DLIB_CASSERT(*truth < static_cast<unsigned long>(vocab_size), "label " << *truth << " outside the vocabulary");
+                targets[i] = add(*truth);
+            }
+            const double log_range = std::log(vocab_size + 1.0);
+            for (long s = 0; s < num_sampled; ++s)
+            {
+                const long r = static_cast<long>(std::exp(rnd.get_random_double() * log_range)) - 1;
+                add(ranking.token(std::min(std::max(r, 0L), vocab_size - 1)));
+            }
+            const long num_candidates = candidates.size();
+
+            // columns of the candidates, and their biases minus the log of their expected count
+            resizable_tensor w(num_inputs, num_candidates), b(1, num_candidates);
+            const float* all_w = params.host();
+            const float* all_b = params.host() + weights.size();
+            for (long k = 0; k < num_inputs; ++k)
+            {
+                for (long c = 0; c < num_candidates; ++c)
+                    w.host()[k * num_candidates + c] = all_w[k * vocab_size + candidates[c]];
+            }
+            for (long c = 0; c < num_candidates; ++c)
+            {
+                const double r = ranking.rank(candidates[c]);
+                const double q = std::log((r + 2) / (r + 1)) / log_range;
+                b.host()[c] = all_b[candidates[c]] - std::log(-std::expm1(num_sampled * std::log1p(-q)));
+            }
+
+            const auto x = alias_tensor(n, num_inputs)(input);
+            resizable_tensor logits(n, num_candidates);
+            tt::gemm(0, logits, 1, x, false, w, false);
+            for (long i = 0; i < n; ++i)
+            {
+                for (long c = 0; c < num_candidates; ++c)
+                    logits.host()[i * num_candidates + c] += b.host()[c];
+            }
+            const double loss = impl::softmax_cross_entropy(logits.host(), n, num_candidates, targets.data(), scale);
+
+            resizable_tensor dw(num_inputs, num_candidates);
+            tt::gemm(0, dw, 1, x, true, logits, false);
+            auto dx = alias_tensor(n, num_inputs)(grad_input);
+            tt::gemm(0, dx, 1, logits, false, w, true);
+            loss_params_grad.copy_size(params);
+            loss_params_grad = 0;
+            float* g_w = loss_params_grad.host();
+            float* g_b = loss_params_grad.host() + weights.size();
+            for (long k = 0; k < num_inputs; ++k)
+            {
+                for (long c = 0; c < num_candidates; ++c)
+                    g_w[k * vocab_size + candidates[c]] = dw.host()[k * num_candidates + c];
+            }
+            for (long i = 0; i < n; ++i)
+            {
+                for (long c = 0; c < num_candidates; ++c)
+                    g_b[candidates[c]] += logits.host()[i * num_candidates + c];
+            }
+            for (const long token : candidates)
+                slot[token] = -1;
+            return loss;
+        }
+
+        /**
+         * @brief log p(token | sample) of every token of the vocabulary, (N, vocab_size).
+         */
+        void log_probabilities(const tensor& input, resizable_tensor& log_probs) const
+        {
+            const long n = input.num_samples();
+            log_probs.set_size(n, vocab_size);
+            tt::gemm(0, log_probs, 1, alias_tensor(n, num_inputs)(input), false, weights(params, 0), false);
+            const float* all_b = params.host() + weights.size();
+            for (long i = 0; i < n; ++i)
+            {
+                for (long c = 0; c < vocab_size; ++c)
+                    log_probs.host()[i * vocab_size + c] += all_b[c];
+            }
+            impl::log_softmax_rows(log_probs.host(), n, vocab_size);
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const sampled_softmax_& item, std::ostream& out)
+        {
+            serialize("sampled_softmax_", out);
+            serialize(item.params, out);
+            serialize(item.num_inputs, out);
+            serialize(item.ranking, out);
+        }
+
+        friend void deserialize(sampled_softmax_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "sampled_softmax_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::sampled_softmax_.");
+            deserialize(item.params, in);
+            deserialize(item.num_inputs, in);
+            deserialize(item.ranking, in);
+            item.weights = alias_tensor(item.num_inputs, vocab_size);
+            item.biases = alias_tensor(1, vocab_size);
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const sampled_softmax_& /*item*/)
+        {
+            out << "sampled_softmax\t (vocab_size=" << vocab_size << ", num_sampled=" << num_sampled << ")";
+            return out;
+        }
+
+        friend void to_xml(const sampled_softmax_& item, std::ostream& out)
+        {
+            out << "<sampled_softmax vocab_size='" << vocab_size << "' num_sampled='" << num_sampled << "'>\n";
+            out << mat(item.params);
+            out << "</sampled_softmax>\n";
+        }
+
+        private:
+        resizable_tensor params;
+        long num_inputs = 0;
+        vocabulary_ranking ranking;
+        alias_tensor weights, biases;
+
+        mutable dlib::rand rnd;
+        mutable std::vector<long> slot;  // index of each token in the candidates, -1 when absent
+        mutable resizable_tensor loss_params_grad;
+    };
+
+    /**
+     * @brief Log loss over the vocabulary, computed by the adaptive_softmax or sampled_softmax
+     * layer below from the labels.  to_label() returns the most likely token of the full
+     * softmax.
+     */
+    class loss_softmax_head_
+    {
+        public:
+        typedef unsigned long training_label_type;
+        typedef unsigned long output_label_type;
+
+        template <typename SUB_TYPE, typename label_iterator>
+        void to_label(const tensor& /*input_tensor*/, const SUB_TYPE& sub, label_iterator iter) const
+        {
+            resizable_tensor log_probs;
+            sub.layer_details().log_probabilities(sub.get_output(), log_probs);
+            std::vector<unsigned long> labels;
+            impl::argmax_rows(log_probs, labels);
+            std::copy(labels.begin(), labels.end(), iter);
+        }
+
+        template <typename const_label_iterator, typename SUBNET>
+        double compute_loss_value_and_gradient(const tensor& /*input_tensor*/, const_label_iterator truth, SUBNET& sub) const
+        {
+            return sub.layer_details().compute_loss(sub.get_output(), truth, sub.get_gradient_input());
+        }
+
+        friend void serialize(const loss_softmax_head_& /*item*/, std::ostream& out)
+        {
+            serialize("loss_softmax_head_", out);
+        }
+
+        friend void deserialize(loss_softmax_head_& /*item*/, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "loss_softmax_head_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::loss_softmax_head_.");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const loss_softmax_head_& /*item*/)
+        {
+            out << "loss_softmax_head";
+            return out;
+        }
+
+        friend void to_xml(const loss_softmax_head_& /*item*/, std::ostream& out)
+        {
+            out << "<loss_softmax_head/>";
+        }
+    };
+
+    template <long vocab_size, long head_size, typename SUBNET>
+    using adaptive_softmax = add_layer<adaptive_softmax_<vocab_size, head_size>, SUBNET>;
+
+    template <long vocab_size, long num_sampled, typename SUBNET>
+    using sampled_softmax = add_layer<sampled_softmax_<vocab_size, num_sampled>, SUBNET>;
+
+    template <long vocab_size, long head_size, typename SUBNET>
+    using loss_adaptive_softmax = add_loss_layer<loss_softmax_head_, adaptive_softmax<vocab_size, head_size, SUBNET>>;
+
+    template <long vocab_size, long num_sampled, typename SUBNET>
+    using loss_sampled_softmax = add_loss_layer<loss_softmax_head_, sampled_softmax<vocab_size, num_sampled, SUBNET>>;
+}
+
+#endif // SoftmaxHeads_H
@@ -0,0 +1,390 @@
+#ifndef SparseEmbeddings_H
+#define SparseEmbeddings_H
+
+/**
+ * @file sparse_embeddings.h
+ * @brief Token embeddings trained with row-wise (lazy) Adam or SGD updates
+ *
+ * A batch of a few thousand tokens reads a few hundred rows of a table of tens of thousands,
+ * but a layer whose table is its parameter tensor gets a gradient over the whole table, which
+ * the solver then reads and updates in full, along with its moments: the step time grows with
+ * the vocabulary.  sparse_embeddings keeps the table and its optimizer state to itself, like
+ * dlib's embeddings, and
+ *
+ * - in the backward pass, sums the gradient of the tokens of the batch in one row per
+ *   distinct token,
+ * - in apply_update(), updates these rows only, with Adam or SGD with momentum.
+ *
+ * dnn_trainer has no hook to call apply_update() after its solvers, so by default the
+ * backward pass calls it, as dlib's embeddings do, and each backward pass is a training step.
+ * With set_update_in_backward(false), backward() only adds to the gradient of the layer, so
+ * that gradient checks leave the table alone and several backward passes can be accumulated,
+ * and the training loop calls apply_update() once per step: data_parallel::trainer does so,
+ * after summing the gradients of its replicas, and copies the updated rows back to them.
+ *
+ * The updates are lazy: the moments of a row only decay on the steps whose batch holds its
+ * token, as in LazyAdam and torch.optim.SparseAdam, and the Adam bias correction uses the
+ * number of steps of the layer.  Everything but the first allocation of the moments costs time
+ * proportional to the number of tokens of the batch.
+ *
+ * The trainer does not see the table, and so neither its learning rate: set_learning_rate()
+ * sets the one of the layer, set_embeddings_learning_rate() the one of all the layers of a
+ * network, for example from the learning rate of the trainer between steps.
+ */
+
+#include <dlib/dnn.h>
+
+#include <atomic>
+#include <cmath>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    enum class embeddings_solver
+    {
+        adam,  // Adam with decoupled weight decay (AdamW)
+        sgd    // SGD with momentum and L2 weight decay, as dlib::sgd
+    };
+
+    /**
+     * @brief Table of num_embeddings rows of embedding_dim features, the input tokens selecting
+     * the rows, updated row by row in the backward pass.
+     *
+     * Input: (N, K, NR, 1) token ids, from input<matrix<int, 0, 1>>.
+     * Output: (N, K, NR, embedding_dim).
+     */
+    template <long num_embeddings, long embedding_dim>
+    class sparse_embeddings_
+    {
+        static_assert(num_embeddings > 0 && embedding_dim > 0, "the table must not be empty");
+
+        public:
+        explicit sparse_embeddings_(
+            const embeddings_solver solver = embeddings_solver::adam,
+            const float learning_rate = 1e-3f,
+            const float weight_decay = 0
+        ) : solver(solver), learning_rate(learning_rate), weight_decay(weight_decay)
+        {
+        }
+
+        sparse_embeddings_(const sparse_embeddings_& item) { *this = item; }
+        sparse_embeddings_& operator=(const sparse_embeddings_& item)
+        {
+            if (this == &item)
+                return *this;
+            embs = item.embs;
+            moment1 = item.moment1;
+            moment2 = item.moment2;
+            solver = item.solver;
+            learning_rate = item.learning_rate.load();
+            learning_rate_multiplier = item.learning_rate_multiplier;
+            weight_decay = item.weight_decay;
+            momentum1 = item.momentum1;
+            momentum2 = item.momentum2;
+            num_steps = item.num_steps;
+            update_in_backward = item.update_in_backward;
+            slot = item.slot;
+            rows = item.rows;
+            row_grads = item.row_grads;
+            updated_rows = item.updated_rows;
+            return *this;
+        }
+
+        embeddings_solver get_solver() const { return solver; }
+        float get_learning_rate() const { return learning_rate; }
+        // Can be called from another thread than the one training the network.
+        void set_learning_rate(const float lr) { learning_rate = lr; }
+        double get_learning_rate_multiplier() const { return learning_rate_multiplier; }
+        void set_learning_rate_multiplier(const double val) { learning_rate_multiplier = val; }
+        float get_weight_decay() const { return weight_decay; }
+        void set_weight_decay(const float val) { weight_decay = val; }
+        // beta1 and beta2 of Adam, the momentum of SGD being momentum1
+        void set_momentums(const float m1, const float m2) { momentum1 = m1; momentum2 = m2; }
+        // number of calls to apply_update()
+        long get_num_steps() const { return num_steps; }
+        bool get_update_in_backward() const { return update_in_backward; }
+        void set_update_in_backward(const bool val) { update_in_backward = val; }
+
+        const tensor& get_embeddings() const { return embs; }
+        tensor& get_embeddings() { return embs; }
+
+        template <typename SUBNET> void setup(const SUBNET& /*sub*/)
+        {
+            embs.set_size(num_embeddings, embedding_dim);
+            tt::tensor_rand rnd(std::rand());
+            rnd.fill_gaussian(embs);
+            slot.assign(num_embeddings, -1);
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& prev = sub.get_output();
+            DLIB_CASSERT(prev.nc() == 1, "expected one token id per row");
+            output.set_size(prev.num_samples(), prev.k(), prev.nr(), embedding_dim);
+            const float* ids = prev.host();
+            const float* table = embs.host();
+            float* out = output.host_write_only();
+            for (size_t i = 0; i < prev.size(); ++i)
+            {
+                const long token = static_cast<long>(ids[i]);
+                DLIB_CASSERT(0 <= token && token < num_embeddings, "token id out of the range of the table");
+                std::copy(table + token * embedding_dim, table + (token + 1) * embedding_dim, out + i * embedding_dim);
+            }
+        }
+
+        template <typename SUBNET> void backward(const tensor& gradient_input, SUBNET& sub, tensor& /*params_grad*/)
+        {
+            // no gradient for the token ids, as the layer goes right after the input layer
+            if (learning_rate_multiplier == 0)
+                return;
+            const tensor& prev = sub.get_output();
+            const float* ids = prev.host();
+            const float* gi = gradient_input.host();
+            for (size_t i = 0; i < prev.size(); ++i)
+            {
+                float* g = row_gradient(static_cast<long>(ids[i]));
+                for (long d = 0; d < embedding_dim; ++d)
+                    g[d] += gi[i * embedding_dim + d];
+            }
+            if (update_in_backward)
+                apply_update();
+        }
+
+        // Multiplies the gradient summed since the last update by s.
+        void scale_gradient(const float s)
+        {
+            for (float& g : row_grads)
+                g *= s;
+        }
+
+        // Adds the gradient summed by item, a copy of this layer, to the one of this layer.
+        void add_gradient(const sparse_embeddings_& item)
+        {
+            for (size_t r = 0; r < item.rows.size(); ++r)
+            {
+                const float* in = item.row_grads.data() + r * embedding_dim;
+                float* g = row_gradient(item.rows[r]);
+                for (long d = 0; d < embedding_dim; ++d)
+                    g[d] += in[d];
+            }
+        }
+
+        // Updates the rows that have a gradient with it, and clears the gradient.
+        void apply_update()
+        {
+            if (moment1.size() == 0)
+            {
+                moment1.copy_size(embs);
+                moment1 = 0;
+                if (solver == embeddings_solver::adam)
+                {
+                    moment2.copy_size(embs);
+                    moment2 = 0;
+                }
+            }
+
+            ++num_steps;
+            const float lr = learning_rate * learning_rate_multiplier;
+            if (solver == embeddings_solver::adam)
+                update_adam(lr);
+            else
+                update_sgd(lr);
+            updated_rows = rows;
+            clear_gradient();
+        }
+
+        void clear_gradient()
+        {
+            for (const long token : rows)
+                slot[token] = -1;
+            rows.clear();
+            row_grads.clear();
+        }
+
+        // Copies the rows of the table that the last update of item, a copy of this layer,
+        // changed, and clears the gradient of this layer.
+        void copy_update(const sparse_embeddings_& item)
+        {
+            const float* in = item.embs.host();
+            float* out = embs.host();
+            for (const long token : item.updated_rows)
+                std::copy(in + token * embedding_dim, in + (token + 1) * embedding_dim, out + token * embedding_dim);
+            updated_rows = item.updated_rows;
+            clear_gradient();
+        }
+
+        // The table is not a parameter tensor: the solvers of the trainer leave it alone.
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const sparse_embeddings_& item, std::ostream& out)
+        {
+            serialize("sparse_embeddings_", out);
+            serialize(item.embs, out);
+            serialize(static_cast<int>(item.solver), out);
+            serialize(item.learning_rate.load(), out);
+            serialize(item.learning_rate_multiplier, out);
+            serialize(item.weight_decay, out);
+            serialize(item.momentum1, out);
+            serialize(item.momentum2, out);
+            serialize(item.num_steps, out);
+            serialize(item.moment1, out);
+            serialize(item.moment2, out);
+        }
+
+        friend void deserialize(sparse_embeddings_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "sparse_embeddings_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing dlib::sparse_embeddings_.");
+            deserialize(item.embs, in);
+            int solver;
+            deserialize(solver, in);
+            item.solver = static_cast<embeddings_solver>(solver);
+            float lr;
+            deserialize(lr, in);
+            item.learning_rate = lr;
+            deserialize(item.learning_rate_multiplier, in);
+            deserialize(item.weight_decay, in);
+            deserialize(item.momentum1, in);
+            deserialize(item.momentum2, in);
+            deserialize(item.num_steps, in);
+            deserialize(item.moment1, in);
+            deserialize(item.moment2, in);
+            if (item.embs.num_samples() != num_embeddings || item.embs.k() != embedding_dim)
+                throw serialization_error("Wrong size of the table found while deserializing dlib::sparse_embeddings_.");
+            item.slot.assign(num_embeddings, -1);
+            item.rows.clear();
+            item.row_grads.clear();
+            item.updated_rows.clear();
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const sparse_embeddings_& item)
+        {
+            out << "sparse_embeddings\t (num_embeddings=" << num_embeddings << ", embedding_dim=" << embedding_dim
+                << ", solver=" << (item.solver == embeddings_solver::adam ? "adam" : "sgd")
+                << ", learning_rate=" << item.get_learning_rate() << ")"
+                << " learning_rate_mult=" << item.learning_rate_multiplier;
+            return out;
+        }
+
+        friend void to_xml(const sparse_embeddings_& item, std::ostream& out)
+        {
+            out << "<sparse_embeddings num_embeddings='" << num_embeddings << "' embedding_dim='" << embedding_dim
+                << "' solver='" << (item.solver == embeddings_solver::adam ? "adam" : "sgd")
+                << "' learning_rate_mult='" << item.learning_rate_multiplier << "'>\n";
+            out << mat(item.embs);
+            out << "</sparse_embeddings>\n";
+        }
+
+        private:
+        // Gradient of a token, a row of zeros when the token has none yet.
+        float* row_gradient(const long token)
+        {
+            DLIB_ASSERT(0 <= token && token < num_embeddings);
+            if (static_cast<long>(slot.size()) != num_embeddings)
+                slot.assign(num_embeddings, -1);
+            if (slot[token] < 0)
+            {
+                slot[token] = rows.size();
+                rows.push_back(token);
+                row_grads.resize(rows.size() * embedding_dim, 0.f);
+            }
+            return row_grads.data() + slot[token] * embedding_dim;
+        }
+
+        // AdamW on the rows of the batch
+        void update_adam(const float lr)
+        {
+            const float b1 = momentum1, b2 = momentum2;
+            const float correction1 = 1 - std::pow(b1, static_cast<float>(num_steps));
+            const float correction2 = 1 - std::pow(b2, static_cast<float>(num_steps));
+            const float step_size = lr * std::sqrt(correction2) / correction1;
+            const float decay = 1 - lr * weight_decay;
+            float* w = embs.host();
+            float* m = moment1.host();
+            float* v = moment2.host();
+            for (size_t r = 0; r < rows.size(); ++r)
+            {
+                const long offset = rows[r] * embedding_dim;
+                const float* g = row_grads.data() + r * embedding_dim;
+                for (long d = 0; d < embedding_dim; ++d)
+                {
+                    const long i = offset + d;
+                    m[i] = b1 * m[i] + (1 - b1) * g[d];
+                    v[i] = b2 * v[i] + (1 - b2) * g[d] * g[d];
+                    w[i] = decay * w[i] - step_size * m[i] / (std::sqrt(v[i]) + 1e-8f);
+                }
+            }
+        }
+
+        // v = momentum * v - lr * (g + weight_decay * w), w += v, on the rows of the batch
+        void update_sgd(const float lr)
+        {
+            float* w = embs.host();
+            float* v = moment1.host();
+            for (size_t r = 0; r < rows.size(); ++r)
+            {
+                const long offset = rows[r] * embedding_dim;
+                const float* g = row_grads.data() + r * embedding_dim;
+                for (long d = 0; d < embedding_dim; ++d)
+                {
+                    const long i = offset + d;
+                    v[i] = momentum1 * v[i] - lr * (g[d] + weight_decay * w[i]);
+                    w[i] += v[i];
+                }
+            }
+        }
+
+        resizable_tensor params;  // empty
+        resizable_tensor embs;
+        resizable_tensor moment1, moment2;  // allocated by the first update
+        embeddings_solver solver;
+        std::atomic<float> learning_rate;
+        double learning_rate_multiplier = 1;
+        float weight_decay;
+        float momentum1 = 0.9f;
+        float momentum2 = 0.999f;
+        long num_steps = 0;
+        bool update_in_backward = true;
+
+        std::vector<long> slot;          // row of each token in row_grads, -1 when it has no gradient
+        std::vector<long> rows;          // distinct tokens of the batches since the last update
+        std::vector<float> row_grads;    // their summed gradients
+        std::vector<long> updated_rows;  // rows changed by the last update
+    };
+
+    template <long num_embeddings, long embedding_dim, typename SUBNET>
+    using sparse_embeddings = add_layer<sparse_embeddings_<num_embeddings, embedding_dim>, SUBNET>;
+
+    namespace impl
+    {
+        class visitor_embeddings_learning_rate
+        {
+            public:
+            explicit visitor_embeddings_learning_rate(const float learning_rate) : learning_rate(learning_rate) {}
+
+            template <typename T> void operator()(size_t, T&) const {}
+
+            template <long num_embeddings, long embedding_dim, typename SUBNET>
+            void operator()(size_t, add_layer<sparse_embeddings_<num_embeddings, embedding_dim>, SUBNET>& l) const
+            {
+                l.layer_details().set_learning_rate(learning_rate);
+            }
+
+            private:
+            float learning_rate;
+        };
+    }
+
+    // Sets the learning rate of all the sparse_embeddings layers of a network.
+    template <typename net_type>
+    void set_embeddings_learning_rate(net_type& net, const float learning_rate)
+    {
+        visit_layers(net, impl::visitor_embeddings_learning_rate(learning_rate));
+    }
+}
+
+#endif  // SparseEmbeddings_H
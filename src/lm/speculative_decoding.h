@@ -0,0 +1,238 @@
+#ifndef SpeculativeDecoding_H
+#define SpeculativeDecoding_H
+
+/**
+ * @file speculative_decoding.h
+ * @brief Generation with a small draft model proposing tokens for a large target model
+ *
+ * Decoding is one pass of the model per token, and on the CPU each pass of a large model is
+ * bound by reading its weights, whether it processes one token or a few.  Here a small draft
+ * model, for instance a transformer_config with 2 layers and the same vocabulary, proposes k
+ * tokens one by one, and the target model checks them all in a single pass over the k tokens.
+ * Each proposed token is accepted with probability min(1, p(x) / q(x)), p and q being the
+ * target and draft distributions; at the first rejection a token is sampled from
+ * max(0, p - q) normalized instead, and when all are accepted the pass over them also gives
+ * one more token from p.  The generated sequence has exactly the distribution of sampling
+ * from the target model alone (Leviathan et al., Chen et al., 2023), and at temperature 0 it
+ * is the greedy sequence of the target model.
+ */
+
+#include "incremental_decoder.h"
+
+#include <random>
+
+namespace transformer
+{
+    struct speculative_options
+    {
+        // tokens proposed by the draft model per target pass
+        long num_draft_tokens = 4;
+        // 0 picks the most likely token, and accepts a proposal only if it is that token
+        float temperature = 0;
+        // generation stops after this token, -1 for none
+        int end_token = -1;
+        unsigned long seed = 0;
+    };
+
+    struct speculative_stats
+    {
+        size_t generated = 0;      // tokens produced, the prompt excluded
+        size_t target_passes = 0;  // forward passes of the target model after the prompt
+        size_t draft_passes = 0;   // forward passes of the draft model after the prompt
+        size_t proposed = 0;
+        size_t accepted = 0;
+
+        double acceptance_rate() const { return proposed ? static_cast<double>(accepted) / proposed : 0.0; }
+        double tokens_per_target_pass() const { return target_passes ? static_cast<double>(generated) / target_passes : 0.0; }
+
+        friend std::ostream& operator<<(std::ostream& out, const speculative_stats& s)
+        {
+            out << "generated: " << s.generated << " target passes: " << s.target_passes << " draft passes: " << s.draft_passes;
+            out << " acceptance rate: " << s.acceptance_rate() << " tokens per target pass: " << s.tokens_per_target_pass();
+            return out;
+        }
+    };
+
+    /**
+     * @brief Generates tokens from a target model with proposals from a draft model.
+     *
+     * Both models must have the same vocabulary.  The draft is typically extracted from a
+     * smaller transformer_config, but a copy of the target weights with fewer blocks also
+     * works as a draft.
+     *
+     * Usage:
+     *   const auto target = extract_decoder_weights<large_config>(large_net);
+     *   const auto draft = extract_decoder_weights<small_config>(small_net);
+     *   speculative_decoder decoder(target, draft);
+     *   const auto tokens = decoder.generate(prompt, 100);
+     *   std::cout << decoder.get_stats() << '\n';
+     */
+    class speculative_decoder
+    {
+        public:
+        speculative_decoder(
+            const decoder_weights& target,
+            const decoder_weights& draft,
+            const speculative_options& options = speculative_options())
+            : target(target), draft(draft), options(options), target_cache(target), draft_cache(draft), rng(options.seed)
+        {
+            DLIB_CASSERT(target.vocab_size == draft.vocab_size, "the draft and target models must share the vocabulary");
+            DLIB_CASSERT(options.num_draft_tokens > 0 && options.temperature >= 0);
+        }
+
+        // Returns the generated tokens, without the prompt.
+        std::vector<int> generate(const std::vector<int>& prompt, const long max_new_tokens)
+        {
+            DLIB_CASSERT(!prompt.empty() && max_new_tokens > 0);
+            stats = speculative_stats();
+            tokens = prompt;
+            target_cache.clear();
+            draft_cache.clear();
+            // both caches hold every token but the last one, which is fed at the next pass
+            const long max_len = std::min(target.max_seq_len, draft.max_seq_len);
+            if (static_cast<long>(tokens.size()) > max_len)
+                throw std::length_error("speculative_decoder: the prompt is longer than max_seq_len");
+            if (tokens.size() > 1)
+            {
+                forward_tokens(target, target_cache, tokens.data(), tokens.size() - 1, target_logits);
+                forward_tokens(draft, draft_cache, tokens.data(), tokens.size() - 1, draft_logits);
+            }
+
+            const long end = prompt.size() + max_new_tokens;
+            while (static_cast<long>(tokens.size()) < end && static_cast<long>(tokens.size()) <= max_len)
+            {
+                const long length = tokens.size();
+                // the target pass feeds the last token and the k proposals
+                const long k = std::min({options.num_draft_tokens, end - length - 1, max_len - length});
+                if (round(k))
+                    break;
+            }
+            return std::vector<int>(tokens.begin() + prompt.size(), tokens.end());
+        }
+
+        const speculative_stats& get_stats() const { return stats; }
+
+        private:
+        // Proposes k tokens with the draft, verifies them with the target and appends the
+        // accepted ones and one more to tokens.  Returns true if the end token was produced.
+        bool round(const long k)
+        {
+            const long vocab = target.vocab_size;
+            const long length = tokens.size();
+
+            // the draft catches up with the tokens it has not seen and then proposes
+            proposals.clear();
+            draft_probs.resize(k * vocab);
+            for (long i = 0; i < k; ++i)
+            {
+                const int* pending = i == 0 ? tokens.data() + draft_cache.size() : &proposals.back();
+                const long n = i == 0 ? length - draft_cache.size() : 1;
+                forward_tokens(draft, draft_cache, pending, n, draft_logits);
+                ++stats.draft_passes;
+                float* q = &draft_probs[i * vocab];
+                to_probabilities(draft_logits.data(), q, vocab);
+                proposals.push_back(pick(q, vocab));
+            }
+
+            // one target pass over the last token and the proposals gives the k + 1
+            // distributions that check them
+            candidates.assign(tokens.begin() + target_cache.size(), tokens.end());
+            const long fed = candidates.size();
+            candidates.insert(candidates.end(), proposals.begin(), proposals.end());
+            forward_batch(target, {decode_chunk{&target_cache, candidates.data(), static_cast<long>(candidates.size()), &target_logits, true}});
+            ++stats.target_passes;
+            stats.proposed += k;
+
+            target_probs.resize(vocab);
+            for (long i = 0; i <= k; ++i)
+            {
+                float* p = target_probs.data();
+                to_probabilities(target_logits.data() + (fed - 1 + i) * vocab, p, vocab);
+                if (i == k)
+                {
+                    // every proposal was accepted, the last distribution gives one more token
+                    tokens.push_back(pick(p, vocab));
+                    break;
+                }
+                const int x = proposals[i];
+                const float* q = &draft_probs[i * vocab];
+                if (accept(p[x], q[x]))
+                {
+                    ++stats.accepted;
+                    tokens.push_back(x);
+                    if (x == options.end_token)
+                        break;
+                    continue;
+                }
+                // rejected: sample from the part of p that q does not cover
+                if (options.temperature > 0)
+                {
+                    float sum = 0;
+                    for (long v = 0; v < vocab; ++v)
+                        sum += (p[v] = std::max(0.0f, p[v] - q[v]));
+                    for (long v = 0; v < vocab; ++v)
+                        p[v] /= sum;
+                }
+                tokens.push_back(pick(p, vocab));
+                break;
+            }
+            stats.generated += tokens.size() - length;
+
+            // the caches keep the tokens that were accepted, all but the last one
+            const long keep = tokens.size() - 1;
+            target_cache.resize(std::min(target_cache.size(), keep));
+            draft_cache.resize(std::min(draft_cache.size(), keep));
+            return tokens.back() == options.end_token;
+        }
+
+        // Softmax at the temperature, or a one-hot of the most likely token at temperature 0.
+        void to_probabilities(const float* logits, float* probs, const long vocab) const
+        {
+            if (options.temperature == 0)
+            {
+                std::fill(probs, probs + vocab, 0.0f);
+                probs[std::max_element(logits, logits + vocab) - logits] = 1;
+                return;
+            }
+            const float max_logit = *std::max_element(logits, logits + vocab);
+            float sum = 0;
+            for (long v = 0; v < vocab; ++v)
+                sum += (probs[v] = std::exp((logits[v] - max_logit) / options.temperature));
+            for (long v = 0; v < vocab; ++v)
+                probs[v] /= sum;
+        }
+
+        int pick(const float* probs, const long vocab)
+        {
+            if (options.temperature == 0)
+                return std::max_element(probs, probs + vocab) - probs;
+            float u = std::uniform_real_distribution<float>(0, 1)(rng);
+            for (long v = 0; v < vocab; ++v)
+            {
+                u -= probs[v];
+                if (u < 0)
+                    return v;
+            }
+            return vocab - 1;
+        }
+
+        bool accept(const float p, const float q)
+        {
+            if (p >= q)
+                return true;
+            return std::uniform_real_distribution<float>(0, 1)(rng) < p / q;
+        }
+
+        const decoder_weights& target;
+        const decoder_weights& draft;
+        speculative_options options;
+        kv_cache target_cache;
+        kv_cache draft_cache;
+        std::mt19937 rng;
+        speculative_stats stats;
+        std::vector<int> tokens, proposals, candidates;
+        std::vector<float> target_logits, draft_logits, target_probs, draft_probs;
+    };
+}
+
+#endif // SpeculativeDecoding_H
@@ -0,0 +1,437 @@
+#ifndef TokenDataset_H
+#define TokenDataset_H
+
+/**
+ * @file token_dataset.h
+ * @brief Memory-mapped pre-tokenized corpus and a prefetching window loader for training
+ *
+ * File format, little endian as written by the machine that trains:
+ *   header:    char[4] "DTOK", uint32 version, uint32 token size (2 or 4 bytes),
+ *              uint32 reserved, uint64 number of documents, uint64 number of tokens,
+ *              uint64 offset of the document index
+ *   tokens:    all the documents one after the other, uint16 or uint32 each
+ *   index:     aligned on 8 bytes, uint64 start of each document, in tokens, then the
+ *              total number of tokens
+ *
+ * The file is mapped read-only, so the corpus is paged in by the kernel as windows are read
+ * and never copied as a whole into memory; the loader only holds the batches of its ring
+ * buffer, and 8 bytes per document when windows stay within documents.  Windows of seq_len tokens are labelled with the token that follows them, which is
+ * what network_type<true> of a transformer_config trains on with loss_multiclass_log.
+ */
+
+#include <dlib/dnn.h>
+
+#include "../random_permutation.h"
+
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    namespace impl
+    {
+        struct token_file_header
+        {
+            char magic[4] = {'D', 'T', 'O', 'K'};
+            uint32_t version = 1;
+            uint32_t token_bytes = 2;
+            uint32_t reserved = 0;
+            uint64_t num_documents = 0;
+            uint64_t num_tokens = 0;
+            uint64_t index_offset = 0;
+        };
+    }
+
+    /**
+     * @brief Writes a token file one document at a time, so corpora larger than memory can
+     * be converted.  Only the document index (8 bytes per document) is kept until close().
+     *
+     * Usage:
+     *   token_dataset_writer writer("corpus.tok", vocab_size);
+     *   for (const auto& doc : documents) writer.add_document(tokenize(doc));
+     *   writer.close();
+     */
+    class token_dataset_writer
+    {
+        public:
+        // Tokens are stored on 2 bytes when the vocabulary fits, 4 otherwise.
+        token_dataset_writer(const std::string& path, const long vocab_size)
+            : out(path, std::ios::binary)
+        {
+            if (!out)
+                throw std::runtime_error("token_dataset_writer: could not open " + path);
+            header.token_bytes = vocab_size <= 65536 ? 2 : 4;
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            offsets.push_back(0);
+        }
+
+        ~token_dataset_writer()
+        {
+            try { close(); } catch (...) {}
+        }
+
+        template <typename container> void add_document(const container& tokens)
+        {
+            DLIB_CASSERT(out.is_open(), "token_dataset_writer: already closed");
+            for (const auto token : tokens)
+            {
+                if (header.token_bytes == 2)
+                {
+                    DLIB_CASSERT(0 <= token && token < 65536);
+                    const uint16_t t = token;
+                    out.write(reinterpret_cast<const char*>(&t), sizeof(t));
+                }
+                else
+                {
+                    const uint32_t t = token;
+                    out.write(reinterpret_cast<const char*>(&t), sizeof(t));
+                }
+            }
+            header.num_tokens += tokens.size();
+            offsets.push_back(header.num_tokens);
+        }
+
+        void close()
+        {
+            if (!out.is_open())
+                return;
+            header.num_documents = offsets.size() - 1;
+            const uint64_t end = sizeof(header) + header.num_tokens * header.token_bytes;
+            header.index_offset = (end + 7) / 8 * 8;
+            const char padding[8] = {};
+            out.write(padding, header.index_offset - end);
+            out.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint64_t));
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.close();
+            if (!out)
+                throw std::runtime_error("token_dataset_writer: error while writing the file");
+        }
+
+        private:
+        std::ofstream out;
+        impl::token_file_header header;
+        std::vector<uint64_t> offsets;
+    };
+
+    /**
+     * @brief Read-only view of a token file mapped in memory.
+     */
+    class token_dataset
+    {
+        public:
+        explicit token_dataset(const std::string& path)
+        {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("token_dataset: could not open " + path);
+            struct stat st;
+            if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(impl::token_file_header))
+            {
+                ::close(fd);
+                throw std::runtime_error("token_dataset: " + path + " is not a token file");
+            }
+            size = st.st_size;
+            void* p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("token_dataset: could not map " + path);
+            }
+            data = static_cast<const char*>(p);
+            // windows are read at random places
+            ::madvise(p, size, MADV_RANDOM);
+
+            std::memcpy(&header, data, sizeof(header));
+            // the tokens, then the index aligned on 8 bytes, both inside the file: the counts
+            // are bounded by the file size first so that the products do not overflow
+            if (std::memcmp(header.magic, "DTOK", 4) != 0 || header.version != 1 ||
+                (header.token_bytes != 2 && header.token_bytes != 4) ||
+                header.num_tokens > (size - sizeof(header)) / header.token_bytes ||
+                header.num_documents >= size / sizeof(uint64_t) ||
+                header.index_offset < sizeof(header) + header.num_tokens * header.token_bytes ||
+                header.index_offset % sizeof(uint64_t) != 0 || header.index_offset > size ||
+                (header.num_documents + 1) * sizeof(uint64_t) > size - header.index_offset)
+            {
+                ::munmap(p, size);
+                ::close(fd);
+                throw std::runtime_error("token_dataset: " + path + " is not a valid token file");
+            }
+            tokens = data + sizeof(header);
+            index = reinterpret_cast<const uint64_t*>(data + header.index_offset);
+            const std::string error = check_index();
+            if (!error.empty())
+            {
+                ::munmap(p, size);
+                ::close(fd);
+                throw std::runtime_error("token_dataset: " + path + " is corrupt, " + error);
+            }
+        }
+
+        token_dataset(const token_dataset&) = delete;
+        token_dataset& operator=(const token_dataset&) = delete;
+
+        ~token_dataset()
+        {
+            ::munmap(const_cast<char*>(data), size);
+            ::close(fd);
+        }
+
+        uint64_t num_tokens() const { return header.num_tokens; }
+        uint64_t num_documents() const { return header.num_documents; }
+        long token_bytes() const { return header.token_bytes; }
+        uint64_t document_begin(const uint64_t doc) const { return index[doc]; }
+        uint64_t document_end(const uint64_t doc) const { return index[doc + 1]; }
+
+        int operator[](const uint64_t i) const
+        {
+            return header.token_bytes == 2 ? reinterpret_cast<const uint16_t*>(tokens)[i]
+                                           : reinterpret_cast<const uint32_t*>(tokens)[i];
+        }
+
+        // Copies the tokens [begin, begin + n) into out.
+        void copy(const uint64_t begin, const long n, int* out) const
+        {
+            if (header.token_bytes == 2)
+                std::copy_n(reinterpret_cast<const uint16_t*>(tokens) + begin, n, out);
+            else
+                std::copy_n(reinterpret_cast<const uint32_t*>(tokens) + begin, n, out);
+        }
+
+        private:
+        // Checks that the documents follow each other from the first token to the last, so
+        // that document_begin() and document_end() need no check.  Returns what is wrong, or
+        // an empty string.
+        std::string check_index() const
+        {
+            if (index[0] != 0)
+                return "document 0 starts at token " + std::to_string(index[0]);
+            for (uint64_t d = 0; d < header.num_documents; ++d)
+            {
+                if (index[d + 1] < index[d])
+                    return "document " + std::to_string(d) + " ends before it starts";
+            }
+            if (index[header.num_documents] != header.num_tokens)
+                return "the documents end at token " + std::to_string(index[header.num_documents]) +
+                       " of " + std::to_string(header.num_tokens);
+            return "";
+        }
+
+        int fd = -1;
+        size_t size = 0;
+        const char* data = nullptr;
+        const char* tokens = nullptr;
+        const uint64_t* index = nullptr;
+        impl::token_file_header header;
+    };
+
+    /**
+     * @brief Number of occurrences of each token id of a token file, to rank the vocabulary of
+     * an adaptive or sampled softmax head by frequency (softmax_heads.h).
+     */
+    inline std::vector<uint64_t> count_tokens(const token_dataset& data, const long vocab_size)
+    {
+        std::vector<uint64_t> counts(vocab_size, 0);
+        std::vector<int> chunk(1 << 16);
+        for (uint64_t begin = 0; begin < data.num_tokens(); begin += chunk.size())
+        {
+            const long n = std::min<uint64_t>(chunk.size(), data.num_tokens() - begin);
+            data.copy(begin, n, chunk.data());
+            for (long i = 0; i < n; ++i)
+            {
+                if (0 <= chunk[i] && chunk[i] < vocab_size)
+                    ++counts[chunk[i]];
+            }
+        }
+        return counts;
+    }
+
+    struct token_loader_options
+    {
+        long seq_len = 100;
+        long batch_size = 64;
+        // distance between the starts of two consecutive windows
+        long stride = 1;
+        // windows never span two documents
+        bool within_documents = true;
+        // batches assembled ahead of the trainer
+        size_t prefetch = 8;
+        size_t num_threads = 4;
+        unsigned long seed = 0;
+    };
+
+    /**
+     * @brief Samples shuffled windows out of a token_dataset into batches, on background
+     * threads, ahead of the trainer.
+     *
+     * The windows of an epoch are visited in the order of a random permutation of their
+     * indices, computed on the fly so that it needs no memory.  With within_documents, the
+     * loader keeps the number of windows before each document to find the one of a window,
+     * 8 bytes per document of the file.  Batches are assembled in parallel into a ring buffer
+     * of prefetch slots and handed out in order, so the sequence of batches only depends on
+     * the seed.
+     *
+     * Usage:
+     *   token_dataset data("corpus.tok");
+     *   token_batch_loader loader(data, options);
+     *   std::vector<matrix<int, 0, 1>> samples;
+     *   std::vector<unsigned long> labels;
+     *   while (...) { loader.get_batch(samples, labels); trainer.train_one_step(samples, labels); }
+     */
+    class token_batch_loader
+    {
+        public:
+        token_batch_loader(const token_dataset& data, const token_loader_options& options = token_loader_options())
+            : data(data), options(options)
+        {
+            DLIB_CASSERT(options.seq_len > 0 && options.batch_size > 0 && options.stride > 0);
+            DLIB_CASSERT(options.prefetch > 0 && options.num_threads > 0);
+            const uint64_t span = options.seq_len + 1;
+            if (options.within_documents)
+            {
+                windows_before.resize(data.num_documents() + 1);
+                windows_before[0] = 0;
+                for (uint64_t d = 0; d < data.num_documents(); ++d)
+                {
+                    const uint64_t length = data.document_end(d) - data.document_begin(d);
+                    windows_before[d + 1] = windows_before[d] + (length >= span ? (length - span) / options.stride + 1 : 0);
+                }
+                num_windows = windows_before.back();
+            }
+            else
+            {
+                num_windows = data.num_tokens() >= span ? (data.num_tokens() - span) / options.stride + 1 : 0;
+            }
+            if (num_windows == 0)
+                throw std::runtime_error("token_batch_loader: no document is longer than seq_len");
+
+            slots.resize(options.prefetch);
+            for (size_t i = 0; i < options.num_threads; ++i)
+                workers.emplace_back([this] { run(); });
+        }
+
+        token_batch_loader(const token_batch_loader&) = delete;
+        token_batch_loader& operator=(const token_batch_loader&) = delete;
+
+        ~token_batch_loader()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            for (auto& t : workers)
+                t.join();
+        }
+
+        // Swaps the next batch into samples and labels, whose previous buffers are reused.
+        void get_batch(std::vector<matrix<int, 0, 1>>& samples, std::vector<unsigned long>& labels)
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto& slot = slots[consumed % slots.size()];
+            if (!slot.ready)
+            {
+                ++waits;
+                cv.wait(lock, [&] { return slot.ready; });
+            }
+            samples.swap(slot.samples);
+            labels.swap(slot.labels);
+            slot.ready = false;
+            ++consumed;
+            cv.notify_all();
+        }
+
+        uint64_t windows_per_epoch() const { return num_windows; }
+        // number of times get_batch() had to wait for a batch
+        size_t get_waits() const
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return waits;
+        }
+
+        private:
+        struct slot_type
+        {
+            bool ready = false;
+            std::vector<matrix<int, 0, 1>> samples;
+            std::vector<unsigned long> labels;
+        };
+
+        // First token of the w-th window.
+        uint64_t window_start(const uint64_t w) const
+        {
+            if (!options.within_documents)
+                return w * options.stride;
+            const auto it = std::upper_bound(windows_before.begin(), windows_before.end(), w) - 1;
+            const uint64_t doc = it - windows_before.begin();
+            return data.document_begin(doc) + (w - *it) * options.stride;
+        }
+
+        void run()
+        {
+            shuffling::random_permutation permutation;
+            uint64_t permutation_epoch = std::numeric_limits<uint64_t>::max();
+            while (true)
+            {
+                uint64_t batch;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    batch = next_batch++;
+                    cv.wait(lock, [&] { return stopping || batch < consumed + slots.size(); });
+                    if (stopping)
+                        return;
+                }
+                // the slot is ours until it is marked ready
+                auto& slot = slots[batch % slots.size()];
+                slot.samples.resize(options.batch_size);
+                slot.labels.resize(options.batch_size);
+                for (long i = 0; i < options.batch_size; ++i)
+                {
+                    const uint64_t sample = batch * options.batch_size + i;
+                    const uint64_t epoch = sample / num_windows;
+                    if (epoch != permutation_epoch)
+                    {
+                        permutation = shuffling::random_permutation(num_windows, options.seed + epoch);
+                        permutation_epoch = epoch;
+                    }
+                    const uint64_t start = window_start(permutation(sample % num_windows));
+                    auto& window = slot.samples[i];
+                    window.set_size(options.seq_len);
+                    data.copy(start, options.seq_len, &window(0));
+                    slot.labels[i] = data[start + options.seq_len];
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot.ready = true;
+                }
+                cv.notify_all();
+            }
+        }
+
+        const token_dataset& data;
+        token_loader_options options;
+        uint64_t num_windows = 0;
+        std::vector<uint64_t> windows_before;  // windows in the documents before each one
+        std::vector<slot_type> slots;
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+        uint64_t next_batch = 0;
+        uint64_t consumed = 0;
+        size_t waits = 0;
+        bool stopping = false;
+        std::vector<std::thread> workers;
+    };
+}
+
+#endif // TokenDataset_H
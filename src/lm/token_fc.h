@@ -0,0 +1,159 @@
+#ifndef TokenFc_H
+#define TokenFc_H
+
+/**
+ * @file token_fc.h
+ * @brief Fully connected layer applied to each token of a sequence
+ *
+ * dlib's fc layer flattens each sample: on a (N, 1, seq_len, d_model) sequence it mixes all
+ * the positions of the window into one output vector, which is neither what a transformer
+ * block computes nor something the attention can read tokens from.  token_fc multiplies
+ * every row of nc values by the same (nc, num_outputs) matrix instead, so position i of the
+ * output only depends on position i of the input, and the blocks stay causal.
+ *
+ * The parameters are laid out like those of fc_: the weights, then the biases when there
+ * are some, so the incremental decoder and the quantization read both layers the same way.
+ */
+
+#include <dlib/dnn.h>
+
+namespace transformer
+{
+    using namespace dlib;
+
+    /**
+     * @brief out = in * weights + biases over each row of nc values.
+     *
+     * Input: (N, k, nr, nc).  Output: (N, k, nr, num_outputs).
+     *
+     * Template parameters:
+     * @param num_outputs_: Number of outputs of each row
+     * @param bias_mode: FC_HAS_BIAS or FC_NO_BIAS, as for fc_
+     */
+    template <unsigned long num_outputs_, fc_bias_mode bias_mode>
+    class token_fc_
+    {
+        static_assert(num_outputs_ > 0, "The number of outputs must be > 0");
+
+        public:
+        token_fc_() = default;
+
+        unsigned long get_num_inputs() const { return num_inputs; }
+        unsigned long get_num_outputs() const { return num_outputs_; }
+
+        template <typename SUBNET> void setup(const SUBNET& sub)
+        {
+            num_inputs = sub.get_output().nc();
+            params.set_size(num_inputs + (bias_mode == FC_HAS_BIAS ? 1 : 0), num_outputs_);
+            dlib::rand rnd(std::rand());
+            randomize_parameters(params, num_inputs + num_outputs_, rnd);
+            weights = alias_tensor(num_inputs, num_outputs_);
+            if (bias_mode == FC_HAS_BIAS)
+            {
+                biases = alias_tensor(1, num_outputs_);
+                biases(params, weights.size()) = 0;
+            }
+        }
+
+        template <typename SUBNET> void forward(const SUBNET& sub, resizable_tensor& output)
+        {
+            const tensor& in = sub.get_output();
+            DLIB_CASSERT(in.nc() == static_cast<long>(num_inputs), "token_fc was set up for rows of " << num_inputs << " values, got " << in.nc());
+            const long rows = in.size() / num_inputs;
+            output.set_size(in.num_samples(), in.k(), in.nr(), num_outputs_);
+            auto out_rows = alias_tensor(rows, num_outputs_)(output);
+            tt::gemm(0, out_rows, 1, alias_tensor(rows, num_inputs)(in), false, weights(params, 0), false);
+            if (bias_mode == FC_HAS_BIAS)
+                tt::add(1, out_rows, 1, biases(params, weights.size()));
+        }
+
+        template <typename SUBNET> void backward(const tensor& gradient_input, SUBNET& sub, tensor& params_grad)
+        {
+            const tensor& in = sub.get_output();
+            const long rows = in.size() / num_inputs;
+            const auto gi_rows = alias_tensor(rows, num_outputs_)(gradient_input);
+            auto w_grad = weights(params_grad, 0);
+            tt::gemm(0, w_grad, 1, alias_tensor(rows, num_inputs)(in), true, gi_rows, false);
+            if (bias_mode == FC_HAS_BIAS)
+            {
+                auto b_grad = biases(params_grad, weights.size());
+                tt::assign_bias_gradient(b_grad, gi_rows);
+            }
+            auto in_grad = alias_tensor(rows, num_inputs)(sub.get_gradient_input());
+            tt::gemm(1, in_grad, 1, gi_rows, false, weights(params, 0), true);
+        }
+
+        alias_tensor_instance get_weights() { return weights(params, 0); }
+        alias_tensor_const_instance get_weights() const { return weights(params, 0); }
+        alias_tensor_instance get_biases()
+        {
+            static_assert(bias_mode == FC_HAS_BIAS, "This token_fc_ layer has no bias");
+            return biases(params, weights.size());
+        }
+        alias_tensor_const_instance get_biases() const
+        {
+            static_assert(bias_mode == FC_HAS_BIAS, "This token_fc_ layer has no bias");
+            return biases(params, weights.size());
+        }
+
+        const tensor& get_layer_params() const { return params; }
+        tensor& get_layer_params() { return params; }
+
+        friend void serialize(const token_fc_& item, std::ostream& out)
+        {
+            serialize("token_fc_", out);
+            serialize(item.num_inputs, out);
+            serialize(item.params, out);
+            serialize(item.weights, out);
+            serialize(item.biases, out);
+            serialize(static_cast<int>(bias_mode), out);
+        }
+
+        friend void deserialize(token_fc_& item, std::istream& in)
+        {
+            std::string version;
+            deserialize(version, in);
+            if (version != "token_fc_")
+                throw serialization_error("Unexpected version '" + version + "' found while deserializing transformer::token_fc_.");
+            deserialize(item.num_inputs, in);
+            deserialize(item.params, in);
+            deserialize(item.weights, in);
+            deserialize(item.biases, in);
+            int bmode = 0;
+            deserialize(bmode, in);
+            if (bias_mode != static_cast<fc_bias_mode>(bmode))
+                throw serialization_error("Wrong fc_bias_mode found while deserializing transformer::token_fc_");
+            if (item.weights.num_samples() != static_cast<long>(item.num_inputs) || item.weights.k() != static_cast<long>(num_outputs_) ||
+                item.params.size() != item.weights.size() + (bias_mode == FC_HAS_BIAS ? num_outputs_ : 0))
+                throw serialization_error("Wrong number of outputs found while deserializing transformer::token_fc_");
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const token_fc_& /*item*/)
+        {
+            out << "token_fc\t (num_outputs=" << num_outputs_ << ")";
+            if (bias_mode == FC_NO_BIAS)
+                out << " no_bias";
+            return out;
+        }
+
+        friend void to_xml(const token_fc_& item, std::ostream& out)
+        {
+            out << "<token_fc num_outputs='" << num_outputs_ << "' use_bias='" << (bias_mode == FC_HAS_BIAS) << "'>\n";
+            out << mat(item.params);
+            out << "</token_fc>\n";
+        }
+
+        private:
+        unsigned long num_inputs = 0;
+        resizable_tensor params;
+        alias_tensor weights, biases;
+    };
+
+    template <unsigned long num_outputs, typename SUBNET>
+    using token_fc = add_layer<token_fc_<num_outputs, FC_HAS_BIAS>, SUBNET>;
+
+    template <unsigned long num_outputs, typename SUBNET>
+    using token_fc_no_bias = add_layer<token_fc_<num_outputs, FC_NO_BIAS>, SUBNET>;
+}
+
+#endif // TokenFc_H
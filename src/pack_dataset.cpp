@@ -0,0 +1,172 @@
+#include "packed_dataset.h"
+#include "training_pipeline.h"
+
+#include <dlib/cmd_line_parser.h>
+#include <dlib/data_io.h>
+
+#include <algorithm>
+#include <set>
+
+// The bytes of a JPEG or PNG file, empty for any other format.
+std::vector<char> read_image_file(const std::string& path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        throw std::runtime_error("could not open " + path);
+    std::vector<char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    const auto b = reinterpret_cast<const unsigned char*>(bytes.data());
+    const bool jpeg = bytes.size() >= 3 && b[0] == 0xFF && b[1] == 0xD8 && b[2] == 0xFF;
+    const bool png = bytes.size() >= 8 && std::memcmp(b, "\x89PNG\r\n\x1a\n", 8) == 0;
+    if (!jpeg && !png)
+        bytes.clear();
+    return bytes;
+}
+
+// Takes one batch from a loader of the packed file, to check that its records decode, and
+// that the images and labels come out of the augmentation as the trainer gets them.
+template <typename label_type>
+void check_batch(training::basic_image_loader<label_type>& loader, const long batch_size, const long size)
+{
+    std::vector<dlib::matrix<dlib::rgb_pixel>> images;
+    std::vector<label_type> labels;
+    loader.get_batch(images, labels);
+    if (images.size() != static_cast<size_t>(batch_size) || labels.size() != images.size())
+        throw std::runtime_error("the loader returned " + std::to_string(images.size()) + " images and " +
+                                 std::to_string(labels.size()) + " labels for a batch of " + std::to_string(batch_size));
+    for (const auto& image : images)
+    {
+        if (image.nr() != size || image.nc() != size)
+            throw std::runtime_error("the loader returned a " + std::to_string(image.nr()) + "x" +
+                                     std::to_string(image.nc()) + " image instead of " + std::to_string(size) + "x" + std::to_string(size));
+    }
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    dlib::command_line_parser parser;
+    parser.add_option("images", "pack the classification set of <arg>, one directory per class", 1);
+    parser.add_option("xml", "pack the detection set of the imglab file <arg>", 1);
+    parser.add_option("output", "write the packed file to <arg> (default: train.pack)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+    parser.check_incompatible_options("images", "xml");
+
+    if (parser.option("h") or parser.option("help") or !(parser.option("images") or parser.option("xml")))
+    {
+        std::cout << "Usage: pack_dataset --images <dir> | --xml <file> [--output <file>]\n";
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    using fms = std::chrono::duration<double, std::milli>;
+    const auto t0 = std::chrono::steady_clock::now();
+    const std::string output = dlib::get_option(parser, "output", "train.pack");
+    size_t num_records = 0, num_boxes = 0, num_skipped = 0, num_bytes = 0;
+
+    if (parser.option("images"))
+    {
+        const auto data = training::list_image_folder(parser.option("images").argument());
+        training::packed_dataset_writer writer(output, data.class_names, false);
+        for (size_t i = 0; i < data.size(); ++i)
+        {
+            const auto bytes = read_image_file(data.files[i]);
+            if (bytes.empty())
+            {
+                ++num_skipped;
+                continue;
+            }
+            writer.add(bytes, data.labels[i]);
+            num_bytes += bytes.size();
+            ++num_records;
+        }
+        writer.close();
+        std::cout << data.class_names.size() << " classes\n";
+    }
+    else
+    {
+        // the images of an imglab file are relative to its directory
+        const std::string xml = parser.option("xml").argument();
+        const std::string root = dlib::get_parent_directory(dlib::file(xml)).full_name();
+        dlib::image_dataset_metadata::dataset metadata;
+        dlib::image_dataset_metadata::load_image_dataset_metadata(metadata, xml);
+
+        std::set<std::string> labels;
+        for (const auto& image : metadata.images)
+        {
+            for (const auto& box : image.boxes)
+                labels.insert(box.label);
+        }
+        const std::vector<std::string> class_names(labels.begin(), labels.end());
+
+        training::packed_dataset_writer writer(output, class_names, true);
+        std::vector<training::packed_box> boxes;
+        for (const auto& image : metadata.images)
+        {
+            const bool absolute = !image.filename.empty() && image.filename[0] == '/';
+            const auto bytes = read_image_file(absolute ? image.filename : root + "/" + image.filename);
+            if (bytes.empty())
+            {
+                ++num_skipped;
+                continue;
+            }
+            boxes.clear();
+            for (const auto& box : image.boxes)
+            {
+                training::packed_box b;
+                b.left = box.rect.left();
+                b.top = box.rect.top();
+                b.right = box.rect.right();
+                b.bottom = box.rect.bottom();
+                b.label = std::lower_bound(class_names.begin(), class_names.end(), box.label) - class_names.begin();
+                b.ignore = box.ignore;
+                boxes.push_back(b);
+            }
+            writer.add(bytes, boxes);
+            num_bytes += bytes.size();
+            num_boxes += boxes.size();
+            ++num_records;
+        }
+        writer.close();
+        std::cout << class_names.size() << " classes, " << num_boxes << " boxes\n";
+    }
+
+    const double seconds = std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count() / 1000;
+    std::cout << "packed " << num_records << " images (" << num_bytes / 1e6 << " MB) into " << output << " in "
+              << seconds << " s, " << num_records / seconds << " images/s\n";
+    if (num_skipped > 0)
+        std::cout << "skipped " << num_skipped << " files that are neither JPEG nor PNG\n";
+
+    // check that the file maps and indexes back, and that the loader of its kind decodes it
+    const training::packed_dataset packed(output);
+    if (packed.size() != num_records)
+        throw std::runtime_error("could not read " + output + " back");
+    if (num_records > 0)
+    {
+        training::pipeline_options options;
+        options.batch_size = std::min<size_t>(num_records, 8);
+        options.shuffle_buffer_size = options.batch_size;
+        options.num_decode_threads = 1;
+        options.num_augment_threads = 1;
+        options.prefetch_batches = 1;
+        if (packed.has_boxes())
+        {
+            training::detection_loader loader(packed, options);
+            check_batch(loader, options.batch_size, options.augmentation.size);
+        }
+        else
+        {
+            training::image_loader loader(packed, options);
+            check_batch(loader, options.batch_size, options.augmentation.size);
+        }
+        std::cout << "read back a batch of " << options.batch_size << " images\n";
+    }
+    return EXIT_SUCCESS;
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,331 @@
+#ifndef PackedDataset_H
+#define PackedDataset_H
+
+#include <dlib/dnn.h>
+#include <dlib/image_io.h>
+
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*!
+    A training set packed in one file: the encoded images (JPEG or PNG, as they were on disk),
+    their class labels or their boxes, and an index that finds any record in O(1).  Reading
+    millions of small files costs an open and a few reads per image; the packed file is mapped
+    in memory once and the images are decoded straight from the mapping.
+
+    File format, little endian as written by the machine that trains:
+        header:  char[4] "DPAK", uint32 version, uint32 flags (1 when the records have boxes),
+                 uint32 number of classes, uint64 number of records, uint64 number of boxes,
+                 uint64 offset of the index, uint64 offset of the boxes, uint64 offset of the
+                 class names, uint64 reserved
+        images:  the encoded images one after the other
+        index:   aligned on 8 bytes, one packed_index_entry per record, then one whose offset
+                 is the end of the images and whose first_box is the number of boxes
+        boxes:   one packed_box per box, the boxes of each record one after the other
+        names:   uint32 length and the characters of each class name
+!*/
+namespace training
+{
+    using namespace dlib;
+
+    struct packed_box
+    {
+        // in pixels of the image, inclusive, like dlib::drectangle
+        float left = 0, top = 0, right = 0, bottom = 0;
+        uint32_t label = 0;
+        uint32_t ignore = 0;
+    };
+
+    namespace impl
+    {
+        struct packed_file_header
+        {
+            char magic[4] = {'D', 'P', 'A', 'K'};
+            uint32_t version = 1;
+            uint32_t flags = 0;
+            uint32_t num_classes = 0;
+            uint64_t num_records = 0;
+            uint64_t num_boxes = 0;
+            uint64_t index_offset = 0;
+            uint64_t boxes_offset = 0;
+            uint64_t names_offset = 0;
+            uint64_t reserved = 0;
+        };
+
+        struct packed_index_entry
+        {
+            uint64_t offset = 0;
+            uint64_t first_box = 0;
+            uint32_t size = 0;
+            uint32_t label = 0;
+        };
+
+        const uint32_t packed_has_boxes = 1;
+    }
+
+    /*!
+        Writes a packed file one image at a time.  The images go to the file as they are added;
+        the index (24 bytes per image) and the boxes (24 bytes per box) are kept until close().
+
+        Usage:
+            packed_dataset_writer writer("train.pack", class_names, false);
+            for (size_t i = 0; i < files.size(); ++i)
+                writer.add(read_file(files[i]), labels[i]);
+            writer.close();
+    !*/
+    class packed_dataset_writer
+    {
+        public:
+        packed_dataset_writer(const std::string& path, const std::vector<std::string>& class_names, const bool has_boxes)
+            : out(path, std::ios::binary), class_names(class_names)
+        {
+            if (!out)
+                throw std::runtime_error("packed_dataset_writer: could not open " + path);
+            header.flags = has_boxes ? impl::packed_has_boxes : 0;
+            header.num_classes = class_names.size();
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        }
+
+        ~packed_dataset_writer()
+        {
+            try { close(); } catch (...) {}
+        }
+
+        // Adds an image of a classification set.
+        void add(const std::vector<char>& image, const unsigned long label)
+        {
+            DLIB_CASSERT(!(header.flags & impl::packed_has_boxes), "packed_dataset_writer: the records have boxes");
+            DLIB_CASSERT(label < class_names.size());
+            add_image(image, label);
+        }
+
+        // Adds an image of a detection set, with its boxes.
+        void add(const std::vector<char>& image, const std::vector<packed_box>& image_boxes)
+        {
+            DLIB_CASSERT(header.flags & impl::packed_has_boxes, "packed_dataset_writer: the records have labels");
+            for (const auto& b : image_boxes)
+                DLIB_CASSERT(b.label < class_names.size());
+            add_image(image, 0);
+            boxes.insert(boxes.end(), image_boxes.begin(), image_boxes.end());
+        }
+
+        void close()
+        {
+            if (!out.is_open())
+                return;
+            impl::packed_index_entry end;
+            end.offset = offset;
+            end.first_box = boxes.size();
+            index.push_back(end);
+
+            header.num_records = index.size() - 1;
+            header.num_boxes = boxes.size();
+            header.index_offset = (offset + 7) / 8 * 8;
+            header.boxes_offset = header.index_offset + index.size() * sizeof(impl::packed_index_entry);
+            header.names_offset = header.boxes_offset + boxes.size() * sizeof(packed_box);
+            const char padding[8] = {};
+            out.write(padding, header.index_offset - offset);
+            out.write(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(impl::packed_index_entry));
+            out.write(reinterpret_cast<const char*>(boxes.data()), boxes.size() * sizeof(packed_box));
+            for (const auto& name : class_names)
+            {
+                const uint32_t length = name.size();
+                out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+                out.write(name.data(), length);
+            }
+            out.seekp(0);
+            out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            out.close();
+            if (!out)
+                throw std::runtime_error("packed_dataset_writer: error while writing the file");
+        }
+
+        private:
+        void add_image(const std::vector<char>& image, const unsigned long label)
+        {
+            DLIB_CASSERT(out.is_open(), "packed_dataset_writer: already closed");
+            DLIB_CASSERT(image.size() <= std::numeric_limits<uint32_t>::max());
+            impl::packed_index_entry entry;
+            entry.offset = offset;
+            entry.first_box = boxes.size();
+            entry.size = image.size();
+            entry.label = label;
+            index.push_back(entry);
+            out.write(image.data(), image.size());
+            offset += image.size();
+        }
+
+        std::ofstream out;
+        std::vector<std::string> class_names;
+        impl::packed_file_header header;
+        uint64_t offset = sizeof(impl::packed_file_header);
+        std::vector<impl::packed_index_entry> index;
+        std::vector<packed_box> boxes;
+    };
+
+    /*!
+        Read-only view of a packed file mapped in memory.  All the accessors are const and
+        read the mapping only, so any number of threads can read and decode records at the
+        same time without locking.  The constructor checks every index entry and box against
+        the size of the file and the number of classes, and throws on a corrupt file, so that
+        the accessors do not have to.
+    !*/
+    class packed_dataset
+    {
+        public:
+        explicit packed_dataset(const std::string& path)
+        {
+            fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("packed_dataset: could not open " + path);
+            struct stat st;
+            if (::fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(impl::packed_file_header))
+            {
+                ::close(fd);
+                throw std::runtime_error("packed_dataset: " + path + " is not a packed file");
+            }
+            size_bytes = st.st_size;
+            void* p = ::mmap(nullptr, size_bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                ::close(fd);
+                throw std::runtime_error("packed_dataset: could not map " + path);
+            }
+            data = static_cast<const char*>(p);
+            // records are read in a random order
+            ::madvise(p, size_bytes, MADV_RANDOM);
+
+            std::memcpy(&header, data, sizeof(header));
+            // the counts are bounded by the size of the file first, so that the offsets computed
+            // from them cannot overflow
+            if (std::memcmp(header.magic, "DPAK", 4) != 0 || header.version != 1 ||
+                header.index_offset % 8 != 0 || header.index_offset < sizeof(header) || header.index_offset > size_bytes ||
+                header.num_records >= size_bytes / sizeof(impl::packed_index_entry) ||
+                header.num_boxes > size_bytes / sizeof(packed_box) ||
+                header.boxes_offset != header.index_offset + (header.num_records + 1) * sizeof(impl::packed_index_entry) ||
+                header.names_offset != header.boxes_offset + header.num_boxes * sizeof(packed_box) ||
+                header.names_offset > size_bytes || !read_class_names())
+            {
+                unmap();
+                throw std::runtime_error("packed_dataset: " + path + " is not a valid packed file");
+            }
+            index = reinterpret_cast<const impl::packed_index_entry*>(data + header.index_offset);
+            boxes = reinterpret_cast<const packed_box*>(data + header.boxes_offset);
+            const std::string error = check_records();
+            if (!error.empty())
+            {
+                unmap();
+                throw std::runtime_error("packed_dataset: " + path + " is corrupt, " + error);
+            }
+        }
+
+        packed_dataset(const packed_dataset&) = delete;
+        packed_dataset& operator=(const packed_dataset&) = delete;
+
+        ~packed_dataset() { unmap(); }
+
+        size_t size() const { return header.num_records; }
+        bool has_boxes() const { return header.flags & impl::packed_has_boxes; }
+        const std::vector<std::string>& get_class_names() const { return class_names; }
+
+        // The encoded bytes of record i.
+        const unsigned char* image_data(const size_t i) const { return reinterpret_cast<const unsigned char*>(data + index[i].offset); }
+        size_t image_size(const size_t i) const { return index[i].size; }
+
+        unsigned long label(const size_t i) const { return index[i].label; }
+        const packed_box* boxes_begin(const size_t i) const { return boxes + index[i].first_box; }
+        const packed_box* boxes_end(const size_t i) const { return boxes + index[i + 1].first_box; }
+
+        // Decodes record i, a JPEG or PNG image.
+        void load_image(const size_t i, matrix<rgb_pixel>& img) const
+        {
+            const unsigned char* bytes = image_data(i);
+            const size_t n = image_size(i);
+            if (n >= 3 && bytes[0] == 0xFF && bytes[1] == 0xD8 && bytes[2] == 0xFF)
+                load_jpeg(img, bytes, n);
+            else if (n >= 8 && std::memcmp(bytes, "\x89PNG\r\n\x1a\n", 8) == 0)
+                load_png(img, bytes, n);
+            else
+                throw image_load_error("packed_dataset: record " + std::to_string(i) + " is neither a JPEG nor a PNG image");
+        }
+
+        // The boxes of record i, labelled with the names of their classes.
+        void load_boxes(const size_t i, std::vector<yolo_rect>& dets) const
+        {
+            dets.clear();
+            for (auto b = boxes_begin(i); b != boxes_end(i); ++b)
+            {
+                yolo_rect det(drectangle(b->left, b->top, b->right, b->bottom), 1, class_names[b->label]);
+                det.ignore = b->ignore != 0;
+                dets.push_back(std::move(det));
+            }
+        }
+
+        private:
+        // Checks that the records only point inside the file and to known classes, so that the
+        // accessors need no check.  Returns what is wrong, or an empty string.
+        std::string check_records() const
+        {
+            const auto record = [](const uint64_t i) { return "record " + std::to_string(i); };
+            if (index[0].first_box != 0)
+                return record(0) + " does not start at the first box";
+            for (uint64_t i = 0; i < header.num_records; ++i)
+            {
+                const auto& entry = index[i];
+                if (entry.offset < sizeof(header) || entry.offset > header.index_offset || entry.size > header.index_offset - entry.offset)
+                    return record(i) + " is outside of the images";
+                if (index[i + 1].first_box < entry.first_box)
+                    return record(i) + " has a negative number of boxes";
+                if (!has_boxes() && entry.label >= header.num_classes)
+                    return record(i) + " has the label " + std::to_string(entry.label) + " of " + std::to_string(header.num_classes) + " classes";
+            }
+            if (index[header.num_records].first_box != header.num_boxes)
+                return "the records do not have " + std::to_string(header.num_boxes) + " boxes";
+            for (uint64_t b = 0; b < header.num_boxes; ++b)
+            {
+                if (boxes[b].label >= header.num_classes)
+                    return "box " + std::to_string(b) + " has the label " + std::to_string(boxes[b].label) + " of " + std::to_string(header.num_classes) + " classes";
+            }
+            return "";
+        }
+
+        bool read_class_names()
+        {
+            size_t pos = header.names_offset;
+            for (uint32_t c = 0; c < header.num_classes; ++c)
+            {
+                uint32_t length = 0;
+                if (pos + sizeof(length) > size_bytes)
+                    return false;
+                std::memcpy(&length, data + pos, sizeof(length));
+                pos += sizeof(length);
+                if (pos + length > size_bytes)
+                    return false;
+                class_names.emplace_back(data + pos, length);
+                pos += length;
+            }
+            return true;
+        }
+
+        void unmap()
+        {
+            ::munmap(const_cast<char*>(data), size_bytes);
+            ::close(fd);
+        }
+
+        int fd = -1;
+        size_t size_bytes = 0;
+        const char* data = nullptr;
+        const impl::packed_index_entry* index = nullptr;
+        const packed_box* boxes = nullptr;
+        impl::packed_file_header header;
+        std::vector<std::string> class_names;
+    };
+}  // namespace training
+
+#endif  // PackedDataset_H
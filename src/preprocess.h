@@ -0,0 +1,265 @@
+#ifndef Preprocess_H
+#define Preprocess_H
+
+#include <dlib/dnn.h>
+#include <dlib/image_io.h>
+
+namespace preprocess
+{
+    using namespace dlib;
+
+    // Where an image ended up inside the network input, to map detections back.
+    struct letterbox
+    {
+        double scale = 1;
+        double pad_x = 0;
+        double pad_y = 0;
+
+        drectangle to_image(const drectangle& r) const
+        {
+            return drectangle(
+                (r.left() - pad_x) / scale,
+                (r.top() - pad_y) / scale,
+                (r.right() - pad_x) / scale,
+                (r.bottom() - pad_y) / scale);
+        }
+    };
+
+    struct stage_timings
+    {
+        running_stats<double> decode;
+        running_stats<double> resize;
+        running_stats<double> total;
+
+        void clear()
+        {
+            decode.clear();
+            resize.clear();
+            total.clear();
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, const stage_timings& t)
+        {
+            // an empty running_stats has no mean
+            const auto mean = [](const running_stats<double>& rs) { return rs.current_n() ? rs.mean() : 0.0; };
+            out << "decode: " << mean(t.decode) << " ms, resize+pad+normalize: " << mean(t.resize)
+                << " ms, total: " << mean(t.total) << " ms";
+            return out;
+        }
+    };
+
+    /*!
+        Letterboxes images straight into the planar float input tensor of a network that starts
+        with input_rgb_image: decoding, bilinear resizing, padding and the input_rgb_image
+        normalization all happen in a single pass per output row, spread over a thread pool, and
+        the result is written at the batch offset of each image.  This avoids the intermediate
+        letterboxed matrix and the std::vector batch that to_tensor() needs.
+    !*/
+    class letterbox_loader
+    {
+        public:
+        letterbox_loader(
+            const long rows,
+            const long cols,
+            const input_rgb_image& input,
+            thread_pool& tp = default_thread_pool(),
+            const rgb_pixel pad_color = rgb_pixel(114, 114, 114))
+            : rows(rows),
+              cols(cols),
+              avg_red(input.get_avg_red()),
+              avg_green(input.get_avg_green()),
+              avg_blue(input.get_avg_blue()),
+              pad_color(pad_color),
+              tp(tp)
+        {
+        }
+
+        const stage_timings& get_timings() const { return timings; }
+        stage_timings& get_timings() { return timings; }
+
+        // Loads the image files (any format load_image() understands) into x.
+        std::vector<letterbox> load_files(const std::vector<std::string>& filenames, resizable_tensor& x)
+        {
+            return load(filenames.size(), x, [&](const size_t i, matrix<rgb_pixel>& img) { load_image(img, filenames[i]); });
+        }
+
+        // Loads JPEG encoded images held in memory into x.
+        std::vector<letterbox> load_jpegs(const std::vector<std::string>& buffers, resizable_tensor& x)
+        {
+            return load(buffers.size(), x, [&](const size_t i, matrix<rgb_pixel>& img)
+            {
+                load_jpeg(img, reinterpret_cast<const unsigned char*>(buffers[i].data()), buffers[i].size());
+            });
+        }
+
+        // Letterboxes already decoded images into x.
+        std::vector<letterbox> load_images(const std::vector<matrix<rgb_pixel>>& images, resizable_tensor& x)
+        {
+            using fms = std::chrono::duration<double, std::milli>;
+            const auto t0 = std::chrono::steady_clock::now();
+            x.set_size(images.size(), 3, rows, cols);
+            std::vector<letterbox> boxes(images.size());
+            write_all(images, x, boxes);
+            const auto t1 = std::chrono::steady_clock::now();
+            timings.resize.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            timings.total.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            return boxes;
+        }
+
+        // Letterboxes a single image into sample n of x, which must already have the right size.
+        letterbox write(const matrix<rgb_pixel>& img, tensor& x, const long n) const
+        {
+            DLIB_CASSERT(x.k() == 3 && x.nr() == rows && x.nc() == cols && n < x.num_samples());
+            const letterbox box = fit(img);
+            const plan p = make_plan(img, box);
+            float* out = x.host() + n * 3 * rows * cols;
+            const long blocks = (rows + row_block - 1) / row_block;
+            parallel_for(tp, 0, blocks, [&](long i)
+            {
+                for (long r = i * row_block; r < std::min((i + 1) * row_block, rows); ++r)
+                    write_row(img, p, out, r);
+            });
+            return box;
+        }
+
+        private:
+        static constexpr long row_block = 16;
+
+        // Precomputed bilinear taps for every output column and row.
+        struct plan
+        {
+            long x_begin, x_end, y_begin, y_end;
+            std::vector<long> x0, x1, y0, y1;
+            std::vector<float> wx, wy;
+        };
+
+        letterbox fit(const matrix<rgb_pixel>& img) const
+        {
+            letterbox box;
+            box.scale = std::min(static_cast<double>(cols) / img.nc(), static_cast<double>(rows) / img.nr());
+            box.pad_x = std::floor((cols - std::round(img.nc() * box.scale)) / 2);
+            box.pad_y = std::floor((rows - std::round(img.nr() * box.scale)) / 2);
+            return box;
+        }
+
+        plan make_plan(const matrix<rgb_pixel>& img, const letterbox& box) const
+        {
+            plan p;
+            p.x_begin = box.pad_x;
+            p.x_end = box.pad_x + std::round(img.nc() * box.scale);
+            p.y_begin = box.pad_y;
+            p.y_end = box.pad_y + std::round(img.nr() * box.scale);
+            const auto taps = [&](const long begin, const long end, const long size,
+                                  std::vector<long>& i0, std::vector<long>& i1, std::vector<float>& w)
+            {
+                for (long o = begin; o < end; ++o)
+                {
+                    const double s = std::max(0.0, (o - begin + 0.5) / box.scale - 0.5);
+                    const long lo = std::min<long>(s, size - 1);
+                    i0.push_back(lo);
+                    i1.push_back(std::min(lo + 1, size - 1));
+                    w.push_back(s - lo);
+                }
+            };
+            taps(p.x_begin, p.x_end, img.nc(), p.x0, p.x1, p.wx);
+            taps(p.y_begin, p.y_end, img.nr(), p.y0, p.y1, p.wy);
+            return p;
+        }
+
+        // Writes row r of the three channel planes starting at out.
+        void write_row(const matrix<rgb_pixel>& img, const plan& p, float* out, const long r) const
+        {
+            float* red = out + r * cols;
+            float* green = red + rows * cols;
+            float* blue = green + rows * cols;
+            const float pad_r = (pad_color.red - avg_red) / 256.0f;
+            const float pad_g = (pad_color.green - avg_green) / 256.0f;
+            const float pad_b = (pad_color.blue - avg_blue) / 256.0f;
+            if (r < p.y_begin || r >= p.y_end)
+            {
+                std::fill(red, red + cols, pad_r);
+                std::fill(green, green + cols, pad_g);
+                std::fill(blue, blue + cols, pad_b);
+                return;
+            }
+            std::fill(red, red + p.x_begin, pad_r);
+            std::fill(green, green + p.x_begin, pad_g);
+            std::fill(blue, blue + p.x_begin, pad_b);
+            const long yi = r - p.y_begin;
+            const float wy = p.wy[yi];
+            const rgb_pixel* row0 = &img(p.y0[yi], 0);
+            const rgb_pixel* row1 = &img(p.y1[yi], 0);
+            for (long c = p.x_begin; c < p.x_end; ++c)
+            {
+                const long xi = c - p.x_begin;
+                const float wx = p.wx[xi];
+                const rgb_pixel& a = row0[p.x0[xi]];
+                const rgb_pixel& b = row0[p.x1[xi]];
+                const rgb_pixel& d = row1[p.x0[xi]];
+                const rgb_pixel& e = row1[p.x1[xi]];
+                const auto lerp = [&](const float v00, const float v01, const float v10, const float v11)
+                {
+                    const float top = v00 + wx * (v01 - v00);
+                    const float bottom = v10 + wx * (v11 - v10);
+                    return top + wy * (bottom - top);
+                };
+                red[c] = (lerp(a.red, b.red, d.red, e.red) - avg_red) / 256.0f;
+                green[c] = (lerp(a.green, b.green, d.green, e.green) - avg_green) / 256.0f;
+                blue[c] = (lerp(a.blue, b.blue, d.blue, e.blue) - avg_blue) / 256.0f;
+            }
+            std::fill(red + p.x_end, red + cols, pad_r);
+            std::fill(green + p.x_end, green + cols, pad_g);
+            std::fill(blue + p.x_end, blue + cols, pad_b);
+        }
+
+        void write_all(const std::vector<matrix<rgb_pixel>>& images, tensor& x, std::vector<letterbox>& boxes) const
+        {
+            std::vector<plan> plans(images.size());
+            for (size_t n = 0; n < images.size(); ++n)
+            {
+                boxes[n] = fit(images[n]);
+                plans[n] = make_plan(images[n], boxes[n]);
+            }
+            // blocks of rows across all the images, so a batch of one still uses every thread
+            const long blocks_per_image = (rows + row_block - 1) / row_block;
+            float* out = x.host_write_only();
+            parallel_for(tp, 0, images.size() * blocks_per_image, [&](long i)
+            {
+                const long n = i / blocks_per_image;
+                const long r0 = (i % blocks_per_image) * row_block;
+                for (long r = r0; r < std::min(r0 + row_block, rows); ++r)
+                    write_row(images[n], plans[n], out + n * 3 * rows * cols, r);
+            });
+        }
+
+        template <typename decoder>
+        std::vector<letterbox> load(const size_t num_images, resizable_tensor& x, const decoder& decode)
+        {
+            using fms = std::chrono::duration<double, std::milli>;
+            const auto t0 = std::chrono::steady_clock::now();
+            decoded.resize(num_images);
+            parallel_for(tp, 0, num_images, [&](long i) { decode(i, decoded[i]); });
+            const auto t1 = std::chrono::steady_clock::now();
+            x.set_size(num_images, 3, rows, cols);
+            std::vector<letterbox> boxes(num_images);
+            write_all(decoded, x, boxes);
+            const auto t2 = std::chrono::steady_clock::now();
+            timings.decode.add(std::chrono::duration_cast<fms>(t1 - t0).count());
+            timings.resize.add(std::chrono::duration_cast<fms>(t2 - t1).count());
+            timings.total.add(std::chrono::duration_cast<fms>(t2 - t0).count());
+            return boxes;
+        }
+
+        long rows;
+        long cols;
+        float avg_red;
+        float avg_green;
+        float avg_blue;
+        rgb_pixel pad_color;
+        thread_pool& tp;
+        std::vector<matrix<rgb_pixel>> decoded;
+        stage_timings timings;
+    };
+}  // namespace preprocess
+
+#endif  // Preprocess_H
@@ -0,0 +1,75 @@
+#ifndef RandomPermutation_H
+#define RandomPermutation_H
+
+#include <dlib/assert.h>
+
+#include <cstdint>
+#include <random>
+#include <utility>
+
+// Random orders of the records or windows of an epoch, computed on the fly, so that they need
+// no memory whatever the size of the dataset and every thread can compute its share of them
+// from the seed alone.
+namespace shuffling
+{
+    /*!
+        A random bijection of [0, n): a 4-round Feistel network on the indices of the smallest
+        power of 4 >= n, applied again until the result is < n (less than 4 times on average).
+        Unlike i -> (a * i + b) mod n, consecutive indices do not land at a constant stride
+        from each other, so neighbouring records are not visited in lockstep.  All the
+        arithmetic is on uint64_t, modulo 2^64.
+    !*/
+    class random_permutation
+    {
+        public:
+        random_permutation() = default;
+
+        random_permutation(const uint64_t n, const uint64_t seed) : n(n)
+        {
+            DLIB_ASSERT(n > 0);
+            while (half_bits < 32 && (uint64_t(1) << (2 * half_bits)) < n)
+                ++half_bits;
+            std::mt19937_64 rng(seed);
+            for (auto& k : keys)
+                k = rng();
+        }
+
+        uint64_t size() const { return n; }
+
+        uint64_t operator()(uint64_t i) const
+        {
+            DLIB_ASSERT(i < n);
+            do
+                i = encrypt(i);
+            while (i >= n);
+            return i;
+        }
+
+        private:
+        uint64_t encrypt(const uint64_t i) const
+        {
+            const uint64_t mask = (uint64_t(1) << half_bits) - 1;
+            uint64_t left = i >> half_bits, right = i & mask;
+            for (const uint64_t k : keys)
+            {
+                left ^= mix(right ^ k) & mask;
+                std::swap(left, right);
+            }
+            return (left << half_bits) | right;
+        }
+
+        // the finalizer of splitmix64
+        static uint64_t mix(uint64_t x)
+        {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+
+        uint64_t n = 1;
+        unsigned int half_bits = 1;
+        uint64_t keys[4] = {};
+    };
+}  // namespace shuffling
+
+#endif  // RandomPermutation_H
@@ -0,0 +1,242 @@
+#include "classification/alexnet.h"
+#include "classification/darknet.h"
+#include "classification/densenet.h"
+#include "classification/googlenet.h"
+#include "classification/repvgg.h"
+#include "classification/resnet.h"
+#include "classification/squeezenet.h"
+#include "classification/vggnet.h"
+#include "classification/vovnet.h"
+#include "training_pipeline.h"
+
+#include <dlib/cmd_line_parser.h>
+
+#include <functional>
+#include <map>
+
+// Sets the number of outputs of the classifier, the layer closest to the loss with a number of
+// outputs: an fc layer, or the 1x1 convolution of SqueezeNet.
+class visitor_set_num_classes
+{
+    public:
+    explicit visitor_set_num_classes(const long num_classes) : num_classes(num_classes) {}
+
+    template <typename T> void operator()(size_t, T&) {}
+
+    template <unsigned long no, dlib::fc_bias_mode bm, typename SUBNET>
+    void operator()(size_t, dlib::add_layer<dlib::fc_<no, bm>, SUBNET>& l)
+    {
+        if (!done)
+            l.layer_details().set_num_outputs(num_classes);
+        done = true;
+    }
+
+    template <long nf, long nr, long nc, int sy, int sx, int py, int px, typename SUBNET>
+    void operator()(size_t, dlib::add_layer<dlib::con_<nf, nr, nc, sy, sx, py, px>, SUBNET>& l)
+    {
+        if (!done)
+            l.layer_details().set_num_filters(num_classes);
+        done = true;
+    }
+
+    private:
+    long num_classes;
+    bool done = false;
+};
+
+template <typename net_type, typename dataset_type>
+int train(
+    const std::string& model,
+    const dlib::command_line_parser& parser,
+    const dataset_type& data,
+    const std::vector<std::string>& class_names)
+{
+    using fms = std::chrono::duration<double, std::milli>;
+    std::cout << "training " << model << " on " << data.size() << " images of " << class_names.size() << " classes\n";
+
+    const long num_cores = std::max(1u, std::thread::hardware_concurrency());
+    training::pipeline_options options;
+    options.batch_size = dlib::get_option(parser, "batch-size", 64);
+    options.num_decode_threads = dlib::get_option(parser, "decode-threads", std::max(1L, num_cores / 2));
+    options.num_augment_threads = dlib::get_option(parser, "augment-threads", std::max(1L, num_cores / 4));
+    options.shuffle_buffer_size = dlib::get_option(parser, "shuffle-buffer", 2048);
+    options.seed = dlib::get_option(parser, "seed", 0);
+    options.augmentation.size = dlib::get_option(parser, "image-size", 224);
+
+    net_type net;
+    dlib::visit_layers(net, visitor_set_num_classes(class_names.size()));
+    dlib::dnn_trainer<net_type> trainer(net, dlib::sgd(dlib::get_option(parser, "weight-decay", 1e-4), dlib::get_option(parser, "momentum", 0.9)));
+    trainer.set_learning_rate(dlib::get_option(parser, "learning-rate", 0.1));
+    trainer.set_min_learning_rate(dlib::get_option(parser, "min-learning-rate", 1e-5));
+    trainer.set_iterations_without_progress_threshold(dlib::get_option(parser, "patience", 10000));
+    trainer.set_synchronization_file(dlib::get_option(parser, "sync", model + "_trainer.dat"), std::chrono::minutes(10));
+
+    training::image_loader loader(data, options);
+    const long max_steps = dlib::get_option(parser, "max-steps", 0);
+    const long report_every = dlib::get_option(parser, "report-every", 100);
+    std::vector<dlib::matrix<dlib::rgb_pixel>> images;
+    std::vector<unsigned long> labels;
+    double train_ms = 0;
+    auto report_start = std::chrono::steady_clock::now();
+    while (trainer.get_learning_rate() >= trainer.get_min_learning_rate() &&
+           (max_steps == 0 || static_cast<long>(trainer.get_train_one_step_calls()) < max_steps))
+    {
+        loader.get_batch(images, labels);
+        const auto t0 = std::chrono::steady_clock::now();
+        trainer.train_one_step(images, labels);
+        train_ms += std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count();
+
+        if (trainer.get_train_one_step_calls() % report_every == 0)
+        {
+            // the trainer takes the batches at the pace of the slower of itself and the loader:
+            // when get_batch() waits, the loader is the bottleneck and its slowest stage is the
+            // one that sustains the fewest images per second
+            const auto now = std::chrono::steady_clock::now();
+            const double wall_ms = std::chrono::duration_cast<fms>(now - report_start).count();
+            const auto stats = loader.collect_stats();
+            const double images_per_second = 1000.0 * stats.batches * options.batch_size / wall_ms;
+            const double waiting = stats.wait_ms / wall_ms;
+            std::cout << "step " << trainer.get_train_one_step_calls()
+                      << ", loss " << trainer.get_average_loss()
+                      << ", lr " << trainer.get_learning_rate()
+                      << " | decode " << stats.decode_rate() << " img/s (" << stats.num_decode_threads << " threads)"
+                      << ", augment " << stats.augment_rate() << " img/s (" << stats.num_augment_threads << " threads)"
+                      << ", training " << images_per_second << " img/s"
+                      << ", waiting for data " << 100 * waiting << "%, in train_one_step " << 100 * train_ms / wall_ms << "%";
+            if (stats.failed > 0)
+                std::cout << ", " << stats.failed << " unreadable files";
+            if (waiting > 0.1)
+                std::cout << " -> input bound (" << (stats.decode_rate() < stats.augment_rate() ? "decode" : "augment") << ")\n";
+            else
+                std::cout << " -> compute bound\n";
+            train_ms = 0;
+            report_start = now;
+        }
+    }
+
+    trainer.get_net();
+    net.clean();
+    const std::string output = dlib::get_option(parser, "output", model + ".dnn");
+    dlib::serialize(output) << net << class_names;
+    std::cout << "saved " << output << '\n';
+    return EXIT_SUCCESS;
+}
+
+template <typename net_type>
+int train(const std::string& model, const dlib::command_line_parser& parser)
+{
+    if (parser.option("pack"))
+    {
+        const training::packed_dataset data(parser.option("pack").argument());
+        return train<net_type>(model, parser, data, data.get_class_names());
+    }
+    const auto data = training::list_image_folder(parser.option("train").argument());
+    if (data.size() == 0)
+        throw std::runtime_error("no image found in " + parser.option("train").argument());
+    return train<net_type>(model, parser, data, data.class_names);
+}
+
+int main(const int argc, const char** argv)
+try
+{
+    using train_function = std::function<int(const std::string&, const dlib::command_line_parser&)>;
+    const std::map<std::string, train_function> models{
+        {"alexnet", train<alexnet::train>},
+        {"squeezenet1.0", train<squeezenet::train_v1_0>},
+        {"squeezenet1.1", train<squeezenet::train_v1_1>},
+        {"vgg11", train<vggnet::train_11>},
+        {"vgg13", train<vggnet::train_13>},
+        {"vgg16", train<vggnet::train_16>},
+        {"vgg19", train<vggnet::train_19>},
+        {"googlenet", train<googlenet::train>},
+        {"resnet18", train<resnet::train_18>},
+        {"resnet34", train<resnet::train_34>},
+        {"resnet50", train<resnet::train_50>},
+        {"resnet101", train<resnet::train_101>},
+        {"resnet152", train<resnet::train_152>},
+        {"resnet50-checkpointed", train<resnet::train_50_checkpointed>},
+        {"resnet101-checkpointed", train<resnet::train_101_checkpointed>},
+        {"resnet152-checkpointed", train<resnet::train_152_checkpointed>},
+        {"darknet19", train<darknet::train_19>},
+        {"darknet53", train<darknet::train_53>},
+        {"darknet53csp", train<darknet::train_53csp>},
+        {"densenet121", train<densenet::train_121>},
+        {"densenet169", train<densenet::train_169>},
+        {"densenet201", train<densenet::train_201>},
+        {"densenet265", train<densenet::train_265>},
+        {"densenet161", train<densenet::train_161>},
+        {"vovnet19slim", train<vovnet::train_19_slim>},
+        {"vovnet19", train<vovnet::train_19>},
+        {"vovnet27slim", train<vovnet::train_27_slim>},
+        {"vovnet27", train<vovnet::train_27>},
+        {"vovnet39", train<vovnet::train_39>},
+        {"vovnet57", train<vovnet::train_57>},
+        {"vovnet99", train<vovnet::train_99>},
+        {"repvgg-a0", train<repvgg::train_a0>},
+        {"repvgg-a1", train<repvgg::train_a1>},
+        {"repvgg-a2", train<repvgg::train_a2>},
+        {"repvgg-b0", train<repvgg::train_b0>},
+        {"repvgg-b1", train<repvgg::train_b1>},
+        {"repvgg-b2", train<repvgg::train_b2>},
+        {"repvgg-b3", train<repvgg::train_b3>},
+    };
+
+    dlib::command_line_parser parser;
+    parser.add_option("train", "train on the images of <arg>, one directory per class", 1);
+    parser.add_option("pack", "train on the packed file <arg>, written by pack_dataset", 1);
+    parser.add_option("model", "set the network to train (default: resnet50)", 1);
+    parser.add_option("list-models", "list the networks that can be trained");
+    parser.add_option("image-size", "set the size of the training crops (default: 224)", 1);
+    parser.add_option("batch-size", "set the number of images per step (default: 64)", 1);
+    parser.add_option("learning-rate", "set the initial learning rate (default: 0.1)", 1);
+    parser.add_option("min-learning-rate", "stop once the learning rate is below <arg> (default: 1e-5)", 1);
+    parser.add_option("momentum", "set the momentum of SGD (default: 0.9)", 1);
+    parser.add_option("weight-decay", "set the weight decay of SGD (default: 1e-4)", 1);
+    parser.add_option("patience", "steps without progress before lowering the learning rate (default: 10000)", 1);
+    parser.add_option("max-steps", "stop after <arg> steps (default: 0, no limit)", 1);
+    parser.add_option("sync", "set the synchronization file of the trainer (default: <model>_trainer.dat)", 1);
+    parser.add_option("output", "save the network and the class names to <arg> (default: <model>.dnn)", 1);
+    parser.set_group_name("Input Pipeline Options");
+    parser.add_option("decode-threads", "set the number of image decoding threads (default: half of the cores)", 1);
+    parser.add_option("augment-threads", "set the number of augmentation threads (default: a quarter of the cores)", 1);
+    parser.add_option("shuffle-buffer", "set the number of samples batches are drawn from (default: 2048)", 1);
+    parser.add_option("seed", "set the seed of the shuffling and the augmentation (default: 0)", 1);
+    parser.add_option("report-every", "print the losses and the pipeline throughput every <arg> steps (default: 100)", 1);
+    parser.set_group_name("Help Options");
+    parser.add_option("h", "alias for --help");
+    parser.add_option("help", "display this message and exit");
+    parser.parse(argc, argv);
+    parser.check_incompatible_options("train", "pack");
+
+    if (parser.option("h") or parser.option("help"))
+    {
+        parser.print_options();
+        return EXIT_SUCCESS;
+    }
+
+    if (parser.option("list-models"))
+    {
+        for (const auto& m : models)
+            std::cout << m.first << '\n';
+        return EXIT_SUCCESS;
+    }
+
+    if (!parser.option("train") and !parser.option("pack"))
+    {
+        std::cout << "give the training images with --train or --pack\n";
+        parser.print_options();
+        return EXIT_FAILURE;
+    }
+
+    const std::string model = dlib::get_option(parser, "model", "resnet50");
+    const auto m = models.find(model);
+    if (m == models.end())
+        throw std::runtime_error("unknown model: " + model + " (see --list-models)");
+    std::cout << std::fixed << std::setprecision(3);
+    return m->second(model, parser);
+}
+catch (const std::exception& e)
+{
+    std::cout << e.what() << '\n';
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,542 @@
+#ifndef TrainingPipeline_H
+#define TrainingPipeline_H
+
+#include <dlib/dir_nav.h>
+#include <dlib/dnn.h>
+#include <dlib/image_io.h>
+#include <dlib/image_transforms.h>
+
+#include "packed_dataset.h"
+#include "random_permutation.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace training
+{
+    using namespace dlib;
+
+    /*!
+        An ImageNet style training set: one directory per class under the root, named after the
+        class, holding the images of that class, at any depth.  The classes are sorted by name,
+        which gives their labels.
+    !*/
+    struct image_folder
+    {
+        std::vector<std::string> class_names;
+        std::vector<std::string> files;
+        std::vector<unsigned long> labels;
+
+        size_t size() const { return files.size(); }
+    };
+
+    inline image_folder list_image_folder(const std::string& root)
+    {
+        image_folder data;
+        std::vector<directory> dirs = directory(root).get_dirs();
+        std::sort(dirs.begin(), dirs.end());
+        for (const auto& dir : dirs)
+        {
+            std::vector<file> files = get_files_in_directory_tree(dir, match_endings(".jpg .JPG .jpeg .JPEG .png .PNG"));
+            std::sort(files.begin(), files.end());
+            for (const auto& f : files)
+            {
+                data.files.push_back(f.full_name());
+                data.labels.push_back(data.class_names.size());
+            }
+            data.class_names.push_back(dir.name());
+        }
+        return data;
+    }
+
+    struct augmentation_options
+    {
+        long size = 224;
+        // range of the area of the crop over the area of the image
+        double min_scale = 0.08;
+        double max_scale = 1;
+        // range of the aspect ratio (width over height) of the crop
+        double min_ratio = 3.0 / 4;
+        double max_ratio = 4.0 / 3;
+        // detection: range of the zoom of the letterboxed image
+        double min_zoom = 0.75;
+        double max_zoom = 1.25;
+        bool flip = true;
+    };
+
+    /*!
+        The Inception training augmentation: a crop of random area and aspect ratio, resized to
+        size x size, flipped left-right half of the time.  When 10 random crops do not fit in
+        the image, the crop is the largest centered one within the aspect ratio range.
+    !*/
+    inline void random_resized_crop(
+        const matrix<rgb_pixel>& img,
+        matrix<rgb_pixel>& crop,
+        const augmentation_options& options,
+        dlib::rand& rnd)
+    {
+        const double area = img.nr() * img.nc();
+        long w = 0, h = 0, x = 0, y = 0;
+        for (int attempt = 0; attempt < 10 && w == 0; ++attempt)
+        {
+            const double target_area = area * (options.min_scale + rnd.get_random_double() * (options.max_scale - options.min_scale));
+            const double log_min = std::log(options.min_ratio), log_max = std::log(options.max_ratio);
+            const double ratio = std::exp(log_min + rnd.get_random_double() * (log_max - log_min));
+            const long cw = std::lround(std::sqrt(target_area * ratio));
+            const long ch = std::lround(std::sqrt(target_area / ratio));
+            if (0 < cw && cw <= img.nc() && 0 < ch && ch <= img.nr())
+            {
+                w = cw;
+                h = ch;
+                x = rnd.get_random_64bit_number() % (img.nc() - w + 1);
+                y = rnd.get_random_64bit_number() % (img.nr() - h + 1);
+            }
+        }
+        if (w == 0)
+        {
+            const double ratio = static_cast<double>(img.nc()) / img.nr();
+            w = img.nc();
+            h = img.nr();
+            if (ratio < options.min_ratio)
+                h = std::lround(w / options.min_ratio);
+            else if (ratio > options.max_ratio)
+                w = std::lround(h * options.max_ratio);
+            x = (img.nc() - w) / 2;
+            y = (img.nr() - h) / 2;
+        }
+        extract_image_chip(img, chip_details(rectangle(x, y, x + w - 1, y + h - 1), chip_dims(options.size, options.size)), crop);
+        if (options.flip && rnd.get_random_double() < 0.5)
+            flip_image_left_right(crop);
+    }
+
+    /*!
+        The detection training augmentation: the image is fit in a size x size square, keeping
+        its aspect ratio, zoomed by a random factor between min_zoom and max_zoom and placed at
+        a random position, the rest of the square being black, then flipped left-right half of
+        the time.  The boxes follow the image and are clipped to the square; those with less
+        than half of their area left in it are dropped.
+    !*/
+    inline void random_letterbox(
+        const matrix<rgb_pixel>& img,
+        const std::vector<yolo_rect>& boxes,
+        matrix<rgb_pixel>& crop,
+        std::vector<yolo_rect>& crop_boxes,
+        const augmentation_options& options,
+        dlib::rand& rnd)
+    {
+        const double zoom = options.min_zoom + rnd.get_random_double() * (options.max_zoom - options.min_zoom);
+        const double side = std::max(img.nr(), img.nc()) / zoom;
+        const double x = (img.nc() - side) * rnd.get_random_double();
+        const double y = (img.nr() - side) * rnd.get_random_double();
+        const chip_details details(drectangle(x, y, x + side - 1, y + side - 1), chip_dims(options.size, options.size));
+        extract_image_chip(img, details, crop);
+        const bool flip = options.flip && rnd.get_random_double() < 0.5;
+        if (flip)
+            flip_image_left_right(crop);
+
+        const auto tform = get_mapping_to_chip(details);
+        const drectangle square(0, 0, options.size - 1, options.size - 1);
+        crop_boxes.clear();
+        for (const auto& b : boxes)
+        {
+            yolo_rect box = b;
+            box.rect = drectangle(tform(b.rect.tl_corner()), tform(b.rect.br_corner()));
+            const drectangle visible = box.rect.intersect(square);
+            if (visible.is_empty() || visible.area() < 0.5 * box.rect.area())
+                continue;
+            box.rect = visible;
+            if (flip)
+                box.rect = drectangle(options.size - 1 - visible.right(), visible.top(), options.size - 1 - visible.left(), visible.bottom());
+            crop_boxes.push_back(std::move(box));
+        }
+    }
+
+    // Reads record i of a training set into image and label, for basic_image_loader.
+    inline void load_record(const image_folder& data, const size_t i, matrix<rgb_pixel>& image, unsigned long& label)
+    {
+        load_image(image, data.files[i]);
+        label = data.labels[i];
+    }
+
+    inline void load_record(const packed_dataset& data, const size_t i, matrix<rgb_pixel>& image, unsigned long& label)
+    {
+        data.load_image(i, image);
+        label = data.label(i);
+    }
+
+    inline void load_record(const packed_dataset& data, const size_t i, matrix<rgb_pixel>& image, std::vector<yolo_rect>& boxes)
+    {
+        data.load_image(i, image);
+        data.load_boxes(i, boxes);
+    }
+
+    // The augmentation of each kind of label: random_resized_crop() for classes,
+    // random_letterbox() for boxes.
+    inline void augment_sample(
+        const matrix<rgb_pixel>& image,
+        const unsigned long& label,
+        matrix<rgb_pixel>& crop,
+        unsigned long& crop_label,
+        const augmentation_options& options,
+        dlib::rand& rnd)
+    {
+        random_resized_crop(image, crop, options, rnd);
+        crop_label = label;
+    }
+
+    inline void augment_sample(
+        const matrix<rgb_pixel>& image,
+        const std::vector<yolo_rect>& boxes,
+        matrix<rgb_pixel>& crop,
+        std::vector<yolo_rect>& crop_boxes,
+        const augmentation_options& options,
+        dlib::rand& rnd)
+    {
+        random_letterbox(image, boxes, crop, crop_boxes, options, rnd);
+    }
+
+    struct pipeline_options
+    {
+        long batch_size = 64;
+        size_t num_decode_threads = 4;
+        size_t num_augment_threads = 4;
+        // batches are drawn at random among at least half of these samples
+        size_t shuffle_buffer_size = 2048;
+        // batches assembled ahead of the trainer, 2 for double buffering
+        size_t prefetch_batches = 2;
+        unsigned long seed = 0;
+        // a decoding thread that fails on this many records in a row stops the pipeline, and
+        // get_batch() throws instead of waiting for images that never come
+        size_t max_consecutive_failures = 1000;
+        augmentation_options augmentation;
+    };
+
+    // Work done by each stage since the last call to image_loader::collect_stats().
+    struct pipeline_stats
+    {
+        size_t decoded = 0;
+        size_t failed = 0;  // images that could not be decoded, skipped
+        size_t augmented = 0;
+        size_t batches = 0;
+        double decode_ms = 0;   // summed over the decoding threads
+        double augment_ms = 0;  // summed over the augmentation threads
+        double wait_ms = 0;     // spent by get_batch() waiting for a batch
+        size_t num_decode_threads = 0;
+        size_t num_augment_threads = 0;
+
+        // images per second each stage sustains with all its threads busy
+        double decode_rate() const { return decode_ms > 0 ? 1000 * decoded * num_decode_threads / decode_ms : 0; }
+        double augment_rate() const { return augment_ms > 0 ? 1000 * augmented * num_augment_threads / augment_ms : 0; }
+    };
+
+    /*!
+        Feeds dnn_trainer::train_one_step() with augmented batches, prepared on background
+        threads by a pipeline of stages joined by bounded queues:
+            - decoding threads read and decode the records of an image_folder (any format
+              load_image() understands) or of a packed_dataset, in the order of a random
+              permutation of the records at each epoch; each thread takes its own share of the
+              permutation, so they read without sharing any state,
+            - augmentation threads apply augment_sample(),
+            - a shuffle buffer, from which a batching thread draws the samples of each batch at
+              random, so that consecutive samples of the decoding threads end up in different
+              batches,
+            - prefetch_batches batch slots, filled while the trainer consumes the previous ones,
+              and swapped into the vectors of the trainer without copying the images.
+        A full queue blocks the stage that feeds it, so the pipeline runs at the pace of its
+        slowest stage or of the trainer, which collect_stats() tells apart.
+    !*/
+    template <typename label_type>
+    class basic_image_loader
+    {
+        public:
+        // The records are read from data, which must outlive the loader.
+        template <typename dataset_type>
+        basic_image_loader(const dataset_type& data, const pipeline_options& options = pipeline_options())
+            : num_records(data.size()),
+              load([&data](const size_t i, sample& s) { load_record(data, i, s.image, s.label); }),
+              options(options)
+        {
+            if constexpr (std::is_same_v<dataset_type, packed_dataset>)
+            {
+                if (data.has_boxes() != std::is_same_v<label_type, std::vector<yolo_rect>>)
+                    throw std::invalid_argument(data.has_boxes() ? "the packed dataset has boxes, use a detection_loader"
+                                                                 : "the packed dataset has class labels, use an image_loader");
+            }
+            DLIB_CASSERT(num_records > 0, "no image to train on");
+            DLIB_CASSERT(options.batch_size > 0 && options.prefetch_batches > 0);
+            DLIB_CASSERT(options.num_decode_threads > 0 && options.num_augment_threads > 0);
+            DLIB_CASSERT(options.max_consecutive_failures > 0);
+            DLIB_CASSERT(options.shuffle_buffer_size >= static_cast<size_t>(options.batch_size));
+            slots.resize(options.prefetch_batches);
+            for (size_t i = 0; i < options.num_decode_threads; ++i)
+                threads.emplace_back([this, i] { run_decode(i); });
+            for (size_t i = 0; i < options.num_augment_threads; ++i)
+                threads.emplace_back([this, i] { run_augment(i); });
+            threads.emplace_back([this] { run_batcher(); });
+        }
+
+        basic_image_loader(const basic_image_loader&) = delete;
+        basic_image_loader& operator=(const basic_image_loader&) = delete;
+
+        ~basic_image_loader()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            decoded.close();
+            shuffle_buffer.close();
+            cv.notify_all();
+            for (auto& t : threads)
+                t.join();
+        }
+
+        // Swaps the next batch into images and labels, whose previous buffers are reused.
+        void get_batch(std::vector<matrix<rgb_pixel>>& images, std::vector<label_type>& labels)
+        {
+            using fms = std::chrono::duration<double, std::milli>;
+            const auto t0 = std::chrono::steady_clock::now();
+            std::unique_lock<std::mutex> lock(mutex);
+            auto& slot = slots[consumed % slots.size()];
+            cv.wait(lock, [&] { return slot.ready || !failure.empty(); });
+            if (!slot.ready)
+                throw std::runtime_error(failure);
+            images.swap(slot.images);
+            labels.swap(slot.labels);
+            slot.ready = false;
+            ++consumed;
+            stats.wait_ms += std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count();
+            ++stats.batches;
+            cv.notify_all();
+        }
+
+        pipeline_stats collect_stats()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pipeline_stats result = stats;
+            result.num_decode_threads = options.num_decode_threads;
+            result.num_augment_threads = options.num_augment_threads;
+            stats = pipeline_stats();
+            return result;
+        }
+
+        private:
+        struct sample
+        {
+            matrix<rgb_pixel> image;
+            label_type label{};
+        };
+
+        struct slot_type
+        {
+            bool ready = false;
+            std::vector<matrix<rgb_pixel>> images;
+            std::vector<label_type> labels;
+        };
+
+        // Queue of at most capacity samples, whose consumers take the oldest one or any one.
+        class sample_queue
+        {
+            public:
+            explicit sample_queue(const size_t capacity) : capacity(capacity) {}
+
+            bool push(sample& item)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+                if (closed)
+                    return false;
+                items.push_back(std::move(item));
+                not_empty.notify_one();
+                return true;
+            }
+
+            // Takes a sample at random once the queue holds min_size of them.
+            bool pop(sample& item, dlib::rand* rnd = nullptr, const size_t min_size = 1)
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_empty.wait(lock, [&] { return closed || items.size() >= min_size; });
+                if (closed)
+                    return false;
+                if (rnd)
+                    std::swap(items.front(), items[rnd->get_random_64bit_number() % items.size()]);
+                item = std::move(items.front());
+                items.pop_front();
+                not_full.notify_one();
+                return true;
+            }
+
+            void close()
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                closed = true;
+                not_full.notify_all();
+                not_empty.notify_all();
+            }
+
+            private:
+            size_t capacity;
+            std::deque<sample> items;
+            std::mutex mutex;
+            std::condition_variable not_full, not_empty;
+            bool closed = false;
+        };
+
+        template <typename F>
+        static double time_ms(F&& f)
+        {
+            using fms = std::chrono::duration<double, std::milli>;
+            const auto t0 = std::chrono::steady_clock::now();
+            f();
+            return std::chrono::duration_cast<fms>(std::chrono::steady_clock::now() - t0).count();
+        }
+
+        // Thread t of n decodes the records at positions t, t + n, t + 2n... of the permutations
+        // of the successive epochs, which every thread computes from the seed.
+        void run_decode(const size_t thread)
+        {
+            shuffling::random_permutation permutation;
+            uint64_t permutation_epoch = std::numeric_limits<uint64_t>::max();
+            sample s;
+            size_t failures = 0;
+            std::string last_error;
+            for (uint64_t i = thread;; i += options.num_decode_threads)
+            {
+                const uint64_t epoch = i / num_records;
+                if (epoch != permutation_epoch)
+                {
+                    permutation = shuffling::random_permutation(num_records, options.seed + epoch);
+                    permutation_epoch = epoch;
+                }
+                bool ok = true;
+                const double ms = time_ms([&]
+                {
+                    try
+                    {
+                        load(permutation(i % num_records), s);
+                    }
+                    catch (const std::exception& e)
+                    {
+                        ok = false;
+                        last_error = e.what();
+                    }
+                });
+                if (ok && s.image.size() == 0)
+                {
+                    ok = false;
+                    last_error = "empty image";
+                }
+                failures = ok ? 0 : failures + 1;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats.decode_ms += ms;
+                    if (ok)
+                        ++stats.decoded;
+                    else
+                        ++stats.failed;
+                }
+                if (failures == options.max_consecutive_failures)
+                {
+                    fail("image_loader: could not decode " + std::to_string(failures) + " records in a row, the last one: " + last_error);
+                    return;
+                }
+                if (ok && !decoded.push(s))
+                    return;
+                if (stopping_requested())
+                    return;
+            }
+        }
+
+        void run_augment(const size_t thread)
+        {
+            dlib::rand rnd(options.seed * 1000 + thread);
+            sample s, crop;
+            while (decoded.pop(s))
+            {
+                const double ms = time_ms([&] { augment_sample(s.image, s.label, crop.image, crop.label, options.augmentation, rnd); });
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    stats.augment_ms += ms;
+                    ++stats.augmented;
+                }
+                if (!shuffle_buffer.push(crop))
+                    return;
+            }
+        }
+
+        void run_batcher()
+        {
+            dlib::rand rnd(options.seed);
+            const size_t min_size = std::max<size_t>(1, options.shuffle_buffer_size / 2);
+            sample s;
+            for (uint64_t batch = 0;; ++batch)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return stopping || batch < consumed + slots.size(); });
+                    if (stopping)
+                        return;
+                }
+                // the slot is ours until it is marked ready
+                auto& slot = slots[batch % slots.size()];
+                slot.images.resize(options.batch_size);
+                slot.labels.resize(options.batch_size);
+                for (long i = 0; i < options.batch_size; ++i)
+                {
+                    if (!shuffle_buffer.pop(s, &rnd, min_size))
+                        return;
+                    slot.images[i].swap(s.image);
+                    std::swap(slot.labels[i], s.label);
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    slot.ready = true;
+                }
+                cv.notify_all();
+            }
+        }
+
+        // Stops all the threads; get_batch() throws error once the ready batches are taken.
+        void fail(const std::string& error)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+                if (failure.empty())
+                    failure = error;
+            }
+            decoded.close();
+            shuffle_buffer.close();
+            cv.notify_all();
+        }
+
+        bool stopping_requested()
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            return stopping;
+        }
+
+        size_t num_records;
+        std::function<void(size_t, sample&)> load;
+        pipeline_options options;
+        sample_queue decoded{2 * options.num_augment_threads};
+        sample_queue shuffle_buffer{options.shuffle_buffer_size};
+        std::vector<slot_type> slots;
+        std::mutex mutex;
+        std::condition_variable cv;
+        uint64_t consumed = 0;
+        bool stopping = false;
+        std::string failure;  // why the pipeline stopped on its own
+        pipeline_stats stats;
+        std::vector<std::thread> threads;
+    };
+
+    using image_loader = basic_image_loader<unsigned long>;
+    using detection_loader = basic_image_loader<std::vector<yolo_rect>>;
+}  // namespace training
+
+#endif  // TrainingPipeline_H